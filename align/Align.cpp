@@ -14,6 +14,9 @@
 
 #include "Align.h"
 
+#include "AlignmentFeatureCache.h"
+#include "AlignmentScheduler.h"
+#include "CachingAligner.h"
 #include "LinearAligner.h"
 #include "MATCHAligner.h"
 #include "TransformDTWAligner.h"
@@ -26,13 +29,23 @@
 
 #include "base/Pitch.h"
 
+#include <QFileInfo>
 #include <QSettings>
-#include <QTimer>
+#include <QStringList>
 
 namespace sv {
 
 using std::make_shared;
 
+Align::Align() :
+    m_featureCache(make_shared<AlignmentFeatureCache>())
+{
+}
+
+Align::~Align()
+{
+}
+
 QString
 Align::getAlignmentTypeTag(AlignmentType type)
 {
@@ -83,15 +96,59 @@ Align::scheduleAlignment(Document *doc,
                          ModelId reference,
                          ModelId toAlign)
 {
-    int delay = 700 * int(m_aligners.size());
-    if (delay > 3500) {
-        delay = 3500;
-    }
     if (!addAligner(doc, reference, toAlign)) {
         return;
     }
-    SVCERR << "Align::scheduleAlignment: delaying " << delay << "ms" << endl;
-    QTimer::singleShot(delay, m_aligners[toAlign].get(), SLOT(begin()));
+    size_t bytes = estimateMemory(reference, toAlign);
+    SVCERR << "Align::scheduleAlignment: queueing alignment of " << toAlign
+           << ", estimated " << (bytes >> 20) << "MB" << endl;
+    AlignmentScheduler::getInstance()->schedule
+        (m_aligners[toAlign], toAlign, bytes);
+}
+
+void
+Align::prioritise(ModelId toAlign)
+{
+    AlignmentScheduler::getInstance()->prioritise(toAlign);
+}
+
+void
+Align::cancelAlignments()
+{
+    // Destroying the aligners removes any that are queued from the
+    // scheduler, and stops any that are running
+
+    std::map<ModelId, std::shared_ptr<Aligner>> aligners;
+    {
+        QMutexLocker locker(&m_mutex);
+        aligners.swap(m_aligners);
+    }
+    for (auto p: aligners) {
+        disconnect(p.second.get(), nullptr, this, nullptr);
+    }
+}
+
+size_t
+Align::estimateMemory(ModelId reference, ModelId toAlign)
+{
+    // Roughly: the aligners work from features at about 50 frames
+    // per second, and need a few KB per feature frame of each model
+    // for the features themselves and for the band of the cost
+    // matrix around the path
+    
+    static const double FRAMES_PER_SECOND = 50.0;
+    static const double BYTES_PER_FRAME = 4096.0;
+
+    double frames = 0.0;
+    for (ModelId id: { reference, toAlign }) {
+        if (auto model = ModelById::get(id)) {
+            if (model->getSampleRate() > 0) {
+                frames += double(model->getEndFrame() - model->getStartFrame())
+                    / model->getSampleRate() * FRAMES_PER_SECOND;
+            }
+        }
+    }
+    return size_t(frames * BYTES_PER_FRAME);
 }
 
 bool
@@ -139,11 +196,15 @@ Align::addAligner(Document *doc,
             bool withTuningDifference =
                 (type == MATCHAlignmentWithPitchCompare);
             
-            aligner = make_shared<MATCHAligner>(doc,
-                                                reference,
-                                                toAlign,
-                                                getUseSubsequenceAlignment(),
-                                                withTuningDifference);
+            auto matchAligner =
+                make_shared<MATCHAligner>(doc,
+                                          reference,
+                                          toAlign,
+                                          getUseSubsequenceAlignment(),
+                                          withTuningDifference);
+            matchAligner->setFeatureCache(m_featureCache);
+            
+            aligner = matchAligner;
             break;
         }
 
@@ -156,7 +217,7 @@ Align::addAligner(Document *doc,
                 getDefaultTransformFor("vamp:pyin:pyin:notes",
                                        refModel->getSampleRate());
 
-            aligner = make_shared<TransformDTWAligner>
+            auto dtwAligner = make_shared<TransformDTWAligner>
                 (doc,
                  reference,
                  toAlign,
@@ -179,6 +240,18 @@ Align::addAligner(Document *doc,
                      }
                      return v;
                  });
+
+            dtwAligner->setDTWConstraint(getDTWConstraint(type));
+
+            // and take long enough to extract that a rough path
+            // while they are going is worth having
+            dtwAligner->setStreaming(true);
+
+            // and share the reference's notes with other alignments
+            // against it
+            dtwAligner->setFeatureCache(m_featureCache);
+            
+            aligner = dtwAligner;
             break;
         }
         
@@ -194,6 +267,12 @@ Align::addAligner(Document *doc,
         }
         }
 
+        // Linear alignments are quicker to calculate than to look up
+        if (type != LinearAlignment && type != TrimmedLinearAlignment) {
+            aligner = make_shared<CachingAligner>
+                (doc, reference, toAlign, getCacheSettings(type), aligner);
+        }
+
         m_aligners[toAlign] = aligner;
     }
 
@@ -206,6 +285,78 @@ Align::addAligner(Document *doc,
     return true;
 }
 
+QString
+Align::getCacheSettings(AlignmentType type)
+{
+    bool subsequence = getUseSubsequenceAlignment();
+    
+    QStringList settings;
+    settings << getAlignmentTypeTag(type)
+             << (subsequence ? "subsequence" : "whole");
+
+    switch (type) {
+    case MATCHAlignment:
+    case MATCHAlignmentWithPitchCompare: {
+        TransformId id = MATCHAligner::getAlignmentTransformName(subsequence);
+        settings << id << getPluginVersionTag(id);
+        if (type == MATCHAlignmentWithPitchCompare) {
+            id = MATCHAligner::getTuningDifferenceTransformName();
+            settings << id << getPluginVersionTag(id);
+        }
+        break;
+    }
+    case SungNoteContourAlignment: {
+        TransformId id = "vamp:pyin:pyin:notes";
+        DTWConstraint c = getDTWConstraint(type);
+        settings << id << getPluginVersionTag(id)
+                 << QString("dtw %1 %2 %3 %4 %5")
+            .arg(int(c.type)).arg(c.bandWidth).arg(c.maxSlope)
+            .arg(c.radius).arg(qulonglong(c.fullMatrixCells));
+        break;
+    }
+    case TransformDrivenDTWAlignment:
+        settings << getPreferredAlignmentTransform().toXmlString();
+        break;
+    case ExternalProgramAlignment: {
+        // The program's identity is its path and the version of it
+        // found there
+        QString program = getPreferredAlignmentProgram();
+        QFileInfo info(program);
+        settings << program
+                 << QString::number(info.size())
+                 << info.lastModified().toString(Qt::ISODate);
+        break;
+    }
+    default:
+        break;
+    }
+
+    return settings.join("\n");
+}
+
+DTWConstraint
+Align::getDTWConstraint(AlignmentType type)
+{
+    DTWConstraint constraint;
+
+    if (type == SungNoteContourAlignment) {
+        // Note contours of long recordings are too long for the full
+        // cost matrix; short ones still get it
+        constraint.type = DTWConstraint::Type::Multiscale;
+    }
+
+    return constraint;
+}
+
+QString
+Align::getPluginVersionTag(TransformId id)
+{
+    // An updated plugin may calculate a different alignment. This
+    // loads the plugin to ask, but only once per alignment
+    Transform t = TransformFactory::getInstance()->getDefaultTransformFor(id);
+    return QString("version %1").arg(t.getPluginVersion());
+}
+
 Align::AlignmentType
 Align::getAlignmentPreference()
 {
@@ -22,12 +22,14 @@
 #include <set>
 
 #include "Aligner.h"
+#include "DTW.h"
 
 #include "transform/Transform.h"
 
 namespace sv {
 
 class AlignmentModel;
+class AlignmentFeatureCache;
 class Document;
 
 class Align : public QObject
@@ -35,7 +37,8 @@ class Align : public QObject
     Q_OBJECT
     
 public:
-    Align() { }
+    Align();
+    ~Align();
 
     enum AlignmentType {
         NoAlignment,
@@ -171,18 +174,29 @@ public:
 
     /**
      * As alignModel, except that the alignment does not begin
-     * immediately, but is instead placed behind an event callback
-     * with a small delay. Useful to avoid an unresponsive GUI when
-     * firing off alignments while doing something else as well. Any
-     * error is reported by firing the alignmentFailed signal.
-     *
-     * Scheduled alignments are not queued or serialised - many could
-     * happen at once. They are just delayed a little for UI
-     * responsiveness.
+     * immediately, but is instead queued with the process-wide
+     * AlignmentScheduler, which begins it when there are cores and
+     * memory enough, taking prioritised models first. Useful to
+     * avoid an unresponsive GUI, or an overloaded machine, when
+     * firing off many alignments at once. Any error is reported by
+     * firing the alignmentFailed signal.
      */
     void scheduleAlignment(Document *doc,
                            ModelId reference,
                            ModelId toAlign);
+
+    /**
+     * Give scheduled alignment of the given model priority over
+     * alignments prioritised before it, such as when it becomes
+     * visible or focused.
+     */
+    void prioritise(ModelId toAlign);
+
+    /**
+     * Stop all alignments started or scheduled through this object
+     * that have not yet completed, without reporting them as failed.
+     */
+    void cancelAlignments();
     
     /**
      * Return true if the preferred alignment facility is available
@@ -217,8 +231,29 @@ private:
     // we don't key this on the whole (reference, toAlign) pair
     std::map<ModelId, std::shared_ptr<Aligner>> m_aligners;
 
+    // Transform outputs and tuning differences shared between the
+    // aligners we create, so that the reference's are calculated
+    // once however many models are aligned against it
+    std::shared_ptr<AlignmentFeatureCache> m_featureCache;
+
     bool addAligner(Document *doc, ModelId reference, ModelId toAlign);
     void removeAligner(QObject *);
+
+    // Rough estimate of the memory an alignment of the two models
+    // needs while running
+    static size_t estimateMemory(ModelId reference, ModelId toAlign);
+
+    // Everything besides the audio that an alignment of the given
+    // type depends on, for the alignment cache key
+    static QString getCacheSettings(AlignmentType type);
+
+    // The DTW constraint used by alignments of the given type, for
+    // those that use TransformDTWAligner
+    static DTWConstraint getDTWConstraint(AlignmentType type);
+
+    // Description of the plugin version that the transform with the
+    // given id would use, for the alignment cache key
+    static QString getPluginVersionTag(TransformId id);
 };
 
 } // end namespace sv
@@ -0,0 +1,361 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "AlignmentCache.h"
+
+#include "data/model/AlignmentModel.h"
+#include "data/model/DenseTimeValueModel.h"
+#include "data/model/ReadOnlyWaveFileModel.h"
+
+#include "base/Debug.h"
+#include "base/ResourceFinder.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QXmlStreamReader>
+
+#include <algorithm>
+#include <map>
+
+//#define DEBUG_ALIGNMENT_CACHE 1
+
+namespace sv {
+
+// Blocks read from the audio for its content hash, alongside the
+// identity of the file it comes from
+static const int HASH_BLOCKS = 64;
+static const sv_frame_t HASH_BLOCK_FRAMES = 4096;
+
+// Block size for reading the whole of audio that has no file
+static const sv_frame_t HASH_FULL_FRAMES = 65536;
+
+// Total size of the cache files beyond which the least recently used
+// are removed
+static const qint64 MAX_CACHE_BYTES = 64 * 1024 * 1024;
+
+static const quint32 CACHE_MAGIC = 0x53564143; // "SVAC"
+// Version 2 keys include the file identity or full content hash
+static const quint32 CACHE_VERSION = 2;
+
+// A ready model's audio doesn't change, so its hash can be kept for
+// as long as the model lasts. Ids are never reused
+static QMutex hashMutex;
+static std::map<ModelId, QString> contentHashes;
+
+static QString
+getCachePath(QString key)
+{
+    QString dir = ResourceFinder().getResourceSaveDir("alignments");
+    if (dir == "") return "";
+    return QDir(dir).filePath(key + ".path");
+}
+
+QString
+AlignmentCache::getContentHash(ModelId modelId,
+                               const std::atomic<bool> *abort)
+{
+    auto model = ModelById::getAs<DenseTimeValueModel>(modelId);
+    if (!model || !model->isOK() || !model->isReady()) {
+        return "";
+    }
+
+    {
+        QMutexLocker locker(&hashMutex);
+        auto itr = contentHashes.find(modelId);
+        if (itr != contentHashes.end()) return itr->second;
+    }
+    
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+
+    sv_frame_t start = model->getStartFrame();
+    sv_frame_t end = model->getEndFrame();
+    int channels = model->getChannelCount();
+
+    QByteArray header;
+    QDataStream hs(&header, QIODevice::WriteOnly);
+    hs << double(model->getSampleRate()) << qint32(channels)
+       << qint64(start) << qint64(end);
+
+    // For audio read from a local file, the file's identity stands
+    // in for its content, with a few blocks of the decoded audio in
+    // case it is decoded differently. Anything else is hashed in
+    // full, which is slower but happens only once per model
+    
+    QString localPath;
+    if (auto wfm = ModelById::getAs<ReadOnlyWaveFileModel>(modelId)) {
+        localPath = wfm->getLocalFilename();
+    }
+    QFileInfo info(localPath);
+    bool haveFile = (localPath != "" && info.isFile());
+
+    if (haveFile) {
+        hs << info.absoluteFilePath() << qint64(info.size())
+           << qint64(info.lastModified().toMSecsSinceEpoch());
+    }
+    hash.addData(header);
+
+    auto aborted = [&]() {
+        return abort && *abort;
+    };
+    
+    auto addBlock = [&](sv_frame_t from, sv_frame_t count) {
+        for (int c = 0; c < channels; ++c) {
+            auto data = model->getData(c, from, count);
+            hash.addData(reinterpret_cast<const char *>(data.data()),
+                         int(data.size() * sizeof(float)));
+        }
+    };
+
+    if (haveFile) {
+        sv_frame_t duration = end - start;
+        for (int i = 0; i < HASH_BLOCKS; ++i) {
+            if (aborted()) return "";
+            sv_frame_t from = start + (duration * i) / HASH_BLOCKS;
+            sv_frame_t count = std::min(HASH_BLOCK_FRAMES, end - from);
+            if (count <= 0) continue;
+            addBlock(from, count);
+        }
+    } else {
+        for (sv_frame_t from = start; from < end; from += HASH_FULL_FRAMES) {
+            if (aborted()) return "";
+            addBlock(from, std::min(HASH_FULL_FRAMES, end - from));
+        }
+    }
+
+    QString result = QString::fromLatin1(hash.result().toHex());
+
+    QMutexLocker locker(&hashMutex);
+    contentHashes[modelId] = result;
+    return result;
+}
+
+QString
+AlignmentCache::getKnownContentHash(ModelId modelId)
+{
+    QMutexLocker locker(&hashMutex);
+    auto itr = contentHashes.find(modelId);
+    if (itr != contentHashes.end()) return itr->second;
+    return "";
+}
+
+QString
+AlignmentCache::getFileIdentityHash(ModelId modelId)
+{
+    auto model = ModelById::getAs<ReadOnlyWaveFileModel>(modelId);
+    if (!model || !model->isOK()) {
+        return "";
+    }
+
+    QString localPath = model->getLocalFilename();
+    QFileInfo info(localPath);
+    if (localPath == "" || !info.isFile()) {
+        return "";
+    }
+
+    // Everything here is known as soon as the file is opened, so
+    // unlike the content hash this needs no decoded audio
+    QByteArray identity;
+    QDataStream ids(&identity, QIODevice::WriteOnly);
+    ids << double(model->getSampleRate())
+        << qint32(model->getChannelCount())
+        << info.absoluteFilePath() << qint64(info.size())
+        << qint64(info.lastModified().toMSecsSinceEpoch());
+
+    return QString::fromLatin1
+        (QCryptographicHash::hash(identity, QCryptographicHash::Sha1).toHex());
+}
+
+QString
+AlignmentCache::makeKey(QString referenceHash,
+                        QString toAlignHash,
+                        QString settings)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QString("%1\n%2\n%3\n%4")
+                 .arg(CACHE_VERSION)
+                 .arg(referenceHash)
+                 .arg(toAlignHash)
+                 .arg(settings)
+                 .toUtf8());
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+std::shared_ptr<Path>
+AlignmentCache::load(QString key)
+{
+    QString path = getCachePath(key);
+    if (path == "") return {};
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return {};
+    }
+
+    QDataStream in(&file);
+    quint32 magic = 0, version = 0;
+    double sampleRate = 0.0;
+    qint32 resolution = 0;
+    qint64 count = 0;
+    in >> magic >> version >> sampleRate >> resolution >> count;
+
+    if (in.status() != QDataStream::Ok ||
+        magic != CACHE_MAGIC || version != CACHE_VERSION ||
+        sampleRate <= 0.0 || resolution <= 0 || count < 0) {
+        SVDEBUG << "AlignmentCache::load: Cache file " << path
+                << " is not valid, ignoring it" << endl;
+        return {};
+    }
+
+    auto result = std::make_shared<Path>(sampleRate, resolution);
+    for (qint64 i = 0; i < count; ++i) {
+        qint64 frame = 0, mapframe = 0;
+        in >> frame >> mapframe;
+        if (in.status() != QDataStream::Ok) {
+            SVDEBUG << "AlignmentCache::load: Cache file " << path
+                    << " is truncated, ignoring it" << endl;
+            return {};
+        }
+        result->add(PathPoint(frame, mapframe));
+    }
+
+#ifdef DEBUG_ALIGNMENT_CACHE
+    SVDEBUG << "AlignmentCache::load: Loaded " << count << " points for key "
+            << key << endl;
+#endif
+
+    // The modification time orders entries by use for prune()
+    file.setFileTime(QDateTime::currentDateTimeUtc(),
+                     QFileDevice::FileModificationTime);
+
+    return result;
+}
+
+bool
+AlignmentCache::store(QString key, ModelId alignmentModelId)
+{
+    auto alignmentModel = ModelById::getAs<AlignmentModel>(alignmentModelId);
+    if (!alignmentModel) return false;
+
+    // The path is only to be had through the model's XML, which
+    // contains it as a path model and its dataset
+
+    QString xml;
+    {
+        QTextStream stream(&xml);
+        alignmentModel->toXml(stream);
+    }
+
+    QXmlStreamReader reader("<cache>" + xml + "</cache>");
+
+    std::shared_ptr<Path> result;
+    QString dataset;
+    bool inDataset = false;
+
+    while (!reader.atEnd()) {
+        reader.readNext();
+        if (!reader.isStartElement()) {
+            if (reader.isEndElement() && reader.name() == QString("dataset")) {
+                inDataset = false;
+            }
+            continue;
+        }
+        auto attributes = reader.attributes();
+        if (reader.name() == QString("model") &&
+            attributes.value("subtype") == QString("path") && !result) {
+            double sampleRate = attributes.value("sampleRate").toDouble();
+            int resolution = attributes.value("resolution").toInt();
+            if (sampleRate <= 0.0 || resolution <= 0) return false;
+            result = std::make_shared<Path>(sampleRate, resolution);
+            dataset = attributes.value("dataset").toString();
+        } else if (reader.name() == QString("dataset") && result) {
+            inDataset = (attributes.value("id").toString() == dataset);
+        } else if (reader.name() == QString("point") && inDataset) {
+            result->add(PathPoint(attributes.value("frame").toLongLong(),
+                                  attributes.value("mapframe").toLongLong()));
+        }
+    }
+
+    if (reader.hasError() || !result || result->getPointCount() == 0) {
+        SVDEBUG << "AlignmentCache::store: No path found in alignment model "
+                << alignmentModelId << endl;
+        return false;
+    }
+
+    QString path = getCachePath(key);
+    if (path == "") return false;
+
+    // Write to a temporary file and rename, so that a reader never
+    // sees a partial file
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        SVDEBUG << "AlignmentCache::store: Failed to open " << path
+                << " for writing" << endl;
+        return false;
+    }
+
+    QDataStream out(&file);
+    out << CACHE_MAGIC << CACHE_VERSION
+        << double(result->getSampleRate()) << qint32(result->getResolution())
+        << qint64(result->getPointCount());
+    for (const auto &p: result->getPoints()) {
+        out << qint64(p.frame) << qint64(p.mapframe);
+    }
+
+    if (!file.commit()) {
+        SVDEBUG << "AlignmentCache::store: Failed to write " << path << endl;
+        return false;
+    }
+
+#ifdef DEBUG_ALIGNMENT_CACHE
+    SVDEBUG << "AlignmentCache::store: Stored " << result->getPointCount()
+            << " points for key " << key << endl;
+#endif
+
+    prune();
+    
+    return true;
+}
+
+void
+AlignmentCache::prune()
+{
+    QString dirPath = ResourceFinder().getResourceSaveDir("alignments");
+    if (dirPath == "") return;
+
+    // Newest first, by modification time, which load() updates
+    QFileInfoList entries = QDir(dirPath).entryInfoList
+        ({ "*.path" }, QDir::Files, QDir::Time);
+
+    qint64 total = 0;
+    for (const auto &entry: entries) {
+        total += entry.size();
+        if (total > MAX_CACHE_BYTES) {
+#ifdef DEBUG_ALIGNMENT_CACHE
+            SVDEBUG << "AlignmentCache::prune: Removing " << entry.fileName()
+                    << endl;
+#endif
+            QFile::remove(entry.absoluteFilePath());
+        }
+    }
+}
+
+} // end namespace sv
@@ -0,0 +1,109 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_ALIGNMENT_CACHE_H
+#define SV_ALIGNMENT_CACHE_H
+
+#include "data/model/Model.h"
+#include "svcore/data/model/Path.h"
+
+#include <QString>
+
+#include <memory>
+#include <atomic>
+
+namespace sv {
+
+/**
+ * An on-disk cache of alignment paths, in the user's "alignments"
+ * resource directory, so that alignments already calculated for the
+ * same audio with the same settings can be had again without
+ * recalculating them.
+ *
+ * Entries are keyed by content hashes of the two audio models and a
+ * string describing everything else the alignment depends on (the
+ * alignment type, transform, program and so on). They are never
+ * invalidated, only superseded, since a change to anything they
+ * depend on changes the key. The directory is kept to a fixed total
+ * size by removing the least recently used entries.
+ */
+class AlignmentCache
+{
+public:
+    /**
+     * Return a hash of the audio content of the given dense model,
+     * or an empty string if it is not a dense model or is not yet
+     * ready. For a model read from a local file, this combines the
+     * file's path, size and modification time with the rate, channel
+     * count, length and a few blocks of the audio. For any other
+     * model it covers the whole of the audio, which means reading all
+     * of it the first time. The result is kept for each model, so
+     * later calls are cheap.
+     *
+     * As the first call for a model may take a long time, it should
+     * be made from a worker thread. If abort is non-null, the
+     * calculation gives up and returns an empty string as soon as it
+     * finds it set.
+     */
+    static QString getContentHash(ModelId model,
+                                  const std::atomic<bool> *abort = nullptr);
+
+    /**
+     * Return the hash already calculated by getContentHash for the
+     * given model, or an empty string if there is none yet. This
+     * never calculates anything, so is cheap to call from any thread.
+     */
+    static QString getKnownContentHash(ModelId model);
+
+    /**
+     * Return a hash of the identity of the local file the given
+     * model reads its audio from (its path, size and modification
+     * time, with the model's rate and channel count), or an empty
+     * string if it is not a wave file model read from a local file.
+     * Unlike getContentHash this is available as soon as the model
+     * has been created, before its audio has been decoded. It is not
+     * the same as the content hash for the same model.
+     */
+    static QString getFileIdentityHash(ModelId model);
+
+    /**
+     * Return the cache key for aligning the audio with hash
+     * toAlignHash against that with hash referenceHash, using the
+     * given settings description.
+     */
+    static QString makeKey(QString referenceHash,
+                           QString toAlignHash,
+                           QString settings);
+
+    /**
+     * Return the cached path for the given key, or null if there is
+     * none.
+     */
+    static std::shared_ptr<Path> load(QString key);
+
+    /**
+     * Store the path of the given alignment model under the given
+     * key, removing the least recently used entries if the cache has
+     * grown too large. Return false if the model has no path or it
+     * could not be written.
+     */
+    static bool store(QString key, ModelId alignmentModel);
+
+private:
+    static void prune();
+};
+
+} // end namespace sv
+
+#endif
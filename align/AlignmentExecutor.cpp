@@ -0,0 +1,179 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "AlignmentExecutor.h"
+
+#include "base/Debug.h"
+#include "system/System.h"
+
+#include <QThread>
+
+#include <algorithm>
+
+//#define DEBUG_ALIGNMENT_EXECUTOR 1
+
+namespace sv {
+
+// Least memory budget, whatever the system reports
+static const size_t MIN_BUDGET_MB = 256;
+
+AlignmentExecutor *
+AlignmentExecutor::getInstance()
+{
+    static AlignmentExecutor instance;
+    return &instance;
+}
+
+AlignmentExecutor::AlignmentExecutor() :
+    m_budget(0),
+    m_bytesInUse(0),
+    m_threadsInUse(0),
+    m_nextId(1),
+    m_exiting(false)
+{
+    // Half of what is free now, leaving room for everything else
+    ssize_t available = 0, total = 0;
+    GetRealMemoryMBAvailable(available, total);
+    if (available <= 0) available = total / 2;
+    size_t mb = std::max(MIN_BUDGET_MB, size_t(std::max(ssize_t(0),
+                                                        available / 2)));
+    m_budget = mb * 1024 * 1024;
+
+    int n = std::max(1, QThread::idealThreadCount());
+
+#ifdef DEBUG_ALIGNMENT_EXECUTOR
+    SVDEBUG << "AlignmentExecutor: " << n << " thread(s), budget "
+            << mb << "MB" << endl;
+#endif
+
+    for (int i = 0; i < n; ++i) {
+        WorkerThread *t = new WorkerThread(*this);
+        t->start();
+        m_threads.push_back(t);
+    }
+}
+
+AlignmentExecutor::~AlignmentExecutor()
+{
+    m_mutex.lock();
+    m_exiting = true;
+    m_queue.clear();
+    m_condition.wakeAll();
+    m_mutex.unlock();
+
+    for (auto t: m_threads) {
+        t->wait();
+        delete t;
+    }
+}
+
+AlignmentExecutor::TaskId
+AlignmentExecutor::submit(size_t estimatedBytes, Task task)
+{
+    QMutexLocker locker(&m_mutex);
+
+    TaskId id = m_nextId++;
+    m_queue.push_back({ id, estimatedBytes, task });
+
+#ifdef DEBUG_ALIGNMENT_EXECUTOR
+    SVDEBUG << "AlignmentExecutor::submit: task " << id << ", estimated "
+            << estimatedBytes << " bytes, " << m_queue.size()
+            << " queued, " << m_running.size() << " running" << endl;
+#endif
+
+    m_condition.wakeAll();
+    return id;
+}
+
+void
+AlignmentExecutor::cancel(TaskId id)
+{
+    QMutexLocker locker(&m_mutex);
+
+    for (auto itr = m_queue.begin(); itr != m_queue.end(); ++itr) {
+        if (itr->id == id) {
+            m_queue.erase(itr);
+            return;
+        }
+    }
+
+    while (m_running.find(id) != m_running.end()) {
+        m_condition.wait(&m_mutex);
+    }
+}
+
+bool
+AlignmentExecutor::takeNext(Pending &pending)
+{
+    // Strictly in order, so that a large task is not overtaken
+    // indefinitely by smaller ones
+
+    if (m_queue.empty()) return false;
+    if (m_running.size() >= m_threads.size()) return false;
+    if (m_threadsInUse >= int(m_threads.size())) return false;
+
+    const Pending &next = m_queue.front();
+    if (!m_running.empty() && m_bytesInUse + next.bytes > m_budget) {
+        return false;
+    }
+
+    pending = next;
+    m_queue.pop_front();
+    return true;
+}
+
+void
+AlignmentExecutor::WorkerThread::run()
+{
+    AlignmentExecutor &e(m_executor);
+
+    e.m_mutex.lock();
+
+    while (!e.m_exiting) {
+
+        Pending pending;
+        if (!e.takeNext(pending)) {
+            e.m_condition.wait(&e.m_mutex);
+            continue;
+        }
+
+        // Share the free cores between this and whatever is still
+        // queued, which may be able to start alongside it
+        int free = int(e.m_threads.size()) - e.m_threadsInUse;
+        int threads = std::max(1, free / int(e.m_queue.size() + 1));
+        
+        e.m_running.insert(pending.id);
+        e.m_bytesInUse += pending.bytes;
+        e.m_threadsInUse += threads;
+
+#ifdef DEBUG_ALIGNMENT_EXECUTOR
+        SVDEBUG << "AlignmentExecutor: starting task " << pending.id
+                << " with " << threads << " thread(s), "
+                << e.m_bytesInUse << " bytes in use" << endl;
+#endif
+
+        e.m_mutex.unlock();
+        pending.task(threads);
+        e.m_mutex.lock();
+
+        e.m_running.erase(pending.id);
+        e.m_bytesInUse -= pending.bytes;
+        e.m_threadsInUse -= threads;
+        e.m_condition.wakeAll();
+    }
+
+    e.m_mutex.unlock();
+}
+
+} // end namespace sv
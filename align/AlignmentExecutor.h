@@ -0,0 +1,121 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_ALIGNMENT_EXECUTOR_H
+#define SV_ALIGNMENT_EXECUTOR_H
+
+#include "base/Thread.h"
+
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <deque>
+#include <functional>
+#include <set>
+#include <vector>
+
+namespace sv {
+
+/**
+ * A process-wide queue of alignment calculations, such as DTW runs,
+ * carried out in background threads. Tasks run at once so long as
+ * their estimated memory use fits within a budget based on the
+ * memory available when the executor was created, the same budget
+ * the AlignmentScheduler uses for the alignments the tasks belong
+ * to. A task whose estimate exceeds the whole budget runs only when
+ * nothing else is running.
+ *
+ * Each task is told, when it starts, how many threads it may use
+ * itself. These come from the cores not already given to running
+ * tasks, shared between it and the tasks queued behind it, and at
+ * least one core must be free for a task to start, so that the
+ * threads of all running tasks together never outnumber the cores.
+ *
+ * All functions may be called from any thread.
+ */
+class AlignmentExecutor
+{
+public:
+    typedef std::function<void(int threads)> Task;
+    typedef int TaskId;
+
+    static AlignmentExecutor *getInstance();
+
+    /**
+     * Queue a task expected to need the given number of bytes while
+     * it runs. Return an id that can be passed to cancel().
+     */
+    TaskId submit(size_t estimatedBytes, Task task);
+
+    /**
+     * Remove the given task if it has not yet started, or wait for
+     * it to finish if it has. On return the task is not running and
+     * will not be run.
+     */
+    void cancel(TaskId id);
+
+    int getMaxConcurrency() const { return int(m_threads.size()); }
+
+    /**
+     * Return the memory budget for all alignment work in the
+     * process, half of what was available when the executor was
+     * created.
+     */
+    size_t getMemoryBudget() const { return m_budget; }
+
+    ~AlignmentExecutor();
+
+private:
+    AlignmentExecutor();
+
+    struct Pending {
+        TaskId id;
+        size_t bytes;
+        Task task;
+    };
+
+    class WorkerThread : public Thread
+    {
+    public:
+        WorkerThread(AlignmentExecutor &executor) :
+            Thread(Thread::NonRTThread),
+            m_executor(executor) { }
+
+        void run() override;
+
+    protected:
+        AlignmentExecutor &m_executor;
+    };
+
+    bool takeNext(Pending &pending); // with m_mutex held
+
+    std::vector<WorkerThread *> m_threads;
+    size_t m_budget;
+
+    QMutex m_mutex; // for everything below
+    QWaitCondition m_condition;
+    std::deque<Pending> m_queue;
+    std::set<TaskId> m_running;
+    size_t m_bytesInUse;
+    int m_threadsInUse;
+    TaskId m_nextId;
+    bool m_exiting;
+
+    AlignmentExecutor(const AlignmentExecutor &) =delete;
+    AlignmentExecutor &operator=(const AlignmentExecutor &) =delete;
+};
+
+} // end namespace sv
+
+#endif
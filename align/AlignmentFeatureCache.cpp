@@ -0,0 +1,120 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "AlignmentFeatureCache.h"
+
+#include "transform/ModelTransformerFactory.h"
+
+#include "base/Debug.h"
+
+//#define DEBUG_ALIGNMENT_FEATURE_CACHE 1
+
+namespace sv {
+
+AlignmentFeatureCache::AlignmentFeatureCache()
+{
+}
+
+AlignmentFeatureCache::~AlignmentFeatureCache()
+{
+    for (auto p: m_outputs) {
+        ModelById::release(p.second);
+    }
+}
+
+void
+AlignmentFeatureCache::purge()
+{
+    for (auto i = m_outputs.begin(); i != m_outputs.end(); ) {
+        if (!ModelById::get(i->first.first) || !ModelById::get(i->second)) {
+#ifdef DEBUG_ALIGNMENT_FEATURE_CACHE
+            SVDEBUG << "AlignmentFeatureCache::purge: Dropping output "
+                    << i->second << " of vanished input "
+                    << i->first.first << endl;
+#endif
+            ModelById::release(i->second);
+            i = m_outputs.erase(i);
+        } else {
+            ++i;
+        }
+    }
+
+    for (auto i = m_tuningFrequencies.begin();
+         i != m_tuningFrequencies.end(); ) {
+        if (!ModelById::get(i->first.first) ||
+            !ModelById::get(i->first.second)) {
+            i = m_tuningFrequencies.erase(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+ModelId
+AlignmentFeatureCache::getTransformOutput(const Transform &transform,
+                                          ModelId input,
+                                          QString &message)
+{
+    purge();
+
+    auto key = std::make_pair(input, transform.toXmlString());
+
+    auto itr = m_outputs.find(key);
+    if (itr != m_outputs.end()) {
+        SVDEBUG << "AlignmentFeatureCache::getTransformOutput: Reusing output "
+                << itr->second << " of transform "
+                << transform.getIdentifier() << " on model " << input
+                << endl;
+        return itr->second;
+    }
+
+    ModelTransformerFactory *mtf = ModelTransformerFactory::getInstance();
+    ModelId output = mtf->transform(transform, input, message);
+    if (output.isNone() || !ModelById::get(output)) {
+        return {};
+    }
+
+#ifdef DEBUG_ALIGNMENT_FEATURE_CACHE
+    SVDEBUG << "AlignmentFeatureCache::getTransformOutput: Started transform "
+            << transform.getIdentifier() << " on model " << input
+            << " with output " << output << endl;
+#endif
+    
+    m_outputs[key] = output;
+    return output;
+}
+
+bool
+AlignmentFeatureCache::getTuningFrequency(ModelId reference,
+                                          ModelId toAlign,
+                                          float &frequency) const
+{
+    auto itr = m_tuningFrequencies.find(std::make_pair(reference, toAlign));
+    if (itr == m_tuningFrequencies.end()) {
+        return false;
+    }
+    frequency = itr->second;
+    return true;
+}
+
+void
+AlignmentFeatureCache::setTuningFrequency(ModelId reference,
+                                          ModelId toAlign,
+                                          float frequency)
+{
+    purge();
+    m_tuningFrequencies[std::make_pair(reference, toAlign)] = frequency;
+}
+
+} // end namespace sv
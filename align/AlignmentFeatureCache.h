@@ -0,0 +1,89 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_ALIGNMENT_FEATURE_CACHE_H
+#define SV_ALIGNMENT_FEATURE_CACHE_H
+
+#include "data/model/Model.h"
+#include "transform/Transform.h"
+
+#include <QString>
+
+#include <map>
+#include <utility>
+
+namespace sv {
+
+/**
+ * Features calculated for alignment that can be shared between
+ * aligners, such as the transform outputs for a reference model that
+ * many other models are being aligned against. An Align object owns
+ * one of these for the aligners it creates. Entries last until their
+ * input models go away or the cache is destroyed, so that later
+ * alignments can reuse them as well as concurrent ones.
+ *
+ * Not thread-safe: like the aligners, this is for use from the GUI
+ * thread only.
+ */
+class AlignmentFeatureCache
+{
+public:
+    AlignmentFeatureCache();
+
+    // Releases the output models it holds
+    ~AlignmentFeatureCache();
+
+    /**
+     * Return the output model of the given transform run on the
+     * given input model, starting the transform if it has not been
+     * run already. The model may still be being calculated, in which
+     * case the caller should watch its completion as usual. The
+     * model belongs to the cache and must not be released by the
+     * caller. If the transform could not be started, return a none
+     * id with the error in message.
+     */
+    ModelId getTransformOutput(const Transform &transform,
+                               ModelId input,
+                               QString &message);
+
+    /**
+     * Retrieve the tuning frequency of toAlign relative to reference
+     * found by an earlier alignment, returning false if there is
+     * none.
+     */
+    bool getTuningFrequency(ModelId reference, ModelId toAlign,
+                            float &frequency) const;
+
+    /**
+     * Record the tuning frequency of toAlign relative to reference.
+     */
+    void setTuningFrequency(ModelId reference, ModelId toAlign,
+                            float frequency);
+
+    AlignmentFeatureCache(const AlignmentFeatureCache &) =delete;
+    AlignmentFeatureCache &operator=(const AlignmentFeatureCache &) =delete;
+
+private:
+    // (input model, transform XML) -> output model
+    std::map<std::pair<ModelId, QString>, ModelId> m_outputs;
+
+    // (reference, toAlign) -> tuning frequency
+    std::map<std::pair<ModelId, ModelId>, float> m_tuningFrequencies;
+
+    void purge();
+};
+
+} // end namespace sv
+
+#endif
@@ -0,0 +1,256 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "AlignmentScheduler.h"
+#include "AlignmentExecutor.h"
+
+#include "base/Debug.h"
+
+#include <QThread>
+
+#include <algorithm>
+
+//#define DEBUG_ALIGNMENT_SCHEDULER 1
+
+namespace sv {
+
+static const int PROGRESS_INTERVAL_MS = 500;
+
+AlignmentScheduler *
+AlignmentScheduler::getInstance()
+{
+    static AlignmentScheduler *instance = new AlignmentScheduler();
+    return instance;
+}
+
+AlignmentScheduler::AlignmentScheduler() :
+    m_maxConcurrency(1),
+    m_budget(0),
+    m_sequence(0),
+    m_priorityCounter(0),
+    m_starting(false)
+{
+    // Each alignment typically runs a feature extractor on each of
+    // its two models, and then a DTW that can use several threads
+    // itself, so half as many at once as there are cores keeps them
+    // all busy without oversubscribing
+    m_maxConcurrency = std::max(1, QThread::idealThreadCount() / 2);
+
+    // The DTWs of running alignments are what take most of their
+    // memory, and the executor that runs them has the same budget,
+    // so that neither lets in more than the other can bear
+    m_budget = AlignmentExecutor::getInstance()->getMemoryBudget();
+
+#ifdef DEBUG_ALIGNMENT_SCHEDULER
+    SVDEBUG << "AlignmentScheduler: up to " << m_maxConcurrency
+            << " at once, budget " << (m_budget >> 20) << "MB" << endl;
+#endif
+
+    m_progressTimer.setInterval(PROGRESS_INTERVAL_MS);
+    connect(&m_progressTimer, SIGNAL(timeout()),
+            this, SLOT(updateProgress()));
+}
+
+void
+AlignmentScheduler::schedule(std::shared_ptr<Aligner> aligner,
+                             ModelId toAlign,
+                             size_t estimatedBytes)
+{
+    cancel(toAlign);
+
+    Job job;
+    job.aligner = aligner;
+    job.key = aligner.get();
+    job.toAlign = toAlign;
+    job.bytes = estimatedBytes;
+    job.sequence = ++m_sequence;
+    job.running = false;
+    m_jobs.push_back(job);
+
+#ifdef DEBUG_ALIGNMENT_SCHEDULER
+    SVDEBUG << "AlignmentScheduler::schedule: model " << toAlign
+            << ", estimated " << estimatedBytes << " bytes, "
+            << m_jobs.size() << " job(s)" << endl;
+#endif
+
+    connect(aligner.get(), SIGNAL(complete(ModelId)),
+            this, SLOT(alignerFinished()));
+    connect(aligner.get(), SIGNAL(failed(ModelId, QString)),
+            this, SLOT(alignerFinished()));
+    connect(aligner.get(), SIGNAL(destroyed(QObject *)),
+            this, SLOT(alignerDestroyed(QObject *)));
+
+    if (!m_progressTimer.isActive()) {
+        m_progressTimer.start();
+    }
+
+    // Begin from the event loop rather than within the caller, which
+    // may be in the middle of something else
+    QTimer::singleShot(0, this, SLOT(startNext()));
+}
+
+void
+AlignmentScheduler::cancel(ModelId toAlign)
+{
+    for (auto itr = m_jobs.begin(); itr != m_jobs.end(); ) {
+        if (itr->toAlign == toAlign && !itr->running) {
+            if (auto aligner = itr->aligner.lock()) {
+                disconnect(aligner.get(), nullptr, this, nullptr);
+            }
+            itr = m_jobs.erase(itr);
+        } else {
+            ++itr;
+        }
+    }
+}
+
+void
+AlignmentScheduler::prioritise(ModelId toAlign)
+{
+    m_priorities[toAlign] = ++m_priorityCounter;
+}
+
+int
+AlignmentScheduler::getPriority(ModelId toAlign) const
+{
+    auto itr = m_priorities.find(toAlign);
+    if (itr == m_priorities.end()) return 0;
+    return itr->second;
+}
+
+void
+AlignmentScheduler::alignerFinished()
+{
+    remove(qobject_cast<Aligner *>(sender()));
+}
+
+void
+AlignmentScheduler::alignerDestroyed(QObject *obj)
+{
+    // Called during QObject's destructor, so obj is no longer an
+    // Aligner and is only compared with
+    remove(static_cast<Aligner *>(obj));
+}
+
+void
+AlignmentScheduler::remove(Aligner *aligner)
+{
+    if (!aligner) return;
+
+    bool found = false;
+    for (auto itr = m_jobs.begin(); itr != m_jobs.end(); ++itr) {
+        if (itr->key == aligner) {
+            m_jobs.erase(itr);
+            found = true;
+            break;
+        }
+    }
+    if (!found) return;
+
+#ifdef DEBUG_ALIGNMENT_SCHEDULER
+    SVDEBUG << "AlignmentScheduler::remove: " << m_jobs.size()
+            << " job(s) left" << endl;
+#endif
+
+    if (m_starting) {
+        // An aligner finished within its own begin(): carry on
+        // once startNext has returned
+        QTimer::singleShot(0, this, SLOT(startNext()));
+    } else {
+        startNext();
+    }
+
+    if (m_jobs.empty()) {
+        updateProgress();
+    }
+}
+
+void
+AlignmentScheduler::startNext()
+{
+    if (m_starting) return;
+    m_starting = true;
+
+    while (true) {
+
+        int running = 0;
+        size_t bytes = 0;
+        int next = -1;
+
+        for (int i = 0; i < int(m_jobs.size()); ++i) {
+            const Job &job = m_jobs[i];
+            if (job.running) {
+                ++running;
+                bytes += job.bytes;
+                continue;
+            }
+            if (next < 0) {
+                next = i;
+                continue;
+            }
+            int p = getPriority(job.toAlign);
+            int np = getPriority(m_jobs[next].toAlign);
+            if (p > np || (p == np && job.sequence < m_jobs[next].sequence)) {
+                next = i;
+            }
+        }
+
+        if (next < 0 || running >= m_maxConcurrency) break;
+        if (running > 0 && bytes + m_jobs[next].bytes > m_budget) break;
+
+        auto aligner = m_jobs[next].aligner.lock();
+        if (!aligner) {
+            m_jobs.erase(m_jobs.begin() + next);
+            continue;
+        }
+
+#ifdef DEBUG_ALIGNMENT_SCHEDULER
+        SVDEBUG << "AlignmentScheduler::startNext: beginning alignment of "
+                << m_jobs[next].toAlign << ", " << running
+                << " already running" << endl;
+#endif
+
+        m_jobs[next].running = true;
+
+        // The aligner may finish, and be released by its owner,
+        // during begin(): holding it here keeps it alive until then
+        aligner->begin();
+    }
+
+    m_starting = false;
+}
+
+void
+AlignmentScheduler::updateProgress()
+{
+    int jobs = int(m_jobs.size());
+
+    if (jobs == 0) {
+        m_progressTimer.stop();
+        emit progressChanged(0, 100);
+        return;
+    }
+
+    int total = 0;
+    for (const Job &job: m_jobs) {
+        if (!job.running) continue;
+        if (auto model = ModelById::get(job.toAlign)) {
+            total += model->getAlignmentCompletion();
+        }
+    }
+
+    emit progressChanged(jobs, total / jobs);
+}
+
+} // end namespace sv
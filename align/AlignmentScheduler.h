@@ -0,0 +1,125 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_ALIGNMENT_SCHEDULER_H
+#define SV_ALIGNMENT_SCHEDULER_H
+
+#include "Aligner.h"
+
+#include <QObject>
+#include <QTimer>
+
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace sv {
+
+/**
+ * Decides when each scheduled aligner begins. Aligners wait in a
+ * queue ordered by priority, and then by when they were scheduled,
+ * and begin as long as there are fewer running than the concurrency
+ * limit (based on the number of cores) and the estimated memory of
+ * those running, plus the next, fits within the budget. That is the
+ * AlignmentExecutor's budget, based on the memory available at
+ * startup, so that the two agree. An aligner estimated to need more
+ * than the whole budget runs when nothing else is.
+ *
+ * An aligner counts as running from begin() until it emits complete
+ * or failed or is destroyed. Destroying a queued aligner removes it
+ * from the queue. The scheduler holds no ownership of aligners.
+ *
+ * One scheduler is shared by every Align, and so every Document, in
+ * the process. All functions are for the GUI thread only.
+ */
+class AlignmentScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    static AlignmentScheduler *getInstance();
+
+    /**
+     * Queue the given aligner, for aligning the given model, with
+     * the given estimate of the memory it needs while running. Any
+     * aligner already queued for the same model is removed.
+     */
+    void schedule(std::shared_ptr<Aligner> aligner,
+                  ModelId toAlign,
+                  size_t estimatedBytes);
+
+    /**
+     * Remove any queued aligner for the given model. A running one
+     * is unaffected; destroy it to stop it.
+     */
+    void cancel(ModelId toAlign);
+
+    /**
+     * Give alignment of the given model priority over all alignments
+     * prioritised before it, such as when it becomes visible. The
+     * priority persists for later alignments of the same model.
+     */
+    void prioritise(ModelId toAlign);
+
+    /**
+     * Return the number of alignments queued or running.
+     */
+    int getJobCount() const { return int(m_jobs.size()); }
+
+    int getMaxConcurrency() const { return m_maxConcurrency; }
+    size_t getMemoryBudget() const { return m_budget; }
+
+signals:
+    /**
+     * Emitted periodically while there are alignments waiting or
+     * running, and once when the last finishes. percent is the
+     * average completion across all of them, counting queued ones as
+     * zero.
+     */
+    void progressChanged(int jobs, int percent);
+
+private slots:
+    void alignerFinished();
+    void alignerDestroyed(QObject *);
+    void updateProgress();
+    void startNext();
+
+private:
+    AlignmentScheduler();
+
+    struct Job {
+        std::weak_ptr<Aligner> aligner;
+        Aligner *key; // for finding the job once the aligner has gone
+        ModelId toAlign;
+        size_t bytes;
+        int sequence;
+        bool running;
+    };
+
+    int m_maxConcurrency;
+    size_t m_budget;
+    int m_sequence;
+    int m_priorityCounter;
+    bool m_starting;
+    std::vector<Job> m_jobs;
+    std::map<ModelId, int> m_priorities;
+    QTimer m_progressTimer;
+
+    int getPriority(ModelId) const;
+    void remove(Aligner *);
+};
+
+} // end namespace sv
+
+#endif
@@ -0,0 +1,170 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "CachingAligner.h"
+#include "AlignmentCache.h"
+
+#include "data/model/AlignmentModel.h"
+
+#include "framework/Document.h"
+
+namespace sv {
+
+CachingAligner::CachingAligner(Document *doc,
+                               ModelId reference,
+                               ModelId toAlign,
+                               QString settings,
+                               std::shared_ptr<Aligner> aligner) :
+    m_document(doc),
+    m_reference(reference),
+    m_toAlign(toAlign),
+    m_settings(settings),
+    m_aligner(aligner),
+    m_waiting(false),
+    m_hashThread(nullptr),
+    m_abortHash(false)
+{
+    connect(m_aligner.get(), SIGNAL(complete(ModelId)),
+            this, SLOT(alignerComplete(ModelId)));
+    connect(m_aligner.get(), SIGNAL(failed(ModelId, QString)),
+            this, SLOT(alignerFailed(ModelId, QString)));
+    connect(this, SIGNAL(hashesCalculated(QString, QString)),
+            this, SLOT(hashesReady(QString, QString)),
+            Qt::QueuedConnection);
+}
+
+CachingAligner::~CachingAligner()
+{
+    if (m_hashThread) {
+        // The hash calculation checks this between blocks, so the
+        // wait is brief
+        m_abortHash = true;
+        m_hashThread->wait();
+        delete m_hashThread;
+    }
+}
+
+bool
+CachingAligner::modelsReady() const
+{
+    for (ModelId id: { m_reference, m_toAlign }) {
+        auto model = ModelById::get(id);
+        if (!model || !model->isReady()) return false;
+    }
+    return true;
+}
+
+void
+CachingAligner::begin()
+{
+    if (modelsReady()) {
+        startHashing();
+        return;
+    }
+
+    SVDEBUG << "CachingAligner[" << this << "]: begin(): waiting for models "
+            << "to be ready before looking up alignment" << endl;
+
+    m_waiting = true;
+    for (ModelId id: { m_reference, m_toAlign }) {
+        if (auto model = ModelById::get(id)) {
+            connect(model.get(), SIGNAL(ready(ModelId)),
+                    this, SLOT(modelReady(ModelId)));
+        }
+    }
+}
+
+void
+CachingAligner::modelReady(ModelId)
+{
+    if (!m_waiting || !modelsReady()) return;
+    m_waiting = false;
+    startHashing();
+}
+
+void
+CachingAligner::startHashing()
+{
+    // Hashing audio that doesn't come from a local file means reading
+    // all of it, so keep it off the GUI thread
+    if (m_hashThread) return;
+    m_hashThread = new HashThread(*this);
+    m_hashThread->start();
+}
+
+void
+CachingAligner::HashThread::run()
+{
+    CachingAligner &a(m_aligner);
+    QString referenceHash =
+        AlignmentCache::getContentHash(a.m_reference, &a.m_abortHash);
+    QString toAlignHash =
+        AlignmentCache::getContentHash(a.m_toAlign, &a.m_abortHash);
+    if (a.m_abortHash) return;
+    emit a.hashesCalculated(referenceHash, toAlignHash);
+}
+
+void
+CachingAligner::hashesReady(QString referenceHash, QString toAlignHash)
+{
+    if (referenceHash == "" || toAlignHash == "") {
+        m_aligner->begin();
+        return;
+    }
+
+    m_key = AlignmentCache::makeKey(referenceHash, toAlignHash, m_settings);
+
+    auto toAlign = ModelById::get(m_toAlign);
+    auto path = AlignmentCache::load(m_key);
+
+    if (!path || !toAlign) {
+        SVDEBUG << "CachingAligner[" << this << "]: no cached alignment of "
+                << m_toAlign << " against " << m_reference
+                << ", calculating it" << endl;
+        m_aligner->begin();
+        return;
+    }
+
+    SVDEBUG << "CachingAligner[" << this << "]: using cached alignment of "
+            << m_toAlign << " against " << m_reference << " ("
+            << path->getPointCount() << " points)" << endl;
+
+    auto alignmentModel = std::make_shared<AlignmentModel>
+        (m_reference, m_toAlign, ModelId());
+    alignmentModel->setPath(*path);
+    alignmentModel->setCompletion(100);
+    ModelId alignmentModelId = ModelById::add(alignmentModel);
+
+    toAlign->setAlignment(alignmentModelId);
+    m_document->addNonDerivedModel(alignmentModelId);
+
+    emit complete(alignmentModelId);
+}
+
+void
+CachingAligner::alignerComplete(ModelId alignmentModel)
+{
+    if (m_key != "") {
+        AlignmentCache::store(m_key, alignmentModel);
+    }
+    emit complete(alignmentModel);
+}
+
+void
+CachingAligner::alignerFailed(ModelId toAlign, QString errorText)
+{
+    emit failed(toAlign, errorText);
+}
+
+} // end namespace sv
@@ -0,0 +1,96 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_CACHING_ALIGNER_H
+#define SV_CACHING_ALIGNER_H
+
+#include "Aligner.h"
+
+#include "base/Thread.h"
+
+#include <memory>
+#include <atomic>
+
+namespace sv {
+
+class Document;
+
+/**
+ * An aligner that looks up the alignment in the AlignmentCache
+ * before calculating it with another aligner, and stores what that
+ * aligner calculates. The cache key depends on the audio content,
+ * so begin() first waits for both models to be ready, then has their
+ * content hashes calculated in a background thread.
+ */
+class CachingAligner : public Aligner
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Create a CachingAligner that falls back to the given aligner
+     * for the same models. The settings string should describe
+     * everything besides the audio that the result depends on.
+     */
+    CachingAligner(Document *doc,
+                   ModelId reference,
+                   ModelId toAlign,
+                   QString settings,
+                   std::shared_ptr<Aligner> aligner);
+
+    ~CachingAligner();
+
+    void begin() override;
+
+signals:
+    void hashesCalculated(QString referenceHash, QString toAlignHash);
+
+private slots:
+    void modelReady(ModelId);
+    void hashesReady(QString referenceHash, QString toAlignHash);
+    void alignerComplete(ModelId alignmentModel);
+    void alignerFailed(ModelId toAlign, QString errorText);
+
+private:
+    Document *m_document;
+    ModelId m_reference;
+    ModelId m_toAlign;
+    QString m_settings;
+    std::shared_ptr<Aligner> m_aligner;
+    QString m_key;
+    bool m_waiting;
+
+    class HashThread : public Thread
+    {
+    public:
+        HashThread(CachingAligner &aligner) :
+            Thread(Thread::NonRTThread),
+            m_aligner(aligner) { }
+
+        void run() override;
+
+    protected:
+        CachingAligner &m_aligner;
+    };
+
+    HashThread *m_hashThread;
+    std::atomic<bool> m_abortHash;
+
+    bool modelsReady() const;
+    void startHashing();
+};
+
+} // end namespace sv
+
+#endif
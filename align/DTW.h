@@ -16,18 +16,179 @@
 #define SV_DTW_H
 
 #include <vector>
+#include <deque>
 #include <functional>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
 
 //#define DEBUG_DTW 1
 
 namespace sv {
 
-template <typename Value>
+/**
+ * Which cells of the cost matrix a DTW calculates, and how much of
+ * it is kept for traceback. The full matrix is O(N*M) in time, which
+ * is fine for short sequences but slow for long ones; the other
+ * types calculate only a window of cells around the likely path.
+ */
+struct DTWConstraint
+{
+    enum class Type {
+        Full,       // every cell
+        Band,       // Sakoe-Chiba band around the diagonal
+        SlopeBand,  // Itakura parallelogram, limiting the slope of the path
+        Multiscale  // FastDTW-style: refine a path found at lower resolution
+    };
+
+    Type type = Type::Full;
+
+    /**
+     * Band: half-width of the band, as a proportion of the length of
+     * the aligned sequence.
+     */
+    double bandWidth = 0.1;
+
+    /**
+     * SlopeBand: greatest permitted overall slope of the path, whose
+     * reciprocal is also the least.
+     */
+    double maxSlope = 2.0;
+
+    /**
+     * Multiscale: number of cells either side of the path projected
+     * from the level below to calculate.
+     */
+    int radius = 8;
+
+    /**
+     * All types: if the full matrix would have no more than this
+     * many cells, calculate it regardless of type. Also the size at
+     * which Multiscale stops reducing the resolution.
+     */
+    size_t fullMatrixCells = 4000000;
+
+    /**
+     * All types: most cells whose traceback steps (at 2 bits each)
+     * are held at once. Beyond this, traceback recalculates the
+     * costs in stripes from rows checkpointed on the first pass,
+     * taking roughly twice as long in memory proportional to the
+     * square root of the number of cells rather than the number.
+     */
+    size_t tracebackCells = size_t(1) << 31;
+
+    /**
+     * Return a rough estimate of the number of bytes a DTW would use
+     * at its peak in aligning sequences of the given lengths with
+     * this constraint, for deciding how many may run at once.
+     */
+    size_t estimateMemory(size_t n1, size_t n2, bool subsequence) const {
+
+        double full = double(n1) * double(n2);
+        double cells = full;
+
+        if (full > double(fullMatrixCells)) {
+            Type t = type;
+            if (subsequence && (t == Type::Band || t == Type::SlopeBand)) {
+                t = Type::Multiscale;
+            }
+            switch (t) {
+            case Type::Full:
+                break;
+            case Type::Band:
+                cells = double(n1) * (2.0 * bandWidth * double(n2) + 3.0);
+                break;
+            case Type::SlopeBand: {
+                // Area of the parallelogram, as a proportion
+                double s = std::max(1.0, maxSlope);
+                cells = full * (s - 1.0) / (s + 1.0) + double(n1) * 3.0;
+                break;
+            }
+            case Type::Multiscale:
+                cells = std::max(double(fullMatrixCells),
+                                 double(n1 + n2) * (4.0 * radius + 4.0));
+                break;
+            }
+            cells = std::min(cells, full);
+        }
+
+        // Steps for traceback at 2 bits per cell, or for one stripe
+        // at a time plus the cost rows at the stripe boundaries
+        double held = cells;
+        double boundaries = 0.0;
+        if (cells > double(tracebackCells)) {
+            held = std::max(double(tracebackCells),
+                            std::sqrt(cells * double(n2)));
+            boundaries = (cells / held) * double(n2) * sizeof(double);
+        }
+
+        // Plus the window, the last column and a few rows of costs
+        double rows = double(n1) * 3.0 * sizeof(size_t) +
+            double(n2) * 64.0 * sizeof(double);
+
+        return size_t(held / 4.0 + boundaries + rows);
+    }
+};
+
+/**
+ * Function that calls job(i) for each i in [0, count), possibly
+ * concurrently, returning when all calls have completed. Used by DTW
+ * to calculate in parallel.
+ */
+typedef std::function<void(int count, const std::function<void(int)> &job)>
+    DTWRunner;
+
+/**
+ * Dynamic time warping of sequences of Value, with the given
+ * distance metric. The metric type may be a function object class,
+ * which the compiler can inline into the cost calculation, or by
+ * default a std::function.
+ */
+template <typename Value,
+          typename Metric = std::function<double(const Value &, const Value &)>>
 class DTW
 {
 public:
-    DTW(std::function<double(const Value &, const Value &)> distanceMetric) :
-        m_metric(distanceMetric) { }
+    /**
+     * Function to merge two consecutive values into one, used when
+     * reducing resolution for Multiscale alignment. If none is
+     * supplied, the first of each pair is used.
+     */
+    typedef std::function<Value(const Value &, const Value &)> Combiner;
+
+    DTW(Metric distanceMetric = Metric(), Combiner combiner = {}) :
+        m_metric(distanceMetric), m_combiner(combiner) { }
+
+    void setConstraint(DTWConstraint constraint) {
+        m_constraint = constraint;
+    }
+
+    DTWConstraint getConstraint() const {
+        return m_constraint;
+    }
+
+    /**
+     * Calculate large cost matrices in parallel, using the given
+     * runner with the given number of threads. The matrix is split
+     * into tiles that are calculated an anti-diagonal of tiles at a
+     * time. The result is exactly the same as calculating serially.
+     */
+    void setParallelRunner(DTWRunner runner, int threads) {
+        m_runner = runner;
+        m_threads = threads;
+    }
+
+    /**
+     * Stop work as soon as the given flag becomes true, checking it
+     * between blocks of rows of the cost calculation and during
+     * traceback. An aborted alignment returns promptly with a
+     * meaningless result, which the caller should discard. The flag
+     * must outlive the alignment.
+     */
+    void setAbortFlag(const std::atomic<bool> *abort) {
+        m_abort = abort;
+    }
 
     /**
      * Align the sequence s2 against the whole of the sequence s1,
@@ -41,6 +202,10 @@ public:
     /**
      * Align the sequence sub against the best-matching subsequence of
      * s, returning the index into s for each element in sub.
+     *
+     * The Band and SlopeBand constraints assume that the two
+     * sequences start and end together, so with those Multiscale is
+     * used instead here.
      */
     std::vector<size_t> alignSubsequence(std::vector<Value> s,
                                          std::vector<Value> sub) {
@@ -48,94 +213,784 @@ public:
     }
 
 private:
-    std::function<double(const Value &, const Value &)> m_metric;
+    Metric m_metric;
+    Combiner m_combiner;
+    DTWConstraint m_constraint;
+    DTWRunner m_runner;
+    int m_threads = 1;
+    const std::atomic<bool> *m_abort = nullptr;
+
+    bool aborted() const {
+        return m_abort && m_abort->load(std::memory_order_relaxed);
+    }
     
     typedef double cost_t;
 
-    struct CostOption {
-        bool present;
-        cost_t cost;
+    typedef std::vector<std::pair<size_t, size_t>> path_t; // (j, i) cells
+
+    // For each index j into s1, the range [lo[j], hi[j]) of indices
+    // into s2 whose costs are calculated. A row may be empty only in
+    // subsequence alignment
+    struct Window {
+        std::vector<size_t> lo;
+        std::vector<size_t> hi;
     };
 
-    cost_t choose(CostOption x, CostOption y, CostOption d) {
-        if (x.present && y.present) {
-            if (!d.present) {
-                throw std::logic_error("if x & y both exist, so must diagonal");
+    Window fullWindow(size_t n1, size_t n2) const {
+        Window w;
+        w.lo = std::vector<size_t>(n1, 0);
+        w.hi = std::vector<size_t>(n1, n2);
+        return w;
+    }
+
+    // Make a window for whole-sequence alignment connected from the
+    // first cell to the last, so that every cell in it is reachable
+    void connectWindow(Window &w, size_t n2) const {
+        size_t n1 = w.lo.size();
+        w.lo[0] = 0;
+        w.hi[n1-1] = n2;
+        for (size_t j = 1; j < n1; ++j) {
+            w.lo[j] = std::min(w.lo[j], w.hi[j-1]);
+        }
+        for (size_t j = n1 - 1; j > 0; --j) {
+            w.lo[j-1] = std::min(w.lo[j-1], w.lo[j]);
+        }
+        for (size_t j = 0; j < n1; ++j) {
+            w.hi[j] = std::max(w.hi[j], w.lo[j] + 1);
+        }
+    }
+
+    Window bandWindow(size_t n1, size_t n2) const {
+        Window w = fullWindow(n1, n2);
+        double halfWidth = std::max(1.0, m_constraint.bandWidth * double(n2));
+        for (size_t j = 0; j < n1; ++j) {
+            double centre = (n1 > 1 ? double(j) * double(n2 - 1) / double(n1 - 1)
+                             : 0.0);
+            w.lo[j] = size_t(std::max(0.0, std::floor(centre - halfWidth)));
+            w.hi[j] = size_t(std::min(double(n2),
+                                      std::ceil(centre + halfWidth) + 1.0));
+        }
+        connectWindow(w, n2);
+        return w;
+    }
+
+    Window slopeBandWindow(size_t n1, size_t n2) const {
+        Window w = fullWindow(n1, n2);
+        double s = std::max(1.0, m_constraint.maxSlope);
+        double scale = double(n2 - 1);
+        for (size_t j = 0; j < n1; ++j) {
+            double x = (n1 > 1 ? double(j) / double(n1 - 1) : 0.0);
+            double ylo = std::max(x / s, 1.0 - s * (1.0 - x));
+            double yhi = std::min(x * s, 1.0 - (1.0 - x) / s);
+            w.lo[j] = size_t(std::max(0.0, std::floor(ylo * scale) - 1.0));
+            w.hi[j] = size_t(std::min(double(n2),
+                                      std::ceil(yhi * scale) + 2.0));
+        }
+        connectWindow(w, n2);
+        return w;
+    }
+
+    std::vector<Value> coarsen(const std::vector<Value> &s) const {
+        std::vector<Value> c;
+        c.reserve((s.size() + 1) / 2);
+        for (size_t k = 0; k < s.size(); k += 2) {
+            if (k + 1 < s.size() && m_combiner) {
+                c.push_back(m_combiner(s[k], s[k+1]));
+            } else {
+                c.push_back(s[k]);
             }
-            return std::min(std::min(x.cost, y.cost), d.cost);
-        } else if (x.present) {
-            return x.cost;
-        } else if (y.present) {
-            return y.cost;
-        } else {
-            return 0.0;
-        }
-    }
-
-    std::vector<std::vector<cost_t>> costSequences(std::vector<Value> s1,
-                                                   std::vector<Value> s2,
-                                                   bool subsequence) {
-
-        std::vector<std::vector<cost_t>> costs
-            (s1.size(), std::vector<cost_t>(s2.size(), 0.0));
-
-        for (size_t j = 0; j < s1.size(); ++j) {
-            for (size_t i = 0; i < s2.size(); ++i) {
-                cost_t c = m_metric(s1[j], s2[i]);
-                if (i == 0 && subsequence) {
-                    costs[j][i] = c;
-                } else {
-                    costs[j][i] = choose
-                        (
-                            { j > 0,
-                              j > 0 ? c + costs[j-1][i] : 0.0
-                            },
-                            { i > 0,
-                              i > 0 ? c + costs[j][i-1] : 0.0
-                            },
-                            { j > 0 && i > 0,
-                              j > 0 && i > 0 ? c + costs[j-1][i-1] : 0.0
-                            });
+        }
+        return c;
+    }
+
+    Window multiscaleWindow(const std::vector<Value> &s1,
+                            const std::vector<Value> &s2,
+                            bool subsequence) {
+
+        size_t n1 = s1.size(), n2 = s2.size();
+        size_t radius = size_t(std::max(1, m_constraint.radius));
+
+        if (n1 * n2 <= m_constraint.fullMatrixCells ||
+            n1 <= radius + 2 || n2 <= radius + 2) {
+            return fullWindow(n1, n2);
+        }
+
+        // Align at half the resolution, then calculate only the
+        // cells within radius of the path found there
+        
+        std::vector<Value> c1 = coarsen(s1), c2 = coarsen(s2);
+        
+        Window coarseWindow = multiscaleWindow(c1, c2, subsequence);
+        if (aborted()) return fullWindow(0, 0);
+        
+        std::vector<size_t> coarseAlignment(c2.size(), 0);
+        path_t coarsePath;
+        run(c1, c2, subsequence, coarseWindow, coarseAlignment, &coarsePath);
+        if (aborted()) return fullWindow(0, 0);
+
+        Window w;
+        w.lo = std::vector<size_t>(n1, n2);
+        w.hi = std::vector<size_t>(n1, 0);
+
+        for (const auto &cell: coarsePath) {
+            size_t j0 = cell.first * 2, i0 = cell.second * 2;
+            size_t jlo = (j0 > radius ? j0 - radius : 0);
+            size_t jhi = std::min(n1, j0 + 2 + radius);
+            size_t ilo = (i0 > radius ? i0 - radius : 0);
+            size_t ihi = std::min(n2, i0 + 2 + radius);
+            for (size_t j = jlo; j < jhi; ++j) {
+                w.lo[j] = std::min(w.lo[j], ilo);
+                w.hi[j] = std::max(w.hi[j], ihi);
+            }
+        }
+
+        for (size_t j = 0; j < n1; ++j) {
+            if (w.lo[j] >= w.hi[j]) {
+                w.lo[j] = w.hi[j] = 0;
+            }
+        }
+
+        if (!subsequence) {
+            connectWindow(w, n2);
+        }
+        
+        return w;
+    }
+
+    Window makeWindow(const std::vector<Value> &s1,
+                      const std::vector<Value> &s2,
+                      bool subsequence) {
+
+        size_t n1 = s1.size(), n2 = s2.size();
+
+        if (n1 * n2 <= m_constraint.fullMatrixCells) {
+            return fullWindow(n1, n2);
+        }
+        
+        switch (m_constraint.type) {
+        case DTWConstraint::Type::Full:
+            return fullWindow(n1, n2);
+        case DTWConstraint::Type::Band:
+            if (!subsequence) return bandWindow(n1, n2);
+            break;
+        case DTWConstraint::Type::SlopeBand:
+            if (!subsequence) return slopeBandWindow(n1, n2);
+            break;
+        case DTWConstraint::Type::Multiscale:
+            break;
+        }
+
+        return multiscaleWindow(s1, s2, subsequence);
+    }
+
+    // One row of cumulative costs, for indices [lo, lo + costs.size())
+    // into s2
+    struct CostRow {
+        size_t lo = 0;
+        std::vector<cost_t> costs;
+
+        cost_t at(size_t i) const {
+            if (i < lo || i >= lo + costs.size()) {
+                return std::numeric_limits<cost_t>::infinity();
+            }
+            return costs[i - lo];
+        }
+    };
+
+    // The step traceback takes from each cell, decided as the cell's
+    // cost is calculated, so that traceback needs no costs at all
+    enum Step : unsigned char {
+        StepUp = 0,       // to (j-1, i)
+        StepLeft = 1,     // to (j, i-1)
+        StepDiagonal = 2, // to (j-1, i-1)
+        StepStop = 3      // start of path
+    };
+
+    // Steps for the cells of rows [from, to) of a window, packed four
+    // to a byte in one contiguous row-major block. Each row starts on
+    // a byte boundary
+    class Backpointers {
+    public:
+        void reset(const Window &window, size_t from, size_t to) {
+            m_window = &window;
+            m_from = from;
+            m_to = to;
+            m_offsets.resize(to - from);
+            size_t bytes = 0;
+            for (size_t j = from; j < to; ++j) {
+                m_offsets[j - from] = bytes;
+                bytes += (window.hi[j] - window.lo[j] + 3) / 4;
+            }
+            m_bits.assign(bytes, 0);
+        }
+
+        bool containsRow(size_t j) const {
+            return m_window && j >= m_from && j < m_to;
+        }
+
+        // Set the steps for cells [i0, i1) of row j, one per cell.
+        // Rows may be set in parts, but not concurrently
+        void setRange(size_t j, size_t i0, size_t i1,
+                      const unsigned char *steps) {
+            unsigned char *row = m_bits.data() + m_offsets[j - m_from];
+            size_t k = i0 - m_window->lo[j], k1 = i1 - m_window->lo[j];
+            const unsigned char *s = steps - k;
+            for (; k < k1 && (k & 3); ++k) {
+                row[k >> 2] |= (unsigned char)(s[k] << ((k & 3) * 2));
+            }
+            for (; k + 4 <= k1; k += 4) {
+                row[k >> 2] = (unsigned char)
+                    (s[k] | (s[k+1] << 2) | (s[k+2] << 4) | (s[k+3] << 6));
+            }
+            for (; k < k1; ++k) {
+                row[k >> 2] |= (unsigned char)(s[k] << ((k & 3) * 2));
+            }
+        }
+
+        Step get(size_t j, size_t i) const {
+            size_t k = i - m_window->lo[j];
+            const unsigned char *row = m_bits.data() + m_offsets[j - m_from];
+            return Step((row[k >> 2] >> ((k & 3) * 2)) & 3);
+        }
+
+    private:
+        const Window *m_window = nullptr;
+        size_t m_from = 0;
+        size_t m_to = 0;
+        std::vector<size_t> m_offsets;
+        std::vector<unsigned char> m_bits;
+    };
+
+    // Rows calculated together by costRows
+    static const size_t ROW_BLOCK = 8;
+
+    // Rows in each band of tiles, when calculating in parallel
+    static const size_t BAND_ROWS = 8 * ROW_BLOCK;
+
+    // Least width of a tile, and least number of cells in a range of
+    // rows worth calculating in parallel
+    static const size_t MIN_TILE_COLUMNS = 512;
+    static const size_t MIN_PARALLEL_CELLS = 4000000;
+
+    // Working space for costRows and costSteps, kept between blocks to
+    // avoid reallocating
+    struct RowScratch {
+        std::vector<cost_t> distances[ROW_BLOCK];
+        std::vector<cost_t> above;  // above[k] = cost of (j-1, from+k-1)
+        std::vector<unsigned char> steps;
+    };
+
+    // Calculate the costs of cells [from[r], end) of rows[r], for the
+    // rows j0 + r, r in [0, count), given the row above the first in
+    // above. The row's costs from its lo up to from[r] must already be
+    // present, as the left neighbours. count must be no more than
+    // ROW_BLOCK.
+    //
+    // Each cost is the distance plus the least of the costs up, left
+    // and diagonally, where those outside the window are infinite.
+    // Along a row each cell depends on the one before, so rather than
+    // a row at a time, the block is calculated in anti-diagonal
+    // order: the cells (j0+r, t-r) for each t in turn, which are
+    // independent of one another, so a single dependency chain does
+    // not hold everything up. The distances, which depend on nothing,
+    // are calculated a row at a time in loops with no boundary tests
+    void costRows(const std::vector<Value> &s1,
+                  const std::vector<Value> &s2,
+                  bool subsequence,
+                  size_t j0,
+                  size_t count,
+                  const size_t *from,
+                  const CostRow &aboveFirst,
+                  CostRow *rows,
+                  RowScratch &scratch) {
+
+        const cost_t inf = std::numeric_limits<cost_t>::infinity();
+
+        const CostRow *above[ROW_BLOCK];
+        size_t end[ROW_BLOCK];
+        
+        size_t tmin = std::numeric_limits<size_t>::max(), tmax = 0;
+        
+        for (size_t r = 0; r < count; ++r) {
+            above[r] = (r == 0 ? &aboveFirst : &rows[r-1]);
+            end[r] = rows[r].lo + rows[r].costs.size();
+            if (from[r] >= end[r]) continue;
+            tmin = std::min(tmin, from[r] + r);
+            tmax = std::max(tmax, end[r] + r);
+            std::vector<cost_t> &d = scratch.distances[r];
+            d.resize(end[r] - from[r]);
+            const Value &v = s1[j0 + r];
+            const Value *s = s2.data() + from[r];
+            for (size_t k = 0; k < end[r] - from[r]; ++k) {
+                d[k] = m_metric(v, s[k]);
+            }
+        }
+
+        if (tmax == 0) return;
+
+        // The range of t for which every row has a cell to calculate
+        // with neighbours up, left and diagonally present too, and so
+        // needs no boundary tests
+        size_t t0 = tmin, t1 = tmin;
+        if (count == ROW_BLOCK) {
+            t0 = 0;
+            t1 = std::numeric_limits<size_t>::max();
+            for (size_t r = 0; r < count; ++r) {
+                size_t lo = std::max(from[r],
+                                     std::max(rows[r].lo, above[r]->lo) + 1);
+                size_t hi = std::min(end[r], above[r]->lo +
+                                     above[r]->costs.size());
+                t0 = std::max(t0, lo + r);
+                t1 = std::min(t1, hi + r);
+            }
+            if (t1 <= t0) {
+                t0 = t1 = tmin;
+            }
+        }
+        
+        auto edge = [&](size_t t) {
+            for (size_t r = 0; r < count; ++r) {
+                if (t < from[r] + r || t >= end[r] + r) {
+                    continue;
+                }
+                CostRow &row = rows[r];
+                size_t i = t - r;
+                cost_t up = above[r]->at(i);
+                cost_t diagonal = (i > 0 ? above[r]->at(i-1) : inf);
+                cost_t left = (i > row.lo ? row.costs[i - 1 - row.lo] : inf);
+                cost_t d = scratch.distances[r][i - from[r]];
+                cost_t cost = d + std::min(std::min(diagonal, up), left);
+                if (i == 0) {
+                    if (subsequence) {
+                        cost = d;
+                    } else if (j0 + r == 0) {
+                        cost = 0.0;
+                    }
+                }
+                row.costs[i - row.lo] = cost;
+            }
+        };
+
+        for (size_t t = tmin; t < t0; ++t) {
+            edge(t);
+        }
+
+        if (t0 < t1) {
+            cost_t *c[ROW_BLOCK];
+            const cost_t *a[ROW_BLOCK], *d[ROW_BLOCK];
+            size_t off[ROW_BLOCK], aoff[ROW_BLOCK], doff[ROW_BLOCK];
+            for (size_t r = 0; r < ROW_BLOCK; ++r) {
+                c[r] = rows[r].costs.data();
+                d[r] = scratch.distances[r].data();
+                a[r] = above[r]->costs.data();
+                off[r] = rows[r].lo + r;
+                aoff[r] = above[r]->lo + r;
+                doff[r] = from[r] + r;
+            }
+            for (size_t t = t0; t < t1; ++t) {
+                for (size_t r = 0; r < ROW_BLOCK; ++r) {
+                    size_t k = t - off[r], ka = t - aoff[r];
+                    c[r][k] = d[r][t - doff[r]] +
+                        std::min(std::min(a[r][ka-1], a[r][ka]), c[r][k-1]);
                 }
             }
         }
 
-        return costs;
+        for (size_t t = std::max(t0, t1); t < tmax; ++t) {
+            edge(t);
+        }
     }
 
-    std::vector<size_t> align(const std::vector<Value> &s1,
-                              const std::vector<Value> &s2,
-                              bool subsequence) {
+    // Record the traceback steps for cells [from, end) of a finished
+    // row j, given the row above it
+    void costSteps(size_t j,
+                   bool subsequence,
+                   size_t from,
+                   const CostRow &above,
+                   const CostRow &row,
+                   RowScratch &scratch,
+                   Backpointers &bp) {
 
-        // Return the index into s1 for each element in s2
+        const cost_t inf = std::numeric_limits<cost_t>::infinity();
+
+        size_t end = row.lo + row.costs.size();
+        if (from >= end) return;
+        size_t width = end - from;
         
-        std::vector<size_t> alignment(s2.size(), 0);
+        // The row above, aligned so that a[k] and a[k+1] are diagonal
+        // from and above cell from+k
+        std::vector<cost_t> &a = scratch.above;
+        a.assign(width + 1, inf);
+        if (!above.costs.empty()) {
+            size_t lo = std::max(above.lo, from > 0 ? from - 1 : 0);
+            size_t hi = std::min(above.lo + above.costs.size(), end);
+            if (lo < hi) {
+                std::copy(above.costs.begin() + (lo - above.lo),
+                          above.costs.begin() + (hi - above.lo),
+                          a.begin() + (lo + 1 - from));
+            }
+        }
+        
+        const cost_t *c = row.costs.data() + (from - row.lo);
+        cost_t left = (from > row.lo ? c[-1] : inf);
 
-        if (s1.empty() || s2.empty()) {
-            return alignment;
+        // As the traceback rule would choose them from the
+        // neighbouring costs: of the cells above and to the left,
+        // the lesser (the left if equal), or the diagonal if that is
+        // no greater. (Arithmetic rather than branches, as the choice
+        // is unpredictable)
+        auto choose = [](cost_t up, cost_t left, cost_t diagonal) {
+                          int u = int(up < left);
+                          int d = int(diagonal <= std::min(up, left));
+                          return (unsigned char)
+                              (d * StepDiagonal +
+                               (1 - d) * (u * StepUp + (1 - u) * StepLeft));
+                      };
+        
+        std::vector<unsigned char> &steps = scratch.steps;
+        steps.resize(width);
+        steps[0] = choose(a[1], left, a[0]);
+        for (size_t k = 1; k < width; ++k) {
+            steps[k] = choose(a[k+1], c[k-1], a[k]);
+        }
+        if (j == 0) {
+            std::fill(steps.begin(), steps.end(), (unsigned char)StepLeft);
+        }
+        if (from == 0) {
+            steps[0] = ((subsequence || j == 0) ? StepStop : StepUp);
         }
+        bp.setRange(j, from, end, steps.data());
+    }
 
-        auto costs = costSequences(s1, s2, subsequence);
+    // Where costRange puts what it finds, besides the costs of its
+    // last row. Any may be null
+    struct RangeOutput {
+        std::vector<cost_t> *lastColumn = nullptr; // cost at end of s2, by row
+        const std::vector<size_t> *stripes = nullptr;
+        std::vector<CostRow> *boundaries = nullptr; // row before each stripe
+        Backpointers *bp = nullptr;
+    };
 
-#ifdef DEBUG_DTW
-        SVCERR << "Cost matrix:" << endl;
-        for (auto v: cost) {
-            for (auto x: v) {
-                SVCERR << x << " ";
+    // Make a row ready for costRange to store cells into, covering
+    // the whole of row j of the window
+    static void prepareRow(const Window &window, size_t j, CostRow &row) {
+        row.lo = window.lo[j];
+        row.costs.resize(window.hi[j] - window.lo[j]);
+    }
+
+    // Store the calculated cells [from, end) of row j, whose row
+    // above is above, into the outputs
+    void storeRow(size_t j,
+                  bool subsequence,
+                  size_t n2,
+                  size_t from,
+                  const CostRow &above,
+                  const CostRow &row,
+                  RowScratch &scratch,
+                  const RangeOutput &out) {
+
+        size_t end = row.lo + row.costs.size();
+        if (from >= end) return;
+        
+        if (out.lastColumn && end == n2) {
+            (*out.lastColumn)[j] = row.costs[n2 - 1 - row.lo];
+        }
+        
+        if (out.boundaries) {
+            auto itr = std::lower_bound(out.stripes->begin() + 1,
+                                        out.stripes->end() - 1, j + 1);
+            if (itr != out.stripes->end() - 1 && *itr == j + 1) {
+                CostRow &b = (*out.boundaries)[itr - out.stripes->begin()];
+                std::copy(row.costs.begin() + (from - row.lo),
+                          row.costs.end(),
+                          b.costs.begin() + (from - b.lo));
+            }
+        }
+
+        if (out.bp) {
+            costSteps(j, subsequence, from, above, row, scratch, *out.bp);
+        }
+    }
+    
+    // Calculate the costs of rows [from, to), given those of row
+    // from-1 in prev (empty if from is 0), leaving those of row to-1
+    // in prev
+    void costRange(const std::vector<Value> &s1,
+                   const std::vector<Value> &s2,
+                   bool subsequence,
+                   const Window &window,
+                   size_t from,
+                   size_t to,
+                   CostRow &prev,
+                   const RangeOutput &out) {
+
+        size_t cells = 0;
+        for (size_t j = from; j < to; ++j) {
+            cells += window.hi[j] - window.lo[j];
+        }
+        if (m_runner && m_threads > 1 && cells >= MIN_PARALLEL_CELLS) {
+            costRangeParallel(s1, s2, subsequence, window, from, to,
+                              prev, out);
+            return;
+        }
+        
+        CostRow block[ROW_BLOCK];
+        size_t start[ROW_BLOCK];
+        RowScratch scratch;
+        
+        for (size_t j = from; j < to; j += ROW_BLOCK) {
+            if (aborted()) return;
+            size_t count = std::min(size_t(ROW_BLOCK), to - j);
+            for (size_t r = 0; r < count; ++r) {
+                prepareRow(window, j + r, block[r]);
+                start[r] = block[r].lo;
+            }
+            costRows(s1, s2, subsequence, j, count, start, prev, block,
+                     scratch);
+            for (size_t r = 0; r < count; ++r) {
+                storeRow(j + r, subsequence, s2.size(), start[r],
+                         r == 0 ? prev : block[r-1], block[r], scratch, out);
+            }
+            std::swap(prev, block[count - 1]);
+        }
+    }
+
+    // Working space for one tile job
+    struct TileScratch {
+        RowScratch rows;
+        CostRow block[2][ROW_BLOCK];
+    };
+
+    // As costRange, but splitting the rows into bands of BAND_ROWS
+    // and the columns into tiles, and calculating the tiles in
+    // parallel an anti-diagonal at a time, since each depends only
+    // on those above and to the left. Each tile works in its own
+    // short rows, with one extra cell on the left for the neighbour
+    // in the tile before. The costs are the same as costRange's, as
+    // each cell is calculated in the same way from the same
+    // neighbours
+    void costRangeParallel(const std::vector<Value> &s1,
+                           const std::vector<Value> &s2,
+                           bool subsequence,
+                           const Window &window,
+                           size_t from,
+                           size_t to,
+                           CostRow &prev,
+                           const RangeOutput &out) {
+
+        size_t threads = size_t(m_threads);
+        size_t bandsPerGroup = threads * 2;
+        size_t n2 = s2.size();
+
+        std::vector<CostRow> bottoms(bandsPerGroup);
+        std::vector<std::vector<cost_t>> lefts
+            (bandsPerGroup, std::vector<cost_t>(BAND_ROWS));
+        std::vector<TileScratch> scratch(bandsPerGroup);
+        
+        for (size_t g0 = from; g0 < to; g0 += bandsPerGroup * BAND_ROWS) {
+
+            size_t g1 = std::min(to, g0 + bandsPerGroup * BAND_ROWS);
+            size_t bands = (g1 - g0 + BAND_ROWS - 1) / BAND_ROWS;
+            
+            size_t colMin = n2, colMax = 0;
+            for (size_t j = g0; j < g1; ++j) {
+                if (window.hi[j] > window.lo[j]) {
+                    colMin = std::min(colMin, window.lo[j]);
+                    colMax = std::max(colMax, window.hi[j]);
+                }
+            }
+            if (colMax <= colMin) {
+                colMin = colMax = 0;
+            }
+            
+            size_t tileWidth = (colMax - colMin) / (threads * 2);
+            tileWidth = std::max(size_t(MIN_TILE_COLUMNS),
+                                 (tileWidth + 3) & ~size_t(3));
+            size_t tiles = std::max(size_t(1), (colMax - colMin + tileWidth - 1)
+                                    / tileWidth);
+
+            for (size_t b = 0; b < bands; ++b) {
+                size_t last = std::min(g1, g0 + (b + 1) * BAND_ROWS) - 1;
+                prepareRow(window, last, bottoms[b]);
             }
-            SVCERR << "\n";
+
+            auto tile = [&](size_t b, size_t c, TileScratch &ts) {
+
+                size_t ilo = colMin + c * tileWidth;
+                size_t ihi = std::min(colMax, ilo + tileWidth);
+                size_t b0 = g0 + b * BAND_ROWS;
+                size_t b1 = std::min(g1, b0 + BAND_ROWS);
+
+                const CostRow *above = (b == 0 ? &prev : &bottoms[b-1]);
+                CostRow *block = ts.block[0];
+                size_t start[ROW_BLOCK];
+                
+                for (size_t j = b0; j < b1; j += ROW_BLOCK) {
+
+                    if (aborted()) return;
+                    
+                    size_t count = std::min(size_t(ROW_BLOCK), b1 - j);
+
+                    for (size_t r = 0; r < count; ++r) {
+                        size_t lo = window.lo[j + r], hi = window.hi[j + r];
+                        size_t first = std::max(lo, ilo);
+                        size_t left = std::max(lo, ilo > 0 ? ilo - 1 : 0);
+                        size_t end = std::min(hi, ihi);
+                        CostRow &row = block[r];
+                        if (left < end) {
+                            row.lo = left;
+                            row.costs.resize(end - left);
+                            if (left < first) {
+                                row.costs[0] = lefts[b][j + r - b0];
+                            }
+                        } else {
+                            row.lo = first;
+                            row.costs.clear();
+                        }
+                        start[r] = first;
+                    }
+
+                    costRows(s1, s2, subsequence, j, count, start, *above,
+                             block, ts.rows);
+
+                    for (size_t r = 0; r < count; ++r) {
+                        const CostRow &row = block[r];
+                        size_t end = row.lo + row.costs.size();
+                        if (start[r] >= end) continue;
+                        storeRow(j + r, subsequence, n2, start[r],
+                                 r == 0 ? *above : block[r-1], row,
+                                 ts.rows, out);
+                        if (end == ihi) {
+                            lefts[b][j + r - b0] = row.costs.back();
+                        }
+                        if (j + r + 1 == b1) {
+                            CostRow &bottom = bottoms[b];
+                            std::copy(row.costs.begin() + (start[r] - row.lo),
+                                      row.costs.end(),
+                                      bottom.costs.begin() +
+                                      (start[r] - bottom.lo));
+                        }
+                    }
+
+                    above = &block[count - 1];
+                    block = (block == ts.block[0] ? ts.block[1] : ts.block[0]);
+                }
+            };
+
+            for (size_t q = 0; q + 1 < bands + tiles; ++q) {
+                if (aborted()) return;
+                size_t bmin = (q >= tiles ? q - tiles + 1 : 0);
+                size_t bmax = std::min(bands - 1, q);
+                m_runner(int(bmax - bmin + 1), [&](int ix) {
+                        size_t b = bmin + size_t(ix);
+                        tile(b, q - b, scratch[ix]);
+                    });
+            }
+
+            std::swap(prev, bottoms[bands - 1]);
+        }
+    }
+    
+    // Calculate the costs within the window and track back from the
+    // end, filling in the index into s1 for each element of s2, and
+    // also the cells visited if path is non-null.
+    //
+    // Only a block of rows of costs is held at a time, plus the steps
+    // for traceback. If there are more cells than tracebackCells, the
+    // steps are not kept from the first pass: instead the cost rows
+    // at the boundaries of stripes of rows are, and traceback
+    // recalculates the steps for one stripe at a time from these
+    void run(const std::vector<Value> &s1,
+             const std::vector<Value> &s2,
+             bool subsequence,
+             const Window &window,
+             std::vector<size_t> &alignment,
+             path_t *path) {
+
+        size_t n1 = s1.size(), n2 = s2.size();
+
+        size_t cells = 0, widest = 0;
+        for (size_t j = 0; j < n1; ++j) {
+            size_t width = window.hi[j] - window.lo[j];
+            cells += width;
+            widest = std::max(widest, width);
         }
+
+        // Rows [stripes[k], stripes[k+1]) make stripe k. Stripes of
+        // about sqrt(cells * widest) cells each balance the memory
+        // for steps against that for the boundary rows
+        std::vector<size_t> stripes { 0 };
+        if (cells > m_constraint.tracebackCells) {
+            size_t budget = std::max
+                (m_constraint.tracebackCells,
+                 size_t(std::sqrt(double(cells) * double(widest))));
+            size_t acc = 0;
+            for (size_t j = 0; j < n1; ++j) {
+                size_t width = window.hi[j] - window.lo[j];
+                if (acc > 0 && acc + width > budget) {
+                    stripes.push_back(j);
+                    acc = 0;
+                }
+                acc += width;
+            }
+        }
+        stripes.push_back(n1);
+        size_t nstripes = stripes.size() - 1;
+
+#ifdef DEBUG_DTW
+        SVCERR << "DTW: " << n1 << " x " << n2 << ", " << cells
+               << " cells in window, " << nstripes << " stripe(s)" << endl;
 #endif
 
-        size_t j = s1.size() - 1;
-        size_t i = s2.size() - 1;
+        // boundaries[k] holds the costs of the row before stripe k
+        std::vector<CostRow> boundaries(nstripes);
+        for (size_t k = 1; k < nstripes; ++k) {
+            prepareRow(window, stripes[k] - 1, boundaries[k]);
+        }
+        
+        std::vector<cost_t> lastColumn
+            (n1, std::numeric_limits<cost_t>::infinity());
+        Backpointers bp;
+
+        RangeOutput out;
+        out.lastColumn = &lastColumn;
+        if (nstripes == 1) {
+            bp.reset(window, 0, n1);
+            out.bp = &bp;
+        } else {
+            out.stripes = &stripes;
+            out.boundaries = &boundaries;
+        }
+        
+        CostRow prev;
+        costRange(s1, s2, subsequence, window, 0, n1, prev, out);
+        prev = CostRow();
+
+        auto step = [&](size_t j, size_t i) {
+                        if (!bp.containsRow(j)) {
+                            size_t k = size_t
+                                (std::upper_bound(stripes.begin(),
+                                                  stripes.end(), j) -
+                                 stripes.begin()) - 1;
+                            bp.reset(window, stripes[k], j + 1);
+                            RangeOutput stripeOut;
+                            stripeOut.bp = &bp;
+                            CostRow p = boundaries[k];
+                            costRange(s1, s2, subsequence, window,
+                                      stripes[k], j + 1, p, stripeOut);
+                        }
+                        return bp.get(j, i);
+                    };
+        
+        size_t j = n1 - 1;
+        size_t i = n2 - 1;
 
         if (subsequence) {
             cost_t min = 0.0;
             size_t minidx = 0;
-            for (size_t j = 0; j < s1.size(); ++j) {
-                if (j == 0 || costs[j][i] < min) {
-                    min = costs[j][i];
+            for (size_t j = 0; j < n1; ++j) {
+                if (j == 0 || lastColumn[j] < min) {
+                    min = lastColumn[j];
                     minidx = j;
                 }
             }
@@ -148,51 +1003,273 @@ private:
         
         while (i > 0 || j > 0) {
 
-            alignment[i] = j;
-            
-            if (i == 0) {
-                if (subsequence) {
-                    break;
-                } else {
-                    --j;
-                    continue;
-                }
-            }
+            if (aborted()) return;
             
-            if (j == 0) {
-                --i;
-                continue;
-            }
+            alignment[i] = j;
+            if (path) path->push_back({ j, i });
 
-            cost_t a = costs[j-1][i];
-            cost_t b = costs[j][i-1];
-            cost_t both = costs[j-1][i-1];
+            Step s = step(j, i);
 
-            if (a < b) {
+            // A stripe's steps may have been left incomplete
+            if (aborted()) return;
+            
+            if (s == StepStop) {
+                break;
+            }
+            if (s != StepLeft) {
                 --j;
-                if (both <= a) {
-                    --i;
-                }
-            } else {
+            }
+            if (s != StepUp) {
                 --i;
-                if (both <= b) {
-                    --j;
-                }
             }
         }
 
+        if (path && i == 0 && j == 0) {
+            path->push_back({ j, i });
+        }
+        
         if (subsequence) {
             alignment[0] = j;
         }
+    }
+
+    std::vector<size_t> align(const std::vector<Value> &s1,
+                              const std::vector<Value> &s2,
+                              bool subsequence) {
+
+        // Return the index into s1 for each element in s2
         
+        std::vector<size_t> alignment(s2.size(), 0);
+
+        if (s1.empty() || s2.empty()) {
+            return alignment;
+        }
+
+        Window window = makeWindow(s1, s2, subsequence);
+        if (aborted()) return alignment;
+        
+        run(s1, s2, subsequence, window, alignment, nullptr);
         return alignment;
     }
 };
 
+/**
+ * Online time warping (after Dixon's OLTW, as in MATCH) of sequences
+ * that grow as they are calculated, such as features still being
+ * extracted. Rather than the whole cost matrix, it calculates a band
+ * of cells following the path, adding a row or column (or both) at a
+ * time according to where the cheapest cell on the frontier is, so it
+ * needs only as much of each sequence as it has reached.
+ *
+ * The alignment it gives is the forward path, the cheapest frontier
+ * cell found at each step, which is not the optimal path but is
+ * available at once. It is monotonic, and is extended, never
+ * revised, as more of the sequences are consumed.
+ */
+template <typename Value,
+          typename Metric = std::function<double(const Value &, const Value &)>>
+class OnlineDTW
+{
+public:
+    /**
+     * searchWidth is the number of rows and columns back from the
+     * frontier that are calculated. maxRunCount is the most rows, or
+     * columns, added in succession before one of the other is forced.
+     */
+    OnlineDTW(Metric distanceMetric = Metric(),
+              size_t searchWidth = 500,
+              int maxRunCount = 3) :
+        m_metric(distanceMetric),
+        m_width(std::max(size_t(1), searchWidth)),
+        m_maxRunCount(maxRunCount) { }
+
+    /**
+     * Consume as much more of s1 and s2 as the path can reach. Each
+     * call must pass the same sequences as before, optionally
+     * extended at the end.
+     */
+    void advance(const std::vector<Value> &s1,
+                 const std::vector<Value> &s2) {
+
+        m_s1.insert(m_s1.end(), s1.begin() + m_s1.size(), s1.end());
+        m_s2.insert(m_s2.end(), s2.begin() + m_s2.size(), s2.end());
+
+        while (true) {
+
+            Direction d = Both;
+            if (m_t > 0) {
+                size_t j = 0, i = 0;
+                d = getIncrement(j, i);
+                record(j, i);
+            }
+
+            bool rowAvailable = (m_t < m_s1.size());
+            bool columnAvailable = (m_u < m_s2.size());
+
+            if (d == Both) {
+                if (!rowAvailable || !columnAvailable) break;
+                addColumn();
+                addRow();
+            } else if (d == Row) {
+                if (!rowAvailable) break;
+                addRow();
+            } else {
+                if (!columnAvailable) break;
+                addColumn();
+            }
+
+            if (d == m_previous && d != Both) {
+                ++m_runCount;
+            } else {
+                m_runCount = 1;
+            }
+            m_previous = d;
+        }
+    }
+
+    /**
+     * Return the index into s1 for each element in s2 that the path
+     * has reached so far.
+     */
+    const std::vector<size_t> &getAlignment() const {
+        return m_alignment;
+    }
+
+private:
+    typedef double cost_t;
+
+    enum Direction { Row, Column, Both };
+
+    // Costs of row j for indices [lo, lo + costs.size()) into s2
+    struct Band {
+        size_t lo = 0;
+        std::vector<cost_t> costs;
+        
+        cost_t at(size_t i) const {
+            if (i < lo || i >= lo + costs.size()) {
+                return std::numeric_limits<cost_t>::infinity();
+            }
+            return costs[i - lo];
+        }
+    };
+
+    Metric m_metric;
+    size_t m_width;
+    int m_maxRunCount;
+    std::vector<Value> m_s1;
+    std::vector<Value> m_s2;
+
+    // The last m_width rows calculated, the last being row m_t-1.
+    // Every one of them extends to column m_u-1
+    std::deque<Band> m_rows;
+    size_t m_t = 0; // rows calculated
+    size_t m_u = 0; // columns calculated
+
+    Direction m_previous = Both;
+    int m_runCount = 0;
+    std::vector<size_t> m_alignment;
+
+    cost_t cost(size_t j, size_t i, cost_t up, cost_t left, cost_t diagonal) {
+        cost_t d = m_metric(m_s1[j], m_s2[i]);
+        if (j == 0 && i == 0) return d;
+        return d + std::min(std::min(diagonal, up), left);
+    }
+    
+    void addRow() {
+        size_t j = m_t;
+        const cost_t inf = std::numeric_limits<cost_t>::infinity();
+        const Band *above = (m_rows.empty() ? nullptr : &m_rows.back());
+        Band row;
+        row.lo = (m_u > m_width ? m_u - m_width : 0);
+        row.costs.resize(m_u - row.lo);
+        for (size_t i = row.lo; i < m_u; ++i) {
+            cost_t up = (above ? above->at(i) : inf);
+            cost_t diagonal = (above && i > 0 ? above->at(i-1) : inf);
+            cost_t left = (i > row.lo ? row.costs[i - row.lo - 1] : inf);
+            row.costs[i - row.lo] = cost(j, i, up, left, diagonal);
+        }
+        m_rows.push_back(row);
+        if (m_rows.size() > m_width) {
+            m_rows.pop_front();
+        }
+        ++m_t;
+    }
+
+    void addColumn() {
+        size_t i = m_u;
+        size_t j0 = m_t - m_rows.size();
+        const cost_t inf = std::numeric_limits<cost_t>::infinity();
+        for (size_t k = 0; k < m_rows.size(); ++k) {
+            Band &row = m_rows[k];
+            const Band *above = (k > 0 ? &m_rows[k-1] : nullptr);
+            cost_t up = (above ? above->at(i) : inf);
+            cost_t diagonal = (above && i > 0 ? above->at(i-1) : inf);
+            cost_t left = (row.costs.empty() ? inf : row.costs.back());
+            row.costs.push_back(cost(j0 + k, i, up, left, diagonal));
+        }
+        ++m_u;
+    }
+
+    // Find the cheapest cell, by cost per step of path length, in
+    // the last row and column, and decide which way to go from it
+    Direction getIncrement(size_t &bestJ, size_t &bestI) const {
+
+        const Band &last = m_rows.back();
+        size_t j0 = m_t - m_rows.size();
+        cost_t best = std::numeric_limits<cost_t>::infinity();
+        bestJ = m_t - 1;
+        bestI = (m_u > 0 ? m_u - 1 : 0);
+
+        auto consider = [&](size_t j, size_t i, cost_t c) {
+                            cost_t n = c / cost_t(j + i + 1);
+                            if (n < best) {
+                                best = n;
+                                bestJ = j;
+                                bestI = i;
+                            }
+                        };
+        
+        for (size_t k = 0; k < last.costs.size(); ++k) {
+            consider(m_t - 1, last.lo + k, last.costs[k]);
+        }
+        if (m_u > 0) {
+            for (size_t k = 0; k + 1 < m_rows.size(); ++k) {
+                consider(j0 + k, m_u - 1, m_rows[k].at(m_u - 1));
+            }
+        }
+
+        if (m_runCount >= m_maxRunCount) {
+            if (m_previous == Row) return Column;
+            if (m_previous == Column) return Row;
+        }
+        
+        if (bestJ + 1 < m_t) {
+            return Column; // path has reached the last column early
+        } else if (bestI + 1 < m_u) {
+            return Row;    // and the last row
+        } else {
+            return Both;
+        }
+    }
+
+    void record(size_t j, size_t i) {
+        if (m_u == 0) return;
+        if (!m_alignment.empty()) {
+            j = std::max(j, m_alignment.back());
+        }
+        while (m_alignment.size() <= i) {
+            m_alignment.push_back(j);
+        }
+    }
+};
+
 class MagnitudeDTW
 {
 public:
-    MagnitudeDTW() : m_dtw(metric) { }
+    MagnitudeDTW(DTWConstraint constraint = DTWConstraint()) :
+        m_dtw(Metric(), combine) {
+        m_dtw.setConstraint(constraint);
+    }
 
     std::vector<size_t> alignSequences(std::vector<double> s1,
                                        std::vector<double> s2) {
@@ -204,12 +1281,31 @@ public:
         return m_dtw.alignSubsequence(s, sub);
     }
 
-private:
-    DTW<double> m_dtw;
+    void setParallelRunner(DTWRunner runner, int threads) {
+        m_dtw.setParallelRunner(runner, threads);
+    }
+
+    void setAbortFlag(const std::atomic<bool> *abort) {
+        m_dtw.setAbortFlag(abort);
+    }
 
+    // The distance metric, also for use with OnlineDTW
+    struct Metric {
+        double operator()(const double &a, const double &b) const {
+            return metric(a, b);
+        }
+    };
+
+private:
     static double metric(const double &a, const double &b) {
         return std::abs(b - a);
     }
+
+    DTW<double, Metric> m_dtw;
+
+    static double combine(const double &a, const double &b) {
+        return (a + b) / 2.0;
+    }
 };
 
 class RiseFallDTW
@@ -226,7 +1322,10 @@ public:
         double distance;
     };
 
-    RiseFallDTW() : m_dtw(metric) { }
+    RiseFallDTW(DTWConstraint constraint = DTWConstraint()) :
+        m_dtw(Metric(), combine) {
+        m_dtw.setConstraint(constraint);
+    }
 
     std::vector<size_t> alignSequences(std::vector<Value> s1,
                                        std::vector<Value> s2) {
@@ -238,8 +1337,47 @@ public:
         return m_dtw.alignSubsequence(s, sub);
     }
 
+    void setParallelRunner(DTWRunner runner, int threads) {
+        m_dtw.setParallelRunner(runner, threads);
+    }
+
+    void setAbortFlag(const std::atomic<bool> *abort) {
+        m_dtw.setAbortFlag(abort);
+    }
+
+    // The distance metric, also for use with OnlineDTW
+    struct Metric {
+        double operator()(const Value &a, const Value &b) const {
+            return metric(a, b);
+        }
+    };
+
 private:
-    DTW<Value> m_dtw;
+
+    DTW<Value, Metric> m_dtw;
+
+    // Two consecutive rises or falls in sequence make one of their
+    // net distance
+    static Value combine(const Value &a, const Value &b) {
+        if (a.direction == Direction::None &&
+            b.direction == Direction::None) {
+            return a;
+        }
+        auto sign = [](const Value &v) {
+                        return (v.direction == Direction::Up ? v.distance :
+                                v.direction == Direction::Down ? -v.distance :
+                                0.0);
+                    };
+        double net = sign(a) + sign(b);
+        if (net > 0.0) {
+            return { Direction::Up, net };
+        } else if (net < 0.0) {
+            return { Direction::Down, -net };
+        } else {
+            return { a.direction != Direction::None ?
+                     a.direction : b.direction, 0.0 };
+        }
+    }
 
     static double metric(const Value &a, const Value &b) {
         
@@ -16,17 +16,34 @@
 
 #include <QFileInfo>
 #include <QApplication>
+#include <QProcessEnvironment>
+#include <QtEndian>
 
 #include "data/model/ReadOnlyWaveFileModel.h"
-#include "data/model/SparseTimeValueModel.h"
 #include "data/model/AlignmentModel.h"
 
-#include "data/fileio/CSVFileReader.h"
-
 #include "framework/Document.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+//#define DEBUG_EXTERNAL_PROGRAM_ALIGNER 1
+
 namespace sv {
 
+// Binary output: magic, version, and sample rate, then frame pairs
+static const char BINARY_MAGIC[] = "SVAP";
+static const int BINARY_MAGIC_SIZE = 4;
+static const quint32 BINARY_VERSION = 1;
+static const int BINARY_HEADER_SIZE = BINARY_MAGIC_SIZE + 4 + 8;
+static const int BINARY_RECORD_SIZE = 16;
+
+// The path is re-published to the alignment model when it has grown
+// by this many points, or by a quarter of what was last published if
+// that is more, so that the copying stays linear overall
+static const int MIN_PUBLISH_POINTS = 1000;
+
 ExternalProgramAligner::ExternalProgramAligner(Document *doc,
                                                ModelId reference,
                                                ModelId toAlign,
@@ -35,7 +52,10 @@ ExternalProgramAligner::ExternalProgramAligner(Document *doc,
     m_reference(reference),
     m_toAlign(toAlign),
     m_program(program),
-    m_process(nullptr)
+    m_process(nullptr),
+    m_outputFormat(OutputFormat::Unknown),
+    m_binaryRate(0.0),
+    m_publishedPointCount(0)
 {
 }
 
@@ -60,7 +80,8 @@ ExternalProgramAligner::begin()
 {
     // Run an external program, passing to it paths to the main
     // model's audio file and the new model's audio file. It returns
-    // the path in CSV form through stdout.
+    // the path in CSV or binary form through stdout, which we parse
+    // as it arrives.
 
     auto reference = ModelById::getAs<ReadOnlyWaveFileModel>(m_reference);
     auto other = ModelById::getAs<ReadOnlyWaveFileModel>(m_toAlign);
@@ -100,9 +121,20 @@ ExternalProgramAligner::begin()
     m_alignmentModel = ModelById::add(alignmentModel);
     other->setAlignment(m_alignmentModel);
 
+    m_outputFormat = OutputFormat::Unknown;
+    m_output.clear();
+    m_binaryRate = 0.0;
+    m_path.reset(new Path(alignmentModel->getSampleRate(), 1));
+    m_publishedPointCount = 0;
+    m_parseError = "";
+
     m_process = new QProcess;
     m_process->setProcessChannelMode(QProcess::SeparateChannels);
 
+    QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+    env.insert("SV_ALIGNMENT_OUTPUT_FORMATS", "csv,binary");
+    m_process->setProcessEnvironment(env);
+
     connect(m_process,
             SIGNAL(finished(int, QProcess::ExitStatus)),
             this,
@@ -113,6 +145,11 @@ ExternalProgramAligner::begin()
             this,
             SLOT(logStderrOutput()));
 
+    connect(m_process,
+            SIGNAL(readyReadStandardOutput()),
+            this,
+            SLOT(readStdoutOutput()));
+
     QStringList args;
     args << refPath << otherPath;
 
@@ -181,6 +218,199 @@ ExternalProgramAligner::logStderrOutput()
     m_process->setReadChannel(QProcess::StandardOutput);
 }
 
+void
+ExternalProgramAligner::readStdoutOutput()
+{
+    if (!m_process) return;
+
+    m_output.append(m_process->readAllStandardOutput());
+
+    if (m_parseError != "") {
+        // Keep draining, but the result is already a failure
+        m_output.clear();
+        return;
+    }
+    
+    if (!parseOutput(false)) {
+        SVCERR << "ERROR: ExternalProgramAligner: " << m_parseError << endl;
+        m_output.clear();
+        return;
+    }
+
+    publishPath(false);
+}
+
+bool
+ExternalProgramAligner::parseOutput(bool final)
+{
+    if (m_outputFormat == OutputFormat::Unknown) {
+        if (m_output.size() < BINARY_MAGIC_SIZE &&
+            QByteArray(BINARY_MAGIC).startsWith(m_output) && !final) {
+            return true; // can't tell yet
+        }
+        if (m_output.startsWith(BINARY_MAGIC)) {
+            m_outputFormat = OutputFormat::Binary;
+        } else {
+            m_outputFormat = OutputFormat::CSV;
+        }
+#ifdef DEBUG_EXTERNAL_PROGRAM_ALIGNER
+        SVDEBUG << "ExternalProgramAligner: Output format is "
+                << (m_outputFormat == OutputFormat::Binary ? "binary" : "CSV")
+                << endl;
+#endif
+    }
+
+    if (m_outputFormat == OutputFormat::Binary) {
+        return parseBinary(final);
+    } else {
+        return parseCSV(final);
+    }
+}
+
+bool
+ExternalProgramAligner::parseCSV(bool final)
+{
+    // The output format has time in the reference file first, and
+    // time in the "other" file in the second column. This is a more
+    // natural approach for a command-line alignment tool, but it's
+    // the opposite of what we expect for native alignment paths,
+    // which map from "other" file to reference.
+
+    double rate = m_path->getSampleRate();
+    int consumed = 0;
+    
+    while (consumed < m_output.size()) {
+
+        int eol = m_output.indexOf('\n', consumed);
+        if (eol < 0) {
+            if (!final) break;
+            eol = m_output.size();
+        }
+
+        QByteArray line = m_output.mid(consumed, eol - consumed).trimmed();
+        consumed = eol + 1;
+
+        if (line.isEmpty() || line.startsWith('#')) continue;
+
+        QList<QByteArray> fields = line.split(',');
+        bool ok = (fields.size() >= 2);
+        double refTime = 0.0, otherTime = 0.0;
+        if (ok) refTime = fields[0].trimmed().toDouble(&ok);
+        if (ok) otherTime = fields[1].trimmed().toDouble(&ok);
+
+        if (!ok) {
+            // A header line or similar - skip it, as the CSV reader did
+#ifdef DEBUG_EXTERNAL_PROGRAM_ALIGNER
+            SVDEBUG << "ExternalProgramAligner: Skipping unparseable line \""
+                    << QString::fromUtf8(line) << "\"" << endl;
+#endif
+            continue;
+        }
+
+        m_path->add(PathPoint(sv_frame_t(round(otherTime * rate)),
+                              sv_frame_t(round(refTime * rate))));
+    }
+
+    m_output.remove(0, std::min(consumed, int(m_output.size())));
+    return true;
+}
+
+bool
+ExternalProgramAligner::parseBinary(bool final)
+{
+    int consumed = 0;
+    
+    if (m_binaryRate == 0.0) {
+        if (m_output.size() < BINARY_HEADER_SIZE) {
+            if (final) {
+                m_parseError = tr("Binary output was truncated");
+                return false;
+            }
+            return true;
+        }
+        const uchar *data =
+            reinterpret_cast<const uchar *>(m_output.constData());
+        quint32 version =
+            qFromLittleEndian<quint32>(data + BINARY_MAGIC_SIZE);
+        quint64 rateBits =
+            qFromLittleEndian<quint64>(data + BINARY_MAGIC_SIZE + 4);
+        double rate = 0.0;
+        memcpy(&rate, &rateBits, sizeof(rate));
+        if (version != BINARY_VERSION) {
+            m_parseError = tr("Unsupported binary format version %1")
+                .arg(version);
+            return false;
+        }
+        if (!(rate > 0.0)) {
+            m_parseError = tr("Invalid sample rate in binary output");
+            return false;
+        }
+        m_binaryRate = rate;
+        consumed = BINARY_HEADER_SIZE;
+    }
+
+    double ratio = m_path->getSampleRate() / m_binaryRate;
+    const uchar *data = reinterpret_cast<const uchar *>(m_output.constData());
+    
+    while (consumed + BINARY_RECORD_SIZE <= m_output.size()) {
+        qint64 refFrame = qFromLittleEndian<qint64>(data + consumed);
+        qint64 otherFrame = qFromLittleEndian<qint64>(data + consumed + 8);
+        consumed += BINARY_RECORD_SIZE;
+        if (ratio == 1.0) {
+            m_path->add(PathPoint(otherFrame, refFrame));
+        } else {
+            m_path->add(PathPoint(sv_frame_t(round(otherFrame * ratio)),
+                                  sv_frame_t(round(refFrame * ratio))));
+        }
+    }
+
+    m_output.remove(0, consumed);
+
+    if (final && !m_output.isEmpty()) {
+        m_parseError = tr("Binary output was truncated");
+        return false;
+    }
+    
+    return true;
+}
+
+void
+ExternalProgramAligner::publishPath(bool final)
+{
+    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
+    if (!alignmentModel) return;
+
+    int count = int(m_path->getPointCount());
+    if (count == 0) return;
+
+    if (!final) {
+        int threshold = std::max(MIN_PUBLISH_POINTS, m_publishedPointCount / 4);
+        if (count - m_publishedPointCount < threshold) return;
+    }
+
+#ifdef DEBUG_EXTERNAL_PROGRAM_ALIGNER
+    SVDEBUG << "ExternalProgramAligner: Publishing path of " << count
+            << " point(s)" << (final ? " (final)" : "") << endl;
+#endif
+    
+    alignmentModel->setPath(*m_path);
+    m_publishedPointCount = count;
+
+    if (final) return;
+    
+    // Estimate progress from how far into the to-align model the
+    // path has reached, within the range left after startup
+    auto other = ModelById::get(m_toAlign);
+    if (other && other->getEndFrame() > 0) {
+        sv_frame_t reached = m_path->getPoints().rbegin()->frame;
+        double proportion = double(reached) / double(other->getEndFrame());
+        int completion = 10 + int(round(89.0 * std::min(proportion, 1.0)));
+        if (completion > alignmentModel->getCompletion()) {
+            alignmentModel->setCompletion(completion);
+        }
+    }
+}
+
 void
 ExternalProgramAligner::programFinished(int exitCode,
                                         QProcess::ExitStatus status)
@@ -208,67 +438,34 @@ ExternalProgramAligner::programFinished(int exitCode,
     
     if (exitCode == 0 && status == 0) {
 
-        CSVFormat format;
-        format.setModelType(CSVFormat::TwoDimensionalModel);
-        format.setTimingType(CSVFormat::ExplicitTiming);
-        format.setTimeUnits(CSVFormat::TimeSeconds);
-        format.setColumnCount(2);
-        // The output format has time in the reference file first, and
-        // time in the "other" file in the second column. This is a
-        // more natural approach for a command-line alignment tool,
-        // but it's the opposite of what we expect for native
-        // alignment paths, which map from "other" file to
-        // reference. These column purpose settings reflect that.
-        format.setColumnPurpose(1, CSVFormat::ColumnStartTime);
-        format.setColumnPurpose(0, CSVFormat::ColumnValue);
-        format.setAllowQuoting(false);
-        format.setSeparator(',');
-
-        CSVFileReader reader(process, format, alignmentModel->getSampleRate());
-        if (!reader.isOK()) {
-            SVCERR << "ERROR: ExternalProgramAligner: Failed to parse output"
-                   << endl;
-            errorText = tr("Failed to parse output of program: %1")
-                .arg(reader.getError());
-            alignmentModel->setError(errorText);
-            goto done;
+        if (m_parseError == "") {
+            m_output.append(m_process->readAllStandardOutput());
+            parseOutput(true);
         }
-
-        //!!! to use ById?
         
-        Model *csvOutput = reader.load();
-
-        SparseTimeValueModel *path =
-            qobject_cast<SparseTimeValueModel *>(csvOutput);
-        if (!path) {
-            SVCERR << "ERROR: ExternalProgramAligner: Output did not convert to sparse time-value model"
-                   << endl;
-            errorText =
-                tr("Output of alignment program was not in the proper format");
+        if (m_parseError != "") {
+            SVCERR << "ERROR: ExternalProgramAligner: Failed to parse output: "
+                   << m_parseError << endl;
+            errorText = tr("Failed to parse output of program: %1")
+                .arg(m_parseError);
             alignmentModel->setError(errorText);
-            delete csvOutput;
             goto done;
         }
-                       
-        if (path->isEmpty()) {
+
+        if (m_path->getPointCount() == 0) {
             SVCERR << "ERROR: ExternalProgramAligner: Output contained no mappings"
                    << endl;
             errorText = 
                 tr("Output of alignment program contained no mappings");
             alignmentModel->setError(errorText);
-            delete path;
             goto done;
         }
 
         SVCERR << "ExternalProgramAligner: Setting alignment path ("
-             << path->getEventCount() << " point(s))" << endl;
+               << m_path->getPointCount() << " point(s))" << endl;
 
-        auto pathId =
-            ModelById::add(std::shared_ptr<SparseTimeValueModel>(path));
-        alignmentModel->setPathFrom(pathId);
+        publishPath(true);
         alignmentModel->setCompletion(100);
-
-        ModelById::release(pathId);
         
     } else {
         SVCERR << "ERROR: ExternalProgramAligner: Aligner program "
@@ -281,6 +478,7 @@ ExternalProgramAligner::programFinished(int exitCode,
 done:
     delete m_process;
     m_process = nullptr;
+    m_output.clear();
 
     // "This should be emitted as the last thing the aligner does, as
     // the recipient may delete the aligner during the call."
@@ -291,4 +489,3 @@ done:
     }
 }
 } // end namespace sv
-
@@ -17,14 +17,38 @@
 
 #include "Aligner.h"
 
+#include "data/model/Path.h"
+
 #include <QProcess>
 #include <QString>
+#include <QByteArray>
+
+#include <memory>
 
 namespace sv {
 
 class AlignmentModel;
 class Document;
 
+/**
+ * An aligner that runs an external program, passing it the paths of
+ * the reference and to-align audio files as arguments, and reads the
+ * alignment path from its standard output as it arrives.
+ *
+ * The output is normally CSV text, one line per path point, with the
+ * time in seconds in the reference file in the first column and that
+ * in the to-align file in the second.
+ *
+ * The program is also told, through the SV_ALIGNMENT_OUTPUT_FORMATS
+ * environment variable, that it may instead write a compact binary
+ * format. This consists of the four bytes "SVAP", a little-endian
+ * 32-bit version number (1), and a little-endian 64-bit IEEE double
+ * giving the sample rate the frames are expressed at, followed by
+ * any number of pairs of little-endian 64-bit signed integers giving
+ * a frame in the reference and the corresponding frame in the
+ * to-align file. The format is recognised by its magic, so a program
+ * that ignores the variable and writes CSV works as it always did.
+ */
 class ExternalProgramAligner : public Aligner
 {
     Q_OBJECT
@@ -45,6 +69,7 @@ public:
 private slots:
     void programFinished(int, QProcess::ExitStatus);
     void logStderrOutput();
+    void readStdoutOutput();
 
 private:
     Document *m_document;
@@ -53,6 +78,19 @@ private:
     ModelId m_alignmentModel;
     QString m_program;
     QProcess *m_process;
+
+    enum class OutputFormat { Unknown, CSV, Binary };
+    OutputFormat m_outputFormat;
+    QByteArray m_output;
+    double m_binaryRate;
+    std::unique_ptr<Path> m_path;
+    int m_publishedPointCount;
+    QString m_parseError;
+
+    bool parseOutput(bool final);
+    bool parseCSV(bool final);
+    bool parseBinary(bool final);
+    void publishPath(bool final);
 };
 
 } // end namespace sv
@@ -13,6 +13,7 @@
 */
 
 #include "MATCHAligner.h"
+#include "AlignmentFeatureCache.h"
 
 #include "data/model/SparseTimeValueModel.h"
 #include "data/model/RangeSummarisableTimeValueModel.h"
@@ -58,6 +59,12 @@ MATCHAligner::~MATCHAligner()
     ModelById::release(m_pathOutputModel);
 }
 
+void
+MATCHAligner::setFeatureCache(std::shared_ptr<AlignmentFeatureCache> cache)
+{
+    m_featureCache = cache;
+}
+
 QString
 MATCHAligner::getAlignmentTransformName(bool subsequence)
 {
@@ -179,6 +186,13 @@ MATCHAligner::begin()
     TransformId tdId;
     if (m_withTuningDifference) {
         tdId = getTuningDifferenceTransformName();
+        if (m_featureCache &&
+            m_featureCache->getTuningFrequency(m_reference, m_toAlign,
+                                               m_tuningFrequency)) {
+            SVDEBUG << "MATCHAligner: Reusing tuning frequency "
+                    << m_tuningFrequency << " found earlier" << endl;
+            tdId = "";
+        }
     }
 
     if (tdId == "") {
@@ -288,6 +302,11 @@ MATCHAligner::tuningDifferenceCompletionChanged(ModelId tuningDiffOutputModelId)
     } else {
         SVCERR << "MATCHAligner::tuningDifferenceCompletionChanged: No tuning frequency reported" << endl;
     }    
+
+    if (m_featureCache) {
+        m_featureCache->setTuningFrequency(m_reference, m_toAlign,
+                                           m_tuningFrequency);
+    }
     
     ModelById::release(tuningDiffOutputModel);
     m_tuningDiffOutputModel = {};
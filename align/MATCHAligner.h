@@ -17,9 +17,12 @@
 
 #include "Aligner.h"
 
+#include <memory>
+
 namespace sv {
 
 class AlignmentModel;
+class AlignmentFeatureCache;
 class Document;
 
 class MATCHAligner : public Aligner
@@ -36,6 +39,16 @@ public:
     // Destroy the aligner, cleanly cancelling any ongoing alignment
     ~MATCHAligner();
 
+    /**
+     * Set a cache in which to record the tuning difference found
+     * between the two models, and from which to take it instead of
+     * running the tuning-difference transform again if they have
+     * been aligned before. MATCH itself takes both models as a single
+     * input, so there is nothing more of it to share. Call before
+     * begin().
+     */
+    void setFeatureCache(std::shared_ptr<AlignmentFeatureCache> cache);
+
     void begin() override;
 
     static bool isAvailable(bool subsequence,
@@ -62,6 +75,7 @@ private:
     bool m_withTuningDifference;
     float m_tuningFrequency;
     bool m_incomplete;
+    std::shared_ptr<AlignmentFeatureCache> m_featureCache;
 };
 
 } // end namespace sv
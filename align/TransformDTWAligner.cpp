@@ -13,6 +13,7 @@
 */
 
 #include "TransformDTWAligner.h"
+#include "AlignmentFeatureCache.h"
 #include "DTW.h"
 
 #include "data/model/SparseTimeValueModel.h"
@@ -23,12 +24,12 @@
 
 #include "framework/Document.h"
 
+#include "audio/MixWorkerPool.h"
+
 #include "transform/ModelTransformerFactory.h"
 #include "transform/FeatureExtractionModelTransformer.h"
 
 #include <QSettings>
-#include <QMutex>
-#include <QMutexLocker>
 
 namespace sv {
 
@@ -52,9 +53,6 @@ TransformDTWAligner::RiseFallPreprocessor identityRiseFallPreprocessor =
         }
     };
 
-QMutex
-TransformDTWAligner::m_dtwMutex;
-
 TransformDTWAligner::TransformDTWAligner(Document *doc,
                                          ModelId reference,
                                          ModelId toAlign,
@@ -69,8 +67,14 @@ TransformDTWAligner::TransformDTWAligner(Document *doc,
     m_subsequence(subsequence),
     m_incomplete(true),
     m_magnitudePreprocessor(identityMagnitudePreprocessor),
-    m_riseFallPreprocessor(identityRiseFallPreprocessor)
+    m_riseFallPreprocessor(identityRiseFallPreprocessor),
+    m_task(0),
+    m_abort(false),
+    m_resolution(0),
+    m_streaming(false)
 {
+    connect(this, SIGNAL(dtwCalculated()), this, SLOT(finishAlignment()),
+            Qt::QueuedConnection);
 }
 
 TransformDTWAligner::TransformDTWAligner(Document *doc,
@@ -87,8 +91,14 @@ TransformDTWAligner::TransformDTWAligner(Document *doc,
     m_subsequence(subsequence),
     m_incomplete(true),
     m_magnitudePreprocessor(outputPreprocessor),
-    m_riseFallPreprocessor(identityRiseFallPreprocessor)
+    m_riseFallPreprocessor(identityRiseFallPreprocessor),
+    m_task(0),
+    m_abort(false),
+    m_resolution(0),
+    m_streaming(false)
 {
+    connect(this, SIGNAL(dtwCalculated()), this, SLOT(finishAlignment()),
+            Qt::QueuedConnection);
 }
 
 TransformDTWAligner::TransformDTWAligner(Document *doc,
@@ -105,20 +115,54 @@ TransformDTWAligner::TransformDTWAligner(Document *doc,
     m_subsequence(subsequence),
     m_incomplete(true),
     m_magnitudePreprocessor(identityMagnitudePreprocessor),
-    m_riseFallPreprocessor(outputPreprocessor)
+    m_riseFallPreprocessor(outputPreprocessor),
+    m_task(0),
+    m_abort(false),
+    m_resolution(0),
+    m_streaming(false)
 {
+    connect(this, SIGNAL(dtwCalculated()), this, SLOT(finishAlignment()),
+            Qt::QueuedConnection);
 }
 
 TransformDTWAligner::~TransformDTWAligner()
 {
+    if (m_task) {
+        // A DTW that is already running stops at its next check of
+        // the abort flag, so the wait in cancel() is brief
+        m_abort = true;
+        AlignmentExecutor::getInstance()->cancel(m_task);
+    }
+    
     if (m_incomplete) {
         if (auto toAlign = ModelById::get(m_toAlign)) {
             toAlign->setAlignment({});
         }
     }
     
-    ModelById::release(m_referenceOutputModel);
-    ModelById::release(m_toAlignOutputModel);
+    if (!m_featureCache) {
+        ModelById::release(m_referenceOutputModel);
+        ModelById::release(m_toAlignOutputModel);
+    }
+}
+
+void
+TransformDTWAligner::setDTWConstraint(DTWConstraint constraint)
+{
+    m_dtwConstraint = constraint;
+}
+
+void
+TransformDTWAligner::setStreaming(bool streaming)
+{
+    m_streaming = streaming;
+}
+
+void
+TransformDTWAligner::setFeatureCache(std::shared_ptr<AlignmentFeatureCache>
+                                     cache)
+{
+    m_featureCache = cache;
 }
 
 bool
@@ -145,7 +189,13 @@ TransformDTWAligner::begin()
 
     QString message;
 
-    m_referenceOutputModel = mtf->transform(m_transform, m_reference, message);
+    if (m_featureCache) {
+        m_referenceOutputModel = m_featureCache->getTransformOutput
+            (m_transform, m_reference, message);
+    } else {
+        m_referenceOutputModel = mtf->transform
+            (m_transform, m_reference, message);
+    }
     auto referenceOutputModel = ModelById::get(m_referenceOutputModel);
     if (!referenceOutputModel) {
         SVCERR << "Align::alignModel: ERROR: Failed to create reference output model (no plugin?)" << endl;
@@ -161,7 +211,13 @@ TransformDTWAligner::begin()
 
     message = "";
 
-    m_toAlignOutputModel = mtf->transform(m_transform, m_toAlign, message);
+    if (m_featureCache) {
+        m_toAlignOutputModel = m_featureCache->getTransformOutput
+            (m_transform, m_toAlign, message);
+    } else {
+        m_toAlignOutputModel = mtf->transform
+            (m_transform, m_toAlign, message);
+    }
     auto toAlignOutputModel = ModelById::get(m_toAlignOutputModel);
     if (!toAlignOutputModel) {
         SVCERR << "Align::alignModel: ERROR: Failed to create toAlign output model (no plugin?)" << endl;
@@ -193,9 +249,7 @@ TransformDTWAligner::begin()
         toAlignOutputModel->isReady(&completion)) {
         SVCERR << "TransformDTWAligner[" << this << "]: begin(): output models "
                << "are ready already! calling performAlignment" << endl;
-        if (performAlignment()) {
-            emit complete(m_alignmentModel);
-        } else {
+        if (!performAlignment()) {
             emit failed(m_toAlign, tr("Failed to calculate alignment using DTW"));
         }
     }
@@ -208,7 +262,7 @@ TransformDTWAligner::completionChanged(ModelId
 #endif
     )
 {
-    if (!m_incomplete) {
+    if (!m_incomplete || m_task) {
         return;
     }
 #ifdef DEBUG_TRANSFORM_DTW_ALIGNER
@@ -235,9 +289,7 @@ TransformDTWAligner::completionChanged(ModelId
 
         alignmentModel->setCompletion(95);
         
-        if (performAlignment()) {
-            emit complete(m_alignmentModel);
-        } else {
+        if (!performAlignment()) {
             emit failed(m_toAlign, tr("Alignment of transform outputs failed"));
         }
 
@@ -248,6 +300,10 @@ TransformDTWAligner::completionChanged(ModelId
                << ", toAlign completion " << toAlignCompletion << endl;
 #endif
         
+        if (m_streaming && !m_subsequence) {
+            updateStreamingAlignment();
+        }
+        
         int completion = std::min(referenceCompletion,
                                   toAlignCompletion);
         completion = (completion * 94) / 100;
@@ -328,25 +384,138 @@ TransformDTWAligner::makePath(const vector<size_t> &alignment,
     return path;
 }
 
-bool
-TransformDTWAligner::performAlignmentMagnitude()
+template <typename DTWClass, typename Value>
+void
+TransformDTWAligner::submitDTW(vector<Value> s1, vector<Value> s2)
+{
+    size_t bytes = m_dtwConstraint.estimateMemory(s1.size(), s2.size(),
+                                                  m_subsequence);
+
+#ifdef DEBUG_TRANSFORM_DTW_ALIGNER
+    SVCERR << "TransformDTWAligner[" << this << "]: submitting DTW of "
+           << s1.size() << " x " << s2.size() << ", estimated "
+           << bytes << " bytes" << endl;
+#endif
+
+    DTWConstraint constraint = m_dtwConstraint;
+    bool subsequence = m_subsequence;
+    
+    m_onlineMagnitude.reset();
+    m_onlineRiseFall.reset();
+    
+    m_task = AlignmentExecutor::getInstance()->submit
+        (bytes,
+         [this, s1 = std::move(s1), s2 = std::move(s2),
+          constraint, subsequence](int threads) {
+             DTWClass dtw(constraint);
+             dtw.setAbortFlag(&m_abort);
+             MixWorkerPool pool(threads - 1);
+             dtw.setParallelRunner([&pool](int count,
+                                           const std::function<void(int)> &job) {
+                                       pool.run(count, job);
+                                   },
+                                   pool.getThreadCount() + 1);
+             if (subsequence) {
+                 m_alignment = dtw.alignSubsequence(s1, s2);
+             } else {
+                 m_alignment = dtw.alignSequences(s1, s2);
+             }
+             if (m_abort) return;
+             emit dtwCalculated();
+         });
+}
+
+void
+TransformDTWAligner::updateStreamingAlignment()
 {
     auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
     if (!alignmentModel) {
-        return false;
+        return;
     }
 
     vector<sv_frame_t> refFrames, otherFrames;
     vector<double> refValues, otherValues;
     sv_frame_t resolution = 0;
+    
+    if (!getValuesFrom(m_referenceOutputModel,
+                       refFrames, refValues, resolution) ||
+        !getValuesFrom(m_toAlignOutputModel,
+                       otherFrames, otherValues, resolution)) {
+        return;
+    }
+
+    // The transforms add events in order, so each time these are the
+    // same sequences as before, extended
+
+    size_t before = 0, after = 0;
+    const vector<size_t> *alignment = nullptr;
+    
+    if (m_dtwType == Magnitude) {
+        if (!m_onlineMagnitude) {
+            m_onlineMagnitude.reset
+                (new OnlineDTW<double, MagnitudeDTW::Metric>());
+        }
+        vector<double> s1, s2;
+        for (double v: refValues) {
+            s1.push_back(m_magnitudePreprocessor(v));
+        }
+        for (double v: otherValues) {
+            s2.push_back(m_magnitudePreprocessor(v));
+        }
+        before = m_onlineMagnitude->getAlignment().size();
+        m_onlineMagnitude->advance(s1, s2);
+        alignment = &m_onlineMagnitude->getAlignment();
+    } else {
+        if (!m_onlineRiseFall) {
+            m_onlineRiseFall.reset
+                (new OnlineDTW<RiseFallDTW::Value, RiseFallDTW::Metric>());
+        }
+        vector<RiseFallDTW::Value> s1, s2;
+        double prev = 0.0;
+        for (double v: refValues) {
+            s1.push_back(m_riseFallPreprocessor(prev, v));
+            prev = v;
+        }
+        prev = 0.0;
+        for (double v: otherValues) {
+            s2.push_back(m_riseFallPreprocessor(prev, v));
+            prev = v;
+        }
+        before = m_onlineRiseFall->getAlignment().size();
+        m_onlineRiseFall->advance(s1, s2);
+        alignment = &m_onlineRiseFall->getAlignment();
+    }
+
+    after = alignment->size();
+    if (after == before) {
+        return;
+    }
+
+#ifdef DEBUG_TRANSFORM_DTW_ALIGNER
+    SVCERR << "TransformDTWAligner[" << this << "]: updateStreamingAlignment: "
+           << "path now covers " << after << " of " << otherValues.size()
+           << " events from toAlign" << endl;
+#endif
+
+    alignmentModel->setPath(makePath(*alignment,
+                                     refFrames,
+                                     otherFrames,
+                                     alignmentModel->getSampleRate(),
+                                     resolution));
+}
+
+bool
+TransformDTWAligner::performAlignmentMagnitude()
+{
+    vector<double> refValues, otherValues;
 
     if (!getValuesFrom(m_referenceOutputModel,
-                       refFrames, refValues, resolution)) {
+                       m_refFrames, refValues, m_resolution)) {
         return false;
     }
 
     if (!getValuesFrom(m_toAlignOutputModel,
-                       otherFrames, otherValues, resolution)) {
+                       m_otherFrames, otherValues, m_resolution)) {
         return false;
     }
     
@@ -363,65 +532,23 @@ TransformDTWAligner::performAlignmentMagnitude()
            << "Have " << s1.size() << " events from reference, "
            << s2.size() << " from toAlign" << endl;
 #endif
-    
-    MagnitudeDTW dtw;
-    vector<size_t> alignment;
-
-    {
-#ifdef DEBUG_TRANSFORM_DTW_ALIGNER
-        SVCERR << "TransformDTWAligner[" << this
-               << "]: serialising DTW to avoid over-allocation" << endl;
-#endif
-        QMutexLocker locker(&m_dtwMutex);
-        if (m_subsequence) {
-            alignment = dtw.alignSubsequence(s1, s2);
-        } else {
-            alignment = dtw.alignSequences(s1, s2);
-        }
-    }
-
-#ifdef DEBUG_TRANSFORM_DTW_ALIGNER
-    SVCERR << "TransformDTWAligner[" << this << "]: performAlignmentMagnitude: "
-           << "DTW produced " << alignment.size() << " points:" << endl;
-    for (int i = 0; in_range_for(alignment, i) && i < 100; ++i) {
-        SVCERR << alignment[i] << " ";
-    }
-    SVCERR << endl;
-#endif
-
-    alignmentModel->setPath(makePath(alignment,
-                                     refFrames,
-                                     otherFrames,
-                                     alignmentModel->getSampleRate(),
-                                     resolution));
-    alignmentModel->setCompletion(100);
 
-    SVCERR << "TransformDTWAligner[" << this
-           << "]: performAlignmentMagnitude: Done" << endl;
-
-    m_incomplete = false;
+    submitDTW<MagnitudeDTW>(s1, s2);
     return true;
 }
 
 bool
 TransformDTWAligner::performAlignmentRiseFall()
 {
-    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
-    if (!alignmentModel) {
-        return false;
-    }
-
-    vector<sv_frame_t> refFrames, otherFrames;
     vector<double> refValues, otherValues;
-    sv_frame_t resolution = 0;
 
     if (!getValuesFrom(m_referenceOutputModel,
-                       refFrames, refValues, resolution)) {
+                       m_refFrames, refValues, m_resolution)) {
         return false;
     }
 
     if (!getValuesFrom(m_toAlignOutputModel,
-                       otherFrames, otherValues, resolution)) {
+                       m_otherFrames, otherValues, m_resolution)) {
         return false;
     }
     
@@ -456,45 +583,43 @@ TransformDTWAligner::performAlignmentRiseFall()
     }
     SVCERR << endl;
 #endif
-    
-    RiseFallDTW dtw;
-    vector<size_t> alignment;
 
-    {
-#ifdef DEBUG_TRANSFORM_DTW_ALIGNER
-        SVCERR << "TransformDTWAligner[" << this
-               << "]: serialising DTW to avoid over-allocation" << endl;
-#endif
-        QMutexLocker locker(&m_dtwMutex);
-        if (m_subsequence) {
-            alignment = dtw.alignSubsequence(s1, s2);
-        } else {
-            alignment = dtw.alignSequences(s1, s2);
-        }
+    submitDTW<RiseFallDTW>(s1, s2);
+    return true;
+}
+
+void
+TransformDTWAligner::finishAlignment()
+{
+    m_task = 0;
+    
+    auto alignmentModel = ModelById::getAs<AlignmentModel>(m_alignmentModel);
+    if (!alignmentModel) {
+        emit failed(m_toAlign, tr("Alignment model was lost"));
+        return;
     }
 
 #ifdef DEBUG_TRANSFORM_DTW_ALIGNER
-    SVCERR << "TransformDTWAligner[" << this << "]: performAlignmentRiseFall: "
-           << "DTW produced " << alignment.size() << " points:" << endl;
-    for (int i = 0; i < alignment.size() && i < 100; ++i) {
-        SVCERR << alignment[i] << " ";
+    SVCERR << "TransformDTWAligner[" << this << "]: finishAlignment: "
+           << "DTW produced " << m_alignment.size() << " points:" << endl;
+    for (int i = 0; in_range_for(m_alignment, i) && i < 100; ++i) {
+        SVCERR << m_alignment[i] << " ";
     }
     SVCERR << endl;
 #endif
 
-    alignmentModel->setPath(makePath(alignment,
-                                     refFrames,
-                                     otherFrames,
+    alignmentModel->setPath(makePath(m_alignment,
+                                     m_refFrames,
+                                     m_otherFrames,
                                      alignmentModel->getSampleRate(),
-                                     resolution));
-
+                                     m_resolution));
     alignmentModel->setCompletion(100);
 
     SVCERR << "TransformDTWAligner[" << this
-           << "]: performAlignmentRiseFall: Done" << endl;
+           << "]: finishAlignment: Done" << endl;
 
     m_incomplete = false;
-    return true;
+    emit complete(m_alignmentModel);
 }
 } // end namespace sv
 
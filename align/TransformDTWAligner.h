@@ -16,18 +16,20 @@
 #define SV_TRANSFORM_DTW_ALIGNER_H
 
 #include "Aligner.h"
+#include "AlignmentExecutor.h"
 #include "DTW.h"
 
 #include "transform/Transform.h"
 #include "svcore/data/model/Path.h"
 
 #include <functional>
-
-#include <QMutex>
+#include <memory>
+#include <atomic>
 
 namespace sv {
 
 class AlignmentModel;
+class AlignmentFeatureCache;
 class Document;
 
 class TransformDTWAligner : public Aligner
@@ -86,17 +88,53 @@ public:
     // Destroy the aligner, cleanly cancelling any ongoing alignment
     ~TransformDTWAligner();
 
+    /**
+     * Set which cells of the cost matrix the DTW calculates. The
+     * default is the full matrix, which is impractically large for
+     * long inputs. Call before begin().
+     */
+    void setDTWConstraint(DTWConstraint constraint);
+
+    /**
+     * Set whether to publish an approximate alignment, from online
+     * time warping of the transform outputs so far, while the
+     * transforms are still running. The full DTW replaces it when
+     * they finish. Not used for subsequence alignment. The default
+     * is false. Call before begin().
+     */
+    void setStreaming(bool streaming);
+
+    /**
+     * Set a cache from which to take the transform outputs, so that
+     * they are calculated only once for each model however many
+     * alignments it takes part in. Without one, the aligner runs the
+     * transforms itself. Call before begin().
+     */
+    void setFeatureCache(std::shared_ptr<AlignmentFeatureCache> cache);
+
     void begin() override;
 
     static bool isAvailable();
 
+signals:
+    // Emitted from the executor thread when the DTW is done
+    void dtwCalculated();
+
 private slots:
     void completionChanged(ModelId);
+    void finishAlignment();
 
 private:
+    // Submit the DTW to the executor, or return false if the values
+    // to align can't be had. The alignment is finished in
+    // finishAlignment() once the DTW is done
     bool performAlignment();
     bool performAlignmentMagnitude();
     bool performAlignmentRiseFall();
+    void updateStreamingAlignment();
+
+    template <typename DTWClass, typename Value>
+    void submitDTW(std::vector<Value> s1, std::vector<Value> s2);
 
     bool getValuesFrom(ModelId modelId,
                        std::vector<sv_frame_t> &frames,
@@ -117,12 +155,27 @@ private:
     ModelId m_alignmentModel;
     Transform m_transform;
     DTWType m_dtwType;
+    DTWConstraint m_dtwConstraint;
     bool m_subsequence;
     bool m_incomplete;
     MagnitudePreprocessor m_magnitudePreprocessor;
     RiseFallPreprocessor m_riseFallPreprocessor;
 
-    static QMutex m_dtwMutex;
+    AlignmentExecutor::TaskId m_task; // 0 if nothing submitted
+    std::atomic<bool> m_abort; // set on destruction, stops a running DTW
+    std::vector<sv_frame_t> m_refFrames;
+    std::vector<sv_frame_t> m_otherFrames;
+    sv_frame_t m_resolution;
+    std::vector<size_t> m_alignment; // written by the executor task
+
+    // If set, owns the output models, which we must then not release
+    std::shared_ptr<AlignmentFeatureCache> m_featureCache;
+
+    bool m_streaming;
+    std::unique_ptr<OnlineDTW<double, MagnitudeDTW::Metric>>
+        m_onlineMagnitude;
+    std::unique_ptr<OnlineDTW<RiseFallDTW::Value, RiseFallDTW::Metric>>
+        m_onlineRiseFall;
 };
 
 } // end namespace sv
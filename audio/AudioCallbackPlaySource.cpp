@@ -18,6 +18,10 @@
 #include "AudioGenerator.h"
 #include "TimeStretchWrapper.h"
 #include "EffectWrapper.h"
+#include "MixWorkerPool.h"
+#include "RealtimeAudit.h"
+#include "PreRenderCache.h"
+#include "LoopStretchCache.h"
 
 #include "data/model/Model.h"
 #include "base/ViewManagerBase.h"
@@ -36,8 +40,11 @@
 
 #include <iostream>
 #include <cassert>
+#include <algorithm>
 
 using breakfastquay::v_zero_channels;
+using breakfastquay::v_zero;
+using breakfastquay::v_add;
 
 using std::cout;
 using std::endl;
@@ -48,6 +55,43 @@ namespace sv {
 //#define DEBUG_AUDIO_PLAY_SOURCE_PLAYING 1
 
 static const int DEFAULT_RING_BUFFER_SIZE = 131071;
+static const int MIN_ADAPTIVE_RING_BUFFER_SIZE = 16383;
+static const int MAX_ADAPTIVE_RING_BUFFER_SIZE = 1048575;
+static const int64_t ADAPTIVE_SHRINK_QUIET_USEC = 20 * 1000000;
+
+// Settings for PlaybackProfile::LowLatency. The ring buffer holds
+// about a third of a second at 44.1kHz, rather than three seconds
+static const int LOW_LATENCY_RING_BUFFER_SIZE = 16383;
+static const sv_frame_t LOW_LATENCY_GENERATOR_BLOCK_SIZE = 256;
+static const sv_frame_t STANDARD_GENERATOR_BLOCK_SIZE = 1024;
+static const int FILL_COMMAND_QUEUE_SIZE = 1024;
+static const sv_frame_t FILL_ARENA_FRAMES = 16384;
+static const size_t MIX_CHUNK_CAPACITY = 16;
+static const int HEALTH_REPORT_INTERVAL_MS = 1000;
+
+// The resampler is the first wrapper around the play source, so
+// timing it here captures resampling and our own ring buffer reads;
+// PlaybackHealth subtracts the latter
+class TimedResamplerWrapper : public breakfastquay::ResamplerWrapper
+{
+public:
+    TimedResamplerWrapper(breakfastquay::ApplicationPlaybackSource *source,
+                          PlaybackHealth *health) :
+        ResamplerWrapper(source),
+        m_health(health) { }
+
+    int getSourceSamples(float *const *samples, int nchannels,
+                         int nframes) override {
+        int64_t start = PlaybackHealth::now();
+        int got = ResamplerWrapper::getSourceSamples
+            (samples, nchannels, nframes);
+        m_health->recordResample(PlaybackHealth::now() - start);
+        return got;
+    }
+
+private:
+    PlaybackHealth *m_health;
+};
 
 AudioCallbackPlaySource::AudioCallbackPlaySource(ViewManagerBase *manager,
                                                  QString clientName) :
@@ -74,21 +118,50 @@ AudioCallbackPlaySource::AudioCallbackPlaySource(ViewManagerBase *manager,
     m_exiting(false),
     m_lastModelEndFrame(0),
     m_ringBufferSize(DEFAULT_RING_BUFFER_SIZE),
-    m_tmpMixbuf(nullptr),
-    m_tmpMixbufSize(0),
-    m_chunkBufferPtrs(nullptr),
-    m_chunkBufferPtrCount(0),
     m_outputLeft(0.0),
     m_outputRight(0.0),
     m_levelsSet(false),
     m_playStartFrame(0),
     m_playStartFramePassed(false),
     m_enforceStereo(true),
+    m_soloing(false),
+    m_fillCommands(FILL_COMMAND_QUEUE_SIZE),
+    m_primeStart(0),
+    m_primeFrames(0),
+    m_preRenderCache(nullptr),
+    m_loopStretchCache(nullptr),
+    m_healthTimer(nullptr),
+    m_fillWanted(false),
+    m_ringBufferChannels(0),
+    m_adaptiveRingBuffer(false),
+    m_nearUnderruns(0),
+    m_starvationArmed(false),
+    m_pendingRingBufferSize(0),
+    m_lastStarvationTime(0),
+    m_playbackProfile(PlaybackProfile::Standard),
+    m_generatorBlockSize(STANDARD_GENERATOR_BLOCK_SIZE),
+    m_multithreadedStretching(false),
     m_fillThread(nullptr),
     m_resamplerWrapper(nullptr),
     m_timeStretchWrapper(nullptr),
     m_auditioningEffectWrapper(nullptr)
 {
+    m_fillMix.generator = m_audioGenerator;
+    m_fillMix.arena = &m_fillArena;
+    m_primeMix.generator = m_audioGenerator;
+    m_primeMix.arena = &m_fillArena;
+    m_fillMix.health = &m_health;
+
+    m_preRenderCache = new PreRenderCache(this);
+    m_loopStretchCache = new LoopStretchCache(this);
+
+    qRegisterMetaType<PlaybackHealth::Report>("PlaybackHealth::Report");
+
+    m_healthTimer = new QTimer(this);
+    m_healthTimer->setInterval(HEALTH_REPORT_INTERVAL_MS);
+    connect(m_healthTimer, SIGNAL(timeout()),
+            this, SLOT(healthTimerTimeout()));
+
     m_viewManager->setAudioPlaySource(this);
 
     connect(m_viewManager, SIGNAL(selectionChanged()),
@@ -121,11 +194,20 @@ AudioCallbackPlaySource::~AudioCallbackPlaySource()
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     SVDEBUG << "AudioCallbackPlaySource dtor: awakening thread" << endl;
 #endif
-        m_condition.wakeAll();
+        wakeFillThread();
         m_fillThread->wait();
         delete m_fillThread;
+        m_fillThread = nullptr;
     }
 
+    delete m_fillMix.pool;
+
+    delete m_preRenderCache;
+    m_preRenderCache = nullptr;
+
+    delete m_loopStretchCache;
+    m_loopStretchCache = nullptr;
+
     clearModels();
     
     if (m_readBuffers != m_writeBuffers) {
@@ -133,8 +215,6 @@ AudioCallbackPlaySource::~AudioCallbackPlaySource()
     }
 
     delete m_writeBuffers;
-    delete[] m_tmpMixbuf;
-    delete[] m_chunkBufferPtrs;
 
     delete m_audioGenerator;
 
@@ -168,17 +248,15 @@ AudioCallbackPlaySource::checkWrappers()
     // to be called only with m_mutex held
 
     if (!m_resamplerWrapper) {
-        m_resamplerWrapper = new breakfastquay::ResamplerWrapper(this);
+        m_resamplerWrapper = new TimedResamplerWrapper(this, &m_health);
     }
     if (!m_auditioningEffectWrapper) {
         m_auditioningEffectWrapper = new EffectWrapper(m_resamplerWrapper);
     }
     if (!m_timeStretchWrapper) {
         m_timeStretchWrapper = new TimeStretchWrapper(m_auditioningEffectWrapper);
-        m_timeStretchWrapper->setQuality
-            (Preferences::getInstance()->getFinerTimeStretch() ?
-             TimeStretchWrapper::Quality::Finer :
-             TimeStretchWrapper::Quality::Faster);
+        m_timeStretchWrapper->setPlaybackHealth(&m_health);
+        updateStretchQuality();
     }
 }
 
@@ -194,8 +272,6 @@ AudioCallbackPlaySource::addModel(ModelId modelId)
     auto model = ModelById::get(modelId);
     if (!model) return;
 
-    m_mutex.lock();
-
     m_models.insert(modelId);
 
     if (model->getEndFrame() > m_lastModelEndFrame) {
@@ -272,17 +348,30 @@ AudioCallbackPlaySource::addModel(ModelId modelId)
         }
     }
 
-    if (!m_writeBuffers || (int)m_writeBuffers->size() < getTargetChannelCount()) {
-        SVCERR << "m_writeBuffers size = " << (m_writeBuffers ? m_writeBuffers->size() : 0) << endl;
+    rebuildRangeLists();
+    m_preRenderCache->invalidate();
+    m_loopStretchCache->invalidate();
+    
+    FillCommand command;
+    command.type = FillCommand::AddModel;
+    command.model = modelId;
+    postFillCommand(command);
+
+    // m_ringBufferChannels is the count we last asked the fill
+    // thread for, which it may not have got to yet
+    if (m_ringBufferChannels < getTargetChannelCount()) {
+        SVCERR << "ring buffer channel count = " << m_ringBufferChannels << endl;
         SVCERR << "target channel count = " << (getTargetChannelCount()) << endl;
-        clearRingBuffers(true, getTargetChannelCount());
+        clearRingBuffers(getTargetChannelCount());
         buffersIncreased = true;
     } else {
-        if (willPlay) clearRingBuffers(true);
+        if (willPlay) clearRingBuffers();
     }
 
     if (srChanged) {
 
+        QMutexLocker locker(&m_mutex);
+
         checkWrappers();
 
         SVCERR << "AudioCallbackPlaySource: Source sample rate changed to "
@@ -293,12 +382,6 @@ AudioCallbackPlaySource::addModel(ModelId modelId)
         m_resamplerWrapper->reset();
     }
 
-    rebuildRangeLists();
-
-    m_mutex.unlock();
-
-    m_audioGenerator->setTargetChannelCount(getTargetChannelCount());
-
     if (buffersIncreased) {
         SVDEBUG << "AudioCallbackPlaySource::addModel: Number of buffers increased to " << getTargetChannelCount() << endl;
         if (getTargetChannelCount() > getDeviceChannelCount()) {
@@ -312,6 +395,7 @@ AudioCallbackPlaySource::addModel(ModelId modelId)
     if (!m_fillThread) {
         m_fillThread = new FillThread(*this);
         m_fillThread->start();
+        updateFillThreadPriority();
     }
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
@@ -325,15 +409,13 @@ AudioCallbackPlaySource::addModel(ModelId modelId)
     SVDEBUG << "AudioCallbackPlaySource::addModel: awakening thread" << endl;
 #endif
     
-    m_condition.wakeAll();
+    wakeFillThread();
 }
 
 void
-AudioCallbackPlaySource::modelChangedWithin(ModelId, sv_frame_t 
-#ifdef DEBUG_AUDIO_PLAY_SOURCE
-                                            startFrame
-#endif
-                                            , sv_frame_t endFrame)
+AudioCallbackPlaySource::modelChangedWithin(ModelId modelId,
+                                            sv_frame_t startFrame,
+                                            sv_frame_t endFrame)
 {
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     SVDEBUG << "AudioCallbackPlaySource::modelChangedWithin(" << startFrame << "," << endFrame << ")" << endl;
@@ -342,6 +424,11 @@ AudioCallbackPlaySource::modelChangedWithin(ModelId, sv_frame_t
         m_lastModelEndFrame = endFrame;
         rebuildRangeLists();
     }
+
+    m_audioGenerator->modelChangedWithin(modelId, startFrame, endFrame);
+
+    if (m_preRenderCache) m_preRenderCache->invalidate();
+    if (m_loopStretchCache) m_loopStretchCache->invalidate();
 }
 
 void
@@ -352,8 +439,6 @@ AudioCallbackPlaySource::removeModel(ModelId modelId)
     
     Profiler profiler("AudioCallbackPlaySource::removeModel");
 
-    m_mutex.lock();
-
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     SVDEBUG << "AudioCallbackPlaySource::removeModel(" << modelId << ")" << endl;
 #endif
@@ -363,6 +448,11 @@ AudioCallbackPlaySource::removeModel(ModelId modelId)
 
     m_models.erase(modelId);
 
+    FillCommand command;
+    command.type = FillCommand::RemoveModel;
+    command.model = modelId;
+    postFillCommand(command);
+
     sv_frame_t lastEnd = 0;
     for (ModelId otherId: m_models) {
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
@@ -384,123 +474,441 @@ AudioCallbackPlaySource::removeModel(ModelId modelId)
     if (m_models.empty()) {
         m_sourceSampleRate = 0;
     }
-    
-    m_mutex.unlock();
 
+    rebuildRangeLists();
+    m_preRenderCache->invalidate();
+    m_loopStretchCache->invalidate();
     clearRingBuffers();
 }
 
 void
 AudioCallbackPlaySource::clearModels()
 {
-    m_mutex.lock();
-
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     SVDEBUG << "AudioCallbackPlaySource::clearModels()" << endl;
 #endif
 
     m_models.clear();
 
+    FillCommand command;
+    command.type = FillCommand::ClearModels;
+    postFillCommand(command);
+
     m_lastModelEndFrame = 0;
 
     m_sourceSampleRate = 0;
 
-    m_mutex.unlock();
-
     m_audioGenerator->clearModels();
 
+    rebuildRangeLists();
+    if (m_preRenderCache) m_preRenderCache->invalidate();
+    if (m_loopStretchCache) m_loopStretchCache->invalidate();
     clearRingBuffers();
 }    
 
 void
-AudioCallbackPlaySource::clearRingBuffers(bool haveLock, int count)
+AudioCallbackPlaySource::clearRingBuffers(int count)
 {
-    if (!haveLock) m_mutex.lock();
-
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     SVDEBUG << "clearRingBuffers" << endl;
 #endif
 
-    rebuildRangeLists();
-
-    if (count == 0) {
-        if (m_writeBuffers) count = int(m_writeBuffers->size());
-    }
-
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     SVDEBUG << "current playing frame = " << getCurrentPlayingFrame() << endl;
 
     SVDEBUG << "write buffer fill (before) = " << m_writeBufferFill << endl;
 #endif
+
+    // The buffered frame is calculated here rather than in the fill
+    // thread, because getCurrentFrame() depends on state that
+    // belongs to the UI thread. By the time the fill thread acts on
+    // it, the read position may have moved on a little further, but
+    // unifyRingBuffers() skips the write buffers forward as needed
     
-    m_writeBufferFill = getCurrentBufferedFrame();
+    if (count > 0) {
+        m_ringBufferChannels = count;
+    }
+
+    FillCommand command;
+    command.type = FillCommand::ResetBuffers;
+    command.channels = count;
+    command.frame = getCurrentBufferedFrame();
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
-    SVDEBUG << "current buffered frame = " << m_writeBufferFill << endl;
+    SVDEBUG << "current buffered frame = " << command.frame << endl;
 #endif
 
+    postFillCommand(command);
+}
+
+void
+AudioCallbackPlaySource::resetWriteBuffers(int count, sv_frame_t fill)
+{
+    if (count == 0) {
+        if (m_writeBuffers) count = int(m_writeBuffers->size());
+    }
+
+    m_writeBufferFill = fill;
+
     if (m_readBuffers != m_writeBuffers) {
         delete m_writeBuffers;
     }
 
+    int pendingSize = m_pendingRingBufferSize.exchange(0);
+    if (pendingSize > 0 && pendingSize != m_ringBufferSize) {
+        SVDEBUG << "AudioCallbackPlaySource::resetWriteBuffers: Ring buffer "
+                << "size changing from " << m_ringBufferSize.load() << " to "
+                << pendingSize << endl;
+        m_ringBufferSize = pendingSize;
+    }
+    
     m_writeBuffers = new RingBufferVector;
 
     for (int i = 0; i < count; ++i) {
         m_writeBuffers->push_back(new RingBuffer<float>(m_ringBufferSize));
     }
 
+    m_fillMix.channels = count;
+    m_primeMix.channels = count;
+    
+    m_audioGenerator->setTargetChannelCount(count);
     m_audioGenerator->reset();
+    m_primeFrames = 0;
+
+    prepareMixContext(m_fillMix, getFillArenaFrameCount());
+    prepareMixContext(m_primeMix, getFillArenaFrameCount());
     
-//    SVDEBUG << "AudioCallbackPlaySource::clearRingBuffers: Created "
+//    SVDEBUG << "AudioCallbackPlaySource::resetWriteBuffers: Created "
 //              << count << " write buffers" << endl;
-
-    if (!haveLock) {
-        m_mutex.unlock();
-    }
 }
 
 void
-AudioCallbackPlaySource::play(sv_frame_t startFrame)
+AudioCallbackPlaySource::postFillCommand(const FillCommand &command)
 {
-    if (!m_target) return;
-    
-    if (!m_sourceSampleRate) {
-        SVCERR << "AudioCallbackPlaySource::play: No source sample rate available, not playing" << endl;
+    if (!m_fillThread) {
+        // Nobody else is touching the write buffers or the fill
+        // model set, so we can just apply the command here
+        bool reset = false;
+        int resetCount = 0;
+        sv_frame_t resetFrame = 0;
+        QMutexLocker locker(&m_mutex);
+        applyFillCommand(command, reset, resetCount, resetFrame);
+        if (reset) {
+            resetWriteBuffers(resetCount, resetFrame);
+        } else {
+            prepareMixContext(m_fillMix, getFillArenaFrameCount());
+            prepareMixContext(m_primeMix, getFillArenaFrameCount());
+        }
         return;
     }
+
+    while (m_fillCommands.getWriteSpace() == 0) {
+        // The fill thread is behind with its commands. This should
+        // be very rare, so just prod it and give it a moment
+        SVDEBUG << "AudioCallbackPlaySource::postFillCommand: command queue "
+                << "is full, waiting for fill thread" << endl;
+        wakeFillThread();
+        QThread::usleep(1000);
+    }
+
+    m_fillCommands.writeOne(command);
+    wakeFillThread();
+}
+
+void
+AudioCallbackPlaySource::processFillCommands()
+{
+    // Called from fill thread. Consecutive buffer resets are
+    // coalesced and carried out once, after the model set has been
+    // brought up to date
     
-    if (m_viewManager->getPlaySelectionMode() &&
-        !m_viewManager->getSelections().empty()) {
+    bool reset = false;
+    int resetCount = 0;
+    sv_frame_t resetFrame = 0;
 
-#ifdef DEBUG_AUDIO_PLAY_SOURCE
-        SVDEBUG << "AudioCallbackPlaySource::play: constraining frame " << startFrame << " to selection = ";
-#endif
+    bool applied = false;
 
-        startFrame = m_viewManager->constrainFrameToSelection(startFrame);
+    while (m_fillCommands.getReadSpace() > 0) {
+        applyFillCommand(m_fillCommands.readOne(),
+                         reset, resetCount, resetFrame);
+        applied = true;
+    }
 
-#ifdef DEBUG_AUDIO_PLAY_SOURCE
-        SVDEBUG << startFrame << endl;
-#endif
+    if (reset) {
+        QMutexLocker locker(&m_mutex);
+        resetWriteBuffers(resetCount, resetFrame);
+    } else if (applied) {
+        // The model set may have changed: make room for it now
+        // rather than while mixing
+        prepareMixContext(m_fillMix, getFillArenaFrameCount());
+        prepareMixContext(m_primeMix, getFillArenaFrameCount());
+    }
+}
 
-    } else {
-        if (startFrame < 0) {
-            startFrame = 0;
+void
+AudioCallbackPlaySource::applyFillCommand(const FillCommand &command,
+                                          bool &reset,
+                                          int &resetCount,
+                                          sv_frame_t &resetFrame)
+{
+    switch (command.type) {
+
+    case FillCommand::AddModel:
+        m_fillMix.models.insert(command.model);
+        if (!ModelById::isa<DenseTimeValueModel>(command.model)) {
+            // Only models with note or synth state need priming
+            m_primeMix.models.insert(command.model);
         }
-        if (startFrame >= m_lastModelEndFrame) {
-            startFrame = 0;
+        break;
+
+    case FillCommand::RemoveModel:
+        m_fillMix.models.erase(command.model);
+        m_primeMix.models.erase(command.model);
+        break;
+
+    case FillCommand::ClearModels:
+        m_fillMix.models.clear();
+        m_primeMix.models.clear();
+        break;
+
+    case FillCommand::SetBlockSize:
+        // Between fills, so nothing is mixing with the old size
+        m_audioGenerator->setBlockSize(command.blockSize);
+        break;
+
+    case FillCommand::ResetBuffers:
+        if (!reset || command.channels > resetCount) {
+            resetCount = command.channels;
         }
+        resetFrame = command.frame;
+        reset = true;
+        break;
     }
+}
 
-#ifdef DEBUG_AUDIO_PLAY_SOURCE
-    SVDEBUG << "play(" << startFrame << ") -> aligned playback model ";
-#endif
+void
+AudioCallbackPlaySource::wakeFillThread()
+{
+    // Only the first wakeup since the fill thread last woke releases
+    // the semaphore, and the fill thread drains any permits left
+    // over each time it wakes. A permit released after the fill
+    // thread has checked m_fillWanted is kept until it next waits,
+    // so none are lost
+    if (!m_fillWanted.exchange(true)) {
+        m_fillSemaphore.release();
+    }
+}
 
-    startFrame = m_viewManager->alignReferenceToPlaybackFrame(startFrame);
+sv_frame_t
+AudioCallbackPlaySource::getLowWaterMark() const
+{
+    return m_ringBufferSize / 2;
+}
+
+sv_frame_t
+AudioCallbackPlaySource::getStarvationMark() const
+{
+    // The fill thread is woken at the low-water mark, so getting
+    // this far below it means it took a long time to respond
+    return m_ringBufferSize / 8;
+}
+
+void
+AudioCallbackPlaySource::setAdaptiveRingBufferSize(bool adaptive)
+{
+    if (adaptive == m_adaptiveRingBuffer) return;
+
+    m_adaptiveRingBuffer = adaptive;
+    m_nearUnderruns = 0;
+
+    if (!adaptive) {
+        // Go back to the default at the next reset
+        m_pendingRingBufferSize = getProfileRingBufferSize();
+    }
+}
+
+int
+AudioCallbackPlaySource::getProfileRingBufferSize() const
+{
+    // Never smaller than four generator blocks, or a single fill
+    // could not keep the callback fed
+    int floor = int(4 * m_blockSize);
+    
+    if (m_playbackProfile == PlaybackProfile::LowLatency) {
+        return std::max(LOW_LATENCY_RING_BUFFER_SIZE, floor);
+    } else {
+        return std::max(DEFAULT_RING_BUFFER_SIZE, floor);
+    }
+}
+
+void
+AudioCallbackPlaySource::setGeneratorBlockSize(sv_frame_t blockSize)
+{
+    blockSize = std::max(blockSize, AudioGenerator::getMinimumBlockSize());
+    if (blockSize == m_generatorBlockSize) return;
+
+    SVDEBUG << "AudioCallbackPlaySource::setGeneratorBlockSize: "
+            << blockSize << endl;
+    
+    m_generatorBlockSize = blockSize;
+
+    FillCommand command;
+    command.type = FillCommand::SetBlockSize;
+    command.blockSize = blockSize;
+    postFillCommand(command);
+
+    m_preRenderCache->invalidate();
+    m_loopStretchCache->invalidate();
+}
+
+void
+AudioCallbackPlaySource::setPlaybackProfile(PlaybackProfile profile)
+{
+    if (profile == m_playbackProfile) return;
+
+    SVDEBUG << "AudioCallbackPlaySource::setPlaybackProfile: "
+            << (profile == PlaybackProfile::LowLatency ?
+                "low latency" : "standard") << endl;
+    
+    m_playbackProfile = profile;
+
+    setGeneratorBlockSize(profile == PlaybackProfile::LowLatency ?
+                          LOW_LATENCY_GENERATOR_BLOCK_SIZE :
+                          STANDARD_GENERATOR_BLOCK_SIZE);
+
+    updateFillThreadPriority();
+    updateStretchQuality();
+
+    // The new ring buffer size takes effect at a buffer reset, so
+    // ask for one now rather than waiting for the next seek
+    m_pendingRingBufferSize = getProfileRingBufferSize();
+    m_nearUnderruns = 0;
+    clearRingBuffers();
+}
+
+void
+AudioCallbackPlaySource::updateFillThreadPriority()
+{
+    if (!m_fillThread) return;
+
+    // With the smaller ring buffers the fill thread has much less
+    // time in hand when woken, so should not be kept waiting by
+    // ordinary work
+    m_fillThread->setPriority(m_playbackProfile == PlaybackProfile::LowLatency ?
+                              QThread::HighestPriority :
+                              QThread::NormalPriority);
+}
+
+void
+AudioCallbackPlaySource::adaptRingBufferSize()
+{
+    if (!m_adaptiveRingBuffer) return;
+
+    int64_t now = PlaybackHealth::now();
+    if (m_lastStarvationTime == 0) m_lastStarvationTime = now;
+    
+    int current = m_pendingRingBufferSize;
+    if (current == 0) current = m_ringBufferSize;
+    int target = current;
+
+    if (m_nearUnderruns.exchange(0) > 0) {
+        m_lastStarvationTime = now;
+        target = std::min(current * 2 + 1, MAX_ADAPTIVE_RING_BUFFER_SIZE);
+    } else if (now - m_lastStarvationTime > ADAPTIVE_SHRINK_QUIET_USEC) {
+        m_lastStarvationTime = now;
+        target = std::max({ current / 2,
+                            MIN_ADAPTIVE_RING_BUFFER_SIZE,
+                            int(4 * m_blockSize) });
+    }
+
+    if (target == current) return;
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
-    SVDEBUG << startFrame << endl;
+    SVDEBUG << "AudioCallbackPlaySource::adaptRingBufferSize: target size "
+            << target << " (was " << current << ")" << endl;
 #endif
 
+    m_pendingRingBufferSize = target;
+    
+    // A smaller buffer is never urgent, so it waits for the next
+    // reset (seek, parameter change etc) unless we are stopped. A
+    // larger one is wanted now: if playback is contiguous and no
+    // reset is already in progress, grow the write buffers in place
+    // and let unifyRingBuffers swap them in. (Otherwise the read
+    // position can't be worked out from the buffer fill alone, so
+    // wait for a reset)
+
+    bool contiguous =
+        (m_readBuffers == m_writeBuffers &&
+         !m_viewManager->getPlayLoopMode() &&
+         !(m_fillMix.ranges && m_fillMix.ranges->constrained));
+
+    if (!m_playing) {
+        resetWriteBuffers(m_fillMix.channels, m_writeBufferFill);
+    } else if (target > current && contiguous) {
+        growWriteBuffers();
+    }
+}
+
+void
+AudioCallbackPlaySource::growWriteBuffers()
+{
+    int size = m_pendingRingBufferSize.exchange(0);
+    if (size <= m_ringBufferSize || !m_writeBuffers) return;
+
+    // Carry over what has been written but not yet read, so that the
+    // new buffers continue from the same write position and the
+    // generator's notes and synth state can carry on undisturbed.
+    // The audio callback may read on while we copy, so each channel
+    // can have a little less left than the one before; all of them
+    // end at m_writeBufferFill, so we keep the same number of frames
+    // from the end of each. unifyRingBuffers skips any of those that
+    // have been read by the time it swaps the buffers in
+
+    RingBufferVector *old = m_writeBuffers;
+    int count = int(old->size());
+
+    std::vector<std::vector<float>> unread(count);
+    int carried = -1;
+    for (int c = 0; c < count; ++c) {
+        RingBuffer<float> *rb = (*old)[c];
+        unread[c].resize(rb->getSize());
+        int n = rb->peek(unread[c].data(), rb->getReadSpace());
+        unread[c].resize(n);
+        if (carried < 0 || n < carried) carried = n;
+    }
+    if (carried < 0) carried = 0;
+
+    SVDEBUG << "AudioCallbackPlaySource::growWriteBuffers: Ring buffer "
+            << "size changing from " << m_ringBufferSize.load() << " to "
+            << size << ", carrying over " << carried << " frames" << endl;
+    
+    m_ringBufferSize = size;
+    m_writeBuffers = new RingBufferVector;
+
+    for (int c = 0; c < count; ++c) {
+        RingBuffer<float> *rb = new RingBuffer<float>(m_ringBufferSize);
+        rb->write(unread[c].data() + unread[c].size() - carried, carried);
+        m_writeBuffers->push_back(rb);
+    }
+}
+
+void
+AudioCallbackPlaySource::play(sv_frame_t startFrame)
+{
+    if (!m_target) return;
+    
+    if (!m_sourceSampleRate) {
+        SVCERR << "AudioCallbackPlaySource::play: No source sample rate available, not playing" << endl;
+        return;
+    }
+
+    // Alignment models may have changed since the ranges were built,
+    // and this is cheap compared with starting playback
+    rebuildRangeLists();
+
+    startFrame = mapPlayStartFrame(startFrame);
+
     // The fill thread will automatically empty its buffers before
     // starting again if we have not so far been playing, but not if
     // we're just re-seeking.
@@ -523,9 +931,42 @@ AudioCallbackPlaySource::play(sv_frame_t startFrame)
         }
     }
 
-    m_mutex.unlock();
-
+    // The generator is reset with the mutex held, as the fill thread
+    // holds it while mixing
     m_audioGenerator->reset();
+    m_primeFrames = 0;
+
+    // If the audio from here has been rendered in advance, start
+    // with that. The fill thread continues from the end of it, once
+    // it has brought the generator's note state up to the same point
+
+    auto head = m_preRenderCache->getHead(startFrame);
+    if (head && m_readBuffers && m_readBuffers == m_writeBuffers &&
+        int(head->data.size()) == int(m_writeBuffers->size())) {
+
+        sv_frame_t space = head->frames;
+        for (int c = 0; c < int(head->data.size()); ++c) {
+            RingBuffer<float> *wb = getWriteRingBuffer(c);
+            if (!wb) space = 0;
+            else space = std::min(space, sv_frame_t(wb->getWriteSpace()));
+        }
+
+        if (space == head->frames) {
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+            SVDEBUG << "AudioCallbackPlaySource::play: using " << space
+                    << " pre-rendered frames from " << startFrame << endl;
+#endif
+            for (int c = 0; c < int(head->data.size()); ++c) {
+                getWriteRingBuffer(c)->write(head->data[c].data(),
+                                             int(head->frames));
+            }
+            m_readBufferFill = m_writeBufferFill = head->endFrame;
+            m_primeStart = startFrame;
+            m_primeFrames = head->frames;
+        }
+    }
+
+    m_mutex.unlock();
 
     m_playStartFrame = startFrame;
     m_playStartFramePassed = false;
@@ -537,14 +978,21 @@ AudioCallbackPlaySource::play(sv_frame_t startFrame)
     bool changed = !m_playing;
     m_lastRetrievalTimestamp = 0;
     m_lastCurrentFrame = 0;
+    m_starvationArmed = false;
     m_playing = true;
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     SVDEBUG << "AudioCallbackPlaySource::play: awakening thread" << endl;
 #endif
 
-    m_condition.wakeAll();
+    wakeFillThread();
+
+    // Keep the audio from here ready for the next time, as the play
+    // position is likely to come back to it
+    m_preRenderCache->setPlayPosition(startFrame);
+    
     if (changed) {
+        m_healthTimer->start();
         emit playStatusChanged(m_playing);
         emit activity(tr("Play from %1").arg
                       (RealTime::frame2RealTime
@@ -552,6 +1000,51 @@ AudioCallbackPlaySource::play(sv_frame_t startFrame)
     }
 }
 
+sv_frame_t
+AudioCallbackPlaySource::mapPlayStartFrame(sv_frame_t startFrame)
+{
+    if (m_viewManager->getPlaySelectionMode() &&
+        !m_viewManager->getSelections().empty()) {
+
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+        SVDEBUG << "AudioCallbackPlaySource::mapPlayStartFrame: constraining frame " << startFrame << " to selection = ";
+#endif
+
+        startFrame = m_viewManager->constrainFrameToSelection(startFrame);
+
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+        SVDEBUG << startFrame << endl;
+#endif
+
+    } else {
+        if (startFrame < 0) {
+            startFrame = 0;
+        }
+        if (startFrame >= m_lastModelEndFrame) {
+            startFrame = 0;
+        }
+    }
+
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+    SVDEBUG << "mapPlayStartFrame(" << startFrame << ") -> aligned playback model ";
+#endif
+
+    startFrame = m_viewManager->alignReferenceToPlaybackFrame(startFrame);
+
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+    SVDEBUG << startFrame << endl;
+#endif
+
+    return startFrame;
+}
+
+void
+AudioCallbackPlaySource::preparePlayback(sv_frame_t startFrame)
+{
+    if (!m_sourceSampleRate) return;
+    m_preRenderCache->setPlayPosition(mapPlayStartFrame(startFrame));
+}
+
 void
 AudioCallbackPlaySource::stop()
 {
@@ -565,9 +1058,11 @@ AudioCallbackPlaySource::stop()
     SVDEBUG << "AudioCallbackPlaySource::stop: awakening thread" << endl;
 #endif
 
-    m_condition.wakeAll();
+    wakeFillThread();
     m_lastRetrievalTimestamp = 0;
     if (changed) {
+        m_healthTimer->stop();
+        healthTimerTimeout();
         emit playStatusChanged(m_playing);
         if (m_sourceSampleRate) {
             emit activity(tr("Stop at %1").arg
@@ -581,10 +1076,17 @@ AudioCallbackPlaySource::stop()
     m_lastCurrentFrame = 0;
 }
 
+void
+AudioCallbackPlaySource::healthTimerTimeout()
+{
+    emit playbackHealthReport(m_health.getReport());
+}
+
 void
 AudioCallbackPlaySource::selectionChanged()
 {
     if (m_viewManager->getPlaySelectionMode()) {
+        rebuildRangeLists();
         clearRingBuffers();
     }
 }
@@ -592,12 +1094,15 @@ AudioCallbackPlaySource::selectionChanged()
 void
 AudioCallbackPlaySource::playLoopModeChanged()
 {
+    m_loopStretchCache->invalidate();
     clearRingBuffers();
 }
 
 void
 AudioCallbackPlaySource::playSelectionModeChanged()
 {
+    rebuildRangeLists();
+    
     if (!m_viewManager->getSelections().empty()) {
         clearRingBuffers();
     }
@@ -606,6 +1111,8 @@ AudioCallbackPlaySource::playSelectionModeChanged()
 void
 AudioCallbackPlaySource::playParametersChanged(int)
 {
+    m_preRenderCache->invalidate();
+    m_loopStretchCache->invalidate();
     clearRingBuffers();
 }
 
@@ -613,15 +1120,26 @@ void
 AudioCallbackPlaySource::preferenceChanged(PropertyContainer::PropertyName name)
 {
     if (name == "Use Finer Time Stretch") {
-        if (m_timeStretchWrapper) {
-            m_timeStretchWrapper->setQuality
-                (Preferences::getInstance()->getFinerTimeStretch() ?
-                 TimeStretchWrapper::Quality::Finer :
-                 TimeStretchWrapper::Quality::Faster);
-        }
+        updateStretchQuality();
     }        
 }
 
+void
+AudioCallbackPlaySource::updateStretchQuality()
+{
+    if (!m_timeStretchWrapper) return;
+
+    // The faster stretcher also has much the lower latency
+    bool finer = (m_playbackProfile == PlaybackProfile::Standard &&
+                  Preferences::getInstance()->getFinerTimeStretch());
+
+    m_timeStretchWrapper->setQuality(finer ?
+                                     TimeStretchWrapper::Quality::Finer :
+                                     TimeStretchWrapper::Quality::Faster);
+
+    m_timeStretchWrapper->setMultithreading(m_multithreadedStretching);
+}
+
 void
 AudioCallbackPlaySource::audioProcessingOverload()
 {
@@ -656,14 +1174,21 @@ AudioCallbackPlaySource::setSystemPlaybackBlockSize(int size)
     if (size != 0) {
         m_blockSize = size;
     }
-    if (size * 4 > m_ringBufferSize) {
+
+    // The fill thread is the only writer of m_ringBufferSize, so ask
+    // it for the new size through the pending size and a reset
+    
+    int current = m_pendingRingBufferSize;
+    if (current == 0) current = m_ringBufferSize;
+    
+    if (size * 4 > current) {
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
         SVCERR << "AudioCallbackPlaySource::setTarget: Buffer size "
                << size << " > a quarter of ring buffer size "
-               << m_ringBufferSize << ", calling for more ring buffer"
+               << current << ", calling for more ring buffer"
                << endl;
 #endif
-        m_ringBufferSize = size * 4;
+        m_pendingRingBufferSize = size * 4;
         if (m_writeBuffers && !m_writeBuffers->empty()) {
             clearRingBuffers();
         }
@@ -824,21 +1349,14 @@ AudioCallbackPlaySource::getCurrentFrame(RealTime latency_t)
         return m_viewManager->alignPlaybackFrameToReference(frame);
     }
 
-    int inRange = 0;
-    int index = 0;
-
-    for (int i = 0; i < (int)m_rangeStarts.size(); ++i) {
-        if (bufferedto_t >= m_rangeStarts[i]) {
-            inRange = index;
-        } else {
-            break;
-        }
-        ++index;
-    }
-
-    if (inRange >= int(m_rangeStarts.size())) {
-        inRange = int(m_rangeStarts.size())-1;
-    }
+    // The last range starting at or before the buffered time (or
+    // the first range, if none does)
+    
+    int inRange = int(std::upper_bound(m_rangeStarts.begin(),
+                                       m_rangeStarts.end(),
+                                       bufferedto_t) -
+                      m_rangeStarts.begin()) - 1;
+    if (inRange < 0) inRange = 0;
 
     RealTime playing_t = bufferedto_t;
 
@@ -931,58 +1449,128 @@ void
 AudioCallbackPlaySource::rebuildRangeLists()
 {
     Profiler profiler("AudioCallbackPlaySource::rebuildRangeLists");
+
+    // Build the range index in playback-model frames, which is what
+    // mixModels needs, and then the RealTime lists used by
+    // getCurrentFrame from that. The index is published to the fill
+    // thread by swapping the pointer, so it is never modified once
+    // built
     
-    bool constrained = (m_viewManager->getPlaySelectionMode());
+    auto index = std::make_shared<PlayRangeIndex>();
 
     m_rangeStarts.clear();
     m_rangeDurations.clear();
 
-    sv_samplerate_t sourceRate = getSourceSampleRate();
-    if (sourceRate == 0) return;
-
-    RealTime end = RealTime::frame2RealTime(m_lastModelEndFrame, sourceRate);
-    if (end == RealTime::zeroTime) return;
-
-    if (!constrained) {
-        m_rangeStarts.push_back(RealTime::zeroTime);
-        m_rangeDurations.push_back(end);
-        return;
-    }
+    if (m_viewManager->getPlaySelectionMode()) {
 
-    MultiSelection::SelectionList selections = m_viewManager->getSelections();
-    MultiSelection::SelectionList::const_iterator i;
+        MultiSelection::SelectionList selections =
+            m_viewManager->getSelections();
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
-    SVDEBUG << "AudioCallbackPlaySource::rebuildRangeLists" << endl;
+        SVDEBUG << "AudioCallbackPlaySource::rebuildRangeLists: "
+                << selections.size() << " selection(s)" << endl;
 #endif
 
-    if (!selections.empty()) {
+        for (const auto &sel: selections) {
+            PlayRange range;
+            range.start = m_viewManager->alignReferenceToPlaybackFrame
+                (sel.getStartFrame());
+            range.end = m_viewManager->alignReferenceToPlaybackFrame
+                (sel.getEndFrame());
+            if (range.end > range.start) {
+                index->ranges.push_back(range);
+            }
+        }
 
-        for (i = selections.begin(); i != selections.end(); ++i) {
-            
-            RealTime start =
-                (RealTime::frame2RealTime
-                 (m_viewManager->alignReferenceToPlaybackFrame(i->getStartFrame()),
-                  sourceRate));
-            RealTime duration = 
-                (RealTime::frame2RealTime
-                 (m_viewManager->alignReferenceToPlaybackFrame(i->getEndFrame()) -
-                  m_viewManager->alignReferenceToPlaybackFrame(i->getStartFrame()),
-                  sourceRate));
-            
-            m_rangeStarts.push_back(start);
-            m_rangeDurations.push_back(duration);
+        // Selections are sorted and distinct in reference frames, but
+        // nothing forces an alignment to keep them so
+        std::sort(index->ranges.begin(), index->ranges.end(),
+                  [](const PlayRange &a, const PlayRange &b) {
+                      return a.start < b.start;
+                  });
+        std::vector<PlayRange> merged;
+        for (const auto &range: index->ranges) {
+            if (!merged.empty() && range.start <= merged.back().end) {
+                merged.back().end = std::max(merged.back().end, range.end);
+            } else {
+                merged.push_back(range);
+            }
         }
-    } else {
-        m_rangeStarts.push_back(RealTime::zeroTime);
-        m_rangeDurations.push_back(end);
+        index->ranges = merged;
+        index->constrained = !index->ranges.empty();
     }
 
+    sv_samplerate_t sourceRate = getSourceSampleRate();
+    
+    if (!index->constrained) {
+        index->ranges.clear();
+        if (m_lastModelEndFrame > 0) {
+            index->ranges.push_back({ 0, m_lastModelEndFrame });
+        }
+    }
+
+    if (sourceRate > 0) {
+        for (const auto &range: index->ranges) {
+            m_rangeStarts.push_back
+                (RealTime::frame2RealTime(range.start, sourceRate));
+            m_rangeDurations.push_back
+                (RealTime::frame2RealTime(range.end - range.start,
+                                          sourceRate));
+        }
+    }
+
+    std::shared_ptr<const PlayRangeIndex> published(index);
+    std::atomic_store(&m_rangeIndex, published);
+
+    if (m_preRenderCache) {
+        m_preRenderCache->rangesChanged(published);
+    }
+    if (m_loopStretchCache) {
+        m_loopStretchCache->rangesChanged(published);
+    }
+    
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     SVDEBUG << "Now have " << m_rangeStarts.size() << " play ranges" << endl;
 #endif
 }
 
+int
+AudioCallbackPlaySource::PlayRangeIndex::findContainingOrFollowing
+(sv_frame_t frame) const
+{
+    auto i = std::upper_bound(ranges.begin(), ranges.end(), frame,
+                              [](sv_frame_t f, const PlayRange &range) {
+                                  return f < range.end;
+                              });
+    if (i == ranges.end()) return -1;
+    return int(i - ranges.begin());
+}
+
+sv_frame_t
+AudioCallbackPlaySource::PlayRangeIndex::getTotalDuration() const
+{
+    sv_frame_t total = 0;
+    for (const auto &range: ranges) {
+        total += range.end - range.start;
+    }
+    return total;
+}
+
+bool
+AudioCallbackPlaySource::PlayRangeIndex::isSameAs
+(const PlayRangeIndex &other) const
+{
+    if (constrained != other.constrained) return false;
+    if (ranges.size() != other.ranges.size()) return false;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (ranges[i].start != other.ranges[i].start ||
+            ranges[i].end != other.ranges[i].end) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void
 AudioCallbackPlaySource::setOutputLevels(float left, float right)
 {
@@ -1031,21 +1619,65 @@ AudioCallbackPlaySource::setAuditioningEffect(std::shared_ptr<Auditionable> a)
     m_auditioningEffectWrapper->setBypassed(false);
     m_mutex.unlock();
 
+    m_loopStretchCache->invalidate();
+
     SVDEBUG << "AudioCallbackPlaySource::setAuditioningEffect: set plugin to "
             << plugin << endl;
 }
 
+void
+AudioCallbackPlaySource::setAuditioningEffects
+(std::vector<std::shared_ptr<Auditionable>> a)
+{
+    SVDEBUG << "AudioCallbackPlaySource::setAuditioningEffects: "
+            << a.size() << " plugin(s)" << endl;
+
+    std::vector<std::weak_ptr<RealTimePluginInstance>> plugins;
+    
+    for (auto p: a) {
+        auto plugin = std::dynamic_pointer_cast<RealTimePluginInstance>(p);
+        if (!plugin) {
+            SVCERR << "WARNING: AudioCallbackPlaySource::setAuditioningEffects: auditionable object " << p << " is not a real-time plugin instance" << endl;
+            continue;
+        }
+        plugins.push_back(plugin);
+    }
+
+    m_mutex.lock();
+    m_auditioningEffectWrapper->setEffects(plugins);
+    m_auditioningEffectWrapper->setBypassed(false);
+    m_mutex.unlock();
+
+    m_loopStretchCache->invalidate();
+}
+
+void
+AudioCallbackPlaySource::setAuditioningEffectBypassed(int index,
+                                                      bool bypassed)
+{
+    m_auditioningEffectWrapper->setEffectBypassed(index, bypassed);
+    m_loopStretchCache->invalidate();
+}
+
 void
 AudioCallbackPlaySource::setSoloModelSet(std::set<ModelId> s)
 {
+    m_soloModelSet = s;
+    m_soloing = true;
     m_audioGenerator->setSoloModelSet(s);
+    m_preRenderCache->invalidate();
+    m_loopStretchCache->invalidate();
     clearRingBuffers();
 }
 
 void
 AudioCallbackPlaySource::clearSoloModelSet()
 {
+    m_soloModelSet.clear();
+    m_soloing = false;
     m_audioGenerator->clearSoloModelSet();
+    m_preRenderCache->invalidate();
+    m_loopStretchCache->invalidate();
     clearRingBuffers();
 }
 
@@ -1086,10 +1718,36 @@ AudioCallbackPlaySource::setTimeStretch(double factor)
     checkWrappers();
 
     m_timeStretchWrapper->setTimeStretchRatio(factor);
+    m_loopStretchCache->invalidate();
     
     emit activity(tr("Change time-stretch factor to %1").arg(factor));
 }
 
+void
+AudioCallbackPlaySource::setLoopStretchCaching(bool enabled)
+{
+    m_loopStretchCache->setEnabled(enabled);
+}
+
+bool
+AudioCallbackPlaySource::getLoopStretchCaching() const
+{
+    return m_loopStretchCache->isEnabled();
+}
+
+void
+AudioCallbackPlaySource::setMultithreadedStretching(bool enabled)
+{
+    m_multithreadedStretching = enabled;
+    updateStretchQuality();
+}
+
+bool
+AudioCallbackPlaySource::getMultithreadedStretching() const
+{
+    return m_multithreadedStretching;
+}
+
 int
 AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
                                           int requestedChannels,
@@ -1138,6 +1796,8 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
     // there's a race condition there, which we accommodate with this
     // check.
 
+    RealtimeAudit::Scope scope("audio callback");
+    
     int channels = getTargetChannelCount();
 
     if (!m_playing) {
@@ -1160,6 +1820,10 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
     SVDEBUG << "AudioCallbackPlaySource::getSourceSamples: Playing" << endl;
 #endif
 
+    int64_t startTime = PlaybackHealth::now();
+    int requested = count;
+    int readSpace = count;
+    
     // Ensure that all buffers have at least the amount of data we
     // need -- else reduce the size of our requests correspondingly
 
@@ -1176,6 +1840,7 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
         }
 
         int rs = rb->getReadSpace();
+        if (ch == 0 || rs < readSpace) readSpace = rs;
         if (rs < count) {
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
             SVCERR << "WARNING: AudioCallbackPlaySource::getSourceSamples: "
@@ -1189,7 +1854,14 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
         }
     }
 
-    if (count == 0) return 0;
+    if (count == 0) {
+        if (m_adaptiveRingBuffer && m_starvationArmed) {
+            ++m_nearUnderruns;
+        }
+        m_health.recordCallback(0, requested, 0);
+        m_health.recordSourceRead(PlaybackHealth::now() - startTime);
+        return 0;
+    }
 
     if (m_target) {
         m_lastRetrievedBlockSize = count;
@@ -1197,6 +1869,7 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
     }
 
     int got = 0;
+    int remaining = 0;
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE_PLAYING
     SVDEBUG << "channels == " << channels << endl;
@@ -1214,6 +1887,8 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
             if (ch > 0) request = got;
 
             got = rb->read(buffer[ch], int(request));
+
+            if (ch == 0) remaining = rb->getReadSpace();
             
 #ifdef DEBUG_AUDIO_PLAY_SOURCE_PLAYING
             SVDEBUG << "AudioCallbackPlaySource::getSamples: got " << got << " (of " << count << ") samples on channel " << ch << ", signalling for more (possibly)" << endl;
@@ -1227,21 +1902,90 @@ AudioCallbackPlaySource::getSourceSamples(float *const *buffer,
         }
     }
 
+    // Let the stretcher know where we are, in case it is playing a
+    // pre-stretched loop instead of stretching what we give it
+
+    if (m_timeStretchWrapper) {
+        m_timeStretchWrapper->setSourcePosition(m_readBufferFill, remaining);
+    }
+    
+    // Only wake the fill thread when the buffers have drained to the
+    // low-water mark, and only once each time they do so: the fill
+    // thread clears m_fillWanted when it wakes up
+
+    // Running low only counts against the buffer size once the
+    // buffers have filled properly since playback started or they
+    // were last replaced, so that we don't count the initial fill
+    
+    if (m_adaptiveRingBuffer) {
+        if (remaining >= getLowWaterMark()) {
+            m_starvationArmed = true;
+        } else if (m_starvationArmed &&
+                   (got < requested || remaining < getStarvationMark())) {
+            ++m_nearUnderruns;
+        }
+    }
+    
+    if (remaining < getLowWaterMark()) {
+#ifdef DEBUG_AUDIO_PLAY_SOURCE
+        SVDEBUG << "AudioCallbackPlaySource::getSamples: read space "
+                << remaining << " below low-water mark, awakening thread"
+                << endl;
+#endif
+        wakeFillThread();
+    }
+
+    m_health.recordCallback(readSpace, requested, got);
+    m_health.recordSourceRead(PlaybackHealth::now() - startTime);
+    
+    return got;
+}
+
+// Called from fill thread, mutex held
+void
+AudioCallbackPlaySource::primeGenerator()
+{
+    // Playback started from pre-rendered audio, so the ring buffers
+    // already hold m_primeFrames from m_primeStart. Take the note and
+    // synth models across the same span, discarding the output, so
+    // that notes sounding at the end of it carry on. Dense models
+    // have no such state and are skipped
+
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
-    SVDEBUG << "AudioCallbackPlaySource::getSamples: awakening thread" << endl;
+    SVDEBUG << "AudioCallbackPlaySource::primeGenerator: priming "
+            << m_primeFrames << " frames from " << m_primeStart << endl;
 #endif
 
-    m_condition.wakeAll();
+    m_primeMix.ranges = std::atomic_load(&m_rangeIndex);
 
-    return got;
+    float **bufferPtrs = m_fillArena.getMixBuffers();
+    sv_frame_t blockSize = m_fillArena.getFrameCount();
+    sv_frame_t f = m_primeStart;
+    sv_frame_t remaining = m_primeFrames;
+
+    while (remaining > 0 && !m_primeMix.models.empty()) {
+        sv_frame_t n = std::min(remaining, blockSize);
+        for (int c = 0; c < m_primeMix.channels; ++c) {
+            v_zero(bufferPtrs[c], int(n));
+        }
+        sv_frame_t got = mixModels(m_primeMix, false, f, n, bufferPtrs);
+        if (got <= 0) break;
+        remaining -= got;
+    }
+
+    m_primeFrames = 0;
 }
 
 // Called from fill thread, m_playing true, mutex held
 bool
 AudioCallbackPlaySource::fillBuffers()
 {
+    RealtimeAudit::Scope scope("fill thread");
+    
+    int channels = m_fillMix.channels;
+    
     sv_frame_t space = 0;
-    for (int c = 0; c < getTargetChannelCount(); ++c) {
+    for (int c = 0; c < channels; ++c) {
         RingBuffer<float> *wb = getWriteRingBuffer(c);
         if (wb) {
             sv_frame_t spaceHere = wb->getWriteSpace();
@@ -1274,17 +2018,22 @@ AudioCallbackPlaySource::fillBuffers()
     SVDEBUG << "buffered to " << f << " already" << endl;
 #endif
 
-    int channels = getTargetChannelCount();
-
-    static float **bufferPtrs = nullptr;
-    static int bufferPtrCount = 0;
+    // Mix no more than the arena was sized for. If there is more
+    // space than that, we'll be back for it on the next iteration
+    // of the fill thread, which doesn't wait while there is work
 
-    if (bufferPtrCount < channels) {
-        if (bufferPtrs) delete[] bufferPtrs;
-        bufferPtrs = new float *[channels];
-        bufferPtrCount = channels;
+    MixArena *arena = m_fillMix.arena;
+    if (arena->getChannelCount() < channels ||
+        arena->getSlotCount() < int(m_fillMix.models.size())) {
+        // Shouldn't happen, as we prepare on every change
+        SVDEBUG << "AudioCallbackPlaySource::fillBuffers: mix arena is "
+                << "not prepared, preparing it now" << endl;
+        prepareMixContext(m_fillMix, getFillArenaFrameCount());
     }
-
+    if (space > arena->getFrameCount()) {
+        space = arena->getFrameCount();
+    }
+    
     sv_frame_t generatorBlockSize = m_audioGenerator->getBlockSize();
 
     // space must be a multiple of generatorBlockSize
@@ -1299,23 +2048,23 @@ AudioCallbackPlaySource::fillBuffers()
         return false;
     }
 
-    if (m_tmpMixbufSize < channels * space) {
-        delete[] m_tmpMixbuf;
-        m_tmpMixbufSize = channels * space;
-        m_tmpMixbuf = new float[m_tmpMixbufSize];
+    if (m_primeFrames > 0) {
+        primeGenerator();
     }
 
-    for (int c = 0; c < channels; ++c) {
+    float **bufferPtrs = arena->getMixBuffers();
 
-        bufferPtrs[c] = m_tmpMixbuf + c * space;
-            
-        for (int i = 0; i < space; ++i) {
-            m_tmpMixbuf[c * space + i] = 0.0f;
-        }
+    for (int c = 0; c < channels; ++c) {
+        v_zero(bufferPtrs[c], int(space));
     }
 
-    sv_frame_t got = mixModels(f, space, bufferPtrs); // also modifies f
+    m_fillMix.ranges = std::atomic_load(&m_rangeIndex);
+    
+    sv_frame_t got = mixModels(m_fillMix, m_viewManager->getPlayLoopMode(),
+                               f, space, bufferPtrs); // also modifies f
 
+    sv_frame_t lost = 0;
+    
     for (int c = 0; c < channels; ++c) {
 
         RingBuffer<float> *wb = getWriteRingBuffer(c);
@@ -1330,10 +2079,15 @@ AudioCallbackPlaySource::fillBuffers()
                 SVCERR << "WARNING: Buffer overrun in channel " << c
                        << ": wrote " << actual << " of " << got
                        << " samples" << endl;
+                lost = std::max(lost, got - actual);
             }
         }
     }
 
+    if (lost > 0) {
+        m_health.recordOverrun(lost);
+    }
+
     m_writeBufferFill = f;
     if (readWriteEqual) m_readBufferFill = f;
 
@@ -1348,7 +2102,9 @@ AudioCallbackPlaySource::fillBuffers()
 }    
 
 sv_frame_t
-AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **buffers)
+AudioCallbackPlaySource::mixModels(MixContext &context, bool looping,
+                                   sv_frame_t &frame, sv_frame_t count,
+                                   float **buffers)
 {
     sv_frame_t processed = 0;
     sv_frame_t chunkStart = frame;
@@ -1356,35 +2112,29 @@ AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **
     sv_frame_t selectionSize = 0;
     sv_frame_t nextChunkStart = chunkStart + chunkSize;
     
-    bool looping = m_viewManager->getPlayLoopMode();
-    bool constrained = (m_viewManager->getPlaySelectionMode() &&
-                        !m_viewManager->getSelections().empty());
+    const PlayRangeIndex *ranges = context.ranges.get();
+    bool constrained = (ranges && ranges->constrained);
 
-    int channels = getTargetChannelCount();
+    int channels = context.channels;
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
     SVDEBUG << "mixModels: start " << frame << ", size " << count << ", channels " << channels << endl;
 #endif
 #ifdef DEBUG_AUDIO_PLAY_SOURCE_PLAYING
     if (constrained) {
-        SVDEBUG << "Manager has " << m_viewManager->getSelections().size() << " selection(s):" << endl;
-        for (auto sel: m_viewManager->getSelections()) {
-            SVDEBUG << sel.getStartFrame() << " -> " << sel.getEndFrame()
-                 << " (" << (sel.getEndFrame() - sel.getStartFrame()) << " frames)"
+        SVDEBUG << "Have " << ranges->ranges.size() << " play range(s):" << endl;
+        for (auto range: ranges->ranges) {
+            SVDEBUG << range.start << " -> " << range.end
+                 << " (" << (range.end - range.start) << " frames)"
                  << endl;
         }
     }
 #endif
-    
-    if (m_chunkBufferPtrCount < channels) {
-        if (m_chunkBufferPtrs) delete[] m_chunkBufferPtrs;
-        m_chunkBufferPtrCount = channels;
-        m_chunkBufferPtrs = new float *[m_chunkBufferPtrCount];
-    }
 
-    for (int c = 0; c < channels; ++c) {
-        m_chunkBufferPtrs[c] = buffers[c];
-    }
+    // Work out the chunks first, then render all models across all
+    // of them in renderMixChunks (which may do so in parallel)
+    
+    context.chunks.clear();
 
     while (processed < count) {
         
@@ -1396,32 +2146,25 @@ AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **
 
         if (constrained) {
 
-            sv_frame_t rChunkStart =
-                m_viewManager->alignPlaybackFrameToReference(chunkStart);
-            
-            Selection selection =
-                m_viewManager->getContainingSelection(rChunkStart, true);
+            int ri = ranges->findContainingOrFollowing(chunkStart);
             
-            if (selection.isEmpty()) {
+            if (ri < 0) {
                 if (looping) {
-                    selection = *m_viewManager->getSelections().begin();
-                    chunkStart = m_viewManager->alignReferenceToPlaybackFrame
-                        (selection.getStartFrame());
+                    ri = 0;
+                    chunkStart = ranges->ranges[0].start;
                     fadeIn = 50;
                 }
             }
 
-            if (selection.isEmpty()) {
+            if (ri < 0) {
 
                 chunkSize = 0;
                 nextChunkStart = chunkStart;
 
             } else {
 
-                sv_frame_t sf = m_viewManager->alignReferenceToPlaybackFrame
-                    (selection.getStartFrame());
-                sv_frame_t ef = m_viewManager->alignReferenceToPlaybackFrame
-                    (selection.getEndFrame());
+                sv_frame_t sf = ranges->ranges[ri].start;
+                sv_frame_t ef = ranges->ranges[ri].end;
 
                 selectionSize = ef - sf;
 
@@ -1467,6 +2210,7 @@ AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **
             SVDEBUG << "mixModels: ending at " << nextChunkStart << ", returning frame as "
                  << frame << endl;
 #endif
+            renderMixChunks(context, buffers, count);
             return count;
         }
 
@@ -1494,17 +2238,13 @@ AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **
             }
         }
 
-        for (std::set<ModelId>::iterator mi = m_models.begin();
-             mi != m_models.end(); ++mi) {
-            
-            (void) m_audioGenerator->mixModel(*mi, chunkStart, 
-                                              chunkSize, m_chunkBufferPtrs,
-                                              fadeIn, fadeOut);
-        }
-
-        for (int c = 0; c < channels; ++c) {
-            m_chunkBufferPtrs[c] += chunkSize;
-        }
+        MixChunk chunk;
+        chunk.start = chunkStart;
+        chunk.size = chunkSize;
+        chunk.offset = processed;
+        chunk.fadeIn = fadeIn;
+        chunk.fadeOut = fadeOut;
+        context.chunks.push_back(chunk);
 
         processed += chunkSize;
         chunkStart = nextChunkStart;
@@ -1514,10 +2254,155 @@ AudioCallbackPlaySource::mixModels(sv_frame_t &frame, sv_frame_t count, float **
     SVDEBUG << "mixModels returning " << processed << " frames to " << nextChunkStart << endl;
 #endif
 
+    renderMixChunks(context, buffers, count);
+    
     frame = nextChunkStart;
     return processed;
 }
 
+void
+AudioCallbackPlaySource::renderMixChunks(MixContext &context, float **buffers,
+                                         sv_frame_t count)
+{
+    if (context.chunks.empty()) return;
+
+    int channels = context.channels;
+    AudioGenerator *generator = context.generator;
+    MixArena *arena = context.arena;
+    
+    if (!arena->canMix(channels, count, int(context.models.size()))) {
+        // The owner should have prepared the context for this, so
+        // this is only a fallback. It allocates
+        SVDEBUG << "AudioCallbackPlaySource::renderMixChunks: mix arena "
+                << "is too small for " << count << " frames, resizing"
+                << endl;
+        prepareMixContext(context, count);
+    }
+    
+    context.modelList.assign(context.models.begin(), context.models.end());
+    int nmodels = int(context.modelList.size());
+
+    context.modelTimes.assign(nmodels, 0);
+    context.renderCount = count;
+
+    MixWorkerPool *pool = context.pool;
+    
+    if (!pool || pool->getThreadCount() == 0 || nmodels < 2) {
+
+        // Mix straight into the output, one chunk at a time. The
+        // models are mixed in turn, so they can share one slot
+
+        float **ptrs = arena->getMixPointers();
+        MixArena::Slot *slot = (nmodels > 0 ? arena->getSlot(0) : nullptr);
+        
+        for (const MixChunk &chunk: context.chunks) {
+            for (int c = 0; c < channels; ++c) {
+                ptrs[c] = buffers[c] + chunk.offset;
+            }
+            for (int m = 0; m < nmodels; ++m) {
+                int64_t start = PlaybackHealth::now();
+                (void) generator->mixModel(context.modelList[m],
+                                           chunk.start, chunk.size, ptrs,
+                                           chunk.fadeIn, chunk.fadeOut,
+                                           slot);
+                context.modelTimes[m] += PlaybackHealth::now() - start;
+            }
+        }
+
+        recordModelTimes(context);
+        return;
+    }
+
+    // Render each model across all chunks into the mix buffers of
+    // its own arena slot, which have the same layout as the output
+    // buffers (the generator may write a little either side of each
+    // chunk when fading). The models are independent of one
+    // another, so the generator can mix them concurrently. Then sum
+    // the slots in model order, so that the result doesn't depend on
+    // the order in which the workers happened to finish.
+    //
+    // The job captures only a reference, so that constructing it
+    // doesn't allocate
+    
+    MixWorkerPool::Job job = [&context](int m) {
+        RealtimeAudit::Scope scope("mix worker");
+        int64_t start = PlaybackHealth::now();
+        int channels = context.channels;
+        sv_frame_t count = context.renderCount;
+        MixArena::Slot *slot = context.arena->getSlot(m);
+        float **ptrs = slot->mixPtrs;
+        for (int c = 0; c < channels; ++c) {
+            v_zero(slot->mix[c], int(count));
+        }
+        for (const MixChunk &chunk: context.chunks) {
+            for (int c = 0; c < channels; ++c) {
+                ptrs[c] = slot->mix[c] + chunk.offset;
+            }
+            (void) context.generator->mixModel(context.modelList[m],
+                                               chunk.start, chunk.size, ptrs,
+                                               chunk.fadeIn, chunk.fadeOut,
+                                               slot);
+        }
+        context.modelTimes[m] = PlaybackHealth::now() - start;
+    };
+
+    pool->run(nmodels, job);
+
+    for (int m = 0; m < nmodels; ++m) {
+        MixArena::Slot *slot = arena->getSlot(m);
+        for (int c = 0; c < channels; ++c) {
+            v_add(buffers[c], slot->mix[c], int(count));
+        }
+    }
+
+    recordModelTimes(context);
+}
+
+void
+AudioCallbackPlaySource::prepareMixContext(MixContext &context,
+                                           sv_frame_t frames)
+{
+    if (!context.arena) return;
+    
+    int sourceChannels = 1;
+    for (ModelId modelId: context.models) {
+        auto dtvm = ModelById::getAs<DenseTimeValueModel>(modelId);
+        if (dtvm && dtvm->getChannelCount() > sourceChannels) {
+            sourceChannels = dtvm->getChannelCount();
+        }
+    }
+
+    int nmodels = int(context.models.size());
+
+    context.arena->configure(context.channels, sourceChannels,
+                             frames, nmodels);
+
+    context.modelList.reserve(nmodels);
+    context.modelTimes.reserve(nmodels);
+    context.chunks.reserve(MIX_CHUNK_CAPACITY);
+}
+
+sv_frame_t
+AudioCallbackPlaySource::getFillArenaFrameCount() const
+{
+    // At least a few device blocks, and a multiple of the generator
+    // block size as every fill must be
+    sv_frame_t frames = std::max(FILL_ARENA_FRAMES, m_blockSize * 4);
+    sv_frame_t blockSize = m_audioGenerator->getBlockSize();
+    return ((frames + blockSize - 1) / blockSize) * blockSize;
+}
+
+void
+AudioCallbackPlaySource::recordModelTimes(const MixContext &context)
+{
+    if (!context.health) return;
+    
+    for (int m = 0; m < int(context.modelList.size()); ++m) {
+        context.health->recordModelMix(context.modelList[m],
+                                       context.modelTimes[m]);
+    }
+}
+
 void
 AudioCallbackPlaySource::unifyRingBuffers()
 {
@@ -1582,6 +2467,7 @@ AudioCallbackPlaySource::unifyRingBuffers()
     m_bufferScavenger.claim(m_readBuffers);
     m_readBuffers = m_writeBuffers;
     m_readBufferFill = m_writeBufferFill;
+    m_starvationArmed = false;
 #ifdef DEBUG_AUDIO_PLAY_SOURCE_PLAYING
     SVDEBUG << "unified" << endl;
 #endif
@@ -1596,14 +2482,20 @@ AudioCallbackPlaySource::FillThread::run()
     SVDEBUG << "AudioCallbackPlaySourceFillThread starting" << endl;
 #endif
 
-    s.m_mutex.lock();
+    if (!s.m_fillMix.pool) {
+        s.m_fillMix.pool = new MixWorkerPool(MixWorkerPool::getDefaultThreadCount());
+    }
 
-    bool previouslyPlaying = s.m_playing;
     bool work = false;
 
     while (!s.m_exiting) {
 
+        s.processFillCommands();
+
+        s.m_mutex.lock();
         s.unifyRingBuffers();
+        s.m_mutex.unlock();
+
         s.m_bufferScavenger.scavenge();
         s.m_pluginScavenger.scavenge();
 
@@ -1613,32 +2505,45 @@ AudioCallbackPlaySource::FillThread::run()
             SVDEBUG << "AudioCallbackPlaySourceFillThread: not waiting" << endl;
 #endif
 
-            s.m_mutex.unlock();
-            s.m_mutex.lock();
-
         } else {
+
+            // We are normally woken by the audio callback when the
+            // ring buffers drain to the low-water mark, or by the UI
+            // thread when it posts a command or starts or stops
+            // playback. The timeout keeps the buffers topped up if
+            // neither happens for a while
             
             double ms = 100;
             if (s.getSourceSampleRate() > 0) {
                 ms = double(s.m_ringBufferSize) / s.getSourceSampleRate() * 1000.0;
             }
             
-            if (s.m_playing) ms /= 10;
+            if (s.m_playing) ms /= 4;
 
+            if (!s.m_fillWanted && s.m_fillCommands.getReadSpace() == 0) {
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
-            if (!s.m_playing) SVDEBUG << endl;
-            SVDEBUG << "AudioCallbackPlaySourceFillThread: waiting for " << ms << "ms..." << endl;
+                if (!s.m_playing) SVDEBUG << endl;
+                SVDEBUG << "AudioCallbackPlaySourceFillThread: waiting for up to " << ms << "ms..." << endl;
 #endif
-            
-            s.m_condition.wait(&s.m_mutex, int(ms));
+                s.m_fillSemaphore.tryAcquire(1, int(ms));
+            }
         }
 
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
         SVDEBUG << "AudioCallbackPlaySourceFillThread: awoken" << endl;
 #endif
 
+        // Permits released while we were busy rather than waiting
+        // would otherwise each wake us again for nothing
+        s.m_fillSemaphore.tryAcquire(s.m_fillSemaphore.available());
+        
+        s.m_fillWanted = false;
         work = false;
 
+        if (s.m_fillCommands.getReadSpace() > 0) {
+            s.processFillCommands();
+        }
+        
         if (!s.getSourceSampleRate()) {
 #ifdef DEBUG_AUDIO_PLAY_SOURCE
             SVDEBUG << "AudioCallbackPlaySourceFillThread: source sample rate is zero" << endl;
@@ -1646,23 +2551,20 @@ AudioCallbackPlaySource::FillThread::run()
             continue;
         }
 
-        bool playing = s.m_playing;
+        QMutexLocker locker(&s.m_mutex);
 
-        if (playing && !previouslyPlaying) {
-#ifdef DEBUG_AUDIO_PLAY_SOURCE
-            SVDEBUG << "AudioCallbackPlaySourceFillThread: playback state changed, resetting" << endl;
-#endif
-            for (int c = 0; c < s.getTargetChannelCount(); ++c) {
-                RingBuffer<float> *rb = s.getReadRingBuffer(c);
-                if (rb) rb->reset();
-            }
-        }
-        previouslyPlaying = playing;
+        // No reset here when playback starts: play() has already
+        // reset the ring buffers, and may have put pre-rendered
+        // audio into them since
 
+        int64_t fillStart = PlaybackHealth::now();
         work = s.fillBuffers();
-    }
+        if (work) {
+            s.m_health.recordFill(PlaybackHealth::now() - fillStart);
+        }
 
-    s.m_mutex.unlock();
+        s.adaptRingBufferSize();
+    }
 }
 
 } // end namespace sv
@@ -25,7 +25,11 @@
 
 #include <QObject>
 #include <QMutex>
-#include <QWaitCondition>
+#include <QSemaphore>
+#include <QTimer>
+
+#include "PlaybackHealth.h"
+#include "MixArena.h"
 
 #include "base/Thread.h"
 #include "base/RealTime.h"
@@ -35,6 +39,8 @@
 
 #include <set>
 #include <map>
+#include <atomic>
+#include <memory>
 
 namespace breakfastquay {
     class ResamplerWrapper;
@@ -50,6 +56,10 @@ class RealTimePluginInstance;
 class AudioCallbackPlayTarget;
 class TimeStretchWrapper;
 class EffectWrapper;
+class MixWorkerPool;
+class OfflineRenderer;
+class PreRenderCache;
+class LoopStretchCache;
 
 /**
  * AudioCallbackPlaySource manages audio data supply to callback-based
@@ -105,6 +115,14 @@ public:
      */
     virtual void play(sv_frame_t startFrame) override;
 
+    /**
+     * Note that playback is likely to be started from the given
+     * frame next, so that the start can be rendered in advance and
+     * playback begin without waiting for it to be mixed. The frame
+     * is interpreted as for play().
+     */
+    void preparePlayback(sv_frame_t startFrame);
+
     /**
      * Stop playback and ensure that no more data is returned.
      */
@@ -280,6 +298,31 @@ public:
      */
     void setTimeStretch(double factor);
 
+    /**
+     * Enable or disable rendering looped regions ahead of time with
+     * the finer time-stretcher, to be played in place of the live
+     * stretcher once ready. It is enabled by default.
+     */
+    void setLoopStretchCaching(bool enabled);
+
+    /**
+     * Return true if looped regions are being stretched ahead of
+     * time.
+     */
+    bool getLoopStretchCaching() const;
+
+    /**
+     * Enable or disable stretching each channel in its own thread
+     * during playback, for multichannel material. It is disabled by
+     * default. See TimeStretchWrapper::setMultithreading.
+     */
+    void setMultithreadedStretching(bool enabled);
+
+    /**
+     * Return true if channels are stretched in separate threads.
+     */
+    bool getMultithreadedStretching() const;
+
     /**
      * Set a single real-time plugin as a processing effect for
      * auditioning during playback.
@@ -298,6 +341,24 @@ public:
     virtual void setAuditioningEffect(std::shared_ptr<Auditionable> plugin)
         override;
 
+    /**
+     * Set a chain of real-time plugins to be applied in series, in
+     * the order given, for auditioning during playback. Each plugin
+     * must have been initialised as for setAuditioningEffect. The
+     * latency of the chain is included in the latency compensation
+     * of getCurrentPlayingFrame.
+     *
+     * Pass an empty chain to remove all auditioning plugins.
+     */
+    void setAuditioningEffects(std::vector<std::shared_ptr<Auditionable>>
+                               plugins);
+
+    /**
+     * Bypass or un-bypass the auditioning plugin at the given index
+     * in the chain. This does not interrupt playback.
+     */
+    void setAuditioningEffectBypassed(int index, bool bypassed);
+
     /**
      * Specify that only the given set of models should be played.
      */
@@ -320,6 +381,82 @@ public:
         m_enforceStereo = enforce;
     }
 
+    /**
+     * Enable or disable adaptive ring buffer sizing. When enabled,
+     * the ring buffers are grown whenever the audio callback comes
+     * close to running out of data, and shrunk again after a period
+     * without any such event, so that seeks and parameter changes
+     * are heard sooner on a lightly loaded machine. When disabled
+     * (the default) the buffers return to their default size.
+     */
+    void setAdaptiveRingBufferSize(bool adaptive);
+
+    /**
+     * Return true if adaptive ring buffer sizing is enabled.
+     */
+    bool getAdaptiveRingBufferSize() const {
+        return m_adaptiveRingBuffer;
+    }
+
+    /**
+     * Return the current size of each ring buffer, in frames.
+     */
+    int getRingBufferSize() const { return m_ringBufferSize; }
+
+    /**
+     * Set the block size used by the audio generator when mixing,
+     * which is the granularity of fills and of note and synth
+     * scheduling. The change is made by the fill thread between
+     * fills, so notes and synths already sounding carry on across
+     * it. The default is 1024.
+     */
+    void setGeneratorBlockSize(sv_frame_t blockSize);
+
+    /**
+     * Return the generator block size most recently requested.
+     */
+    sv_frame_t getGeneratorBlockSize() const { return m_generatorBlockSize; }
+
+    enum class PlaybackProfile {
+        Standard,
+        LowLatency
+    };
+    
+    /**
+     * Select a set of playback settings. LowLatency is for
+     * interactive scrubbing and for monitoring while recording: it
+     * uses a small generator block size and ring buffers (so that
+     * changes are heard sooner), runs the fill thread at a higher
+     * priority to make up for the smaller margin, and uses the faster
+     * time-stretcher. Standard, the default, uses the normal sizes
+     * and takes the stretcher quality from the preferences. Adaptive
+     * ring buffer sizing, if enabled, still applies on top of
+     * either.
+     */
+    void setPlaybackProfile(PlaybackProfile profile);
+
+    /**
+     * Return the current playback profile.
+     */
+    PlaybackProfile getPlaybackProfile() const { return m_playbackProfile; }
+
+    /**
+     * Return the playback health counters and histograms recorded
+     * since the source was created or resetPlaybackHealth() was last
+     * called. These are also emitted periodically during playback
+     * through playbackHealthReport().
+     */
+    PlaybackHealth::Report getPlaybackHealth() const {
+        return m_health.getReport();
+    }
+
+    /**
+     * Discard all recorded playback health data.
+     */
+    void resetPlaybackHealth() {
+        m_health.reset();
+    }
+
     virtual std::string getClientName() const override {
         return m_clientName;
     }
@@ -337,6 +474,8 @@ signals:
 
     void activity(QString);
 
+    void playbackHealthReport(PlaybackHealth::Report);
+
 public slots:
     void audioProcessingOverload() override;
 
@@ -347,6 +486,7 @@ protected slots:
     void playParametersChanged(int);
     void preferenceChanged(PropertyContainer::PropertyName);
     void modelChangedWithin(ModelId, sv_frame_t startFrame, sv_frame_t endFrame);
+    void healthTimerTimeout();
 
 protected:
     ViewManagerBase                  *m_viewManager;
@@ -363,7 +503,7 @@ protected:
         }
     };
 
-    std::set<ModelId>                 m_models;
+    std::set<ModelId>                 m_models; // UI thread; see m_fillMix
     RingBufferVector                 *m_readBuffers;
     RingBufferVector                 *m_writeBuffers;
     sv_frame_t                        m_readBufferFill;
@@ -383,11 +523,7 @@ protected:
     bool                              m_playing;
     bool                              m_exiting;
     sv_frame_t                        m_lastModelEndFrame;
-    int                               m_ringBufferSize;
-    float                            *m_tmpMixbuf;
-    sv_frame_t                        m_tmpMixbufSize;
-    float                           **m_chunkBufferPtrs;
-    int                               m_chunkBufferPtrCount;
+    std::atomic<int>                  m_ringBufferSize; // written by fill thread only
     float                             m_outputLeft;
     float                             m_outputRight;
     bool                              m_levelsSet;
@@ -396,6 +532,8 @@ protected:
     bool                              m_playStartFramePassed;
     RealTime                          m_playStartedAt;
     bool                              m_enforceStereo;
+    std::set<ModelId>                 m_soloModelSet; // UI thread
+    bool                              m_soloing;
 
     RingBuffer<float> *getWriteRingBuffer(int c) {
         if (m_writeBuffers && c < (int)m_writeBuffers->size()) {
@@ -414,25 +552,186 @@ protected:
         }
     }
 
-    void clearRingBuffers(bool haveLock = false, int count = 0);
+    // Called from the UI thread. Rebuilds the range lists and asks
+    // the fill thread to replace the write buffers with fresh ones
+    // (count of them, or the existing number if count is zero)
+    void clearRingBuffers(int count = 0);
+
+    // Called from fill thread (or from the UI thread if there is no
+    // fill thread yet), m_mutex held
+    void resetWriteBuffers(int count, sv_frame_t fill);
+
+    // Called from fill thread, m_mutex held, while playing with the
+    // read and write buffers unified. Replace the write buffers with
+    // larger ones of the pending size that carry on from the old
+    // ones, without resetting the generator
+    void growWriteBuffers();
+
     void unifyRingBuffers();
 
+    /**
+     * A change to the model set, or a request to rebuild the ring
+     * buffers, sent from the UI thread to the fill thread. These are
+     * queued and applied by the fill thread between fills, so that
+     * neither side has to wait for the other in order to make them.
+     */
+    struct FillCommand {
+        enum Type {
+            AddModel, RemoveModel, ClearModels, ResetBuffers, SetBlockSize
+        };
+        Type type = ResetBuffers;
+        ModelId model;          // for AddModel, RemoveModel
+        int channels = 0;       // for ResetBuffers; 0 for existing count
+        sv_frame_t frame = 0;   // for ResetBuffers; new write buffer fill
+        sv_frame_t blockSize = 0; // for SetBlockSize
+    };
+
+    // Called from the UI thread only (the queue has a single writer)
+    void postFillCommand(const FillCommand &);
+
+    // Called from fill thread
+    void processFillCommands();
+    void applyFillCommand(const FillCommand &, bool &reset,
+                          int &resetCount, sv_frame_t &resetFrame);
+
+    // Wake the fill thread. Safe to call from the audio callback: it
+    // neither allocates nor takes m_mutex. Where Qt implements
+    // QSemaphore with futexes (Linux, and other platforms in recent
+    // Qt versions) the release is an atomic update and at most a
+    // futex wake, with no mutex at all
+    void wakeFillThread();
+
+    // Read space below which the audio callback wakes the fill thread
+    sv_frame_t getLowWaterMark() const;
+
+    // Read space below which the audio callback counts a near
+    // underrun, for adaptive ring buffer sizing
+    sv_frame_t getStarvationMark() const;
+
+    // Called from fill thread, m_mutex held. Grow or shrink the ring
+    // buffers if adaptive sizing is enabled and the recent history
+    // calls for it
+    void adaptRingBufferSize();
+
+    // Ring buffer size to use when not adapting, for the current
+    // playback profile
+    int getProfileRingBufferSize() const;
+
+    // Apply the fill thread priority and time-stretcher quality
+    // appropriate to the current playback profile
+    void updateFillThreadPriority();
+    void updateStretchQuality();
+
     // Called from fill thread, mutex held.  Return true if work done
     bool fillBuffers();
     
-    // Called from fillBuffers.  Return the number of frames written,
-    // which will be count or fewer.  Return in the frame argument the
-    // new buffered frame position (which may be earlier than the
-    // frame argument passed in, in the case of looping).
-    sv_frame_t mixModels(sv_frame_t &frame, sv_frame_t count, float **buffers);
+    // A range of playback-model frames, from start to end (exclusive)
+    struct PlayRange {
+        sv_frame_t start;
+        sv_frame_t end;
+    };
+
+    // The ranges to be played, in playback-model frames, sorted and
+    // non-overlapping: the selections when play selection is active
+    // (constrained), otherwise the whole of the material. Built by
+    // rebuildRangeLists on the UI thread, and not modified after
+    // that, so the fill thread can use it without locking
+    struct PlayRangeIndex {
+        bool constrained = false;
+        std::vector<PlayRange> ranges;
+
+        // Return the index of the range containing frame, or of the
+        // first range following it, or -1 if there is neither
+        int findContainingOrFollowing(sv_frame_t frame) const;
+
+        sv_frame_t getTotalDuration() const;
 
-    // Ranges of current selections, if play selection is active
+        bool isSameAs(const PlayRangeIndex &other) const;
+    };
+
+    // Latest index, shared with the fill thread; use std::atomic_load
+    // and std::atomic_store to access the pointer
+    std::shared_ptr<const PlayRangeIndex> m_rangeIndex;
+
+    // A contiguous range of playback frames to be mixed at a given
+    // offset into the mixModels output buffers
+    struct MixChunk {
+        sv_frame_t start;
+        sv_frame_t size;
+        sv_frame_t offset;
+        sv_frame_t fadeIn;
+        sv_frame_t fadeOut;
+    };
+
+    // Everything needed to mix a set of models through a generator,
+    // and the scratch space for doing so. The fill thread has one of
+    // these (m_fillMix) and each OfflineRenderer has its own, so that
+    // an offline render shares no mixing state with playback
+    struct MixContext {
+        AudioGenerator *generator = nullptr;
+        std::set<ModelId> models;
+        int channels = 0;
+        MixWorkerPool *pool = nullptr;
+        MixArena *arena = nullptr; // owned by whoever owns the context
+        std::vector<MixChunk> chunks;
+        std::vector<ModelId> modelList;
+        std::vector<int64_t> modelTimes;
+        sv_frame_t renderCount = 0; // frames in current renderMixChunks
+        PlaybackHealth *health = nullptr; // to record per-model mix times
+        std::shared_ptr<const PlayRangeIndex> ranges; // null: unconstrained
+    };
+
+    friend class OfflineRenderer;
+    friend class PreRenderCache;
+    friend class LoopStretchCache;
+    
+    // Called from fillBuffers, or from an OfflineRenderer with its
+    // own context.  Return the number of frames written, which will
+    // be count or fewer.  Return in the frame argument the new
+    // buffered frame position (which may be earlier than the frame
+    // argument passed in, in the case of looping).
+    sv_frame_t mixModels(MixContext &context, bool looping,
+                         sv_frame_t &frame, sv_frame_t count, float **buffers);
+
+    // Called from mixModels. Mix every model in the context across
+    // the chunks planned in it, into buffers of count frames
+    void renderMixChunks(MixContext &context, float **buffers,
+                         sv_frame_t count);
+
+    // Size the context's arena and reserve its other scratch space
+    // for mixing up to the given number of frames at a time through
+    // its current models and channel count. Not realtime safe: call
+    // when either of those changes, before mixing again
+    void prepareMixContext(MixContext &context, sv_frame_t frames);
+
+    // The number of frames the fill thread mixes at most at once
+    sv_frame_t getFillArenaFrameCount() const;
+
+    // Called from renderMixChunks, to pass the per-model times it
+    // measured to the context's PlaybackHealth, if it has one
+    void recordModelTimes(const MixContext &context);
+
+    // Ranges of current selections, if play selection is active, as
+    // used by getCurrentFrame (UI thread). Rebuilt together with
+    // m_rangeIndex when the selection, the play selection mode or
+    // the model extents change
     std::vector<RealTime> m_rangeStarts;
     std::vector<RealTime> m_rangeDurations;
     void rebuildRangeLists();
 
     sv_frame_t getCurrentFrame(RealTime outputLatency);
 
+    // Map a frame passed to play() to the playback frame it will
+    // actually start from, taking into account play selection mode
+    // and alignment
+    sv_frame_t mapPlayStartFrame(sv_frame_t startFrame);
+
+    // Called from fillBuffers after play() has started from
+    // pre-rendered audio, to mix the same span through the models
+    // whose generator state carries from one block to the next
+    // (notes and synths), so that the fill continues seamlessly
+    void primeGenerator();
+
     class FillThread : public Thread
     {
     public:
@@ -446,8 +745,30 @@ protected:
         AudioCallbackPlaySource &m_source;
     };
 
+    RingBuffer<FillCommand>           m_fillCommands;
+    MixContext                        m_fillMix; // fill thread's model set etc
+    MixArena                          m_fillArena; // for m_fillMix
+    MixContext                        m_primeMix; // fill thread, for primeGenerator
+    sv_frame_t                        m_primeStart; // guarded by m_mutex
+    sv_frame_t                        m_primeFrames; // guarded by m_mutex
+    PreRenderCache                   *m_preRenderCache;
+    LoopStretchCache                 *m_loopStretchCache;
+    PlaybackHealth                    m_health;
+    QTimer                           *m_healthTimer;
+    std::atomic<bool>                 m_fillWanted;
+    QSemaphore                        m_fillSemaphore; // see wakeFillThread
+    int                               m_ringBufferChannels; // UI thread, as last requested
+
+    std::atomic<bool>                 m_adaptiveRingBuffer;
+    std::atomic<int>                  m_nearUnderruns; // since last adapt
+    std::atomic<bool>                 m_starvationArmed; // buffers have filled
+    std::atomic<int>                  m_pendingRingBufferSize; // 0 if none
+    int64_t                           m_lastStarvationTime; // usec
+    PlaybackProfile                   m_playbackProfile;
+    sv_frame_t                        m_generatorBlockSize; // as requested
+    bool                              m_multithreadedStretching;
+
     QMutex m_mutex;
-    QWaitCondition m_condition;
     FillThread *m_fillThread;
     breakfastquay::ResamplerWrapper *m_resamplerWrapper;
     TimeStretchWrapper *m_timeStretchWrapper;
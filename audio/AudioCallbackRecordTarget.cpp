@@ -13,6 +13,7 @@
 */
 
 #include "AudioCallbackRecordTarget.h"
+#include "RecordingSummary.h"
 
 #include "base/ViewManagerBase.h"
 #include "base/RecordDirectory.h"
@@ -21,14 +22,42 @@
 #include "data/model/WritableWaveFileModel.h"
 
 #include <QDir>
-#include <QTimer>
 #include <QDateTime>
+#include <QThread>
+
+#include <algorithm>
+#include <cmath>
 
 //#define DEBUG_AUDIO_CALLBACK_RECORD_TARGET 1
 
 namespace sv {
 
-static const int recordUpdateTimeout = 200; // ms
+static const int recordUpdateTimeout = 200; // ms, between GUI updates
+
+// Longest time the writer thread waits between passes
+static const int writeInterval = 50; // ms
+
+// Most frames the writer thread reads from the ring buffer and
+// writes to the model at a time
+static const int writeBlockSize = 16384;
+
+// Capacity of the ring buffer, in frames, whatever the channel count
+static const int bufferFrames = 441000;
+
+// Most frames putSamples interleaves at a time, before writing them to
+// the ring buffer
+static const int interleaveFrames = 1024;
+
+AudioCallbackRecordTarget::Buffers::Buffers(int channels_, int frames) :
+    channels(channels_),
+    ring(frames * std::max(channels_, 1)),
+    scratch(interleaveFrames * std::max(channels_, 1), 0.f),
+    levels(new std::atomic<float>[std::max(channels_, 1)])
+{
+    for (int c = 0; c < channels; ++c) {
+        levels[c] = 0.f;
+    }
+}
 
 AudioCallbackRecordTarget::AudioCallbackRecordTarget(ViewManagerBase *manager,
                                                      QString clientName) :
@@ -38,12 +67,22 @@ AudioCallbackRecordTarget::AudioCallbackRecordTarget(ViewManagerBase *manager,
     m_recordSampleRate(44100),
     m_recordChannelCount(2),
     m_frameCount(0),
+    m_droppedFrames(0),
+    m_reportedDroppedFrames(0),
+    m_progressPending(false),
+    m_publishedFrameCount(0),
     m_model(nullptr),
-    m_buffers(nullptr),
-    m_bufferCount(0),
+    m_rtBuffers(nullptr),
+    m_bufferScavenger(1),
+    m_putting(0),
     m_inputLeft(0.f),
     m_inputRight(0.f),
-    m_levelsSet(false)
+    m_levelsSet(false),
+    m_writer(nullptr),
+    m_writerActive(false),
+    m_stopRequested(false),
+    m_writerExiting(false),
+    m_unpublished(false)
 {
     m_viewManager->setAudioRecordTarget(this);
 
@@ -61,40 +100,68 @@ AudioCallbackRecordTarget::~AudioCallbackRecordTarget()
     
     m_viewManager->setAudioRecordTarget(nullptr);
 
-    QMutexLocker locker(&m_bufPtrMutex);
-    for (int c = 0; c < m_bufferCount; ++c) {
-        delete m_buffers[c];
+    if (m_writer) {
+        m_writerMutex.lock();
+        m_writerExiting = true;
+        m_writerCondition.wakeAll();
+        m_writerMutex.unlock();
+        m_writer->wait();
+        delete m_writer;
     }
-    delete[] m_buffers;
+
+    m_rtBuffers = nullptr;
+    waitForPutSamples();
+    m_bufferScavenger.scavenge(true);
 }
 
 void
 AudioCallbackRecordTarget::recreateBuffers()
 {
-    static int bufferSize = 441000;
-    
     int count = m_recordChannelCount;
+    
+    if (m_buffers && m_buffers->channels == count) return;
 
-    if (count > m_bufferCount) {
+    // The writer thread drains the buffers it was started with, into
+    // a model that has their channel count, so they can't be swapped
+    // during a recording. The new count is kept in
+    // m_recordChannelCount and applied when the recording stops;
+    // until then putSamples drops or zero-fills the extra channels
+    
+    if (m_recording) {
+        SVDEBUG << "AudioCallbackRecordTarget::recreateBuffers: "
+                << "channel count changed to " << count
+                << " while recording, deferring until recording stops"
+                << endl;
+        return;
+    }
 
-        RingBuffer<float> **newBuffers = new RingBuffer<float> *[count];
-        for (int c = 0; c < m_bufferCount; ++c) {
-            newBuffers[c] = m_buffers[c];
-        }
-        for (int c = m_bufferCount; c < count; ++c) {
-            newBuffers[c] = new RingBuffer<float>(bufferSize);
-        }
+    // The old buffers may still be in use by putSamples, or by the
+    // writer thread (which has its own reference), so they are
+    // released through the scavenger rather than here
+    
+    std::shared_ptr<Buffers> buffers =
+        std::make_shared<Buffers>(count, bufferFrames);
+    m_rtBuffers = buffers.get();
+    
+    if (m_buffers) {
+        m_bufferScavenger.claim(new std::shared_ptr<Buffers>(m_buffers));
+    }
+    m_buffers = buffers;
+
+    m_bufferScavenger.scavenge();
+}
 
-        // This is the only place where m_buffers is rewritten and
-        // should be the only possible source of contention against
-        // putSamples for this mutex (as the model-updating code is
-        // supposed to run in the same thread as this)
-        QMutexLocker locker(&m_bufPtrMutex);
-        delete[] m_buffers;
-        m_buffers = newBuffers;
-        m_bufferCount = count;
+void
+AudioCallbackRecordTarget::waitForPutSamples()
+{
+    // Wait until any putSamples call that may have started before
+    // the caller changed something has returned. The audio thread
+    // doesn't wait for us, so this is always brief
+    
+    while (m_putting > 0) {
+        QThread::usleep(500);
     }
-}    
+}
     
 int
 AudioCallbackRecordTarget::getApplicationSampleRate() const
@@ -132,51 +199,261 @@ AudioCallbackRecordTarget::setSystemRecordChannelCount(int c)
 }
 
 void
-AudioCallbackRecordTarget::putSamples(const float *const *samples, int, int nframes)
+AudioCallbackRecordTarget::putSamples(const float *const *samples,
+                                      int nchannels, int nframes)
 {
     // This may be called from RT context, and in a different thread
-    // from everything else in this class. It takes a mutex that
-    // should almost never be contended (see recreateBuffers())
-    if (!m_recording) return;
-
-    QMutexLocker locker(&m_bufPtrMutex);
-    if (m_buffers && m_bufferCount >= m_recordChannelCount) {
-        for (int c = 0; c < m_recordChannelCount; ++c) {
-            m_buffers[c]->write(samples[c], nframes);
+    // from everything else in this class. It takes no locks: the
+    // buffers it uses are only ever replaced, never changed in place,
+    // and replaced buffers are not deleted while it may be using them
+
+    ++m_putting;
+
+    Buffers *b = m_rtBuffers;
+    if (!b) {
+        --m_putting;
+        return;
+    }
+
+    int channels = b->channels;
+    int available = std::min(nchannels, channels);
+    bool recording = m_recording;
+    float *scratch = b->scratch.data();
+    
+    int done = 0;
+    
+    while (done < nframes) {
+
+        int n = std::min(nframes - done, interleaveFrames);
+
+        // Measure levels, and interleave if recording, a channel at a
+        // time so as to read each input sequentially
+
+        for (int c = 0; c < available; ++c) {
+
+            const float *in = samples[c] + done;
+            float peak = 0.f;
+
+            if (recording) {
+                for (int i = 0; i < n; ++i) {
+                    float v = in[i];
+                    scratch[i * channels + c] = v;
+                    float a = fabsf(v);
+                    if (a > peak) peak = a;
+                }
+            } else {
+                for (int i = 0; i < n; ++i) {
+                    float a = fabsf(in[i]);
+                    if (a > peak) peak = a;
+                }
+            }
+
+            float prev = b->levels[c];
+            while (peak > prev &&
+                   !b->levels[c].compare_exchange_weak(prev, peak)) { }
+        }
+
+        if (recording) {
+
+            for (int c = available; c < channels; ++c) {
+                for (int i = 0; i < n; ++i) {
+                    scratch[i * channels + c] = 0.f;
+                }
+            }
+
+            // Whole frames only, so that the channels stay in step,
+            // and count whatever won't fit
+            int space = b->ring.getWriteSpace() / channels;
+            int toWrite = std::min(n, space);
+            if (toWrite > 0) {
+                b->ring.write(scratch, toWrite * channels);
+            }
+            if (toWrite < n) {
+                m_droppedFrames += n - toWrite;
+            }
         }
+
+        done += n;
     }
+
+    --m_putting;
 }
 
 void
-AudioCallbackRecordTarget::updateModel()
+AudioCallbackRecordTarget::startWriter()
 {
-#ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
-    cerr << "AudioCallbackRecordTarget::updateModel" << endl;
-#endif
+    // Called from startRecording once m_model is set
+
+    m_writeSource = m_buffers;
+    m_writeSource->ring.reset();
+
+    int channels = m_writeSource->channels;
+    
+    m_writeInterleaved.clear();
+    m_writeInterleaved.resize(writeBlockSize * channels, 0.f);
+    m_writeBuffers.clear();
+    m_writePtrs.clear();
+
+    // A new summary object, as the last one may still be in use
+    m_summary = std::make_shared<RecordingSummary>(channels);
     
-    sv_frame_t frameToEmit = 0;
+    m_writeBuffers.resize(channels, std::vector<float>(writeBlockSize, 0.f));
+    for (auto &b: m_writeBuffers) {
+        m_writePtrs.push_back(b.data());
+    }
+    
+    QMutexLocker locker(&m_writerMutex);
+
+    m_writerActive = true;
+    m_stopRequested = false;
+    
+    if (!m_writer) {
+        m_writer = new WriterThread(*this);
+        m_writer->start();
+    }
+    
+    m_writerCondition.wakeAll();
+}
+
+void
+AudioCallbackRecordTarget::stopWriter()
+{
+    // Wait for the writer thread to write out everything in the ring
+    // buffers and stop. Call only once the audio thread can no
+    // longer be adding to them
+
+    QMutexLocker locker(&m_writerMutex);
+
+    if (!m_writerActive) return;
+    
+    m_stopRequested = true;
+    m_writerCondition.wakeAll();
+
+    while (m_writerActive) {
+        m_writerCondition.wait(&m_writerMutex);
+    }
+}
+
+void
+AudioCallbackRecordTarget::WriterThread::run()
+{
+    AudioCallbackRecordTarget &t(m_target);
+
+    t.m_writerMutex.lock();
+
+    while (!t.m_writerExiting) {
+
+        if (!t.m_writerActive) {
+            t.m_writerCondition.wait(&t.m_writerMutex);
+            continue;
+        }
 
-    int nframes = 0;
-    for (int c = 0; c < m_recordChannelCount; ++c) {
-        if (c == 0 || m_buffers[c]->getReadSpace() < nframes) {
-            nframes = m_buffers[c]->getReadSpace();
+        // Anything written before a stop was requested is already in
+        // the buffers, so a pass after seeing the request gets it all
+        bool stopping = t.m_stopRequested;
+        
+        t.m_writerMutex.unlock();
+        t.drain();
+        t.m_writerMutex.lock();
+
+        if (stopping) {
+            t.m_writerActive = false;
+            t.m_stopRequested = false;
+            t.m_writerCondition.wakeAll();
+            continue;
+        }
+
+        if (!t.m_stopRequested) {
+            t.m_writerCondition.wait(&t.m_writerMutex,
+                                     writeInterval);
         }
     }
 
-    if (nframes == 0) {
+    t.m_writerMutex.unlock();
+}
+
+void
+AudioCallbackRecordTarget::drain()
+{
+    if (!m_writeSource || !m_model) return;
+    
+    int channels = m_writeSource->channels;
+    if (channels == 0) return;
+
+    RingBuffer<float> &ring = m_writeSource->ring;
+    float *interleaved = m_writeInterleaved.data();
+    
+    bool written = false;
+    
+    while (true) {
+
+        int nframes = std::min(writeBlockSize,
+                               ring.getReadSpace() / channels);
+
+        if (nframes == 0) break;
+
 #ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
-        cerr << "AudioCallbackRecordTarget::updateModel: no frames available" << endl;
-#endif 
-        if (m_recording) {
-            QTimer::singleShot(recordUpdateTimeout, this, SLOT(updateModel()));
-        }    
+        cerr << "AudioCallbackRecordTarget::drain: writing " << nframes
+             << " frames" << endl;
+#endif
+        
+        ring.read(interleaved, nframes * channels);
+
+        for (int c = 0; c < channels; ++c) {
+            float *out = m_writePtrs[c];
+            for (int i = 0; i < nframes; ++i) {
+                out[i] = interleaved[i * channels + c];
+            }
+        }
+
+        m_model->addSamples(m_writePtrs.data(), nframes);
+        m_summary->append(m_writePtrs.data(), nframes);
+        m_frameCount += nframes;
+        written = true;
+    }
+
+    if (written) {
+        m_unpublished = true;
+    }
+    
+    // Tell the GUI thread every so often, unless we have already
+    // told it and it hasn't caught up yet
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - m_lastPublished <
+        std::chrono::milliseconds(recordUpdateTimeout)) {
         return;
     }
+    
+    if ((m_unpublished || m_droppedFrames != m_reportedDroppedFrames) &&
+        !m_progressPending.exchange(true)) {
+        m_unpublished = false;
+        m_lastPublished = now;
+        QMetaObject::invokeMethod(this, "updateModel", Qt::QueuedConnection);
+    }
+}
 
+void
+AudioCallbackRecordTarget::updateModel()
+{
+    // Called in the GUI thread when the writer thread has written
+    // something, and from stopRecording
+    
 #ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
-    cerr << "AudioCallbackRecordTarget::updateModel: have " << nframes << " frames" << endl;
+    cerr << "AudioCallbackRecordTarget::updateModel" << endl;
 #endif
 
+    m_progressPending = false;
+
+    sv_frame_t dropped = m_droppedFrames;
+    if (dropped != m_reportedDroppedFrames) {
+        SVCERR << "WARNING: AudioCallbackRecordTarget: " << dropped
+               << " input frame(s) dropped so far, as the record buffers "
+               << "were full" << endl;
+        m_reportedDroppedFrames = dropped;
+        emit recordFramesDropped(dropped);
+    }
+    
     if (!m_model) {
 #ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
         cerr << "AudioCallbackRecordTarget::updateModel: have no model to update; I am hoping there is a good reason for this" << endl;
@@ -184,50 +461,52 @@ AudioCallbackRecordTarget::updateModel()
         return;
     }
 
-    float **samples = new float *[m_recordChannelCount];
-    for (int c = 0; c < m_recordChannelCount; ++c) {
-        samples[c] = new float[nframes];
-        m_buffers[c]->read(samples[c], nframes);
-    }
-
-    m_model->addSamples(samples, nframes);
+    m_model->updateModel();
 
-    for (int c = 0; c < m_recordChannelCount; ++c) {
-        delete[] samples[c];
+    sv_frame_t frameCount = m_frameCount;
+    if (frameCount > m_publishedFrameCount) {
+        emit recordRangeAvailable(m_publishedFrameCount, frameCount,
+                                  m_recordSampleRate);
+        m_publishedFrameCount = frameCount;
     }
-    delete[] samples;
     
-    m_frameCount += nframes;
-    
-    m_model->updateModel();
-    frameToEmit = m_frameCount;
-    emit recordDurationChanged(frameToEmit, m_recordSampleRate);
-
-    if (m_recording) {
-        QTimer::singleShot(recordUpdateTimeout, this, SLOT(updateModel()));
-    }    
+    emit recordDurationChanged(frameCount, m_recordSampleRate);
 }
 
 void
 AudioCallbackRecordTarget::setInputLevels(float left, float right)
 {
-    if (left > m_inputLeft) m_inputLeft = left;
-    if (right > m_inputRight) m_inputRight = right;
+    float prev = m_inputLeft;
+    while (left > prev && !m_inputLeft.compare_exchange_weak(prev, left)) { }
+    prev = m_inputRight;
+    while (right > prev && !m_inputRight.compare_exchange_weak(prev, right)) { }
     m_levelsSet = true;
 }
 
 bool
 AudioCallbackRecordTarget::getInputLevels(float &left, float &right)
 {
-    left = m_inputLeft;
-    right = m_inputRight;
-    bool valid = m_levelsSet;
-    m_inputLeft = 0.f;
-    m_inputRight = 0.f;
-    m_levelsSet = false;
+    bool valid = m_levelsSet.exchange(false);
+    left = m_inputLeft.exchange(0.f);
+    right = m_inputRight.exchange(0.f);
     return valid;
 }
 
+int
+AudioCallbackRecordTarget::getInputLevelChannelCount() const
+{
+    return m_buffers ? m_buffers->channels : 0;
+}
+
+float
+AudioCallbackRecordTarget::getInputLevel(int channel)
+{
+    if (!m_buffers || channel < 0 || channel >= m_buffers->channels) {
+        return 0.f;
+    }
+    return m_buffers->levels[channel].exchange(0.f);
+}
+
 void
 AudioCallbackRecordTarget::modelAboutToBeDeleted()
 {
@@ -235,8 +514,11 @@ AudioCallbackRecordTarget::modelAboutToBeDeleted()
 #ifdef DEBUG_AUDIO_CALLBACK_RECORD_TARGET
         cerr << "AudioCallbackRecordTarget::modelAboutToBeDeleted: taking note" << endl;
 #endif
-        m_model = nullptr;
         m_recording = false;
+        waitForPutSamples();
+        stopWriter();
+        m_model = nullptr;
+        recreateBuffers();
     } else if (m_model) {
         SVCERR << "WARNING: AudioCallbackRecordTarget::modelAboutToBeDeleted: this is not my model!" << endl;
     }
@@ -252,6 +534,9 @@ AudioCallbackRecordTarget::startRecording()
 
     m_model = nullptr;
     m_frameCount = 0;
+    m_droppedFrames = 0;
+    m_reportedDroppedFrames = 0;
+    m_publishedFrameCount = 0;
 
     QString folder = RecordDirectory::getRecordDirectory();
     if (folder == "") return nullptr;
@@ -287,11 +572,11 @@ AudioCallbackRecordTarget::startRecording()
             this, SLOT(modelAboutToBeDeleted()));
 
     m_model->setObjectName(label);
+
+    startWriter();
     m_recording = true;
 
     emit recordStatusChanged(true);
-
-    QTimer::singleShot(recordUpdateTimeout, this, SLOT(updateModel()));
     
     return m_model;
 }
@@ -306,14 +591,17 @@ AudioCallbackRecordTarget::stopRecording()
 
     m_recording = false;
 
-    m_bufPtrMutex.lock();
-    m_bufPtrMutex.unlock();
+    waitForPutSamples();
 
     // buffers should now be up-to-date
+    stopWriter();
     updateModel();
 
     m_model->writeComplete();
     m_model = nullptr;
+
+    // Apply any channel count change deferred during the recording
+    recreateBuffers();
     
     emit recordStatusChanged(false);
     emit recordCompleted();
@@ -21,18 +21,40 @@
 
 #include <string>
 #include <atomic>
+#include <vector>
+#include <chrono>
+#include <memory>
 
 #include <QObject>
 #include <QMutex>
+#include <QWaitCondition>
 
 #include "base/BaseTypes.h"
 #include "base/RingBuffer.h"
+#include "base/Scavenger.h"
+#include "base/Thread.h"
 
 namespace sv {
 
 class ViewManagerBase;
 class WritableWaveFileModel;
-
+class RecordingSummary;
+
+/**
+ * Record target that writes recorded audio to a
+ * WritableWaveFileModel. The audio callback interleaves all channels
+ * into a single ring buffer, which a dedicated writer thread drains
+ * into the model's file. Its
+ * progress is published to the GUI thread asynchronously, so a busy
+ * UI does not hold up the writing. The writer thread also builds
+ * peak summaries as it goes (see RecordingSummary), from which a
+ * recording can be drawn without reading back the file.
+ *
+ * Nothing here assumes stereo: any number of channels may be
+ * recorded and metered. The callback never takes a lock, and a
+ * change of channel count replaces the ring buffer without waiting
+ * for it.
+ */
 class AudioCallbackRecordTarget : public QObject,
                                   public AudioRecordTarget,
                                   public breakfastquay::ApplicationRecordTarget
@@ -62,6 +84,21 @@ public:
     virtual bool isRecording() const override { return m_recording; }
     virtual sv_frame_t getRecordDuration() const override { return m_frameCount; }
 
+    /**
+     * Return the number of input frames dropped during the current
+     * (or most recent) recording because the ring buffers were full.
+     */
+    sv_frame_t getDroppedFrameCount() const { return m_droppedFrames; }
+
+    /**
+     * Return the peak summaries of the current (or most recent)
+     * recording, or a null pointer if nothing has been recorded. The
+     * summaries continue to grow while recording.
+     */
+    std::shared_ptr<const RecordingSummary> getRecordingSummary() const {
+        return m_summary;
+    }
+
     /**
      * Return the current input levels in the range 0.0 -> 1.0, for
      * metering purposes. The values returned are the peak values
@@ -75,6 +112,20 @@ public:
      */
      virtual bool getInputLevels(float &left, float &right) override;
 
+    /**
+     * Return the number of channels for which getInputLevel can
+     * return levels.
+     */
+    int getInputLevelChannelCount() const;
+
+    /**
+     * Return the peak input level for the given channel since the
+     * last time this function was called for that channel, in the
+     * range 0.0 -> 1.0, and reset it to zero. Levels are measured
+     * whether or not recording is in progress.
+     */
+    float getInputLevel(int channel);
+
     WritableWaveFileModel *startRecording(); // caller takes ownership of model
     void stopRecording();
 
@@ -82,28 +133,84 @@ signals:
     void recordStatusChanged(bool recording);
     void recordDurationChanged(sv_frame_t, sv_samplerate_t); // emitted occasionally
     void recordCompleted();
+    void recordFramesDropped(sv_frame_t total); // emitted occasionally
+
+    /**
+     * Emitted occasionally while recording, with the range of frames
+     * written to the model and summarised since the last emission.
+     */
+    void recordRangeAvailable(sv_frame_t from, sv_frame_t to,
+                              sv_samplerate_t);
 
 protected slots:
     void modelAboutToBeDeleted();
     void updateModel();
     
 private:
+    class WriterThread : public Thread
+    {
+    public:
+        WriterThread(AudioCallbackRecordTarget &target) :
+            Thread(Thread::NonRTThread),
+            m_target(target) { }
+
+        void run() override;
+
+    protected:
+        AudioCallbackRecordTarget &m_target;
+    };
+    
     ViewManagerBase *m_viewManager;
     std::string m_clientName;
     std::atomic_bool m_recording;
     sv_samplerate_t m_recordSampleRate;
     int m_recordChannelCount;
-    sv_frame_t m_frameCount;
+    std::atomic<sv_frame_t> m_frameCount;
+    std::atomic<sv_frame_t> m_droppedFrames;
+    std::atomic<sv_frame_t> m_reportedDroppedFrames; // written by GUI thread
+    std::atomic_bool m_progressPending;
+    sv_frame_t m_publishedFrameCount; // GUI thread only
+    std::shared_ptr<RecordingSummary> m_summary;
     QString m_audioFileName;
     WritableWaveFileModel *m_model;
-    RingBuffer<float> **m_buffers;
-    QMutex m_bufPtrMutex;
-    int m_bufferCount;
-    float m_inputLeft;
-    float m_inputRight;
-    bool m_levelsSet;
+
+    // The ring buffer and the other state used by putSamples for a
+    // given channel count. It is replaced as a whole when the count
+    // changes
+    struct Buffers {
+        Buffers(int channels, int frames);
+        int channels;
+        RingBuffer<float> ring; // interleaved
+        std::vector<float> scratch; // interleaving buffer, callback only
+        std::unique_ptr<std::atomic<float>[]> levels;
+    };
+
+    std::shared_ptr<Buffers> m_buffers; // current, set in non-RT threads
+    std::atomic<Buffers *> m_rtBuffers; // the same, for putSamples
+    Scavenger<std::shared_ptr<Buffers>> m_bufferScavenger;
+    std::atomic<int> m_putting; // putSamples calls in progress
+    std::atomic<float> m_inputLeft;
+    std::atomic<float> m_inputRight;
+    std::atomic_bool m_levelsSet;
+
+    WriterThread *m_writer;
+    QMutex m_writerMutex; // for the three flags below
+    QWaitCondition m_writerCondition;
+    bool m_writerActive;  // writing to m_model
+    bool m_stopRequested;
+    bool m_writerExiting;
+    std::shared_ptr<Buffers> m_writeSource;          // writer thread only
+    std::vector<float> m_writeInterleaved;           // writer thread only
+    std::vector<std::vector<float>> m_writeBuffers;  // writer thread only
+    std::vector<float *> m_writePtrs;                // writer thread only
+    bool m_unpublished;                              // writer thread only
+    std::chrono::steady_clock::time_point m_lastPublished; // writer only
 
     void recreateBuffers();
+    void waitForPutSamples();
+    void startWriter();
+    void stopWriter();
+    void drain(); // writer thread only
 };
 
 } // end namespace sv
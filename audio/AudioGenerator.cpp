@@ -29,21 +29,34 @@
 
 #include "ClipMixer.h"
 #include "ContinuousSynth.h"
+#include "RealtimeAudit.h"
+#include "MixKernels.h"
 
 #include <iostream>
 #include <cmath>
+#include <algorithm>
 
 #include <QDir>
 #include <QFile>
 
 namespace sv {
 
-const sv_frame_t
-AudioGenerator::m_processingBlockSize = 1024;
+static const sv_frame_t DEFAULT_PROCESSING_BLOCK_SIZE = 1024;
+
+// ContinuousSynth glides between frequencies over its first 100
+// frames, which must fall within one block
+static const sv_frame_t MIN_PROCESSING_BLOCK_SIZE = 128;
 
 QString
 AudioGenerator::m_sampleDir = "";
 
+// Initial capacity for note starts and ends per block, which is only
+// exceeded (and so reallocated) for very dense note models
+static const size_t NOTE_SCRATCH_CAPACITY = 256;
+
+// Number of processing blocks of events read ahead at a time
+static const int EVENT_CURSOR_WINDOW_BLOCKS = 16;
+
 //#define DEBUG_AUDIO_GENERATOR 1
 
 AudioGenerator::AudioGenerator() :
@@ -51,9 +64,8 @@ AudioGenerator::AudioGenerator() :
     m_targetChannelCount(1),
     m_waveType(0),
     m_soloing(false),
-    m_channelBuffer(nullptr),
-    m_channelBufSiz(0),
-    m_channelBufCount(0)
+    m_processingBlockSize(DEFAULT_PROCESSING_BLOCK_SIZE),
+    m_clipPolyphony(ClipMixer::getDefaultPolyphony())
 {
     initialiseSampleDir();
 
@@ -69,10 +81,9 @@ AudioGenerator::~AudioGenerator()
     SVCERR << "AudioGenerator::~AudioGenerator" << endl;
 #endif
 
-    for (int i = 0; i < m_channelBufCount; ++i) {
-        delete[] m_channelBuffer[i];
+    for (auto &b: m_channelBuffers) {
+        deleteChannelBuffer(b.second);
     }
-    delete[] m_channelBuffer;
 }
 
 void
@@ -147,8 +158,13 @@ AudioGenerator::addModel(ModelId modelId)
     if (usesClipMixer(modelId)) {
         ClipMixer *mixer = makeClipMixerFor(modelId);
         if (mixer) {
-            QMutexLocker locker(&m_mutex);
+            QWriteLocker locker(&m_mutex);
             m_clipMixerMap[modelId] = mixer;
+            m_noteOffs[modelId].setCapacity(mixer->getPolyphony());
+            NoteScratch &scratch = m_noteScratch[modelId];
+            scratch.starts.reserve(NOTE_SCRATCH_CAPACITY);
+            scratch.ends.reserve(NOTE_SCRATCH_CAPACITY);
+            m_noteCursors[modelId].nextFrame = -1;
             return willPlay;
         }
     }
@@ -156,8 +172,9 @@ AudioGenerator::addModel(ModelId modelId)
     if (usesContinuousSynth(modelId)) {
         ContinuousSynth *synth = makeSynthFor(modelId);
         if (synth) {
-            QMutexLocker locker(&m_mutex);
+            QWriteLocker locker(&m_mutex);
             m_continuousSynthMap[modelId] = synth;
+            m_synthCursors[modelId].nextFrame = -1;
             return willPlay;
         }
     }
@@ -177,7 +194,7 @@ AudioGenerator::playClipIdChanged(int playableId, QString)
 
     ClipMixer *mixer = makeClipMixerFor(modelId);
     if (mixer) {
-        QMutexLocker locker(&m_mutex);
+        QWriteLocker locker(&m_mutex);
         ClipMixer *oldMixer = m_clipMixerMap[modelId];
         m_clipMixerMap[modelId] = mixer;
         delete oldMixer;
@@ -234,6 +251,7 @@ AudioGenerator::makeClipMixerFor(ModelId modelId)
     ClipMixer *mixer = new ClipMixer(m_targetChannelCount,
                                      m_sourceSampleRate,
                                      m_processingBlockSize);
+    mixer->setPolyphony(m_clipPolyphony);
 
     double clipF0 = Pitch::getFrequencyForPitch(60, 0, 440.0); // required
 
@@ -270,21 +288,48 @@ AudioGenerator::makeSynthFor(ModelId)
 void
 AudioGenerator::removeModel(ModelId modelId)
 {
-    QMutexLocker locker(&m_mutex);
-
+    QWriteLocker locker(&m_mutex);
+
+    {
+        QMutexLocker bufferLocker(&m_channelBufferMutex);
+        auto itr = m_channelBuffers.find(modelId);
+        if (itr != m_channelBuffers.end()) {
+            deleteChannelBuffer(itr->second);
+            m_channelBuffers.erase(itr);
+        }
+    }
+    
+    m_synthCursors.erase(modelId);
+    
     if (m_clipMixerMap.find(modelId) == m_clipMixerMap.end()) {
         return;
     }
 
     ClipMixer *mixer = m_clipMixerMap[modelId];
     m_clipMixerMap.erase(modelId);
+    m_noteOffs.erase(modelId);
+    m_noteScratch.erase(modelId);
+    m_noteCursors.erase(modelId);
     delete mixer;
 }
 
 void
 AudioGenerator::clearModels()
 {
-    QMutexLocker locker(&m_mutex);
+    QWriteLocker locker(&m_mutex);
+
+    {
+        QMutexLocker bufferLocker(&m_channelBufferMutex);
+        for (auto &b: m_channelBuffers) {
+            deleteChannelBuffer(b.second);
+        }
+        m_channelBuffers.clear();
+    }
+    
+    m_noteOffs.clear();
+    m_noteScratch.clear();
+    m_noteCursors.clear();
+    m_synthCursors.clear();
 
     while (!m_clipMixerMap.empty()) {
         ClipMixer *mixer = m_clipMixerMap.begin()->second;
@@ -296,7 +341,7 @@ AudioGenerator::clearModels()
 void
 AudioGenerator::reset()
 {
-    QMutexLocker locker(&m_mutex);
+    QWriteLocker locker(&m_mutex);
 
 #ifdef DEBUG_AUDIO_GENERATOR
     SVCERR << "AudioGenerator::reset()" << endl;
@@ -309,7 +354,89 @@ AudioGenerator::reset()
         }
     }
 
-    m_noteOffs.clear();
+    // Clear the note-off heaps, but keep an entry for each model:
+    // mixClipModel relies on there being one
+    for (auto &n: m_noteOffs) {
+        n.second.clear();
+    }
+
+    // And have every model read ahead afresh from wherever it is
+    // next asked to play
+    for (auto &c: m_noteCursors) {
+        c.second.nextFrame = -1;
+    }
+    for (auto &c: m_synthCursors) {
+        c.second.nextFrame = -1;
+    }
+}
+
+void
+AudioGenerator::modelChangedWithin(ModelId modelId, sv_frame_t, sv_frame_t)
+{
+    // Called from the UI thread while mixing may be under way, so
+    // just bump the change count for the mixing thread to notice.
+    // The maps themselves only change with m_mutex held for write,
+    // which is never done on another thread from here
+    
+    auto noteItr = m_noteCursors.find(modelId);
+    if (noteItr != m_noteCursors.end()) {
+        ++noteItr->second.changes;
+    }
+
+    auto synthItr = m_synthCursors.find(modelId);
+    if (synthItr != m_synthCursors.end()) {
+        ++synthItr->second.changes;
+    }
+}
+
+template <typename T>
+template <typename Fetch, typename FrameOf>
+void
+AudioGenerator::EventCursor<T>::advance(sv_frame_t blockStart,
+                                        sv_frame_t blockSize,
+                                        sv_frame_t windowSize,
+                                        Fetch fetch,
+                                        FrameOf frameOf,
+                                        size_t &from,
+                                        size_t &to)
+{
+    sv_frame_t blockEnd = blockStart + blockSize;
+    if (windowSize < blockSize) windowSize = blockSize;
+
+    int changesNow = changes;
+    
+    if (blockStart != nextFrame ||
+        changesNow != changesSeen ||
+        blockEnd > windowEnd) {
+
+        // Blocks are mixed in sequence from wherever the window was
+        // last read, so carrying straight on also starts the new
+        // window where the old one ended
+
+        events = fetch(blockStart, windowSize);
+        index = 0;
+        windowEnd = blockStart + windowSize;
+        changesSeen = changesNow;
+
+        auto earlier = [&](const T &a, const T &b) {
+            return frameOf(a) < frameOf(b);
+        };
+        if (!std::is_sorted(events.begin(), events.end(), earlier)) {
+            std::stable_sort(events.begin(), events.end(), earlier);
+        }
+    }
+
+    while (index < events.size() && frameOf(events[index]) < blockStart) {
+        ++index;
+    }
+    from = index;
+    
+    while (index < events.size() && frameOf(events[index]) < blockEnd) {
+        ++index;
+    }
+    to = index;
+
+    nextFrame = blockEnd;
 }
 
 void
@@ -319,12 +446,15 @@ AudioGenerator::setTargetChannelCount(int targetChannelCount)
 
 //    SVDEBUG << "AudioGenerator::setTargetChannelCount(" << targetChannelCount << ")" << endl;
 
-    QMutexLocker locker(&m_mutex);
+    QWriteLocker locker(&m_mutex);
     m_targetChannelCount = targetChannelCount;
 
     for (ClipMixerMap::iterator i = m_clipMixerMap.begin(); i != m_clipMixerMap.end(); ++i) {
         if (i->second) i->second->setChannelCount(targetChannelCount);
     }
+    for (auto &s: m_continuousSynthMap) {
+        if (s.second) s.second->setChannelCount(targetChannelCount);
+    }
 }
 
 sv_frame_t
@@ -333,10 +463,62 @@ AudioGenerator::getBlockSize() const
     return m_processingBlockSize;
 }
 
+void
+AudioGenerator::setClipPolyphony(int voices)
+{
+    QWriteLocker locker(&m_mutex);
+
+    m_clipPolyphony = voices;
+
+    for (auto &m: m_clipMixerMap) {
+        if (m.second) {
+            m.second->setPolyphony(voices);
+            m_noteOffs[m.first].setCapacity(m.second->getPolyphony());
+        }
+    }
+}
+
+int
+AudioGenerator::getClipPolyphony() const
+{
+    return m_clipPolyphony;
+}
+
+sv_frame_t
+AudioGenerator::getMinimumBlockSize()
+{
+    return MIN_PROCESSING_BLOCK_SIZE;
+}
+
+void
+AudioGenerator::setBlockSize(sv_frame_t blockSize)
+{
+    if (blockSize < MIN_PROCESSING_BLOCK_SIZE) {
+        blockSize = MIN_PROCESSING_BLOCK_SIZE;
+    }
+    
+    QWriteLocker locker(&m_mutex);
+
+    if (blockSize == m_processingBlockSize) return;
+
+#ifdef DEBUG_AUDIO_GENERATOR
+    SVCERR << "AudioGenerator::setBlockSize(" << blockSize << ")" << endl;
+#endif
+
+    m_processingBlockSize = blockSize;
+
+    for (auto &m: m_clipMixerMap) {
+        if (m.second) m.second->setBlockSize(blockSize);
+    }
+    for (auto &s: m_continuousSynthMap) {
+        if (s.second) s.second->setBlockSize(blockSize);
+    }
+}
+
 void
 AudioGenerator::setSoloModelSet(std::set<ModelId> s)
 {
-    QMutexLocker locker(&m_mutex);
+    QWriteLocker locker(&m_mutex);
 
     m_soloModelSet = s;
     m_soloing = true;
@@ -345,7 +527,7 @@ AudioGenerator::setSoloModelSet(std::set<ModelId> s)
 void
 AudioGenerator::clearSoloModelSet()
 {
-    QMutexLocker locker(&m_mutex);
+    QWriteLocker locker(&m_mutex);
 
     m_soloModelSet.clear();
     m_soloing = false;
@@ -355,14 +537,15 @@ sv_frame_t
 AudioGenerator::mixModel(ModelId modelId,
                          sv_frame_t startFrame, sv_frame_t frameCount,
                          float **buffer,
-                         sv_frame_t fadeIn, sv_frame_t fadeOut)
+                         sv_frame_t fadeIn, sv_frame_t fadeOut,
+                         MixArena::Slot *scratch)
 {
     if (m_sourceSampleRate == 0) {
         SVCERR << "WARNING: AudioGenerator::mixModel: No base source sample rate available" << endl;
         return frameCount;
     }
 
-    QMutexLocker locker(&m_mutex);
+    RealtimeAudit::ReadLocker locker(&m_mutex, "AudioGenerator::mixModel");
 
     auto model = ModelById::get(modelId);
     if (!model || !model->canPlay()) return frameCount;
@@ -394,17 +577,18 @@ AudioGenerator::mixModel(ModelId modelId,
 
     if (std::dynamic_pointer_cast<DenseTimeValueModel>(model)) {
         return mixDenseTimeValueModel(modelId, startFrame, frameCount,
-                                      buffer, gain, pan, fadeIn, fadeOut);
+                                      buffer, gain, pan, fadeIn, fadeOut,
+                                      scratch);
     }
 
     if (usesClipMixer(modelId)) {
         return mixClipModel(modelId, startFrame, frameCount,
-                            buffer, gain, pan);
+                            buffer, gain, pan, scratch);
     }
 
     if (usesContinuousSynth(modelId)) {
         return mixContinuousSynthModel(modelId, startFrame, frameCount,
-                                       buffer, gain, pan);
+                                       buffer, gain, pan, scratch);
     }
 
     std::cerr << "AudioGenerator::mixModel: WARNING: Model " << modelId << " of type " << model->getTypeName() << " is marked as playable, but I have no mechanism to play it" << std::endl;
@@ -412,11 +596,55 @@ AudioGenerator::mixModel(ModelId modelId,
     return frameCount;
 }
 
+AudioGenerator::ChannelBuffer &
+AudioGenerator::getChannelBuffer(ModelId modelId,
+                                 int channels, sv_frame_t frames)
+{
+    ChannelBuffer *cb = nullptr;
+    
+    {
+        // References into a std::map remain valid when other
+        // elements are added, so we only need the lock in order to
+        // find or insert the element
+        QMutexLocker locker(&m_channelBufferMutex);
+        cb = &m_channelBuffers[modelId];
+    }
+
+    if (cb->size < frames || cb->count < channels) {
+
+        deleteChannelBuffer(*cb);
+
+        cb->data = new float *[channels];
+
+        for (int c = 0; c < channels; ++c) {
+            cb->data[c] = new float[frames];
+        }
+
+        cb->count = channels;
+        cb->size = frames;
+    }
+
+    return *cb;
+}
+
+void
+AudioGenerator::deleteChannelBuffer(ChannelBuffer &cb)
+{
+    for (int c = 0; c < cb.count; ++c) {
+        delete[] cb.data[c];
+    }
+    delete[] cb.data;
+    cb.data = nullptr;
+    cb.size = 0;
+    cb.count = 0;
+}
+
 sv_frame_t
 AudioGenerator::mixDenseTimeValueModel(ModelId modelId,
                                        sv_frame_t startFrame, sv_frame_t frames,
                                        float **buffer, float gain, float pan,
-                                       sv_frame_t fadeIn, sv_frame_t fadeOut)
+                                       sv_frame_t fadeIn, sv_frame_t fadeOut,
+                                       MixArena::Slot *scratch)
 {
     sv_frame_t maxFrames = frames + std::max(fadeIn, fadeOut);
 
@@ -425,52 +653,61 @@ AudioGenerator::mixDenseTimeValueModel(ModelId modelId,
     
     int modelChannels = dtvm->getChannelCount();
 
-    if (m_channelBufSiz < maxFrames || m_channelBufCount < modelChannels) {
-
-        for (int c = 0; c < m_channelBufCount; ++c) {
-            delete[] m_channelBuffer[c];
-        }
-
-        delete[] m_channelBuffer;
-        m_channelBuffer = new float *[modelChannels];
-
-        for (int c = 0; c < modelChannels; ++c) {
-            m_channelBuffer[c] = new float[maxFrames];
-        }
-
-        m_channelBufCount = modelChannels;
-        m_channelBufSiz = maxFrames;
-    }
+    // Where the whole span is available from the model, mix straight
+    // from the vectors it returns. Only at the very start, where the
+    // fade-in reaches back before frame 0, do we need to copy into a
+    // channel buffer with silence ahead of the data
 
+    std::vector<floatvec_t> data;
+    float **channelBuffer = nullptr;
+    bool direct = false;
+    
     sv_frame_t got = 0;
 
     if (startFrame >= fadeIn/2) {
 
-        auto data = dtvm->getMultiChannelData(0, modelChannels - 1,
-                                              startFrame - fadeIn/2,
-                                              frames + fadeOut/2 + fadeIn/2);
-
-        for (int c = 0; c < modelChannels; ++c) {
-            copy(data[c].begin(), data[c].end(), m_channelBuffer[c]);
-        }
+        data = dtvm->getMultiChannelData(0, modelChannels - 1,
+                                         startFrame - fadeIn/2,
+                                         frames + fadeOut/2 + fadeIn/2);
 
+        if (int(data.size()) < modelChannels) return 0;
+        
         got = data[0].size();
+        direct = true;
 
     } else {
+
+        sv_frame_t channelBufSiz = 0;
+
+        if (scratch &&
+            scratch->sourceChannels >= modelChannels &&
+            scratch->sourceFrames >= maxFrames) {
+            channelBuffer = scratch->source;
+            channelBufSiz = scratch->sourceFrames;
+        } else {
+            ChannelBuffer &cb = getChannelBuffer(modelId, modelChannels, maxFrames);
+            channelBuffer = cb.data;
+            channelBufSiz = cb.size;
+        }
+
         sv_frame_t missing = fadeIn/2 - startFrame;
 
         if (missing > 0) {
-            SVCERR << "note: channelBufSiz = " << m_channelBufSiz
+            SVCERR << "note: channelBufSiz = " << channelBufSiz
                  << ", frames + fadeOut/2 = " << frames + fadeOut/2 
                  << ", startFrame = " << startFrame 
                  << ", missing = " << missing << endl;
         }
 
-        auto data = dtvm->getMultiChannelData(0, modelChannels - 1,
-                                              startFrame,
-                                              frames + fadeOut/2);
+        data = dtvm->getMultiChannelData(0, modelChannels - 1,
+                                         startFrame,
+                                         frames + fadeOut/2);
+
+        if (int(data.size()) < modelChannels) return 0;
+        
         for (int c = 0; c < modelChannels; ++c) {
-            copy(data[c].begin(), data[c].end(), m_channelBuffer[c] + missing);
+            std::fill(channelBuffer[c], channelBuffer[c] + missing, 0.f);
+            copy(data[c].begin(), data[c].end(), channelBuffer[c] + missing);
         }
 
         got = data[0].size() + missing;
@@ -491,25 +728,59 @@ AudioGenerator::mixDenseTimeValueModel(ModelId modelId,
             }
         }
 
-        for (sv_frame_t i = 0; i < fadeIn/2; ++i) {
-            float *back = buffer[c];
-            back -= fadeIn/2;
-            back[i] +=
-                (channelGain * m_channelBuffer[sourceChannel][i] * float(i))
-                / float(fadeIn);
+        float *target = buffer[c];
+        const float *source = (direct ?
+                               data[sourceChannel].data() :
+                               channelBuffer[sourceChannel]);
+
+        if (fadeIn/2 > 0) {
+            MixKernels::addWithRamp(target - fadeIn/2, source,
+                                    0.f, channelGain / float(fadeIn),
+                                    std::min(sv_frame_t(fadeIn/2), got));
         }
 
-        for (sv_frame_t i = 0; i < frames + fadeOut/2; ++i) {
-            float mult = channelGain;
-            if (i < fadeIn/2) {
-                mult = (mult * float(i)) / float(fadeIn);
+        // The block itself is a ramp up over the first fadeIn/2
+        // frames, then constant, then a ramp down from just after
+        // frames - fadeOut/2. Anything at or past got is silent
+
+        sv_frame_t total = frames + fadeOut/2;
+        sv_frame_t available = std::min(total, got);
+        sv_frame_t rampOutStart = frames - fadeOut/2 + 1;
+
+        if (fadeIn/2 > rampOutStart) {
+            // The fades overlap, which can only happen for a very
+            // short block, so don't bother to be clever
+            for (sv_frame_t i = 0; i < available; ++i) {
+                float mult = channelGain;
+                if (i < fadeIn/2) {
+                    mult = (mult * float(i)) / float(fadeIn);
+                }
+                if (i > frames - fadeOut/2) {
+                    mult = (mult * float(total - i)) / float(fadeOut);
+                }
+                target[i] += mult * source[i];
             }
-            if (i > frames - fadeOut/2) {
-                mult = (mult * float((frames + fadeOut/2) - i)) / float(fadeOut);
-            }
-            float val = m_channelBuffer[sourceChannel][i];
-            if (i >= got) val = 0.f;
-            buffer[c][i] += mult * val;
+            continue;
+        }
+
+        sv_frame_t rampInEnd = std::min(sv_frame_t(fadeIn/2), available);
+        sv_frame_t steadyEnd = std::min(rampOutStart, available);
+
+        if (rampInEnd > 0) {
+            MixKernels::addWithRamp(target, source,
+                                    0.f, channelGain / float(fadeIn),
+                                    rampInEnd);
+        }
+
+        MixKernels::addWithGain(target + rampInEnd, source + rampInEnd,
+                                channelGain, steadyEnd - rampInEnd);
+
+        if (available > steadyEnd) {
+            MixKernels::addWithRamp(target + steadyEnd, source + steadyEnd,
+                                    (channelGain * float(total - steadyEnd))
+                                    / float(fadeOut),
+                                    -channelGain / float(fadeOut),
+                                    available - steadyEnd);
         }
     }
 
@@ -519,11 +790,24 @@ AudioGenerator::mixDenseTimeValueModel(ModelId modelId,
 sv_frame_t
 AudioGenerator::mixClipModel(ModelId modelId,
                              sv_frame_t startFrame, sv_frame_t frames,
-                             float **buffer, float gain, float pan)
+                             float **buffer, float gain, float pan,
+                             MixArena::Slot *scratch)
 {
-    ClipMixer *clipMixer = m_clipMixerMap[modelId];
+    auto mixerItr = m_clipMixerMap.find(modelId);
+    if (mixerItr == m_clipMixerMap.end()) return 0;
+    ClipMixer *clipMixer = mixerItr->second;
     if (!clipMixer) return 0;
 
+    auto noteOffItr = m_noteOffs.find(modelId);
+    if (noteOffItr == m_noteOffs.end()) return 0;
+
+    auto noteScratchItr = m_noteScratch.find(modelId);
+    if (noteScratchItr == m_noteScratch.end()) return 0;
+
+    auto cursorItr = m_noteCursors.find(modelId);
+    if (cursorItr == m_noteCursors.end()) return 0;
+    EventCursor<NoteData> &cursor = cursorItr->second;
+
     auto exportable = ModelById::getAs<NoteExportable>(modelId);
     
     int blocks = int(frames / m_processingBlockSize);
@@ -551,9 +835,19 @@ AudioGenerator::mixClipModel(ModelId modelId,
     ClipMixer::NoteStart on;
     ClipMixer::NoteEnd off;
 
-    NoteOffSet &noteOffs = m_noteOffs[modelId];
+    NoteOffHeap &noteOffs = noteOffItr->second;
 
-    float **bufferIndexes = new float *[m_targetChannelCount];
+    std::vector<ClipMixer::NoteStart> &starts = noteScratchItr->second.starts;
+    std::vector<ClipMixer::NoteEnd> &ends = noteScratchItr->second.ends;
+
+    std::vector<float *> ownIndexes;
+    float **bufferIndexes = nullptr;
+    if (scratch && scratch->channels >= m_targetChannelCount) {
+        bufferIndexes = scratch->targetPtrs;
+    } else {
+        ownIndexes.resize(m_targetChannelCount);
+        bufferIndexes = ownIndexes.data();
+    }
 
     //!!! + for first block, prime with notes already active
     
@@ -561,38 +855,47 @@ AudioGenerator::mixClipModel(ModelId modelId,
 
         sv_frame_t reqStart = startFrame + i * m_processingBlockSize;
 
-        NoteList notes;
+        size_t from = 0, to = 0;
         if (exportable) {
-            notes = exportable->getNotesStartingWithin(reqStart,
-                                                       m_processingBlockSize);
+            cursor.advance(reqStart, m_processingBlockSize,
+                           m_processingBlockSize * EVENT_CURSOR_WINDOW_BLOCKS,
+                           [&](sv_frame_t start, sv_frame_t duration) {
+                               return exportable->getNotesStartingWithin
+                                   (start, duration);
+                           },
+                           [](const NoteData &note) {
+                               return note.start;
+                           },
+                           from, to);
         }
 
-        std::vector<ClipMixer::NoteStart> starts;
-        std::vector<ClipMixer::NoteEnd> ends;
+        starts.clear();
+        ends.clear();
 
-        while (noteOffs.begin() != noteOffs.end() &&
-               noteOffs.begin()->onFrame > reqStart) {
+        while (!noteOffs.empty() &&
+               noteOffs.top().onFrame > reqStart) {
 
             // We must have jumped back in time, as there is a
             // note-off pending for a note that hasn't begun yet. Emit
             // the note-off now and discard
 
             off.frameOffset = 0;
-            off.frequency = noteOffs.begin()->frequency;
+            off.frequency = noteOffs.top().frequency;
 
 #ifdef DEBUG_AUDIO_GENERATOR
             SVCERR << "mixModel [clip]: adding rewind-caused note-off at frame offset 0 frequency " << off.frequency << endl;
 #endif
 
             ends.push_back(off);
-            noteOffs.erase(noteOffs.begin());
+            noteOffs.pop();
         }
         
-        for (NoteList::const_iterator ni = notes.begin();
-             ni != notes.end(); ++ni) {
+        for (size_t ni = from; ni < to; ++ni) {
 
-            sv_frame_t noteFrame = ni->start;
-            sv_frame_t noteDuration = ni->duration;
+            const NoteData &note = cursor.events[ni];
+            
+            sv_frame_t noteFrame = note.start;
+            sv_frame_t noteDuration = note.duration;
 
             if (noteFrame < reqStart ||
                 noteFrame >= reqStart + m_processingBlockSize) {
@@ -614,26 +917,26 @@ AudioGenerator::mixClipModel(ModelId modelId,
                 continue;
             }
 
-            while (noteOffs.begin() != noteOffs.end() &&
-                   noteOffs.begin()->offFrame <= noteFrame) {
+            while (!noteOffs.empty() &&
+                   noteOffs.top().offFrame <= noteFrame) {
 
-                sv_frame_t eventFrame = noteOffs.begin()->offFrame;
+                sv_frame_t eventFrame = noteOffs.top().offFrame;
                 if (eventFrame < reqStart) eventFrame = reqStart;
 
                 off.frameOffset = eventFrame - reqStart;
-                off.frequency = noteOffs.begin()->frequency;
+                off.frequency = noteOffs.top().frequency;
 
 #ifdef DEBUG_AUDIO_GENERATOR
                 SVCERR << "mixModel [clip]: adding note-off at frame " << eventFrame << " frame offset " << off.frameOffset << " frequency " << off.frequency << endl;
 #endif
 
                 ends.push_back(off);
-                noteOffs.erase(noteOffs.begin());
+                noteOffs.pop();
             }
 
             on.frameOffset = noteFrame - reqStart;
-            on.frequency = ni->getFrequency();
-            on.level = float(ni->velocity) / 127.0f;
+            on.frequency = note.getFrequency();
+            on.level = float(note.velocity) / 127.0f;
             on.pan = pan;
 
 #ifdef DEBUG_AUDIO_GENERATOR
@@ -641,26 +944,26 @@ AudioGenerator::mixClipModel(ModelId modelId,
 #endif
             
             starts.push_back(on);
-            noteOffs.insert
+            noteOffs.push
                 (NoteOff(on.frequency, noteFrame + noteDuration, noteFrame));
         }
 
-        while (noteOffs.begin() != noteOffs.end() &&
-               noteOffs.begin()->offFrame <=
+        while (!noteOffs.empty() &&
+               noteOffs.top().offFrame <=
                reqStart + m_processingBlockSize) {
 
-            sv_frame_t eventFrame = noteOffs.begin()->offFrame;
+            sv_frame_t eventFrame = noteOffs.top().offFrame;
             if (eventFrame < reqStart) eventFrame = reqStart;
 
             off.frameOffset = eventFrame - reqStart;
-            off.frequency = noteOffs.begin()->frequency;
+            off.frequency = noteOffs.top().frequency;
 
 #ifdef DEBUG_AUDIO_GENERATOR
             SVCERR << "mixModel [clip]: adding leftover note-off at frame " << eventFrame << " frame offset " << off.frameOffset << " frequency " << off.frequency << endl;
 #endif
 
             ends.push_back(off);
-            noteOffs.erase(noteOffs.begin());
+            noteOffs.pop();
         }
 
         for (int c = 0; c < m_targetChannelCount; ++c) {
@@ -670,20 +973,78 @@ AudioGenerator::mixClipModel(ModelId modelId,
         clipMixer->mix(bufferIndexes, gain, starts, ends);
     }
 
-    delete[] bufferIndexes;
-
     return got;
 }
 
+void
+AudioGenerator::NoteOffHeap::setCapacity(int capacity)
+{
+    m_capacity = std::max(size_t(1), size_t(capacity));
+    while (m_offs.size() > m_capacity) {
+        dropEarliestStarted();
+    }
+    m_offs.reserve(m_capacity);
+}
+
+bool
+AudioGenerator::NoteOffHeap::later(const NoteOff &n1, const NoteOff &n2)
+{
+    // std::push_heap and std::pop_heap keep the greatest element at
+    // the front, so order by the reverse of NoteOff::Comparator to
+    // keep the earliest note-off there
+    return NoteOff::Comparator()(n2, n1);
+}
+
+void
+AudioGenerator::NoteOffHeap::push(const NoteOff &off)
+{
+    if (m_offs.size() >= m_capacity) {
+        dropEarliestStarted();
+    }
+    m_offs.push_back(off);
+    std::push_heap(m_offs.begin(), m_offs.end(), later);
+}
+
+void
+AudioGenerator::NoteOffHeap::pop()
+{
+    std::pop_heap(m_offs.begin(), m_offs.end(), later);
+    m_offs.pop_back();
+}
+
+void
+AudioGenerator::NoteOffHeap::dropEarliestStarted()
+{
+    if (m_offs.empty()) return;
+    
+    auto earliest = std::min_element
+        (m_offs.begin(), m_offs.end(),
+         [](const NoteOff &n1, const NoteOff &n2) {
+             return n1.onFrame < n2.onFrame;
+         });
+
+#ifdef DEBUG_AUDIO_GENERATOR
+    SVCERR << "AudioGenerator::NoteOffHeap: full, dropping note-off for note "
+           << "starting at " << earliest->onFrame << endl;
+#endif
+    
+    *earliest = m_offs.back();
+    m_offs.pop_back();
+    std::make_heap(m_offs.begin(), m_offs.end(), later);
+}
+
 sv_frame_t
 AudioGenerator::mixContinuousSynthModel(ModelId modelId,
                                         sv_frame_t startFrame,
                                         sv_frame_t frames,
                                         float **buffer,
                                         float gain, 
-                                        float pan)
+                                        float pan,
+                                        MixArena::Slot *scratch)
 {
-    ContinuousSynth *synth = m_continuousSynthMap[modelId];
+    auto synthItr = m_continuousSynthMap.find(modelId);
+    if (synthItr == m_continuousSynthMap.end()) return 0;
+    ContinuousSynth *synth = synthItr->second;
     if (!synth) return 0;
 
     // only type we support here at the moment
@@ -691,6 +1052,10 @@ AudioGenerator::mixContinuousSynthModel(ModelId modelId,
     if (!stvm) return 0;
     if (stvm->getScaleUnits() != "Hz") return 0;
 
+    auto cursorItr = m_synthCursors.find(modelId);
+    if (cursorItr == m_synthCursors.end()) return 0;
+    EventCursor<Event> &cursor = cursorItr->second;
+
     int blocks = int(frames / m_processingBlockSize);
 
     //!!! todo: see comment in mixClipModel
@@ -702,7 +1067,14 @@ AudioGenerator::mixContinuousSynthModel(ModelId modelId,
               << ", blocks " << blocks << endl;
 #endif
     
-    float **bufferIndexes = new float *[m_targetChannelCount];
+    std::vector<float *> ownIndexes;
+    float **bufferIndexes = nullptr;
+    if (scratch && scratch->channels >= m_targetChannelCount) {
+        bufferIndexes = scratch->targetPtrs;
+    } else {
+        ownIndexes.resize(m_targetChannelCount);
+        bufferIndexes = ownIndexes.data();
+    }
 
     for (int i = 0; i < blocks; ++i) {
 
@@ -712,15 +1084,24 @@ AudioGenerator::mixContinuousSynthModel(ModelId modelId,
             bufferIndexes[c] = buffer[c] + i * m_processingBlockSize;
         }
 
-        EventVector points = 
-            stvm->getEventsStartingWithin(reqStart, m_processingBlockSize);
+        size_t from = 0, to = 0;
+        cursor.advance(reqStart, m_processingBlockSize,
+                       m_processingBlockSize * EVENT_CURSOR_WINDOW_BLOCKS,
+                       [&](sv_frame_t start, sv_frame_t duration) {
+                           return stvm->getEventsStartingWithin
+                               (start, duration);
+                       },
+                       [](const Event &e) {
+                           return e.getFrame();
+                       },
+                       from, to);
 
         // by default, repeat last frequency
         float f0 = 0.f;
 
         // go straight to the last freq in this range
-        if (!points.empty()) {
-            f0 = points.rbegin()->getValue();
+        if (to > from) {
+            f0 = cursor.events[to - 1].getValue();
         }
 
         // if there is no such frequency and the next point is further
@@ -728,11 +1109,22 @@ AudioGenerator::mixContinuousSynthModel(ModelId modelId,
         // criterion TimeValueLayer uses for ending a discrete curve
         // segment)
         if (f0 == 0.f) {
+            // The next point is the first after this block in the
+            // cursor's window, if there is one; only if the window
+            // runs out do we have to search the model
             Event nextP;
-            if (!stvm->getNearestEventMatching(reqStart + m_processingBlockSize,
-                                               [](Event) { return true; },
-                                               EventSeries::Forward,
-                                               nextP) ||
+            bool haveNext = false;
+            if (to < cursor.events.size()) {
+                nextP = cursor.events[to];
+                haveNext = true;
+            } else {
+                haveNext = stvm->getNearestEventMatching
+                    (reqStart + m_processingBlockSize,
+                     [](Event) { return true; },
+                     EventSeries::Forward,
+                     nextP);
+            }
+            if (!haveNext ||
                 nextP.getFrame() > reqStart + 2 * stvm->getResolution()) {
                 f0 = -1.f;
             }
@@ -746,8 +1138,6 @@ AudioGenerator::mixContinuousSynthModel(ModelId modelId,
                    f0);
     }
 
-    delete[] bufferIndexes;
-
     return got;
 }
 
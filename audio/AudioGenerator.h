@@ -18,14 +18,21 @@
 
 #include <QObject>
 #include <QMutex>
+#include <QReadWriteLock>
 
 #include <set>
 #include <map>
 #include <vector>
+#include <atomic>
 
 #include "base/BaseTypes.h"
+#include "base/NoteData.h"
+#include "base/Event.h"
 #include "data/model/Model.h"
 
+#include "ClipMixer.h"
+#include "MixArena.h"
+
 namespace sv {
 
 class NoteModel;
@@ -33,7 +40,6 @@ class FlexiNoteModel;
 class DenseTimeValueModel;
 class SparseOneDimensionalModel;
 class Playable;
-class ClipMixer;
 class ContinuousSynth;
 
 class AudioGenerator : public QObject
@@ -67,6 +73,15 @@ public:
      */
     virtual void reset();
 
+    /**
+     * Note that the events in a model may have changed within the
+     * given range, so that anything already read ahead from it for
+     * playback must be read again. This is cheap and does not block.
+     */
+    virtual void modelChangedWithin(ModelId model,
+                                    sv_frame_t startFrame,
+                                    sv_frame_t endFrame);
+
     /**
      * Set the target channel count.  The buffer parameter to mixModel
      * must always point to at least this number of arrays.
@@ -80,15 +95,56 @@ public:
      */
     virtual sv_frame_t getBlockSize() const;
 
+    /**
+     * Set the internal processing block size. This is the
+     * granularity at which synthesised notes and synth frequencies
+     * are scheduled, so a smaller size makes parameter changes and
+     * seeks take effect sooner, at some cost in overhead. The
+     * default is 1024; anything below getMinimumBlockSize() is
+     * raised to it. Notes and synths already sounding carry on
+     * across the change. This must not be called concurrently with
+     * mixModel from another thread unless the caller can be sure
+     * that mixModel is called only with frame counts that are a
+     * multiple of the new size from then on.
+     */
+    virtual void setBlockSize(sv_frame_t blockSize);
+
+    /**
+     * Return the smallest supported processing block size.
+     */
+    static sv_frame_t getMinimumBlockSize();
+
     /**
      * Mix a single model into an output buffer.
+     *
+     * This may be called concurrently from more than one thread, so
+     * long as no two concurrent calls are for the same model. The
+     * model set should not be changed during such calls.
+     *
+     * If a scratch slot is supplied, and it is large enough for the
+     * model and frame count, mixing uses it rather than allocating
+     * memory of its own. Concurrent calls must use different slots.
      */
     virtual sv_frame_t mixModel(ModelId model,
                                 sv_frame_t startFrame,
                                 sv_frame_t frameCount,
                                 float **buffer,
                                 sv_frame_t fadeIn = 0,
-                                sv_frame_t fadeOut = 0);
+                                sv_frame_t fadeOut = 0,
+                                MixArena::Slot *scratch = nullptr);
+
+    /**
+     * Set the number of notes that each model played with a sample
+     * clip can sound at once. When a note starts and this many are
+     * already sounding, the one that started first is released to
+     * make room. The default is ClipMixer::getDefaultPolyphony().
+     */
+    virtual void setClipPolyphony(int voices);
+
+    /**
+     * Return the number of notes each clip model can sound at once.
+     */
+    virtual int getClipPolyphony() const;
 
     /**
      * Specify that only the given set of models should be played.
@@ -144,15 +200,74 @@ protected:
 
     typedef std::map<ModelId, ClipMixer *> ClipMixerMap;
 
-    typedef std::multiset<NoteOff, NoteOff::Comparator> NoteOffSet;
-    typedef std::map<ModelId, NoteOffSet> NoteOffMap;
+    // The pending note-offs for a model, earliest first: a min-heap
+    // in storage allocated up front, with room for one note-off per
+    // voice of the model's clip mixer, so that mixClipModel never
+    // allocates. A note that finds it full displaces the note that
+    // started earliest, whose voice the mixer is about to steal
+    class NoteOffHeap {
+    public:
+        void setCapacity(int capacity); // not in RT context
+        bool empty() const { return m_offs.empty(); }
+        const NoteOff &top() const { return m_offs.front(); }
+        void push(const NoteOff &);
+        void pop();
+        void clear() { m_offs.clear(); }
+
+    private:
+        std::vector<NoteOff> m_offs;
+        size_t m_capacity = 0;
+        void dropEarliestStarted();
+        static bool later(const NoteOff &, const NoteOff &);
+    };
+
+    typedef std::map<ModelId, NoteOffHeap> NoteOffMap;
+
+    // Note starts and ends gathered for each block by mixClipModel,
+    // kept per model so that their capacity is reused
+    struct NoteScratch {
+        std::vector<ClipMixer::NoteStart> starts;
+        std::vector<ClipMixer::NoteEnd> ends;
+    };
+    typedef std::map<ModelId, NoteScratch> NoteScratchMap;
+
+    // A model's playback position in its event sequence, kept from
+    // one block to the next so that each block only steps through
+    // the events that start within it, rather than making a fresh
+    // range query. Events are read a window of several blocks at a
+    // time. The window is read afresh from the block being mixed
+    // whenever that block does not follow on from the previous one
+    // (a seek or a loop), after a reset, or after the model changes
+    template <typename T>
+    struct EventCursor {
+        std::vector<T> events;       // those starting in the window
+        size_t index = 0;            // first event not yet reached
+        sv_frame_t windowEnd = 0;
+        sv_frame_t nextFrame = -1;   // start of the expected next block
+        std::atomic<int> changes{0}; // bumped by modelChangedWithin
+        int changesSeen = 0;
+
+        // Find the events starting within the block, as the range
+        // [from, to) of events, reading a new window if necessary
+        template <typename Fetch, typename FrameOf>
+        void advance(sv_frame_t blockStart, sv_frame_t blockSize,
+                     sv_frame_t windowSize, Fetch fetch, FrameOf frameOf,
+                     size_t &from, size_t &to);
+    };
+    typedef std::map<ModelId, EventCursor<NoteData>> NoteCursorMap;
+    typedef std::map<ModelId, EventCursor<Event>> SynthCursorMap;
 
     typedef std::map<ModelId, ContinuousSynth *> ContinuousSynthMap;
 
-    QMutex m_mutex;
+    // Held for reading while mixing, and for writing when changing
+    // any of the maps below or the parameters shared between models
+    QReadWriteLock m_mutex;
 
     ClipMixerMap m_clipMixerMap;
     NoteOffMap m_noteOffs;
+    NoteScratchMap m_noteScratch;
+    NoteCursorMap m_noteCursors;
+    SynthCursorMap m_synthCursors;
     static QString m_sampleDir;
 
     ContinuousSynthMap m_continuousSynthMap;
@@ -168,21 +283,37 @@ protected:
 
     virtual sv_frame_t mixDenseTimeValueModel
     (ModelId model, sv_frame_t startFrame, sv_frame_t frameCount,
-     float **buffer, float gain, float pan, sv_frame_t fadeIn, sv_frame_t fadeOut);
+     float **buffer, float gain, float pan, sv_frame_t fadeIn, sv_frame_t fadeOut,
+     MixArena::Slot *scratch);
 
     virtual sv_frame_t mixClipModel
     (ModelId model, sv_frame_t startFrame, sv_frame_t frameCount,
-     float **buffer, float gain, float pan);
+     float **buffer, float gain, float pan, MixArena::Slot *scratch);
 
     virtual sv_frame_t mixContinuousSynthModel
     (ModelId model, sv_frame_t startFrame, sv_frame_t frameCount,
-     float **buffer, float gain, float pan);
+     float **buffer, float gain, float pan, MixArena::Slot *scratch);
+    
+    sv_frame_t m_processingBlockSize;
+    int m_clipPolyphony;
+
+    // Scratch space used by mixDenseTimeValueModel when the caller
+    // supplies no slot, or one that is too small. There is one of
+    // these per model so that different models can be mixed at once
+    struct ChannelBuffer {
+        ChannelBuffer() : data(nullptr), size(0), count(0) { }
+        float **data;
+        sv_frame_t size;
+        int count;
+    };
+    typedef std::map<ModelId, ChannelBuffer> ChannelBufferMap;
     
-    static const sv_frame_t m_processingBlockSize;
+    ChannelBufferMap m_channelBuffers;
+    QMutex m_channelBufferMutex; // for the map only, not its contents
 
-    float **m_channelBuffer;
-    sv_frame_t m_channelBufSiz;
-    int m_channelBufCount;
+    ChannelBuffer &getChannelBuffer(ModelId,
+                                    int channels, sv_frame_t frames);
+    static void deleteChannelBuffer(ChannelBuffer &);
 };
 
 } // end namespace sv
@@ -20,15 +20,40 @@
 
 #include <cmath>
 #include <vector>
+#include <algorithm>
+#include <thread>
 
 #include "base/Debug.h"
 
+#include "MixKernels.h"
+
 //#define DEBUG_CLIP_MIXER 1
 
 using std::vector;
 
 namespace sv {
 
+// Default number of notes that can sound at once
+static const int DEFAULT_POLYPHONY = 128;
+
+// Most pitches to keep resampled clips for
+static const size_t MAX_CACHED_RENDERINGS = 64;
+
+// Resolution of the pitches clips are resampled for. Continuously
+// varying frequencies would otherwise rarely hit the cache
+static const double RENDERING_KEY_CENTS = 5.0;
+
+// Most pitches that can be waiting to be resampled
+static const int MAX_RENDER_REQUESTS = 256;
+
+// Zero crossings either side of centre in the interpolation kernel,
+// and kernel table entries per zero crossing
+static const int SINC_ZERO_CROSSINGS = 16;
+static const int SINC_TABLE_RESOLUTION = 64;
+
+// Time over which a note is faded when it ends or is stolen
+static const double RELEASE_TIME = 0.01;
+
 ClipMixer::ClipMixer(int channels, sv_samplerate_t sampleRate, sv_frame_t blockSize) :
     m_channels(channels),
     m_sampleRate(sampleRate),
@@ -36,12 +61,29 @@ ClipMixer::ClipMixer(int channels, sv_samplerate_t sampleRate, sv_frame_t blockS
     m_clipData(nullptr),
     m_clipLength(0),
     m_clipF0(0),
-    m_clipRate(0)
+    m_clipRate(0),
+    m_voiceSerial(0),
+    m_slots(MAX_CACHED_RENDERINGS),
+    m_renderingUse(0),
+    m_renderRequests(MAX_RENDER_REQUESTS),
+    m_renderExiting(false),
+    m_renderThread(nullptr)
 {
+    m_voices.resize(DEFAULT_POLYPHONY);
+    m_levels.resize(m_channels, 0.f);
+    m_noteBuffer.resize(m_blockSize, 0.f);
+    m_targets.resize(m_channels, nullptr);
 }
 
 ClipMixer::~ClipMixer()
 {
+    if (m_renderThread) {
+        m_renderExiting = true;
+        m_renderSemaphore.release();
+        m_renderThread->wait();
+        delete m_renderThread;
+    }
+    
     delete[] m_clipData;
 }
 
@@ -49,6 +91,32 @@ void
 ClipMixer::setChannelCount(int channels)
 {
     m_channels = channels;
+    m_levels.resize(m_channels, 0.f);
+    m_targets.resize(m_channels, nullptr);
+}
+
+int
+ClipMixer::getDefaultPolyphony()
+{
+    return DEFAULT_POLYPHONY;
+}
+
+void
+ClipMixer::setPolyphony(int voices)
+{
+    if (voices < 1) voices = 1;
+    m_voices.resize(voices);
+}
+
+void
+ClipMixer::setBlockSize(sv_frame_t blockSize)
+{
+    // The frame offsets of playing notes are relative to the start
+    // of the next block, whatever its size, so need no adjustment
+    m_blockSize = blockSize;
+    if (sv_frame_t(m_noteBuffer.size()) < m_blockSize) {
+        m_noteBuffer.resize(m_blockSize, 0.f);
+    }
 }
 
 bool
@@ -103,18 +171,24 @@ ClipMixer::loadClipData(QString path, double f0, double level)
     m_clipLength = frames;
     m_clipF0 = f0;
     m_clipRate = rate;
-        
+
+    m_renderThread = new RenderThread(*this);
+    m_renderThread->start();
+    
     return true;
 }
 
 void
 ClipMixer::reset()
 {
-    m_playing.clear();
+    for (Voice &voice : m_voices) {
+        voice.active = false;
+        voice.rendering.reset();
+    }
 }
 
 double
-ClipMixer::getResampleRatioFor(double frequency)
+ClipMixer::getResampleRatioFor(double frequency) const
 {
     if (!m_clipData || !m_clipRate) return 1.0;
     double pitchRatio = m_clipF0 / frequency;
@@ -123,52 +197,250 @@ ClipMixer::getResampleRatioFor(double frequency)
 }
 
 sv_frame_t
-ClipMixer::getResampledClipDuration(double frequency)
+ClipMixer::getResampledClipDuration(double frequency) const
 {
     return sv_frame_t(ceil(double(m_clipLength) * getResampleRatioFor(frequency)));
 }
 
+int
+ClipMixer::getRenderingKey(double frequency) const
+{
+    return int(lrint(1200.0 * log2(frequency / m_clipF0) /
+                     RENDERING_KEY_CENTS));
+}
+
+double
+ClipMixer::getRenderingFrequency(int key) const
+{
+    return m_clipF0 * pow(2.0, double(key) * RENDERING_KEY_CENTS / 1200.0);
+}
+
+std::shared_ptr<const ClipMixer::Rendering>
+ClipMixer::getRendering(double frequency)
+{
+    // Called from the mixing thread. Return the cached rendering for
+    // this pitch if there is one; otherwise ask the render thread for
+    // it and return null, so that the note is interpolated instead
+    
+    int key = getRenderingKey(frequency);
+
+    ++m_renderingUse;
+
+    for (Slot &slot : m_slots) {
+        std::shared_ptr<const Rendering> rendering;
+        ++slot.readers;
+        if (slot.state == SlotReady && slot.key == key) {
+            rendering = slot.rendering;
+        }
+        --slot.readers;
+        if (rendering) {
+            slot.lastUsed = m_renderingUse;
+            return rendering;
+        }
+    }
+
+    // The render thread ignores requests for pitches it has already
+    // rendered, so repeats are harmless; if the queue is full, the
+    // next note at this pitch will ask again
+    if (m_renderRequests.getWriteSpace() > 0) {
+        m_renderRequests.write(&key, 1);
+        m_renderSemaphore.release();
+    }
+    
+    return {};
+}
+
+void
+ClipMixer::RenderThread::run()
+{
+    while (true) {
+        m_mixer.m_renderSemaphore.acquire();
+        if (m_mixer.m_renderExiting) break;
+        m_mixer.renderRequested();
+    }
+}
+
+void
+ClipMixer::renderRequested()
+{
+    while (m_renderRequests.getReadSpace() > 0 && !m_renderExiting) {
+
+        int key = 0;
+        m_renderRequests.read(&key, 1);
+
+        bool have = false;
+        for (const Slot &slot : m_slots) {
+            if (slot.state == SlotReady && slot.key == key) {
+                have = true;
+                break;
+            }
+        }
+        if (have) continue;
+
+        Slot *slot = findSlotToFill();
+        if (!slot) {
+            // Every slot is in use by a playing voice: leave this
+            // pitch to be interpolated
+            continue;
+        }
+
+#ifdef DEBUG_CLIP_MIXER
+        SVCERR << "ClipMixer::renderRequested: rendering clip for frequency "
+               << getRenderingFrequency(key) << endl;
+#endif
+
+        slot->rendering = render(getRenderingFrequency(key));
+        slot->key = key;
+        slot->state = SlotReady;
+    }
+}
+
+ClipMixer::Slot *
+ClipMixer::findSlotToFill()
+{
+    // Return an empty slot, or else the least recently used one that
+    // no voice is playing from, in the Busy state and released, or
+    // null if there is none. A rendering is never released while a
+    // voice holds it, so that the mixing thread never frees one
+    
+    for (Slot &slot : m_slots) {
+        int expected = SlotEmpty;
+        if (slot.state.compare_exchange_strong(expected, SlotBusy)) {
+            return &slot;
+        }
+    }
+
+    // Order by a snapshot of the use times, as the mixing thread
+    // may be updating them
+    std::vector<std::pair<uint64_t, Slot *>> candidates;
+    for (Slot &slot : m_slots) {
+        candidates.push_back({ slot.lastUsed.load(), &slot });
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const std::pair<uint64_t, Slot *> &a,
+                 const std::pair<uint64_t, Slot *> &b) {
+                  return a.first < b.first;
+              });
+
+    for (const auto &candidate : candidates) {
+
+        Slot *slot = candidate.second;
+
+        int expected = SlotReady;
+        if (!slot->state.compare_exchange_strong(expected, SlotBusy)) {
+            continue;
+        }
+
+        // Any lookup that saw the slot Ready may still be copying
+        // the rendering; no new one can start
+        while (slot->readers > 0) {
+            std::this_thread::yield();
+        }
+
+        if (slot->rendering.use_count() > 1) {
+            slot->state = SlotReady;
+            continue;
+        }
+
+        slot->rendering.reset();
+        return slot;
+    }
+
+    return nullptr;
+}
+
+// Hann-windowed sinc, tabulated from 0 to SINC_ZERO_CROSSINGS
+static const vector<double> &
+getSincTable()
+{
+    static const vector<double> table = []() {
+        int n = SINC_ZERO_CROSSINGS * SINC_TABLE_RESOLUTION;
+        vector<double> t(n + 2, 0.0);
+        for (int i = 0; i <= n; ++i) {
+            double x = double(i) / SINC_TABLE_RESOLUTION;
+            double sinc = (i == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x));
+            double window = 0.5 * (1.0 + cos(M_PI * x / SINC_ZERO_CROSSINGS));
+            t[i] = sinc * window;
+        }
+        return t;
+    }();
+    return table;
+}
+
+std::shared_ptr<const ClipMixer::Rendering>
+ClipMixer::render(double frequency) const
+{
+    // Windowed-sinc interpolation of the clip at each output
+    // position. Where the clip is read faster than it was recorded,
+    // the kernel's cutoff is lowered in proportion, and its span
+    // widened to match, so that the result is band-limited
+    
+    double ratio = getResampleRatioFor(frequency);
+    sv_frame_t duration = getResampledClipDuration(frequency);
+
+    auto rendering = std::make_shared<Rendering>(duration, 0.f);
+
+    const vector<double> &table = getSincTable();
+    
+    double cutoff = std::min(1.0, ratio);
+    double halfWidth = double(SINC_ZERO_CROSSINGS) / cutoff;
+    sv_frame_t span = sv_frame_t(ceil(halfWidth));
+
+    for (sv_frame_t s = 0; s < duration; ++s) {
+
+        double os = double(s) / ratio;
+        sv_frame_t centre = sv_frame_t(floor(os));
+
+        sv_frame_t from = std::max(centre - span + 1, sv_frame_t(0));
+        sv_frame_t to = std::min(centre + span, m_clipLength - 1);
+        
+        double sum = 0.0;
+        
+        for (sv_frame_t j = from; j <= to; ++j) {
+            double u = fabs(os - double(j)) * cutoff * SINC_TABLE_RESOLUTION;
+            int ui = int(u);
+            if (ui >= SINC_ZERO_CROSSINGS * SINC_TABLE_RESOLUTION) continue;
+            double frac = u - ui;
+            double k = table[ui] + (table[ui + 1] - table[ui]) * frac;
+            sum += m_clipData[j] * k;
+        }
+
+        (*rendering)[s] = float(sum * cutoff);
+    }
+
+    return rendering;
+}
+
 void
 ClipMixer::mix(float **toBuffers, 
                float gain,
-               vector<NoteStart> newNotes, 
-               vector<NoteEnd> endingNotes)
+               const vector<NoteStart> &newNotes, 
+               const vector<NoteEnd> &endingNotes)
 {
-    for (NoteStart note : newNotes) {
+    for (const NoteStart &note : newNotes) {
         if (note.frequency > 20 && 
             note.frequency < 5000) {
-            m_playing.push_back(note);
+            startVoice(toBuffers, gain, note);
         }
     }
 
-    vector<NoteStart> remaining;
-
-    float *levels = new float[m_channels];
-
 #ifdef DEBUG_CLIP_MIXER
-    SVCERR << "ClipMixer::mix: have " << m_playing.size() << " playing note(s)"
+    SVCERR << "ClipMixer::mix: have " << m_voices.size() << " voice(s)"
          << " and " << endingNotes.size() << " note(s) ending here"
          << endl;
 #endif
 
-    for (NoteStart note : m_playing) {
+    for (Voice &voice : m_voices) {
 
-        for (int c = 0; c < m_channels; ++c) {
-            levels[c] = note.level * gain;
-        }
-        if (note.pan != 0.0 && m_channels == 2) {
-            levels[0] *= 1.0f - note.pan;
-            levels[1] *= note.pan + 1.0f;
-        }
-
-        sv_frame_t start = note.frameOffset;
-        sv_frame_t durationHere = m_blockSize;
-        if (start > 0) durationHere = m_blockSize - start;
+        if (!voice.active) continue;
 
+        sv_frame_t start = voice.note.frameOffset;
+        
         bool ending = false;
+        sv_frame_t endOffset = 0;
 
-        for (NoteEnd end : endingNotes) {
-            if (end.frequency == note.frequency &&
+        for (const NoteEnd &end : endingNotes) {
+            if (end.frequency == voice.note.frequency &&
                 // This is > rather than >= because if we have a
                 // note-off and a note-on at the same time, the
                 // note-off must be switching off an earlier note-on,
@@ -177,88 +449,211 @@ ClipMixer::mix(float **toBuffers,
                 end.frameOffset > start &&
                 end.frameOffset <= m_blockSize) {
                 ending = true;
-                durationHere = end.frameOffset;
-                if (start > 0) durationHere = end.frameOffset - start;
+                endOffset = end.frameOffset;
                 break;
             }
         }
 
-        sv_frame_t clipDuration = getResampledClipDuration(note.frequency);
-        if (start + clipDuration > 0) {
-            if (start < 0 && start + clipDuration < durationHere) {
-                durationHere = start + clipDuration;
-            }
-            if (durationHere > 0) {
-                mixNote(toBuffers,
-                        levels,
-                        note.frequency,
-                        start < 0 ? -start : 0,
-                        start > 0 ?  start : 0,
-                        durationHere,
-                        ending);
-            }
+        if (!mixVoice(toBuffers, gain, voice, ending, endOffset)) {
+            voice.active = false;
+            voice.rendering.reset();
         }
+    }
+}
+
+void
+ClipMixer::startVoice(float **toBuffers, float gain, const NoteStart &note)
+{
+    if (!m_clipData || m_voices.empty()) return;
 
-        if (!ending) {
-            NoteStart adjusted = note;
-            adjusted.frameOffset -= m_blockSize;
-            remaining.push_back(adjusted);
+    Voice *target = nullptr;
+    for (Voice &voice : m_voices) {
+        if (!voice.active) {
+            target = &voice;
+            break;
         }
     }
 
-    delete[] levels;
+    if (!target) {
+        
+        // All voices are in use: steal the one that started first
+        
+        target = &m_voices[0];
+        for (Voice &voice : m_voices) {
+            if (voice.serial < target->serial) target = &voice;
+        }
+
+#ifdef DEBUG_CLIP_MIXER
+        SVCERR << "ClipMixer::startVoice: stealing voice playing frequency "
+               << target->note.frequency << endl;
+#endif
 
-    m_playing = remaining;
+        // Release it over the start of this block rather than just
+        // cut it off, unless it was itself only due to start in this
+        // block, in which case it hasn't yet been heard
+        if (target->note.frameOffset <= 0) {
+            sv_frame_t release =
+                sv_frame_t(round(RELEASE_TIME * m_sampleRate));
+            mixVoice(toBuffers, gain, *target, true,
+                     std::max(sv_frame_t(1), std::min(release, m_blockSize)));
+        }
+    }
+
+    target->active = true;
+    target->note = note;
+    target->rendering = getRendering(note.frequency);
+    if (!target->rendering) {
+        target->ratio = getResampleRatioFor(note.frequency);
+        target->duration = getResampledClipDuration(note.frequency);
+    }
+    target->serial = ++m_voiceSerial;
 }
 
-void
-ClipMixer::mixNote(float **toBuffers,
-                   float *levels,
-                   float frequency,
-                   sv_frame_t sourceOffset,
-                   sv_frame_t targetOffset,
-                   sv_frame_t sampleCount,
-                   bool isEnd)
+bool
+ClipMixer::mixVoice(float **toBuffers, float gain, Voice &voice,
+                    bool ending, sv_frame_t endOffset)
 {
-    if (!m_clipData) return;
+    const NoteStart &note = voice.note;
+    
+    float *levels = m_levels.data();
 
-    double ratio = getResampleRatioFor(frequency);
+    for (int c = 0; c < m_channels; ++c) {
+        levels[c] = note.level * gain;
+    }
+    if (note.pan != 0.0 && m_channels == 2) {
+        levels[0] *= 1.0f - note.pan;
+        levels[1] *= note.pan + 1.0f;
+    }
+
+    sv_frame_t start = note.frameOffset;
+    sv_frame_t durationHere = m_blockSize;
+    if (start > 0) durationHere = m_blockSize - start;
+
+    if (ending) {
+        durationHere = endOffset;
+        if (start > 0) durationHere = endOffset - start;
+    }
+
+    sv_frame_t clipDuration = (voice.rendering ?
+                               sv_frame_t(voice.rendering->size()) :
+                               voice.duration);
     
-    double releaseTime = 0.01;
-    sv_frame_t releaseSampleCount = sv_frame_t(round(releaseTime * m_sampleRate));
-    if (releaseSampleCount > sampleCount) {
-        releaseSampleCount = sampleCount;
+    if (start + clipDuration > 0) {
+        if (start < 0 && start + clipDuration < durationHere) {
+            durationHere = start + clipDuration;
+        }
+        if (durationHere > 0) {
+            mixNote(toBuffers,
+                    levels,
+                    voice,
+                    start < 0 ? -start : 0,
+                    start > 0 ?  start : 0,
+                    durationHere,
+                    ending);
+        }
     }
-    double releaseFraction = 1.0/double(releaseSampleCount);
 
-    for (sv_frame_t i = 0; i < sampleCount; ++i) {
+    if (ending) return false;
 
-        sv_frame_t s = sourceOffset + i;
+    voice.note.frameOffset -= m_blockSize;
 
-        double os = double(s) / ratio;
+    // Once the clip has run out, there is nothing more to hear even
+    // if the note has not yet ended
+    return (voice.note.frameOffset + clipDuration > 0);
+}
+
+void
+ClipMixer::interpolate(double ratio, sv_frame_t sourceOffset,
+                       sv_frame_t count)
+{
+    float *out = m_noteBuffer.data();
+    
+    for (sv_frame_t i = 0; i < count; ++i) {
+
+        double os = double(sourceOffset + i) / ratio;
         sv_frame_t osi = sv_frame_t(floor(os));
 
-        //!!! just linear interpolation for now (same as SV's sample
-        //!!! player). a small sinc kernel would be better and
-        //!!! probably "good enough"
         double value = 0.0;
         if (osi < m_clipLength) {
             value += m_clipData[osi];
         }
         if (osi + 1 < m_clipLength) {
-            value += (m_clipData[osi + 1] - m_clipData[osi]) * (os - double(osi));
-        }
-         
-        if (isEnd && i + releaseSampleCount > sampleCount) {
-            value *= releaseFraction * double(sampleCount - i); // linear ramp for release
+            value += (m_clipData[osi + 1] - m_clipData[osi]) *
+                (os - double(osi));
         }
 
-        for (int c = 0; c < m_channels; ++c) {
-            toBuffers[c][targetOffset + i] += float(levels[c] * value);
-        }
+        out[i] = float(value);
     }
 }
 
+void
+ClipMixer::mixNote(float **toBuffers,
+                   float *levels,
+                   const Voice &voice,
+                   sv_frame_t sourceOffset,
+                   sv_frame_t targetOffset,
+                   sv_frame_t sampleCount,
+                   bool isEnd)
+{
+    sv_frame_t length = (voice.rendering ?
+                         sv_frame_t(voice.rendering->size()) :
+                         voice.duration);
+    sv_frame_t available = length - sourceOffset;
+    if (available > sampleCount) available = sampleCount;
+    if (available < 0) available = 0;
+    
+    if (sv_frame_t(m_noteBuffer.size()) < sampleCount) {
+        // Shouldn't happen, as notes are mixed a block at a time
+        m_noteBuffer.resize(sampleCount, 0.f);
+    }
+    float *note = m_noteBuffer.data();
+
+    const float *source = nullptr;
+    if (voice.rendering) {
+        source = voice.rendering->data() + sourceOffset;
+    } else {
+        interpolate(voice.ratio, sourceOffset, available);
+        source = note;
+    }
+    
+    for (int c = 0; c < m_channels; ++c) {
+        m_targets[c] = toBuffers[c] + targetOffset;
+    }
+
+    if (!isEnd) {
+        MixKernels::addWithGains(m_targets.data(), m_channels,
+                                 source, levels, available);
+        return;
+    }
+
+    // A note ending here is ramped down over its last few frames:
+    // copy it to the note buffer to apply the ramp before mixing
+
+    sv_frame_t releaseSampleCount =
+        sv_frame_t(round(RELEASE_TIME * m_sampleRate));
+    if (releaseSampleCount > sampleCount) {
+        releaseSampleCount = sampleCount;
+    }
+    double releaseFraction = 1.0/double(releaseSampleCount);
+
+    if (source != note) {
+        std::copy(source, source + available, note);
+    }
+    std::fill(note + available, note + sampleCount, 0.f);
+
+    // linear ramp for release, over the frames i for which
+    // i + releaseSampleCount > sampleCount
+    sv_frame_t releaseStart = sampleCount - releaseSampleCount + 1;
+    if (releaseStart < 0) releaseStart = 0;
+    MixKernels::multiplyByRamp
+        (note + releaseStart,
+         float(releaseFraction * double(sampleCount - releaseStart)),
+         float(-releaseFraction),
+         sampleCount - releaseStart);
+
+    MixKernels::addWithGains(m_targets.data(), m_channels, note, levels,
+                             sampleCount);
+}
 
 } // end namespace sv
 
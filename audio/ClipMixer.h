@@ -17,17 +17,33 @@
 #define CLIP_MIXER_H
 
 #include <QString>
+#include <QSemaphore>
+
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
 
 #include "base/BaseTypes.h"
+#include "base/RingBuffer.h"
+#include "base/Thread.h"
 
 namespace sv {
 
 /**
  * Mix in synthetic notes produced by resampling a prerecorded
  * clip. (i.e. this is an implementation of a digital sampler in the
- * musician's sense.) This can mix any number of notes of arbitrary
- * frequency, so long as they all use the same sample clip.
+ * musician's sense.) This can mix notes of arbitrary frequency, so
+ * long as they all use the same sample clip.
+ *
+ * The clip is resampled once for each pitch it is played at, with
+ * the frequency rounded to the nearest five cents, and the results
+ * are cached, so that playing a note is just a matter of scaling and
+ * adding. The resampling is done in a background thread: a note
+ * whose pitch has not been resampled yet is played by linear
+ * interpolation from the clip instead. Notes play in a fixed number
+ * of voices: when a note starts and all are in use, the oldest note
+ * is released to make room.
  */
 
 class ClipMixer
@@ -38,6 +54,25 @@ public:
 
     void setChannelCount(int channels);
 
+    /**
+     * Set the number of notes that can sound at once. The default is
+     * 128. If more are already playing, the excess are cut off.
+     */
+    void setPolyphony(int voices);
+
+    /**
+     * Return the number of notes that can sound at once.
+     */
+    int getPolyphony() const { return int(m_voices.size()); }
+
+    static int getDefaultPolyphony();
+
+    /**
+     * Change the block size for subsequent calls to mix(). Notes
+     * already playing carry on without a break.
+     */
+    void setBlockSize(sv_frame_t blockSize);
+
     /**
      * Load a sample clip from a wav file. This can only happen once:
      * construct a new ClipMixer if you want a different clip. The
@@ -61,10 +96,14 @@ public:
         float frequency; // matching note start
     };
 
+    /**
+     * Mix one block. This neither allocates nor takes locks, so may
+     * be called from the fill thread.
+     */
     void mix(float **toBuffers, 
              float gain,
-             std::vector<NoteStart> newNotes, 
-             std::vector<NoteEnd> endingNotes);
+             const std::vector<NoteStart> &newNotes, 
+             const std::vector<NoteEnd> &endingNotes);
 
 private:
     int m_channels;
@@ -78,14 +117,82 @@ private:
     double m_clipF0;
     sv_samplerate_t m_clipRate;
 
-    std::vector<NoteStart> m_playing;
+    typedef std::vector<float> Rendering; // clip resampled for one pitch
+    
+    struct Voice {
+        bool active = false;
+        NoteStart note;
+        std::shared_ptr<const Rendering> rendering; // null if interpolating
+        double ratio = 1.0;       // resample ratio, when interpolating
+        sv_frame_t duration = 0;  // resampled length, when interpolating
+        uint64_t serial = 0; // order of starting, for stealing
+    };
+
+    // One cached rendering. The render thread fills a slot while it
+    // is not Ready, and the mixing thread only reads it while it is;
+    // readers counts mixing-thread lookups in progress, so that the
+    // render thread can wait for them before reusing a slot
+    enum SlotState { SlotEmpty, SlotBusy, SlotReady };
+    struct Slot {
+        std::atomic<int> state { SlotEmpty };
+        std::atomic<int> readers { 0 };
+        int key = 0;
+        std::shared_ptr<const Rendering> rendering;
+        std::atomic<uint64_t> lastUsed { 0 };
+    };
+
+    class RenderThread : public Thread
+    {
+    public:
+        RenderThread(ClipMixer &mixer) :
+            Thread(Thread::NonRTThread),
+            m_mixer(mixer) { }
+
+        void run() override;
+
+    protected:
+        ClipMixer &m_mixer;
+    };
+
+    std::vector<Voice> m_voices;
+    uint64_t m_voiceSerial;
+    std::vector<Slot> m_slots;
+    uint64_t m_renderingUse;           // mixing thread only
+    RingBuffer<int> m_renderRequests;  // keys, mixing thread to renderer
+    QSemaphore m_renderSemaphore;
+    std::atomic<bool> m_renderExiting;
+    RenderThread *m_renderThread;
+    
+    std::vector<float> m_levels;        // scratch for mix(), per channel
+    std::vector<float> m_noteBuffer;    // scratch for mixNote(), one block
+    std::vector<float *> m_targets;     // scratch for mixNote(), per channel
+
+    double getResampleRatioFor(double frequency) const;
+    sv_frame_t getResampledClipDuration(double frequency) const;
+
+    int getRenderingKey(double frequency) const;
+    double getRenderingFrequency(int key) const;
+    std::shared_ptr<const Rendering> getRendering(double frequency);
+    std::shared_ptr<const Rendering> render(double frequency) const;
+    void renderRequested(); // render thread only
+    Slot *findSlotToFill(); // render thread only
+
+    void startVoice(float **toBuffers, float gain, const NoteStart &note);
+
+    // Mix the part of a voice falling within this block, ending at
+    // the given offset if ending is true. Return true if the voice
+    // has more to play in later blocks
+    bool mixVoice(float **toBuffers, float gain, Voice &voice,
+                  bool ending, sv_frame_t endOffset);
 
-    double getResampleRatioFor(double frequency);
-    sv_frame_t getResampledClipDuration(double frequency);
+    // Fill the note buffer with count frames of the clip resampled
+    // by linear interpolation at the given ratio, from sourceOffset
+    void interpolate(double ratio, sv_frame_t sourceOffset,
+                     sv_frame_t count);
 
     void mixNote(float **toBuffers, 
                  float *levels,
-                 float frequency,
+                 const Voice &voice,
                  sv_frame_t sourceOffset, // within resampled note
                  sv_frame_t targetOffset, // within target buffer
                  sv_frame_t sampleCount,
@@ -13,22 +13,129 @@
 */
 
 #include "ContinuousSynth.h"
+#include "MixKernels.h"
 
 #include "base/Debug.h"
 #include "system/System.h"
 
+#include <algorithm>
 #include <cmath>
 
 namespace sv {
 
+// Samples in one cycle of each wavetable. The phase is a 32-bit
+// fixed-point value whose top TABLE_BITS bits index the table
+static const int TABLE_BITS = 11;
+static const int TABLE_SIZE = 1 << TABLE_BITS;
+static const int FRACTION_BITS = 32 - TABLE_BITS;
+static const uint32_t FRACTION_MASK = (1u << FRACTION_BITS) - 1;
+static const float FRACTION_SCALE = 1.f / float(1u << FRACTION_BITS);
+
+// Tables per wave type, for 1, 2, 4 ... 512 harmonics; the last is as
+// many as a table of TABLE_SIZE samples can hold
+static const int TABLE_LEVELS = 10;
+static const int WAVE_TYPES = 4;
+
+// Frames over which to fade in and out, and glide between frequencies
+static const sv_frame_t FADE_LENGTH = 100;
+
+namespace {
+
+/**
+ * One cycle of each wave type at each level of harmonic content,
+ * with a copy of the first sample at the end so that interpolation
+ * needs no wrap.
+ */
+struct Wavetables
+{
+    std::vector<float> tables[WAVE_TYPES][TABLE_LEVELS];
+
+    Wavetables() {
+
+        std::vector<double> sine(TABLE_SIZE);
+        for (int i = 0; i < TABLE_SIZE; ++i) {
+            sine[i] = sin((2.0 * M_PI * i) / TABLE_SIZE);
+        }
+
+        // sin(h * x) at table index i, for whole h
+        auto harmonic = [&](int i, int h) {
+            return sine[(int64_t(i) * h) % TABLE_SIZE];
+        };
+        
+        for (int type = 0; type < WAVE_TYPES; ++type) {
+            for (int level = 0; level < TABLE_LEVELS; ++level) {
+
+                int harmonics = 1 << level;
+                std::vector<float> &table = tables[type][level];
+                table.resize(TABLE_SIZE + 1, 0.f);
+
+                for (int i = 0; i < TABLE_SIZE; ++i) {
+                    double v = 0.0;
+                    switch (type) {
+                    case 1: // single sinusoid
+                        v = harmonic(i, 1);
+                        break;
+                    case 2: // sawtooth
+                        v = 0.5;
+                        for (int h = 1; h < harmonics; ++h) {
+                            int hn = h + 1;
+                            v -= (1.0 / M_PI) * harmonic(i, hn) / hn;
+                        }
+                        break;
+                    case 3: // square
+                        for (int h = 0; h < harmonics; ++h) {
+                            int hn = h*2 + 1;
+                            v += harmonic(i, hn) / hn;
+                        }
+                        break;
+                    default: // 3 sinusoids
+                        for (int hn = 1; hn <= 3; ++hn) {
+                            v += harmonic(i, hn) / hn;
+                        }
+                        break;
+                    }
+                    table[i] = float(v);
+                }
+
+                table[TABLE_SIZE] = table[0];
+            }
+        }
+    }
+};
+
+const Wavetables &
+getWavetables()
+{
+    static Wavetables tables;
+    return tables;
+}
+
+inline float
+lookup(const float *table, uint32_t phase)
+{
+    uint32_t index = phase >> FRACTION_BITS;
+    float frac = float(phase & FRACTION_MASK) * FRACTION_SCALE;
+    return table[index] + frac * (table[index + 1] - table[index]);
+}
+
+}
+
 ContinuousSynth::ContinuousSynth(int channels, sv_samplerate_t sampleRate, sv_frame_t blockSize, int waveType) :
     m_channels(channels),
     m_sampleRate(sampleRate),
     m_blockSize(blockSize),
-    m_prevF0(-1.0),
-    m_phase(0.0),
-    m_wavetype(waveType) // 0: 3 sinusoids, 1: 1 sinusoid, 2: sawtooth, 3: square
+    m_wavetype(waveType), // 0: 3 sinusoids, 1: 1 sinusoid, 2: sawtooth, 3: square
+    m_tracks(1),
+    m_sounding(false),
+    m_levels(channels, 0.f),
+    m_prevLevels(channels, 0.f),
+    m_block(blockSize, 0.f),
+    m_trackBlock(blockSize, 0.f)
 {
+    if (m_wavetype < 0 || m_wavetype >= WAVE_TYPES) m_wavetype = 0;
+
+    // Build the tables now, rather than on first use in the fill thread
+    (void)getWavetables();
 }
 
 ContinuousSynth::~ContinuousSynth()
@@ -36,118 +143,172 @@ ContinuousSynth::~ContinuousSynth()
 }
 
 void
-ContinuousSynth::reset()
+ContinuousSynth::setChannelCount(int channels)
 {
-    m_phase = 0;
+    m_channels = channels;
+    m_levels.assign(channels, 0.f);
+    m_prevLevels.assign(channels, 0.f);
 }
 
 void
-ContinuousSynth::mix(float **toBuffers, float gain, float pan, float f0f)
+ContinuousSynth::setBlockSize(sv_frame_t blockSize)
+{
+    m_blockSize = blockSize;
+    m_block.resize(blockSize, 0.f);
+    m_trackBlock.resize(blockSize, 0.f);
+}
+
+void
+ContinuousSynth::reset()
+{
+    for (auto &track: m_tracks) {
+        track.phase = 0;
+    }
+}
+
+const float *
+ContinuousSynth::getTable(double f0) const
+{
+    const Wavetables &w = getWavetables();
+
+    if (m_wavetype < 2) {
+        // Sinusoids only: the harmonic content is fixed
+        return w.tables[m_wavetype][0].data();
+    }
+    
+    // As many harmonics as fit below a quarter of the sample rate,
+    // rounded down to the table below
+    int harmonics = int((m_sampleRate / 4) / f0 - 1);
+    int level = 0;
+    while (level + 1 < TABLE_LEVELS && (1 << (level + 1)) <= harmonics) {
+        ++level;
+    }
+    
+    return w.tables[m_wavetype][level].data();
+}
+
+bool
+ContinuousSynth::renderTrack(Track &track, double f0, float *out)
 {
-    double f0(f0f);
-    if (f0 == 0.0) f0 = m_prevF0;
+    if (f0 == 0.0) f0 = track.prevF0;
 
-    bool wasOn = (m_prevF0 > 0.0);
+    bool wasOn = (track.prevF0 > 0.0);
     bool nowOn = (f0 > 0.0);
 
     if (!nowOn && !wasOn) {
-        m_phase = 0;
-        return;
+        track.phase = 0;
+        return false;
     }
 
-    sv_frame_t fadeLength = 100;
+    double fromF0 = (wasOn ? track.prevF0 : f0);
+    double toF0 = (nowOn ? f0 : track.prevF0);
+
+    const float *table = getTable(std::max(fromF0, toF0));
 
-    float *levels = new float[m_channels];
+    auto increment = [&](double f) {
+        f = std::min(f, m_sampleRate / 2);
+        return uint32_t((f / m_sampleRate) * 4294967296.0);
+    };
     
-    for (int c = 0; c < m_channels; ++c) {
-        levels[c] = gain * 0.5f; // scale gain otherwise too loud compared to source
+    uint32_t fromInc = increment(fromF0);
+    uint32_t toInc = increment(toF0);
+
+    sv_frame_t n = m_blockSize;
+    sv_frame_t fade = std::min(FADE_LENGTH, n);
+    uint32_t phase = track.phase;
+    sv_frame_t i = 0;
+
+    if (fromInc != toInc) {
+        // interpolate the frequency shift
+        for ( ; i < fade; ++i) {
+            phase += uint32_t(int64_t(fromInc) +
+                              ((int64_t(toInc) - int64_t(fromInc)) * i) / fade);
+            out[i] = lookup(table, phase);
+        }
     }
-    if (pan != 0.0 && m_channels == 2) {
-        levels[0] *= 1.0f - pan;
-        levels[1] *= pan + 1.0f;
+
+    // At a steady frequency each phase can be had directly from the
+    // first, so that there is no dependency from one sample to the
+    // next and the compiler is free to vectorise the lookup
+    uint32_t base = phase;
+    sv_frame_t steady = n - i;
+    float *steadyOut = out + i;
+    for (sv_frame_t j = 0; j < steady; ++j) {
+        steadyOut[j] = lookup(table, base + uint32_t(j + 1) * toInc);
     }
+    phase = base + uint32_t(steady) * toInc;
 
-//    cerr << "ContinuousSynth::mix: f0 = " << f0 << " (from " << m_prevF0 << "), phase = " << m_phase << endl;
+    if (!wasOn) {
+        MixKernels::multiplyByRamp(out, 0.f, 1.f / float(FADE_LENGTH), fade);
+    } else if (!nowOn) {
+        MixKernels::multiplyByRamp(out, 1.f, -1.f / float(FADE_LENGTH), fade);
+        std::fill(out + fade, out + n, 0.f);
+    }
 
-    for (sv_frame_t i = 0; i < m_blockSize; ++i) {
+    track.phase = phase;
+    track.prevF0 = f0;
+    return true;
+}
 
-        double fHere = (nowOn ? f0 : m_prevF0);
+void
+ContinuousSynth::mix(float **toBuffers, float gain, float pan, float f0)
+{
+    mixTracks(toBuffers, gain, pan, &f0, 1);
+}
 
-        if (wasOn && nowOn && (f0 != m_prevF0) && (i < fadeLength)) {
-            // interpolate the frequency shift
-            fHere = m_prevF0 + ((f0 - m_prevF0) * double(i)) / double(fadeLength);
-        }
+void
+ContinuousSynth::mixTracks(float **toBuffers, float gain, float pan,
+                           const float *f0s, int tracks)
+{
+    if (tracks > int(m_tracks.size())) {
+        m_tracks.resize(tracks);
+    }
 
-        double phasor = (fHere * 2 * M_PI) / m_sampleRate;
-    
-        m_phase = m_phase + phasor;
-
-        int harmonics = int((m_sampleRate / 4) / fHere - 1);
-        if (harmonics < 1) harmonics = 1;
-
-        switch (m_wavetype) {
-        case 1:
-            harmonics = 1;
-            break;
-        case 2:
-            break;
-        case 3:
-            break;
-        default:
-            harmonics = 3;
-            break;
-        }
+    sv_frame_t n = m_blockSize;
+    float *block = m_block.data();
+    bool any = false;
 
-        for (int h = 0; h < harmonics; ++h) {
-
-            double v = 0;
-            double hn = 0;
-            double hp = 0;
-
-            switch (m_wavetype) {
-            case 1: // single sinusoid
-                v = sin(m_phase);
-                break;
-            case 2: // sawtooth
-                if (h != 0) {
-                    hn = h + 1;
-                    hp = m_phase * hn;
-                    v = -(1.0 / M_PI) * sin(hp) / hn;
-                } else {
-                    v = 0.5;
-                }
-                break;
-            case 3: // square
-                hn = h*2 + 1;
-                hp = m_phase * hn;
-                v = sin(hp) / hn;
-                break;
-            default: // 3 sinusoids
-                hn = h + 1;
-                hp = m_phase * hn;
-                v = sin(hp) / hn;
-                break;
+    // Tracks no longer supplied are switched off, so that they fade
+    // out rather than stop dead
+    
+    for (int t = 0; t < int(m_tracks.size()); ++t) {
+        double f0 = (t < tracks ? double(f0s[t]) : -1.0);
+        float *out = (any ? m_trackBlock.data() : block);
+        if (renderTrack(m_tracks[t], f0, out)) {
+            if (any) {
+                MixKernels::addWithGain(block, out, 1.f, n);
             }
+            any = true;
+        }
+    }
 
-            if (!wasOn && i < fadeLength) {
-                // fade in
-                v = v * (double(i) / double(fadeLength));
-            } else if (!nowOn) {
-                // fade out
-                if (i > fadeLength) v = 0;
-                else v = v * (1.0 - (double(i) / double(fadeLength)));
-            }
+    if (!any) {
+        m_sounding = false;
+        return;
+    }
 
-            for (int c = 0; c < m_channels; ++c) {
-                toBuffers[c][i] += float(levels[c] * v);
-            }
-        }
-    }    
+    float *levels = m_levels.data();
+    float *prevLevels = m_prevLevels.data();
+    
+    for (int c = 0; c < m_channels; ++c) {
+        levels[c] = gain * 0.5f; // scale gain otherwise too loud compared to source
+    }
+    if (pan != 0.0 && m_channels == 2) {
+        levels[0] *= 1.0f - pan;
+        levels[1] *= pan + 1.0f;
+    }
 
-    m_prevF0 = f0;
+    // Ramp from the previous block's levels, unless we were silent
+    // and are now fading in anyway
+    
+    for (int c = 0; c < m_channels; ++c) {
+        float from = (m_sounding ? prevLevels[c] : levels[c]);
+        MixKernels::addWithRamp(toBuffers[c], block,
+                                from, (levels[c] - from) / float(n), n);
+        prevLevels[c] = levels[c];
+    }
 
-    delete[] levels;
+    m_sounding = true;
 }
 
 } // end namespace sv
-
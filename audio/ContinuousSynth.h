@@ -17,12 +17,23 @@
 
 #include "base/BaseTypes.h"
 
+#include <cstdint>
+#include <vector>
+
 namespace sv {
 
 /**
  * Mix into a target buffer a signal synthesised so as to sound at a
  * specific frequency. The frequency may change with each processing
  * block, or may be switched on or off.
+ *
+ * The signal is read a block at a time from band-limited wavetables,
+ * shared between all synths, with one table per octave of harmonic
+ * content so that high notes do not alias. Frequency changes glide
+ * over the start of a block and gain and pan changes are ramped
+ * across it, so parameters may change with every block without
+ * clicks. Several frequency tracks may be rendered at once through
+ * mixTracks(), sharing a single pass of gain and pan.
  */
 
 class ContinuousSynth
@@ -33,6 +44,12 @@ public:
     
     void setChannelCount(int channels);
 
+    /**
+     * Change the block size for subsequent calls to mix(). The
+     * oscillator phase carries across the change.
+     */
+    void setBlockSize(sv_frame_t blockSize);
+
     void reset();
 
     /**
@@ -53,15 +70,45 @@ public:
              float pan,
              float f0);
 
+    /**
+     * Mix in the sum of signals at each of the given number of
+     * fundamental frequencies, each of which behaves as the f0
+     * argument to mix() does and keeps its own oscillator state from
+     * one call to the next, by its index. The tracks are summed
+     * before gain and pan are applied, so this is much cheaper than
+     * one synth per track.
+     *
+     * Calling with more tracks than before allocates; otherwise
+     * this is realtime safe.
+     */
+    void mixTracks(float **toBuffers,
+                   float gain,
+                   float pan,
+                   const float *f0s,
+                   int tracks);
+
 private:
+    struct Track {
+        double prevF0 = -1.0;
+        uint32_t phase = 0; // fixed point, one cycle is 2^32
+    };
+    
     int m_channels;
     sv_samplerate_t m_sampleRate;
     sv_frame_t m_blockSize;
 
-    double m_prevF0;
-    double m_phase;
-
     int m_wavetype;
+
+    std::vector<Track> m_tracks;
+    bool m_sounding;
+
+    std::vector<float> m_levels; // per channel, for this block
+    std::vector<float> m_prevLevels; // per channel, for previous block
+    std::vector<float> m_block; // sum of tracks for one block
+    std::vector<float> m_trackBlock; // one track for one block
+
+    bool renderTrack(Track &track, double f0, float *out);
+    const float *getTable(double f0) const;
 };
 
 } // end namespace sv
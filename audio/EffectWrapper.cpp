@@ -18,71 +18,151 @@
 
 #include "base/Debug.h"
 
+#include <algorithm>
+
 //#define DEBUG_EFFECT_WRAPPER 1
 
 using namespace std;
 
 namespace sv {
 
-static const int DEFAULT_RING_BUFFER_SIZE = 131071;
-
 EffectWrapper::EffectWrapper(ApplicationPlaybackSource *source) :
     m_source(source),
+    m_chain(nullptr),
     m_bypassed(false),
-    m_failed(false),
-    m_channelCount(0)
+    m_channelCount(0),
+    m_lastReportedSystemLatency(0),
+    m_reportedEffectLatency(0)
 {
 }
 
 EffectWrapper::~EffectWrapper()
 {
+    delete m_chain;
+    m_scavenger.scavenge(true);
 }
 
 void
 EffectWrapper::setEffect(weak_ptr<RealTimePluginInstance> effect)
+{
+    setEffects({ effect });
+}
+
+void
+EffectWrapper::setEffects(vector<weak_ptr<RealTimePluginInstance>> effects)
 {
     lock_guard<mutex> guard(m_mutex);
 
 #ifdef DEBUG_EFFECT_WRAPPER
     SVCERR << "EffectWrapper[" << this
-           << "]::setEffect(" << effect.lock() << ")" << endl;
+           << "]::setEffects: " << effects.size() << " effect(s)" << endl;
 #endif
-    
-    m_effect = effect;
-    m_failed = false;
+
+    Chain *chain = nullptr;
+
+    if (!effects.empty()) {
+        chain = new Chain;
+        for (auto effect: effects) {
+            auto slot = std::unique_ptr<Slot>(new Slot);
+            slot->effect = effect;
+            auto instance = effect.lock();
+            if (instance) {
+                // Obtained here rather than in the audio thread, as
+                // a plugin may need to run once to report it
+                slot->latency = int(instance->getLatency());
+            }
+            chain->slots.push_back(std::move(slot));
+            chain->running.push_back({});
+        }
+    }
+
+    Chain *old = m_chain.exchange(chain);
+    if (old) {
+        m_scavenger.claim(old);
+    }
+    m_scavenger.scavenge();
+
+    reportLatency(chain);
+}
+
+int
+EffectWrapper::getEffectCount() const
+{
+    const Chain *chain = m_chain;
+    return chain ? int(chain->slots.size()) : 0;
 }
 
 bool
 EffectWrapper::haveEffect() const
 {
-    return m_effect.lock() != nullptr;
+    const Chain *chain = m_chain;
+    if (!chain) return false;
+    for (const auto &slot: chain->slots) {
+        if (!slot->effect.expired()) return true;
+    }
+    return false;
 }
 
 void
 EffectWrapper::clearEffect()
 {
-    m_effect = {};
+    setEffects({});
 }
 
 void
 EffectWrapper::setBypassed(bool bypassed)
 {
-    lock_guard<mutex> guard(m_mutex);
-
 #ifdef DEBUG_EFFECT_WRAPPER
     SVCERR << "EffectWrapper[" << this
            << "]::setBypassed(" << bypassed << ")" << endl;
 #endif
 
+    // May be called from the audio thread, on overload, so no lock
     m_bypassed = bypassed;
+    reportLatency(m_chain);
 }
 
 bool
 EffectWrapper::isBypassed() const
+{
+    return m_bypassed;
+}
+
+void
+EffectWrapper::setEffectBypassed(int index, bool bypassed)
 {
     lock_guard<mutex> guard(m_mutex);
 
-    return m_bypassed;
+#ifdef DEBUG_EFFECT_WRAPPER
+    SVCERR << "EffectWrapper[" << this
+           << "]::setEffectBypassed(" << index << ", " << bypassed << ")"
+           << endl;
+#endif
+
+    Chain *chain = m_chain;
+    if (!chain || index < 0 || index >= int(chain->slots.size())) {
+        return;
+    }
+    chain->slots[index]->bypassed = bypassed;
+    reportLatency(chain);
+}
+
+bool
+EffectWrapper::isEffectBypassed(int index) const
+{
+    lock_guard<mutex> guard(m_mutex);
+    
+    const Chain *chain = m_chain;
+    if (!chain || index < 0 || index >= int(chain->slots.size())) {
+        return false;
+    }
+    return chain->slots[index]->bypassed;
+}
+
+int
+EffectWrapper::getEffectLatency() const
+{
+    return m_reportedEffectLatency;
 }
 
 void
@@ -94,38 +174,63 @@ EffectWrapper::reset()
     SVCERR << "EffectWrapper[" << this << "]::reset" << endl;
 #endif
 
-    for (auto &rb: m_effectOutputBuffers) {
-        rb.reset();
+    // Nothing is buffered here; just give failed effects another go
+    
+    Chain *chain = m_chain;
+    if (chain) {
+        for (auto &slot: chain->slots) {
+            slot->failed = false;
+        }
+        reportLatency(chain);
     }
+}
 
-    m_failed = false;
+bool
+EffectWrapper::isActive(const Slot &slot) const
+{
+    return !slot.bypassed && !slot.failed && !slot.effect.expired();
+}
+
+void
+EffectWrapper::reportLatency(const Chain *chain)
+{
+    int latency = 0;
+    if (chain && !m_bypassed) {
+        for (const auto &slot: chain->slots) {
+            if (isActive(*slot)) latency += slot->latency;
+        }
+    }
+
+    if (latency == m_reportedEffectLatency) return;
+
+#ifdef DEBUG_EFFECT_WRAPPER
+    SVCERR << "EffectWrapper[" << this << "]::reportLatency: effect latency "
+           << "now " << latency << endl;
+#endif
+    
+    m_reportedEffectLatency = latency;
+    m_source->setSystemPlaybackLatency(m_lastReportedSystemLatency + latency);
 }
 
 int
 EffectWrapper::getSourceSamples(float *const *samples,
                                 int nchannels, int nframes)
 {
-    lock_guard<mutex> guard(m_mutex);
-
 #ifdef DEBUG_EFFECT_WRAPPER
     SVCERR << "EffectWrapper[" << this << "]::getSourceSamples: " << nframes
            << " frames across " << nchannels << " channels" << endl;
 #endif
-    
-    auto effect(m_effect.lock());
-    
-    if (!effect) {
-#ifdef DEBUG_EFFECT_WRAPPER
-        SVCERR << "EffectWrapper::getSourceSamples: "
-               << "no effect is set" << endl;
-#endif
-        return m_source->getSourceSamples(samples, nchannels, nframes);
-    }
 
-    if (m_bypassed || m_failed) {
+    Chain *chain = m_chain;
+
+    // Any effect may have been deleted, and so stopped contributing
+    // latency, since we last looked
+    reportLatency(chain);
+    
+    if (!chain || m_bypassed) {
 #ifdef DEBUG_EFFECT_WRAPPER
         SVCERR << "EffectWrapper::getSourceSamples: "
-               << "effect is bypassed or has failed" << endl;
+               << "no effect is set, or chain is bypassed" << endl;
 #endif
         return m_source->getSourceSamples(samples, nchannels, nframes);
     }
@@ -142,65 +247,90 @@ EffectWrapper::getSourceSamples(float *const *samples,
         }
         return 0;
     }
+
+    // Find the effects to run, holding on to each for the duration
+    
+    int running = 0;
+    int blockSize = 0;
+    
+    for (auto &slot: chain->slots) {
+
+        if (slot->bypassed || slot->failed) continue;
+
+        auto effect(slot->effect.lock());
+        if (!effect) continue;
     
-    if ((int)effect->getAudioInputCount() != m_channelCount) {
-        if (!m_failed) {
+        if ((int)effect->getAudioInputCount() != m_channelCount) {
             SVCERR << "EffectWrapper::getSourceSamples: "
                    << "Can't run plugin: plugin input count "
                    << effect->getAudioInputCount() 
                    << " != our channel count " << m_channelCount
                    << " (future errors for this plugin will be suppressed)"
                    << endl;
-            m_failed = true;
+            slot->failed = true;
+            continue;
         }
-    }
-    if ((int)effect->getAudioOutputCount() != m_channelCount) {
-        if (!m_failed) {
+        if ((int)effect->getAudioOutputCount() != m_channelCount) {
             SVCERR << "EffectWrapper::getSourceSamples: "
                    << "Can't run plugin: plugin output count "
                    << effect->getAudioOutputCount() 
                    << " != our channel count " << m_channelCount
                    << " (future errors for this plugin will be suppressed)"
                    << endl;
-            m_failed = true;
+            slot->failed = true;
+            continue;
         }
-    }
 
-    if (m_failed) {
-        return m_source->getSourceSamples(samples, nchannels, nframes);
+        int effectBlockSize = int(effect->getBufferSize());
+        if (running == 0 || effectBlockSize < blockSize) {
+            blockSize = effectBlockSize;
+        }
+        
+        chain->running[running++] = effect;
     }
+
+    int got = m_source->getSourceSamples(samples, nchannels, nframes);
     
-    float **ib = effect->getAudioInputBuffers();
-    float **ob = effect->getAudioOutputBuffers();
-    int blockSize = effect->getBufferSize();
-    
-    int got = 0;
+    if (running == 0 || blockSize <= 0) {
+        for (int i = 0; i < running; ++i) chain->running[i] = {};
+        return got;
+    }
 
-    while (got < nframes) {
+    // Run each effect in turn over each block, in place
 
-        int read = 0;
-        for (int c = 0; c < nchannels; ++c) {
-            read = m_effectOutputBuffers[c].read(samples[c] + got,
-                                                 nframes - got);
-        }
+    int done = 0;
+
+    while (done < got) {
 
-        got += read;
+        int n = std::min(got - done, blockSize);
 
-        if (got < nframes) {
+        for (int i = 0; i < running; ++i) {
 
-            int toRun = m_source->getSourceSamples(ib, nchannels, blockSize);
-            if (toRun <= 0) break;
+            RealTimePluginInstance *effect = chain->running[i].get();
+            
+            float **ib = effect->getAudioInputBuffers();
+            float **ob = effect->getAudioOutputBuffers();
+            
+            for (int c = 0; c < nchannels; ++c) {
+                std::copy(samples[c] + done, samples[c] + done + n, ib[c]);
+            }
 
 #ifdef DEBUG_EFFECT_WRAPPER
             SVCERR << "EffectWrapper::getSourceSamples: Running effect "
-                   << "for " << toRun << " frames" << endl;
+                   << i << " for " << n << " frames" << endl;
 #endif
-            effect->run(Vamp::RealTime::zeroTime, toRun);
+            effect->run(Vamp::RealTime::zeroTime, n);
 
             for (int c = 0; c < nchannels; ++c) {
-                m_effectOutputBuffers[c].write(ob[c], toRun);
+                std::copy(ob[c], ob[c] + n, samples[c] + done);
             }
         }
+
+        done += n;
+    }
+
+    for (int i = 0; i < running; ++i) {
+        chain->running[i] = {};
     }
         
     return got;
@@ -209,16 +339,11 @@ EffectWrapper::getSourceSamples(float *const *samples,
 void
 EffectWrapper::setSystemPlaybackChannelCount(int count)
 {
-    {
-        lock_guard<mutex> guard(m_mutex);
 #ifdef DEBUG_EFFECT_WRAPPER
-        SVCERR << "EffectWrapper[" << this
-               << "]::setSystemPlaybackChannelCount(" << count << ")" << endl;
+    SVCERR << "EffectWrapper[" << this
+           << "]::setSystemPlaybackChannelCount(" << count << ")" << endl;
 #endif
-        m_effectOutputBuffers.resize
-            (count, RingBuffer<float>(DEFAULT_RING_BUFFER_SIZE));
-        m_channelCount = count;
-    }
+    m_channelCount = count;
     m_source->setSystemPlaybackChannelCount(count);
 }
 
@@ -257,7 +382,10 @@ EffectWrapper::setSystemPlaybackBlockSize(int sz)
 void
 EffectWrapper::setSystemPlaybackLatency(int latency)
 {
-    m_source->setSystemPlaybackLatency(latency);
+    // Our own effects' latency adds to the latency downstream
+
+    m_lastReportedSystemLatency = latency;
+    m_source->setSystemPlaybackLatency(latency + m_reportedEffectLatency);
 }
 
 void
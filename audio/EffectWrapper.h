@@ -18,19 +18,32 @@
 #include "bqaudioio/ApplicationPlaybackSource.h"
 
 #include "base/BaseTypes.h"
-#include "base/RingBuffer.h"
+#include "base/Scavenger.h"
 
 #include "plugin/RealTimePluginInstance.h"
 
 #include <vector>
 #include <mutex>
 #include <memory>
+#include <atomic>
 
 namespace sv {
 
 /**
  * A breakfastquay::ApplicationPlaybackSource wrapper that applies a
- * real-time effect plugin.
+ * chain of real-time effect plugins in series.
+ *
+ * The audio is processed in the caller's buffers, a plugin block at
+ * a time, with no intermediate buffering. The chain is held in an
+ * object that is replaced as a whole when the set of effects
+ * changes, and its bypass states are atomic, so the audio callback
+ * never waits on the thread that is changing them. (Parameters are
+ * set directly on the plugin instances, as before.)
+ *
+ * The latency of each effect in use, as reported when it was added,
+ * is added to the latency passed upstream through
+ * setSystemPlaybackLatency, so that the play source can compensate
+ * for it in its playback position.
  */
 class EffectWrapper : public breakfastquay::ApplicationPlaybackSource
 {
@@ -52,29 +65,61 @@ public:
      * Set the effect to apply. The effect instance is shared with the
      * caller: the expectation is that the caller may continue to
      * modify its parameters etc during auditioning. Replaces any
-     * instance previously set.
+     * instances previously set.
      */
     void setEffect(std::weak_ptr<RealTimePluginInstance>);
 
+    /**
+     * Set a chain of effects to apply in series, in the order
+     * given. As with setEffect, the instances are shared with the
+     * caller, and replace any previously set. None of the new
+     * effects is individually bypassed.
+     */
+    void setEffects(std::vector<std::weak_ptr<RealTimePluginInstance>>);
+
+    /**
+     * Return the number of effects in the chain, including any that
+     * are bypassed or no longer exist.
+     */
+    int getEffectCount() const;
+    
     /**
      * Return true if an effect is currently set to be applied.
      */
     bool haveEffect() const;
     
     /**
-     * Remove any applied effect without setting another one.
+     * Remove any applied effects without setting others.
      */
     void clearEffect();
 
     /**
-     * Bypass or un-bypass the effect.
+     * Bypass or un-bypass the whole chain.
      */
     void setBypassed(bool bypassed);
 
     /**
-     * Return true if the effect is bypassed.
+     * Return true if the whole chain is bypassed.
      */
     bool isBypassed() const;
+
+    /**
+     * Bypass or un-bypass the effect at the given index in the
+     * chain.
+     */
+    void setEffectBypassed(int index, bool bypassed);
+
+    /**
+     * Return true if the effect at the given index is bypassed.
+     */
+    bool isEffectBypassed(int index) const;
+
+    /**
+     * Return the total latency in frames of the effects currently in
+     * use, that is, the amount that this wrapper adds to the latency
+     * reported upstream.
+     */
+    int getEffectLatency() const;
     
     /**
      * Clear any buffered data.
@@ -105,13 +150,33 @@ public:
         override;
 
 private:
+    struct Slot {
+        std::weak_ptr<RealTimePluginInstance> effect;
+        int latency = 0;
+        std::atomic<bool> bypassed { false };
+        std::atomic<bool> failed { false };
+    };
+
+    // The chain is only replaced as a whole, and a replaced chain is
+    // scavenged rather than deleted, as the audio thread may still
+    // be using it
+    struct Chain {
+        std::vector<std::unique_ptr<Slot>> slots;
+        // Used only in getSourceSamples, to hold the instances in use
+        std::vector<std::shared_ptr<RealTimePluginInstance>> running;
+    };
+    
     ApplicationPlaybackSource *m_source;
-    std::weak_ptr<RealTimePluginInstance> m_effect;
-    bool m_bypassed;
-    bool m_failed;
-    int m_channelCount;
-    std::vector<RingBuffer<float>> m_effectOutputBuffers;
-    mutable std::mutex m_mutex;
+    std::atomic<Chain *> m_chain;
+    Scavenger<Chain> m_scavenger;
+    std::atomic<bool> m_bypassed;
+    std::atomic<int> m_channelCount;
+    std::atomic<int> m_lastReportedSystemLatency;
+    std::atomic<int> m_reportedEffectLatency;
+    mutable std::mutex m_mutex; // serialises changes to the chain
+
+    bool isActive(const Slot &) const;
+    void reportLatency(const Chain *);
 
     EffectWrapper(const EffectWrapper &)=delete;
     EffectWrapper &operator=(const EffectWrapper &)=delete;
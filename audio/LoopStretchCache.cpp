@@ -0,0 +1,252 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "LoopStretchCache.h"
+
+#include "OfflineRenderer.h"
+#include "EffectWrapper.h"
+
+#include "base/Debug.h"
+#include "base/ViewManagerBase.h"
+
+#include <algorithm>
+
+//#define DEBUG_LOOP_STRETCH_CACHE 1
+
+namespace sv {
+
+// Time to wait after the last change before rendering
+static const int SETTLE_MS = 1000;
+
+// Longest stretched loop we will render
+static const double MAX_LOOP_SECONDS = 60.0;
+
+// Frames rendered at a time, between checks for abandonment
+static const sv_frame_t RENDER_BLOCK_SIZE = 16384;
+
+LoopStretchCache::LoopStretchCache(AudioCallbackPlaySource *source) :
+    m_source(source),
+    m_enabled(true),
+    m_exiting(false),
+    m_generation(0),
+    m_thread(nullptr)
+{
+    m_timer.setSingleShot(true);
+    m_timer.setInterval(SETTLE_MS);
+    QObject::connect(&m_timer, &QTimer::timeout, [this]() { start(); });
+}
+
+LoopStretchCache::~LoopStretchCache()
+{
+    m_timer.stop();
+    
+    if (m_thread) {
+        m_mutex.lock();
+        m_exiting = true;
+        ++m_generation; // abandon any render in progress
+        m_condition.wakeAll();
+        m_mutex.unlock();
+        m_thread->wait();
+        delete m_thread;
+    }
+}
+
+void
+LoopStretchCache::setEnabled(bool enabled)
+{
+    if (m_enabled == enabled) return;
+    m_enabled = enabled;
+    invalidate();
+}
+
+void
+LoopStretchCache::invalidate()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+
+        ++m_generation;
+        m_job.reset();
+    
+        if (m_source->m_timeStretchWrapper) {
+            m_source->m_timeStretchWrapper->setStretchedLoop({});
+        }
+    }
+
+    m_ranges = {};
+    
+    if (m_enabled) {
+        m_timer.start();
+    } else {
+        m_timer.stop();
+    }
+}
+
+void
+LoopStretchCache::rangesChanged
+(std::shared_ptr<const AudioCallbackPlaySource::PlayRangeIndex> ranges)
+{
+    if (m_ranges == ranges) return;
+    if (m_ranges && ranges && m_ranges->isSameAs(*ranges)) return;
+    invalidate();
+}
+
+void
+LoopStretchCache::start()
+{
+    // Called from m_timer once things have settled
+
+    if (!m_enabled) return;
+    
+    AudioCallbackPlaySource *source = m_source;
+    TimeStretchWrapper *wrapper = source->m_timeStretchWrapper;
+
+    if (!wrapper || source->m_models.empty()) return;
+    if (!source->m_viewManager->getPlayLoopMode()) return;
+
+    double ratio = wrapper->getTimeStretchRatio();
+    if (ratio == 1.0) return;
+
+    // The auditioning effect is applied before the stretcher, and
+    // not by us
+    EffectWrapper *effectWrapper = source->m_auditioningEffectWrapper;
+    if (effectWrapper && effectWrapper->haveEffect() &&
+        !effectWrapper->isBypassed()) {
+        return;
+    }
+
+    // The wrapper can only follow the source's position if nothing
+    // between them changes the frame count
+    sv_samplerate_t rate = source->getSourceSampleRate();
+    if (rate == 0 || source->getDeviceSampleRate() != rate) return;
+    
+    auto ranges = std::atomic_load(&source->m_rangeIndex);
+    if (!ranges || ranges->ranges.empty()) return;
+
+    sv_frame_t duration = ranges->getTotalDuration();
+    if (duration <= 0 || double(duration) * ratio > MAX_LOOP_SECONDS * rate) {
+#ifdef DEBUG_LOOP_STRETCH_CACHE
+        SVDEBUG << "LoopStretchCache::start: loop of " << duration
+                << " frames is too long to cache at ratio " << ratio << endl;
+#endif
+        return;
+    }
+
+    std::unique_ptr<Job> job(new Job);
+    job->generation = m_generation;
+    job->wrapper = wrapper;
+    job->renderer.reset(new OfflineRenderer(source));
+    job->renderer->setTimeStretchRatio(ratio);
+
+    auto loop = std::make_shared<TimeStretchWrapper::StretchedLoop>();
+    loop->ratio = ratio;
+    loop->channels = job->renderer->getChannelCount();
+    for (const auto &r: ranges->ranges) {
+        loop->ranges.push_back({ r.start, r.end });
+    }
+    loop->sourceFrames = duration;
+    job->loop = loop;
+
+#ifdef DEBUG_LOOP_STRETCH_CACHE
+    SVDEBUG << "LoopStretchCache::start: rendering " << duration
+            << " source frames at ratio " << ratio << ", generation "
+            << job->generation << endl;
+#endif
+
+    m_ranges = ranges;
+    
+    QMutexLocker locker(&m_mutex);
+
+    m_job = std::move(job);
+    
+    if (!m_thread) {
+        m_thread = new RenderThread(*this);
+        m_thread->start();
+    }
+
+    m_condition.wakeAll();
+}
+
+void
+LoopStretchCache::RenderThread::run()
+{
+    LoopStretchCache &c(m_cache);
+
+    c.m_mutex.lock();
+
+    while (!c.m_exiting) {
+
+        if (!c.m_job) {
+            c.m_condition.wait(&c.m_mutex);
+            continue;
+        }
+
+        std::unique_ptr<Job> job(std::move(c.m_job));
+        
+        c.m_mutex.unlock();
+        c.render(*job);
+        job.reset(); // the renderer goes away on this thread
+        c.m_mutex.lock();
+    }
+
+    c.m_mutex.unlock();
+}
+
+void
+LoopStretchCache::render(Job &job)
+{
+    OfflineRenderer &renderer = *job.renderer;
+    TimeStretchWrapper::StretchedLoop &loop = *job.loop;
+
+    sv_frame_t total = renderer.getTotalFrameCount();
+    int channels = loop.channels;
+    if (total <= 0 || channels <= 0) return;
+
+    loop.data.resize(channels, std::vector<float>(total, 0.f));
+    std::vector<float *> ptrs(channels, nullptr);
+
+    sv_frame_t done = 0;
+    
+    while (done < total) {
+
+        if (m_generation != job.generation) {
+#ifdef DEBUG_LOOP_STRETCH_CACHE
+            SVDEBUG << "LoopStretchCache::render: generation "
+                    << job.generation << " abandoned" << endl;
+#endif
+            return;
+        }
+
+        for (int c = 0; c < channels; ++c) {
+            ptrs[c] = loop.data[c].data() + done;
+        }
+
+        sv_frame_t n = std::min(RENDER_BLOCK_SIZE, total - done);
+        sv_frame_t got = renderer.render(ptrs.data(), n);
+        if (got <= 0) break; // anything left is silent
+        done += got;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (m_generation != job.generation) return;
+
+#ifdef DEBUG_LOOP_STRETCH_CACHE
+    SVDEBUG << "LoopStretchCache::render: rendered " << total
+            << " frames for generation " << job.generation << endl;
+#endif
+
+    job.wrapper->setStretchedLoop(job.loop);
+}
+
+} // end namespace sv
@@ -0,0 +1,126 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_LOOP_STRETCH_CACHE_H
+#define SV_LOOP_STRETCH_CACHE_H
+
+#include "AudioCallbackPlaySource.h"
+#include "TimeStretchWrapper.h"
+
+#include "base/BaseTypes.h"
+#include "base/Thread.h"
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QTimer>
+
+#include <atomic>
+#include <memory>
+
+namespace sv {
+
+class OfflineRenderer;
+
+/**
+ * Renders one time-stretched pass through the looped play region in
+ * the background, with the finer stretcher regardless of the quality
+ * used for live playback, and hands it to the play source's
+ * TimeStretchWrapper to play from on subsequent passes. Until it is
+ * ready, and after any change that would alter it, the live
+ * stretcher is used instead.
+ *
+ * A loop is rendered only when looping at a ratio other than 1, with
+ * no auditioning effect, when the source is not resampled for the
+ * device, and when the stretched loop is no longer than a minute.
+ * Rendering begins once things have been left alone for a moment, so
+ * that dragging a selection or the speed control does not render
+ * over and over.
+ *
+ * All functions are for the UI thread only.
+ */
+class LoopStretchCache
+{
+public:
+    LoopStretchCache(AudioCallbackPlaySource *source);
+    ~LoopStretchCache();
+
+    /**
+     * Enable or disable caching. It is enabled by default.
+     */
+    void setEnabled(bool enabled);
+
+    /**
+     * Return true if caching is enabled.
+     */
+    bool isEnabled() const { return m_enabled; }
+
+    /**
+     * Withdraw any stretched loop from the play source's wrapper and
+     * render again, once things have settled, if the play source's
+     * state still calls for it. Call whenever the models, their play
+     * parameters, the solo set, the play ranges, the loop mode, the
+     * time-stretch ratio or the auditioning effect may have changed.
+     */
+    void invalidate();
+
+    /**
+     * Invalidate if the given range index differs from the one the
+     * loop was rendered for.
+     */
+    void rangesChanged(std::shared_ptr<const AudioCallbackPlaySource::PlayRangeIndex>);
+
+private:
+    struct Job {
+        int generation = 0;
+        std::unique_ptr<OfflineRenderer> renderer;
+        std::shared_ptr<TimeStretchWrapper::StretchedLoop> loop;
+        TimeStretchWrapper *wrapper = nullptr;
+    };
+    
+    class RenderThread : public Thread
+    {
+    public:
+        RenderThread(LoopStretchCache &cache) :
+            Thread(Thread::NonRTThread),
+            m_cache(cache) { }
+
+        void run() override;
+
+    protected:
+        LoopStretchCache &m_cache;
+    };
+
+    AudioCallbackPlaySource *m_source;
+    bool m_enabled;
+    QTimer m_timer;
+    std::shared_ptr<const AudioCallbackPlaySource::PlayRangeIndex> m_ranges;
+
+    QMutex m_mutex; // for everything below
+    QWaitCondition m_condition;
+    std::unique_ptr<Job> m_job;
+    bool m_exiting;
+    
+    std::atomic<int> m_generation;
+    RenderThread *m_thread;
+
+    void start();
+    void render(Job &);
+
+    LoopStretchCache(const LoopStretchCache &) =delete;
+    LoopStretchCache &operator=(const LoopStretchCache &) =delete;
+};
+
+} // end namespace sv
+
+#endif
@@ -0,0 +1,115 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "MixArena.h"
+
+#include "base/Debug.h"
+
+#include <algorithm>
+
+//#define DEBUG_MIX_ARENA 1
+
+namespace sv {
+
+const sv_frame_t MixArena::FadeMargin;
+
+MixArena::MixArena() :
+    m_channels(0),
+    m_sourceChannels(0),
+    m_frames(0)
+{
+}
+
+MixArena::~MixArena()
+{
+}
+
+void
+MixArena::configure(int channels, int sourceChannels,
+                    sv_frame_t frames, int slots)
+{
+    if (channels <= m_channels &&
+        sourceChannels <= m_sourceChannels &&
+        frames <= m_frames &&
+        slots <= int(m_slots.size())) {
+        return;
+    }
+
+    bool resize = (channels > m_channels ||
+                   sourceChannels > m_sourceChannels ||
+                   frames > m_frames);
+
+    if (channels > m_channels) m_channels = channels;
+    if (sourceChannels > m_sourceChannels) m_sourceChannels = sourceChannels;
+    if (frames > m_frames) m_frames = frames;
+
+#ifdef DEBUG_MIX_ARENA
+    SVDEBUG << "MixArena::configure: " << m_channels << " channel(s), "
+            << m_sourceChannels << " source channel(s), " << m_frames
+            << " frames, " << std::max(slots, int(m_slots.size()))
+            << " slot(s)" << endl;
+#endif
+
+    if (resize) {
+        m_mixData.assign(size_t(m_channels) * size_t(m_frames), 0.f);
+        m_mixBuffers.resize(m_channels);
+        m_mixPtrs.resize(m_channels);
+        for (int c = 0; c < m_channels; ++c) {
+            m_mixBuffers[c] = m_mixData.data() + size_t(c) * size_t(m_frames);
+            m_mixPtrs[c] = m_mixBuffers[c];
+        }
+        for (auto &s: m_slots) {
+            configureSlot(*s);
+        }
+    }
+
+    while (int(m_slots.size()) < slots) {
+        m_slots.push_back(std::unique_ptr<SlotData>(new SlotData));
+        configureSlot(*m_slots.rbegin()->get());
+    }
+}
+
+void
+MixArena::configureSlot(SlotData &s)
+{
+    sv_frame_t sourceFrames = m_frames + FadeMargin;
+
+    s.mixData.assign(size_t(m_channels) * size_t(m_frames), 0.f);
+    s.sourceData.assign(size_t(m_sourceChannels) * size_t(sourceFrames), 0.f);
+
+    s.mix.resize(m_channels);
+    s.mixPtrs.resize(m_channels);
+    s.targetPtrs.resize(m_channels);
+    for (int c = 0; c < m_channels; ++c) {
+        s.mix[c] = s.mixData.data() + size_t(c) * size_t(m_frames);
+        s.mixPtrs[c] = s.mix[c];
+        s.targetPtrs[c] = s.mix[c];
+    }
+
+    s.source.resize(m_sourceChannels);
+    for (int c = 0; c < m_sourceChannels; ++c) {
+        s.source[c] = s.sourceData.data() + size_t(c) * size_t(sourceFrames);
+    }
+
+    s.slot.channels = m_channels;
+    s.slot.sourceChannels = m_sourceChannels;
+    s.slot.frames = m_frames;
+    s.slot.sourceFrames = sourceFrames;
+    s.slot.mix = s.mix.data();
+    s.slot.mixPtrs = s.mixPtrs.data();
+    s.slot.source = s.source.data();
+    s.slot.targetPtrs = s.targetPtrs.data();
+}
+
+} // end namespace sv
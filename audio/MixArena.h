@@ -0,0 +1,129 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_MIX_ARENA_H
+#define SV_MIX_ARENA_H
+
+#include "base/BaseTypes.h"
+
+#include <vector>
+#include <memory>
+
+namespace sv {
+
+/**
+ * Preallocated scratch memory for mixing models into a set of output
+ * buffers, so that the mixing itself need not allocate. The arena
+ * has a set of mix buffers for the overall output, and a number of
+ * slots, one for each model being mixed at once. A slot holds
+ * buffers for that model's share of the mix, used when models are
+ * mixed in parallel, and the buffers the AudioGenerator reads model
+ * data into before mixing it.
+ *
+ * The owner of the arena calls configure() whenever the channel
+ * count, block size or number of models may have grown, at a time
+ * when nothing is mixing through it. Everything else is realtime
+ * safe. The arena never shrinks.
+ */
+class MixArena
+{
+public:
+    /**
+     * The generator may read up to this many frames beyond the mix
+     * block size, to cover fades either side of it.
+     */
+    static const sv_frame_t FadeMargin = 128;
+
+    struct Slot {
+        int channels = 0;           // target channels
+        int sourceChannels = 0;     // channels of model data
+        sv_frame_t frames = 0;      // length of each mix buffer
+        sv_frame_t sourceFrames = 0; // length of each source buffer
+        float **mix = nullptr;        // channels x frames
+        float **mixPtrs = nullptr;    // channels, for the caller's use
+        float **source = nullptr;     // sourceChannels x sourceFrames
+        float **targetPtrs = nullptr; // channels, for the generator's use
+    };
+
+    MixArena();
+    ~MixArena();
+
+    /**
+     * Ensure the arena has at least the given capacity. Not realtime
+     * safe, and must not be called while anything is mixing through
+     * the arena.
+     */
+    void configure(int channels, int sourceChannels,
+                   sv_frame_t frames, int slots);
+
+    int getChannelCount() const { return m_channels; }
+    int getSourceChannelCount() const { return m_sourceChannels; }
+    sv_frame_t getFrameCount() const { return m_frames; }
+    int getSlotCount() const { return int(m_slots.size()); }
+
+    /**
+     * Return true if the arena is big enough for the given mix.
+     */
+    bool canMix(int channels, sv_frame_t frames, int slots) const {
+        return channels <= m_channels && frames <= m_frames &&
+            slots <= int(m_slots.size());
+    }
+
+    /**
+     * Return getChannelCount() buffers of getFrameCount() frames
+     * each, for the overall output.
+     */
+    float **getMixBuffers() { return m_mixBuffers.data(); }
+
+    /**
+     * Return an array of getChannelCount() pointers for the caller
+     * to point wherever it likes, typically into the mix buffers.
+     */
+    float **getMixPointers() { return m_mixPtrs.data(); }
+
+    /**
+     * Return the slot with the given index, which must be less than
+     * getSlotCount().
+     */
+    Slot *getSlot(int slot) { return &m_slots[slot]->slot; }
+
+private:
+    struct SlotData {
+        std::vector<float> mixData;
+        std::vector<float> sourceData;
+        std::vector<float *> mix;
+        std::vector<float *> mixPtrs;
+        std::vector<float *> source;
+        std::vector<float *> targetPtrs;
+        Slot slot;
+    };
+
+    int m_channels;
+    int m_sourceChannels;
+    sv_frame_t m_frames;
+
+    std::vector<float> m_mixData;
+    std::vector<float *> m_mixBuffers;
+    std::vector<float *> m_mixPtrs;
+    std::vector<std::unique_ptr<SlotData>> m_slots;
+
+    void configureSlot(SlotData &);
+
+    MixArena(const MixArena &) =delete;
+    MixArena &operator=(const MixArena &) =delete;
+};
+
+} // end namespace sv
+
+#endif
@@ -0,0 +1,411 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "MixKernels.h"
+
+#include "base/Debug.h"
+
+//#define DEBUG_MIX_KERNELS 1
+
+// SSE2 is part of the x86-64 baseline, so is always available
+// there. AVX is compiled separately with a target attribute and only
+// used if the processor turns out to support it. NEON is part of the
+// AArch64 baseline, and available on 32-bit ARM only if the whole
+// build targets it
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define MIX_KERNELS_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define MIX_KERNELS_AVX 1
+#include <immintrin.h>
+#define MIX_KERNELS_TARGET_AVX __attribute__((target("avx")))
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MIX_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace sv {
+
+typedef void (*AddWithGainFn)(float *, const float *, float, sv_frame_t);
+typedef void (*AddWithRampFn)(float *, const float *, float, float, sv_frame_t);
+typedef void (*AddWithGains2Fn)(float *, float *, const float *,
+                                float, float, sv_frame_t);
+typedef void (*MultiplyByRampFn)(float *, float, float, sv_frame_t);
+
+struct KernelSet {
+    const char *name;
+    AddWithGainFn addWithGain;
+    AddWithRampFn addWithRamp;
+    AddWithGains2Fn addWithGains2;
+    MultiplyByRampFn multiplyByRamp;
+};
+
+// Plain versions, also used for the tails left over by the vector ones
+
+static void
+addWithGainScalar(float *dst, const float *src, float gain, sv_frame_t n)
+{
+    for (sv_frame_t i = 0; i < n; ++i) {
+        dst[i] += src[i] * gain;
+    }
+}
+
+static void
+addWithRampScalar(float *dst, const float *src,
+                  float start, float step, sv_frame_t n)
+{
+    for (sv_frame_t i = 0; i < n; ++i) {
+        dst[i] += src[i] * (start + step * float(i));
+    }
+}
+
+static void
+addWithGains2Scalar(float *dst0, float *dst1, const float *src,
+                    float gain0, float gain1, sv_frame_t n)
+{
+    for (sv_frame_t i = 0; i < n; ++i) {
+        dst0[i] += src[i] * gain0;
+        dst1[i] += src[i] * gain1;
+    }
+}
+
+static void
+multiplyByRampScalar(float *buf, float start, float step, sv_frame_t n)
+{
+    for (sv_frame_t i = 0; i < n; ++i) {
+        buf[i] *= start + step * float(i);
+    }
+}
+
+static const KernelSet scalarKernels = {
+    "scalar",
+    addWithGainScalar,
+    addWithRampScalar,
+    addWithGains2Scalar,
+    multiplyByRampScalar
+};
+
+#ifdef MIX_KERNELS_SSE2
+
+static void
+addWithGainSSE2(float *dst, const float *src, float gain, sv_frame_t n)
+{
+    const __m128 g = _mm_set1_ps(gain);
+    sv_frame_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 s = _mm_loadu_ps(src + i);
+        __m128 d = _mm_loadu_ps(dst + i);
+        _mm_storeu_ps(dst + i, _mm_add_ps(d, _mm_mul_ps(s, g)));
+    }
+    addWithGainScalar(dst + i, src + i, gain, n - i);
+}
+
+static void
+addWithRampSSE2(float *dst, const float *src,
+                float start, float step, sv_frame_t n)
+{
+    const __m128 g0 = _mm_set1_ps(start);
+    const __m128 st = _mm_set1_ps(step);
+    const __m128 four = _mm_set1_ps(4.f);
+    __m128 index = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+    sv_frame_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 g = _mm_add_ps(g0, _mm_mul_ps(st, index));
+        __m128 s = _mm_loadu_ps(src + i);
+        __m128 d = _mm_loadu_ps(dst + i);
+        _mm_storeu_ps(dst + i, _mm_add_ps(d, _mm_mul_ps(s, g)));
+        index = _mm_add_ps(index, four);
+    }
+    addWithRampScalar(dst + i, src + i, start + step * float(i), step, n - i);
+}
+
+static void
+addWithGains2SSE2(float *dst0, float *dst1, const float *src,
+                  float gain0, float gain1, sv_frame_t n)
+{
+    const __m128 g0 = _mm_set1_ps(gain0);
+    const __m128 g1 = _mm_set1_ps(gain1);
+    sv_frame_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 s = _mm_loadu_ps(src + i);
+        __m128 d0 = _mm_loadu_ps(dst0 + i);
+        __m128 d1 = _mm_loadu_ps(dst1 + i);
+        _mm_storeu_ps(dst0 + i, _mm_add_ps(d0, _mm_mul_ps(s, g0)));
+        _mm_storeu_ps(dst1 + i, _mm_add_ps(d1, _mm_mul_ps(s, g1)));
+    }
+    addWithGains2Scalar(dst0 + i, dst1 + i, src + i, gain0, gain1, n - i);
+}
+
+static void
+multiplyByRampSSE2(float *buf, float start, float step, sv_frame_t n)
+{
+    const __m128 g0 = _mm_set1_ps(start);
+    const __m128 st = _mm_set1_ps(step);
+    const __m128 four = _mm_set1_ps(4.f);
+    __m128 index = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+    sv_frame_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 g = _mm_add_ps(g0, _mm_mul_ps(st, index));
+        _mm_storeu_ps(buf + i, _mm_mul_ps(_mm_loadu_ps(buf + i), g));
+        index = _mm_add_ps(index, four);
+    }
+    multiplyByRampScalar(buf + i, start + step * float(i), step, n - i);
+}
+
+static const KernelSet sse2Kernels = {
+    "sse2",
+    addWithGainSSE2,
+    addWithRampSSE2,
+    addWithGains2SSE2,
+    multiplyByRampSSE2
+};
+
+#endif
+
+#ifdef MIX_KERNELS_AVX
+
+MIX_KERNELS_TARGET_AVX static void
+addWithGainAVX(float *dst, const float *src, float gain, sv_frame_t n)
+{
+    const __m256 g = _mm256_set1_ps(gain);
+    sv_frame_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 s = _mm256_loadu_ps(src + i);
+        __m256 d = _mm256_loadu_ps(dst + i);
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(d, _mm256_mul_ps(s, g)));
+    }
+    addWithGainScalar(dst + i, src + i, gain, n - i);
+}
+
+MIX_KERNELS_TARGET_AVX static void
+addWithRampAVX(float *dst, const float *src,
+               float start, float step, sv_frame_t n)
+{
+    const __m256 g0 = _mm256_set1_ps(start);
+    const __m256 st = _mm256_set1_ps(step);
+    const __m256 eight = _mm256_set1_ps(8.f);
+    __m256 index = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+    sv_frame_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 g = _mm256_add_ps(g0, _mm256_mul_ps(st, index));
+        __m256 s = _mm256_loadu_ps(src + i);
+        __m256 d = _mm256_loadu_ps(dst + i);
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(d, _mm256_mul_ps(s, g)));
+        index = _mm256_add_ps(index, eight);
+    }
+    addWithRampScalar(dst + i, src + i, start + step * float(i), step, n - i);
+}
+
+MIX_KERNELS_TARGET_AVX static void
+addWithGains2AVX(float *dst0, float *dst1, const float *src,
+                 float gain0, float gain1, sv_frame_t n)
+{
+    const __m256 g0 = _mm256_set1_ps(gain0);
+    const __m256 g1 = _mm256_set1_ps(gain1);
+    sv_frame_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 s = _mm256_loadu_ps(src + i);
+        __m256 d0 = _mm256_loadu_ps(dst0 + i);
+        __m256 d1 = _mm256_loadu_ps(dst1 + i);
+        _mm256_storeu_ps(dst0 + i, _mm256_add_ps(d0, _mm256_mul_ps(s, g0)));
+        _mm256_storeu_ps(dst1 + i, _mm256_add_ps(d1, _mm256_mul_ps(s, g1)));
+    }
+    addWithGains2Scalar(dst0 + i, dst1 + i, src + i, gain0, gain1, n - i);
+}
+
+MIX_KERNELS_TARGET_AVX static void
+multiplyByRampAVX(float *buf, float start, float step, sv_frame_t n)
+{
+    const __m256 g0 = _mm256_set1_ps(start);
+    const __m256 st = _mm256_set1_ps(step);
+    const __m256 eight = _mm256_set1_ps(8.f);
+    __m256 index = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+    sv_frame_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 g = _mm256_add_ps(g0, _mm256_mul_ps(st, index));
+        _mm256_storeu_ps(buf + i, _mm256_mul_ps(_mm256_loadu_ps(buf + i), g));
+        index = _mm256_add_ps(index, eight);
+    }
+    multiplyByRampScalar(buf + i, start + step * float(i), step, n - i);
+}
+
+static const KernelSet avxKernels = {
+    "avx",
+    addWithGainAVX,
+    addWithRampAVX,
+    addWithGains2AVX,
+    multiplyByRampAVX
+};
+
+#endif
+
+#ifdef MIX_KERNELS_NEON
+
+static void
+addWithGainNEON(float *dst, const float *src, float gain, sv_frame_t n)
+{
+    sv_frame_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t s = vld1q_f32(src + i);
+        float32x4_t d = vld1q_f32(dst + i);
+        vst1q_f32(dst + i, vmlaq_n_f32(d, s, gain));
+    }
+    addWithGainScalar(dst + i, src + i, gain, n - i);
+}
+
+static void
+addWithRampNEON(float *dst, const float *src,
+                float start, float step, sv_frame_t n)
+{
+    static const float initial[4] = { 0.f, 1.f, 2.f, 3.f };
+    const float32x4_t g0 = vdupq_n_f32(start);
+    const float32x4_t four = vdupq_n_f32(4.f);
+    float32x4_t index = vld1q_f32(initial);
+    sv_frame_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t g = vmlaq_n_f32(g0, index, step);
+        float32x4_t s = vld1q_f32(src + i);
+        float32x4_t d = vld1q_f32(dst + i);
+        vst1q_f32(dst + i, vmlaq_f32(d, s, g));
+        index = vaddq_f32(index, four);
+    }
+    addWithRampScalar(dst + i, src + i, start + step * float(i), step, n - i);
+}
+
+static void
+addWithGains2NEON(float *dst0, float *dst1, const float *src,
+                  float gain0, float gain1, sv_frame_t n)
+{
+    sv_frame_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t s = vld1q_f32(src + i);
+        float32x4_t d0 = vld1q_f32(dst0 + i);
+        float32x4_t d1 = vld1q_f32(dst1 + i);
+        vst1q_f32(dst0 + i, vmlaq_n_f32(d0, s, gain0));
+        vst1q_f32(dst1 + i, vmlaq_n_f32(d1, s, gain1));
+    }
+    addWithGains2Scalar(dst0 + i, dst1 + i, src + i, gain0, gain1, n - i);
+}
+
+static void
+multiplyByRampNEON(float *buf, float start, float step, sv_frame_t n)
+{
+    static const float initial[4] = { 0.f, 1.f, 2.f, 3.f };
+    const float32x4_t g0 = vdupq_n_f32(start);
+    const float32x4_t four = vdupq_n_f32(4.f);
+    float32x4_t index = vld1q_f32(initial);
+    sv_frame_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t g = vmlaq_n_f32(g0, index, step);
+        vst1q_f32(buf + i, vmulq_f32(vld1q_f32(buf + i), g));
+        index = vaddq_f32(index, four);
+    }
+    multiplyByRampScalar(buf + i, start + step * float(i), step, n - i);
+}
+
+static const KernelSet neonKernels = {
+    "neon",
+    addWithGainNEON,
+    addWithRampNEON,
+    addWithGains2NEON,
+    multiplyByRampNEON
+};
+
+#endif
+
+static const KernelSet &
+selectKernels()
+{
+#ifdef MIX_KERNELS_AVX
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) {
+        return avxKernels;
+    }
+#endif
+#if defined(MIX_KERNELS_SSE2)
+    return sse2Kernels;
+#elif defined(MIX_KERNELS_NEON)
+    return neonKernels;
+#else
+    return scalarKernels;
+#endif
+}
+
+static const KernelSet &
+getKernels()
+{
+    static const KernelSet &kernels = selectKernels();
+#ifdef DEBUG_MIX_KERNELS
+    static bool reported = false;
+    if (!reported) {
+        SVDEBUG << "MixKernels: using " << kernels.name
+                << " implementation" << endl;
+        reported = true;
+    }
+#endif
+    return kernels;
+}
+
+void
+MixKernels::addWithGain(float *dst, const float *src,
+                        float gain, sv_frame_t n)
+{
+    if (n <= 0) return;
+    getKernels().addWithGain(dst, src, gain, n);
+}
+
+void
+MixKernels::addWithRamp(float *dst, const float *src,
+                        float startGain, float gainStep, sv_frame_t n)
+{
+    if (n <= 0) return;
+    getKernels().addWithRamp(dst, src, startGain, gainStep, n);
+}
+
+void
+MixKernels::addWithGains(float *const *dsts, int channels,
+                         const float *src, const float *gains,
+                         sv_frame_t n)
+{
+    if (n <= 0) return;
+
+    const KernelSet &kernels = getKernels();
+
+    int c = 0;
+    for (; c + 1 < channels; c += 2) {
+        kernels.addWithGains2(dsts[c], dsts[c+1], src,
+                              gains[c], gains[c+1], n);
+    }
+    if (c < channels) {
+        kernels.addWithGain(dsts[c], src, gains[c], n);
+    }
+}
+
+void
+MixKernels::multiplyByRamp(float *buf,
+                           float startGain, float gainStep, sv_frame_t n)
+{
+    if (n <= 0) return;
+    getKernels().multiplyByRamp(buf, startGain, gainStep, n);
+}
+
+const char *
+MixKernels::getImplementationName()
+{
+    return getKernels().name;
+}
+
+} // end namespace sv
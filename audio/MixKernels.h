@@ -0,0 +1,73 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_MIX_KERNELS_H
+#define SV_MIX_KERNELS_H
+
+#include "base/BaseTypes.h"
+
+namespace sv {
+
+/**
+ * Vectorised inner loops for mixing sample data into output
+ * buffers with a gain, a linear gain ramp (for fades), or a set of
+ * per-channel gains (for pan).
+ *
+ * The implementation is chosen once, on first use, according to the
+ * instruction sets the processor supports: AVX or SSE2 on x86, NEON
+ * on ARM, or plain C++ otherwise. All functions are realtime safe
+ * and accept unaligned buffers of any length. Source and target must
+ * not overlap.
+ */
+class MixKernels
+{
+public:
+    /**
+     * Add src[i] * gain to dst[i], for i in [0, n).
+     */
+    static void addWithGain(float *dst, const float *src,
+                            float gain, sv_frame_t n);
+
+    /**
+     * Add src[i] * (startGain + i * gainStep) to dst[i], for i in
+     * [0, n). A fade in or out is a ramp from or to zero.
+     */
+    static void addWithRamp(float *dst, const float *src,
+                            float startGain, float gainStep, sv_frame_t n);
+
+    /**
+     * Add src[i] * gains[c] to dsts[c][i], for each of the given
+     * number of channels and i in [0, n). This is how a mono
+     * source is panned across the output: for stereo the source is
+     * read only once for both channels.
+     */
+    static void addWithGains(float *const *dsts, int channels,
+                             const float *src, const float *gains,
+                             sv_frame_t n);
+
+    /**
+     * Multiply buf[i] by (startGain + i * gainStep), for i in [0, n).
+     */
+    static void multiplyByRamp(float *buf,
+                               float startGain, float gainStep, sv_frame_t n);
+
+    /**
+     * Return the name of the implementation in use, e.g. "avx".
+     */
+    static const char *getImplementationName();
+};
+
+} // end namespace sv
+
+#endif
@@ -0,0 +1,159 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "MixWorkerPool.h"
+
+#include "base/Debug.h"
+
+#include <QThread>
+
+//#define DEBUG_MIX_WORKER_POOL 1
+
+namespace sv {
+
+// Polls of the outstanding job count an RT pool's caller makes before
+// it starts yielding its timeslice between polls
+static const int SPIN_POLLS = 2000;
+
+MixWorkerPool::MixWorkerPool(int threadCount, Thread::Type type) :
+    m_spinWait(type == Thread::RTThread),
+    m_job(nullptr),
+    m_jobCount(0),
+    m_nextJob(0),
+    m_outstanding(0),
+    m_exiting(false)
+{
+#ifdef DEBUG_MIX_WORKER_POOL
+    SVDEBUG << "MixWorkerPool: starting " << threadCount << " thread(s)"
+            << endl;
+#endif
+    
+    for (int i = 0; i < threadCount; ++i) {
+        WorkerThread *t = new WorkerThread(*this, type);
+        t->start();
+        m_threads.push_back(t);
+    }
+}
+
+MixWorkerPool::~MixWorkerPool()
+{
+    m_exiting = true;
+    m_workSemaphore.release(int(m_threads.size()));
+
+    for (auto t: m_threads) {
+        t->wait();
+        delete t;
+    }
+}
+
+int
+MixWorkerPool::getDefaultThreadCount()
+{
+    int n = QThread::idealThreadCount() - 1;
+    if (n < 0) n = 0;
+    return n;
+}
+
+void
+MixWorkerPool::run(int count, const Job &job)
+{
+    if (count <= 0) return;
+
+    if (m_threads.empty() || count == 1) {
+        for (int i = 0; i < count; ++i) {
+            job(i);
+        }
+        return;
+    }
+
+    m_jobCount = 0;
+    m_nextJob = 0;
+    m_job = &job;
+    m_outstanding = count;
+    m_jobCount = count;
+
+    // A worker still holding a permit from an earlier run() may wake
+    // for this one instead, and one of this run's permits may then be
+    // left over for the next; either way a worker that finds no index
+    // left to claim just goes back to waiting
+    m_workSemaphore.release(int(m_threads.size()));
+
+    work();
+
+    waitForCompletion();
+    m_job = nullptr;
+}
+
+void
+MixWorkerPool::waitForCompletion()
+{
+    if (m_spinWait) {
+        // Each job is a block's worth of work for one channel, so
+        // the others are normally done within a few microseconds of
+        // ours. Don't sleep on a lock, but don't hog the core if a
+        // worker has been preempted either
+        int polls = 0;
+        while (m_outstanding > 0) {
+            if (++polls > SPIN_POLLS) {
+                QThread::yieldCurrentThread();
+            }
+        }
+        return;
+    }
+    
+    QMutexLocker locker(&m_doneMutex);
+    while (m_outstanding > 0) {
+        m_doneCondition.wait(&m_doneMutex);
+    }
+}
+
+void
+MixWorkerPool::work()
+{
+    while (true) {
+
+        // Claim the next index with a compare-and-swap rather than
+        // a plain increment, so that a thread still finishing up
+        // from a previous run() can't consume an index belonging to a
+        // new one before it has been fully published. run() zeroes
+        // m_jobCount before resetting m_nextJob and sets it again
+        // only after m_job is in place
+        
+        int i = m_nextJob;
+        do {
+            if (i >= m_jobCount) return;
+        } while (!m_nextJob.compare_exchange_weak(i, i + 1));
+
+        (*m_job.load())(i);
+
+        if (--m_outstanding == 0 && !m_spinWait) {
+            QMutexLocker locker(&m_doneMutex);
+            m_doneCondition.wakeAll();
+        }
+    }
+}
+
+void
+MixWorkerPool::WorkerThread::run()
+{
+    MixWorkerPool &p(m_pool);
+
+    while (true) {
+        p.m_workSemaphore.acquire();
+        if (p.m_exiting) break;
+        p.work();
+    }
+}
+
+} // end namespace sv
@@ -0,0 +1,115 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_MIX_WORKER_POOL_H
+#define SV_MIX_WORKER_POOL_H
+
+#include "base/Thread.h"
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSemaphore>
+
+#include <vector>
+#include <functional>
+#include <atomic>
+
+namespace sv {
+
+/**
+ * A small fixed pool of worker threads used to carry out a set of
+ * independent mixing jobs in parallel, such as rendering each of a
+ * number of models into its own buffer. The thread that calls run()
+ * takes part in the work as well, and run() returns only when all of
+ * the jobs are complete.
+ *
+ * Jobs are handed out in index order, but may complete in any order;
+ * any result that must be deterministic should be combined by the
+ * caller after run() returns.
+ *
+ * run() must only be called from one thread at a time.
+ *
+ * A pool of Thread::RTThread type may be run from the audio
+ * callback. Its run() takes no locks: the workers are woken through
+ * a semaphore, and the caller waits for them to complete by spinning
+ * and then yielding rather than sleeping on a condition.
+ */
+class MixWorkerPool
+{
+public:
+    typedef std::function<void(int)> Job;
+
+    /**
+     * Create a pool with the given number of worker threads, in
+     * addition to the calling thread. With zero threads, run() simply
+     * carries out all jobs serially in the calling thread. Use
+     * Thread::RTThread for a pool to be run from the audio callback.
+     */
+    MixWorkerPool(int threadCount, Thread::Type type = Thread::NonRTThread);
+    ~MixWorkerPool();
+
+    /**
+     * Return the number of worker threads, not counting the caller.
+     */
+    int getThreadCount() const { return int(m_threads.size()); }
+
+    /**
+     * Call job(i) for each i in [0, count), distributing the calls
+     * across the worker threads and the calling thread. Return when
+     * all have completed.
+     */
+    void run(int count, const Job &job);
+
+    /**
+     * Return a reasonable default number of worker threads for this
+     * machine, one fewer than the number of available cores.
+     */
+    static int getDefaultThreadCount();
+
+private:
+    class WorkerThread : public Thread
+    {
+    public:
+        WorkerThread(MixWorkerPool &pool, Thread::Type type) :
+            Thread(type),
+            m_pool(pool) { }
+
+        void run() override;
+
+    protected:
+        MixWorkerPool &m_pool;
+    };
+
+    void work();
+    
+    void waitForCompletion();
+    
+    std::vector<WorkerThread *> m_threads;
+    bool m_spinWait; // RT pool: caller never sleeps waiting for workers
+    QSemaphore m_workSemaphore; // one permit per worker per run()
+    QMutex m_doneMutex; // for m_doneCondition, in non-RT pools only
+    QWaitCondition m_doneCondition;
+    std::atomic<const Job *> m_job;
+    std::atomic<int> m_jobCount;
+    std::atomic<int> m_nextJob;
+    std::atomic<int> m_outstanding;
+    std::atomic<bool> m_exiting;
+
+    MixWorkerPool(const MixWorkerPool &) =delete;
+    MixWorkerPool &operator=(const MixWorkerPool &) =delete;
+};
+
+} // end namespace sv
+
+#endif
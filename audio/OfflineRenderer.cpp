@@ -0,0 +1,367 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "OfflineRenderer.h"
+
+#include "AudioGenerator.h"
+#include "MixWorkerPool.h"
+#include "TimeStretchWrapper.h"
+#include "EffectWrapper.h"
+
+#include "base/Debug.h"
+#include "data/fileio/WavFileWriter.h"
+#include "plugin/RealTimePluginInstance.h"
+
+#include "bqvec/VectorOps.h"
+
+#include <QObject>
+
+#include <algorithm>
+#include <cmath>
+
+using breakfastquay::v_zero;
+using breakfastquay::v_copy;
+
+//#define DEBUG_OFFLINE_RENDERER 1
+
+namespace sv {
+
+static const int FILE_WRITE_BLOCK_SIZE = 16384;
+
+OfflineRenderer::OfflineRenderer(AudioCallbackPlaySource *source) :
+    m_source(source),
+    m_generator(new AudioGenerator()),
+    m_pool(nullptr),
+    m_sampleRate(source->getSourceSampleRate()),
+    m_timeRatio(1.0),
+    m_mixSource(nullptr),
+    m_effectWrapper(nullptr),
+    m_timeStretchWrapper(nullptr),
+    m_output(nullptr),
+    m_prepared(false),
+    m_sourceFrameCount(0),
+    m_sourceMixed(0),
+    m_mixFrame(0),
+    m_stretchLatency(0),
+    m_outputDone(0),
+    m_mixBlockSize(0),
+    m_mixAvailable(0),
+    m_mixOffset(0)
+{
+    int channels = source->getTargetChannelCount();
+
+    m_generator->setTargetChannelCount(channels);
+    for (ModelId modelId: source->m_models) {
+        m_generator->addModel(modelId);
+    }
+    if (source->m_soloing) {
+        m_generator->setSoloModelSet(source->m_soloModelSet);
+    }
+
+    if (source->m_timeStretchWrapper) {
+        m_timeRatio = source->m_timeStretchWrapper->getTimeStretchRatio();
+    }
+
+    int threads = MixWorkerPool::getDefaultThreadCount();
+    if (threads > 0 && source->m_models.size() > 1) {
+        m_pool = new MixWorkerPool(threads);
+    }
+
+    m_context.generator = m_generator;
+    m_context.models = source->m_models;
+    m_context.channels = channels;
+    m_context.pool = m_pool;
+    m_context.arena = &m_arena;
+
+    // The range is whatever mixModels will play through once, with
+    // looping off: all of the selections in play-selection mode, or
+    // else everything up to the end of the longest model
+
+    m_context.ranges = std::atomic_load(&source->m_rangeIndex);
+    if (!m_context.ranges) {
+        source->rebuildRangeLists();
+        m_context.ranges = std::atomic_load(&source->m_rangeIndex);
+    }
+    m_sourceFrameCount = m_context.ranges->getTotalDuration();
+
+    m_mixBlockSize = m_generator->getBlockSize() * 16;
+
+    source->prepareMixContext(m_context, m_mixBlockSize);
+
+#ifdef DEBUG_OFFLINE_RENDERER
+    SVDEBUG << "OfflineRenderer: " << m_context.models.size()
+            << " model(s), " << channels << " channel(s) at rate "
+            << m_sampleRate << ", " << m_sourceFrameCount
+            << " source frames" << endl;
+#endif
+}
+
+OfflineRenderer::~OfflineRenderer()
+{
+    delete m_timeStretchWrapper;
+    delete m_effectWrapper;
+    delete m_mixSource;
+    delete m_pool;
+    delete m_generator;
+}
+
+void
+OfflineRenderer::setEffect(std::shared_ptr<RealTimePluginInstance> effect)
+{
+    if (m_prepared) {
+        SVCERR << "WARNING: OfflineRenderer::setEffect: "
+               << "rendering has already begun, ignoring" << endl;
+        return;
+    }
+    m_effect = effect;
+}
+
+void
+OfflineRenderer::setTimeStretchRatio(double ratio)
+{
+    if (m_prepared) {
+        SVCERR << "WARNING: OfflineRenderer::setTimeStretchRatio: "
+               << "rendering has already begun, ignoring" << endl;
+        return;
+    }
+    m_timeRatio = ratio;
+}
+
+sv_frame_t
+OfflineRenderer::getTotalFrameCount() const
+{
+    return sv_frame_t(round(double(m_sourceFrameCount) * m_timeRatio));
+}
+
+void
+OfflineRenderer::prepare()
+{
+    if (m_prepared) return;
+    m_prepared = true;
+
+    int channels = m_context.channels;
+
+    m_mixBuffers.resize(channels);
+    m_mixPtrs.resize(channels);
+    for (int c = 0; c < channels; ++c) {
+        m_mixBuffers[c].resize(m_mixBlockSize, 0.f);
+        m_mixPtrs[c] = m_mixBuffers[c].data();
+    }
+    m_outputPtrs.resize(channels);
+
+    // Same wrapper order as the play source uses, without the
+    // resampler as we render at the source rate
+
+    m_mixSource = new MixSource(*this);
+    m_output = m_mixSource;
+
+    if (m_effect) {
+        m_effectWrapper = new EffectWrapper(m_output);
+        m_effectWrapper->setEffect(m_effect);
+        m_output = m_effectWrapper;
+    }
+
+    if (m_timeRatio != 1.0) {
+        m_timeStretchWrapper = new TimeStretchWrapper(m_output);
+        m_timeStretchWrapper->setTimeStretchRatio(m_timeRatio);
+        m_output = m_timeStretchWrapper;
+    }
+
+    m_output->setSystemPlaybackChannelCount(channels);
+    m_output->setSystemPlaybackSampleRate(int(round(m_sampleRate)));
+
+    if (!m_timeStretchWrapper && !m_effectWrapper) return;
+
+    // An empty request has the stretch wrapper create its stretcher,
+    // which reports its latency to us through setSystemPlaybackLatency
+    // on the way, together with that of the effect. Discard that much
+    // from the start of the output, so that it lines up with the
+    // unprocessed mix
+
+    (void) m_output->getSourceSamples(m_outputPtrs.data(), channels, 0);
+
+    sv_frame_t discard = sv_frame_t(round(double(m_stretchLatency) *
+                                          m_timeRatio));
+
+#ifdef DEBUG_OFFLINE_RENDERER
+    SVDEBUG << "OfflineRenderer::prepare: stretcher and effect latency "
+            << m_stretchLatency << ", discarding " << discard
+            << " output frames" << endl;
+#endif
+
+    std::vector<std::vector<float>> scratch
+        (channels, std::vector<float>(FILE_WRITE_BLOCK_SIZE));
+    std::vector<float *> scratchPtrs(channels);
+    for (int c = 0; c < channels; ++c) {
+        scratchPtrs[c] = scratch[c].data();
+    }
+
+    while (discard > 0) {
+        sv_frame_t n = std::min(discard, sv_frame_t(FILE_WRITE_BLOCK_SIZE));
+        sv_frame_t got = pull(scratchPtrs.data(), n);
+        if (got <= 0) break;
+        discard -= got;
+    }
+}
+
+sv_frame_t
+OfflineRenderer::render(float *const *buffers, sv_frame_t count)
+{
+    prepare();
+
+    sv_frame_t remaining = getTotalFrameCount() - m_outputDone;
+    if (count > remaining) count = remaining;
+    if (count <= 0) return 0;
+
+    sv_frame_t got = pull(buffers, count);
+    m_outputDone += got;
+    return got;
+}
+
+sv_frame_t
+OfflineRenderer::pull(float *const *buffers, sv_frame_t count)
+{
+    int channels = m_context.channels;
+    sv_frame_t got = 0;
+
+    while (got < count) {
+        for (int c = 0; c < channels; ++c) {
+            m_outputPtrs[c] = buffers[c] + got;
+        }
+        int n = int(std::min(count - got, m_mixBlockSize));
+        int obtained = m_output->getSourceSamples
+            (m_outputPtrs.data(), channels, n);
+        if (obtained <= 0) break;
+        got += obtained;
+    }
+
+    return got;
+}
+
+int
+OfflineRenderer::readMixed(float *const *samples, int nchannels, int nframes)
+{
+    int channels = m_context.channels;
+    int got = 0;
+
+    while (got < nframes) {
+
+        if (m_mixAvailable == 0) {
+
+            for (int c = 0; c < channels; ++c) {
+                v_zero(m_mixPtrs[c], int(m_mixBlockSize));
+            }
+
+            if (m_sourceMixed < m_sourceFrameCount) {
+                sv_frame_t mixed = m_source->mixModels
+                    (m_context, false, m_mixFrame, m_mixBlockSize,
+                     m_mixPtrs.data());
+                mixed = std::min(mixed, m_sourceFrameCount - m_sourceMixed);
+                m_sourceMixed += mixed;
+                // Anything past the end of the material is silent,
+                // as the buffers were zeroed
+            }
+
+            m_mixAvailable = m_mixBlockSize;
+            m_mixOffset = 0;
+        }
+
+        int n = int(std::min(sv_frame_t(nframes - got), m_mixAvailable));
+        for (int c = 0; c < nchannels; ++c) {
+            if (c < channels) {
+                v_copy(samples[c] + got, m_mixPtrs[c] + m_mixOffset, n);
+            } else {
+                v_zero(samples[c] + got, n);
+            }
+        }
+        got += n;
+        m_mixOffset += n;
+        m_mixAvailable -= n;
+    }
+
+    return got;
+}
+
+bool
+OfflineRenderer::renderToFile(QString path, QString &error)
+{
+    int channels = m_context.channels;
+
+    if (channels == 0 || m_sampleRate == 0) {
+        error = QObject::tr("Nothing to render");
+        return false;
+    }
+
+    WavFileWriter writer(path, m_sampleRate, channels,
+                         WavFileWriter::WriteToTemporary);
+    if (!writer.isOK()) {
+        error = writer.getError();
+        return false;
+    }
+
+    std::vector<std::vector<float>> buffers
+        (channels, std::vector<float>(FILE_WRITE_BLOCK_SIZE));
+    std::vector<float *> ptrs(channels);
+    for (int c = 0; c < channels; ++c) {
+        ptrs[c] = buffers[c].data();
+    }
+
+    sv_frame_t got;
+    while ((got = render(ptrs.data(), FILE_WRITE_BLOCK_SIZE)) > 0) {
+        if (!writer.writeSamples(ptrs.data(), got)) {
+            error = writer.getError();
+            return false;
+        }
+    }
+
+    if (!writer.close()) {
+        error = writer.getError();
+        return false;
+    }
+
+    return true;
+}
+
+std::string
+OfflineRenderer::MixSource::getClientName() const
+{
+    return m_renderer.m_source->getClientName();
+}
+
+int
+OfflineRenderer::MixSource::getApplicationSampleRate() const
+{
+    return int(round(m_renderer.m_sampleRate));
+}
+
+int
+OfflineRenderer::MixSource::getApplicationChannelCount() const
+{
+    return m_renderer.m_context.channels;
+}
+
+void
+OfflineRenderer::MixSource::setSystemPlaybackLatency(int latency)
+{
+    m_renderer.m_stretchLatency = latency;
+}
+
+int
+OfflineRenderer::MixSource::getSourceSamples(float *const *samples,
+                                             int nchannels, int nframes)
+{
+    return m_renderer.readMixed(samples, nchannels, nframes);
+}
+
+} // end namespace sv
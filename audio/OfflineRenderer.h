@@ -0,0 +1,181 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_OFFLINE_RENDERER_H
+#define SV_OFFLINE_RENDERER_H
+
+#include "AudioCallbackPlaySource.h"
+
+#include "base/BaseTypes.h"
+
+#include <bqaudioio/ApplicationPlaybackSource.h>
+
+#include <QString>
+
+#include <vector>
+#include <memory>
+
+namespace sv {
+
+class AudioGenerator;
+class MixWorkerPool;
+class TimeStretchWrapper;
+class EffectWrapper;
+class RealTimePluginInstance;
+
+/**
+ * Render the mix that an AudioCallbackPlaySource would play, as fast
+ * as possible and without involving the audio device. The same
+ * mixing code is used as for playback, so the result honours the
+ * play parameters of each model, the solo set, and the current
+ * selections when in play-selection mode. Looping is ignored: the
+ * material is rendered once through.
+ *
+ * The renderer takes a snapshot of the play source's models, solo
+ * set, play ranges and time-stretch ratio on construction, which
+ * must happen on the UI thread. It mixes through its own
+ * AudioGenerator, so rendering can then run on any thread while
+ * playback continues. The models must not be deleted while it is in
+ * use.
+ *
+ * Output is at the source sample rate with the play source's target
+ * channel count.
+ */
+class OfflineRenderer
+{
+public:
+    OfflineRenderer(AudioCallbackPlaySource *source);
+    ~OfflineRenderer();
+
+    /**
+     * Apply an effect plugin to the rendered mix. The plugin must
+     * have been initialised with getChannelCount() channels and must
+     * not be in use anywhere else, in particular not as the
+     * play source's auditioning effect. Call before rendering.
+     */
+    void setEffect(std::shared_ptr<RealTimePluginInstance> effect);
+
+    /**
+     * Override the time-stretch ratio taken from the play
+     * source. Call before rendering.
+     */
+    void setTimeStretchRatio(double ratio);
+
+    /**
+     * Return the number of channels that will be rendered.
+     */
+    int getChannelCount() const { return m_context.channels; }
+
+    /**
+     * Return the sample rate of the rendered audio.
+     */
+    sv_samplerate_t getSampleRate() const { return m_sampleRate; }
+
+    /**
+     * Return the total number of frames that will be rendered,
+     * taking into account time-stretching.
+     */
+    sv_frame_t getTotalFrameCount() const;
+
+    /**
+     * Return the number of frames rendered so far.
+     */
+    sv_frame_t getRenderedFrameCount() const { return m_outputDone; }
+
+    /**
+     * Render up to count frames into the given caller-supplied
+     * buffers, one per channel. Return the number of frames actually
+     * rendered, which is fewer than count only at the end of the
+     * material and zero once all of it has been rendered.
+     */
+    sv_frame_t render(float *const *buffers, sv_frame_t count);
+
+    /**
+     * Render everything not yet rendered to a WAV file at the given
+     * path. Return true on success, or false with a message in error.
+     */
+    bool renderToFile(QString path, QString &error);
+
+private:
+    /**
+     * The bottom of our wrapper chain: an ApplicationPlaybackSource
+     * that supplies the output of mixModels in place of ring buffer
+     * contents, padding with silence past the end so that any
+     * stretcher can be drained.
+     */
+    class MixSource : public breakfastquay::ApplicationPlaybackSource
+    {
+    public:
+        MixSource(OfflineRenderer &renderer) : m_renderer(renderer) { }
+
+        std::string getClientName() const override;
+        int getApplicationSampleRate() const override;
+        int getApplicationChannelCount() const override;
+
+        void setSystemPlaybackBlockSize(int) override { }
+        void setSystemPlaybackSampleRate(int) override { }
+        void setSystemPlaybackChannelCount(int) override { }
+        void setSystemPlaybackLatency(int) override;
+
+        void setOutputLevels(float, float) override { }
+        void audioProcessingOverload() override { }
+
+        int getSourceSamples(float *const *samples, int nchannels,
+                             int nframes) override;
+
+    private:
+        OfflineRenderer &m_renderer;
+    };
+
+    AudioCallbackPlaySource *m_source;
+    AudioCallbackPlaySource::MixContext m_context;
+    MixArena m_arena;
+    AudioGenerator *m_generator;
+    MixWorkerPool *m_pool;
+    sv_samplerate_t m_sampleRate;
+    double m_timeRatio;
+    std::shared_ptr<RealTimePluginInstance> m_effect;
+
+    MixSource *m_mixSource;
+    EffectWrapper *m_effectWrapper;
+    TimeStretchWrapper *m_timeStretchWrapper;
+    breakfastquay::ApplicationPlaybackSource *m_output;
+    bool m_prepared;
+
+    sv_frame_t m_sourceFrameCount; // total to be mixed, unstretched
+    sv_frame_t m_sourceMixed;      // mixed so far (not counting padding)
+    sv_frame_t m_mixFrame;         // next playback frame for mixModels
+    sv_frame_t m_stretchLatency;   // reported by the stretcher and effect
+    sv_frame_t m_outputDone;
+
+    // Mixed audio obtained from mixModels but not yet passed on
+    std::vector<std::vector<float>> m_mixBuffers;
+    std::vector<float *> m_mixPtrs;
+    sv_frame_t m_mixBlockSize;
+    sv_frame_t m_mixAvailable;
+    sv_frame_t m_mixOffset;
+
+    std::vector<float *> m_outputPtrs;
+
+    void prepare();
+    int readMixed(float *const *samples, int nchannels, int nframes);
+    sv_frame_t pull(float *const *buffers, sv_frame_t count);
+
+    OfflineRenderer(const OfflineRenderer &) =delete;
+    OfflineRenderer &operator=(const OfflineRenderer &) =delete;
+};
+
+} // end namespace sv
+
+#endif
@@ -0,0 +1,205 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "PlaybackHealth.h"
+
+#include <chrono>
+
+namespace sv {
+
+static int
+binFor(int64_t value)
+{
+    int bin = 0;
+    while (value > 0 && bin < PlaybackHealth::HistogramBins - 1) {
+        value >>= 1;
+        ++bin;
+    }
+    return bin;
+}
+
+int64_t
+PlaybackHealth::Histogram::getPercentile(double percentile) const
+{
+    if (count == 0) return 0;
+
+    int64_t target = int64_t(double(count) * percentile / 100.0);
+    if (target >= count) target = count - 1;
+
+    int64_t seen = 0;
+    for (int i = 0; i < int(bins.size()); ++i) {
+        seen += bins[i];
+        if (seen > target) {
+            if (i == 0) return 0;
+            int64_t upper = (int64_t(1) << i) - 1;
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+void
+PlaybackHealth::AtomicHistogram::add(int64_t value)
+{
+    if (value < 0) value = 0;
+    m_bins[binFor(value)] += 1;
+    m_count += 1;
+    m_total += value;
+    int64_t prev = m_max;
+    while (value > prev && !m_max.compare_exchange_weak(prev, value)) {
+    }
+}
+
+PlaybackHealth::Histogram
+PlaybackHealth::AtomicHistogram::get() const
+{
+    Histogram h;
+    h.bins.resize(HistogramBins);
+    for (int i = 0; i < HistogramBins; ++i) {
+        h.bins[i] = m_bins[i];
+    }
+    h.count = m_count;
+    h.total = m_total;
+    h.max = m_max;
+    return h;
+}
+
+void
+PlaybackHealth::AtomicHistogram::reset()
+{
+    for (int i = 0; i < HistogramBins; ++i) {
+        m_bins[i] = 0;
+    }
+    m_count = 0;
+    m_total = 0;
+    m_max = 0;
+}
+
+void
+PlaybackHealth::addTo(Histogram &h, int64_t value)
+{
+    if (value < 0) value = 0;
+    if (h.bins.empty()) h.bins.resize(HistogramBins);
+    h.bins[binFor(value)] += 1;
+    h.count += 1;
+    h.total += value;
+    if (value > h.max) h.max = value;
+}
+
+PlaybackHealth::PlaybackHealth() :
+    m_callbacks(0),
+    m_underruns(0),
+    m_underrunFrames(0),
+    m_overruns(0),
+    m_overrunFrames(0),
+    m_pendingSourceRead(0)
+{
+}
+
+void
+PlaybackHealth::recordCallback(sv_frame_t readSpace, sv_frame_t requested,
+                               sv_frame_t supplied)
+{
+    m_callbacks += 1;
+    m_callbackReadSpace.add(readSpace);
+    if (supplied < requested) {
+        m_underruns += 1;
+        m_underrunFrames += requested - supplied;
+    }
+}
+
+void
+PlaybackHealth::recordSourceRead(int64_t usec)
+{
+    m_pendingSourceRead += usec;
+}
+
+void
+PlaybackHealth::recordOverrun(sv_frame_t lost)
+{
+    m_overruns += 1;
+    m_overrunFrames += lost;
+}
+
+void
+PlaybackHealth::recordFill(int64_t usec)
+{
+    m_fillDuration.add(usec);
+}
+
+void
+PlaybackHealth::recordModelMix(ModelId model, int64_t usec)
+{
+    QMutexLocker locker(&m_modelMutex);
+    addTo(m_modelMixDuration[model], usec);
+}
+
+void
+PlaybackHealth::recordStretch(int64_t usec)
+{
+    m_stretchDuration.add(usec);
+}
+
+void
+PlaybackHealth::recordResample(int64_t usecIncludingSource)
+{
+    int64_t source = m_pendingSourceRead.exchange(0);
+    m_resampleDuration.add(usecIncludingSource - source);
+}
+
+PlaybackHealth::Report
+PlaybackHealth::getReport() const
+{
+    Report report;
+    report.callbacks = m_callbacks;
+    report.underruns = m_underruns;
+    report.underrunFrames = m_underrunFrames;
+    report.overruns = m_overruns;
+    report.overrunFrames = m_overrunFrames;
+    report.callbackReadSpace = m_callbackReadSpace.get();
+    report.fillDuration = m_fillDuration.get();
+    report.stretchDuration = m_stretchDuration.get();
+    report.resampleDuration = m_resampleDuration.get();
+    {
+        QMutexLocker locker(&m_modelMutex);
+        report.modelMixDuration = m_modelMixDuration;
+    }
+    return report;
+}
+
+void
+PlaybackHealth::reset()
+{
+    m_callbacks = 0;
+    m_underruns = 0;
+    m_underrunFrames = 0;
+    m_overruns = 0;
+    m_overrunFrames = 0;
+    m_pendingSourceRead = 0;
+    m_callbackReadSpace.reset();
+    m_fillDuration.reset();
+    m_stretchDuration.reset();
+    m_resampleDuration.reset();
+    QMutexLocker locker(&m_modelMutex);
+    m_modelMixDuration.clear();
+}
+
+int64_t
+PlaybackHealth::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // end namespace sv
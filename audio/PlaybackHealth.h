@@ -0,0 +1,189 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_PLAYBACK_HEALTH_H
+#define SV_PLAYBACK_HEALTH_H
+
+#include "base/BaseTypes.h"
+#include "data/model/Model.h"
+
+#include <QMutex>
+#include <QMetaType>
+
+#include <atomic>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+namespace sv {
+
+/**
+ * Counters and histograms describing how well playback is keeping
+ * up: ring buffer read space seen by the audio callback, underruns
+ * and overruns, and the time taken by the fill thread and by the
+ * processing stages in the callback. These are recorded by
+ * AudioCallbackPlaySource and its wrappers and can be queried at any
+ * time with getReport().
+ *
+ * The record functions called from the audio callback are lock-free
+ * and do not allocate. recordModelMix takes a mutex and is for the
+ * fill thread only.
+ */
+class PlaybackHealth
+{
+public:
+    /**
+     * Histograms have logarithmic bins: bin 0 counts values of zero
+     * and bin i > 0 counts values v with 2^(i-1) <= v < 2^i. The last
+     * bin also counts anything larger.
+     */
+    static const int HistogramBins = 32;
+
+    struct Histogram {
+        std::vector<int64_t> bins;
+        int64_t count = 0;
+        int64_t total = 0;
+        int64_t max = 0;
+
+        double getMean() const {
+            return count > 0 ? double(total) / double(count) : 0.0;
+        }
+
+        /**
+         * Return an upper bound for the given percentile (0-100) of
+         * recorded values, at the resolution of the bins.
+         */
+        int64_t getPercentile(double percentile) const;
+    };
+
+    struct Report {
+        int64_t callbacks = 0;
+        int64_t underruns = 0;      // callbacks that could not be satisfied
+        int64_t underrunFrames = 0; // frames of silence substituted
+        int64_t overruns = 0;       // fills that failed to write everything
+        int64_t overrunFrames = 0;  // frames dropped by those fills
+
+        Histogram callbackReadSpace; // frames available at callback
+        Histogram fillDuration;      // usec per fillBuffers call
+        Histogram stretchDuration;   // usec per callback, stretcher only
+        Histogram resampleDuration;  // usec per callback, resampler only
+        std::map<ModelId, Histogram> modelMixDuration; // usec per fill
+    };
+
+    PlaybackHealth();
+
+    /**
+     * Called from the audio callback with the frames available in the
+     * ring buffer when it was called, the number requested and the
+     * number actually supplied.
+     */
+    void recordCallback(sv_frame_t readSpace, sv_frame_t requested,
+                        sv_frame_t supplied);
+
+    /**
+     * Called from the audio callback with the time spent reading the
+     * ring buffers, for use by recordResample.
+     */
+    void recordSourceRead(int64_t usec);
+
+    /**
+     * Called from the fill thread when a fill could not write all it
+     * had mixed.
+     */
+    void recordOverrun(sv_frame_t lost);
+
+    /**
+     * Called from the fill thread with the time taken by a fill.
+     */
+    void recordFill(int64_t usec);
+
+    /**
+     * Called from the fill thread with the time taken to mix one model
+     * across a fill. Not realtime safe.
+     */
+    void recordModelMix(ModelId model, int64_t usec);
+
+    /**
+     * Called from the audio callback with the time spent in the
+     * stretcher, excluding time spent obtaining its input.
+     */
+    void recordStretch(int64_t usec);
+
+    /**
+     * Called from the audio callback with the time spent obtaining
+     * audio through the resampler, including the ring buffer reads it
+     * makes; the read time already recorded with recordSourceRead is
+     * subtracted.
+     */
+    void recordResample(int64_t usecIncludingSource);
+
+    /**
+     * Return a snapshot of everything recorded since construction or
+     * the last reset().
+     */
+    Report getReport() const;
+
+    /**
+     * Forget everything recorded so far.
+     */
+    void reset();
+
+    /**
+     * Return a monotonic time in microseconds, for use in measuring
+     * the durations passed to the record functions.
+     */
+    static int64_t now();
+
+private:
+    class AtomicHistogram
+    {
+    public:
+        AtomicHistogram() { reset(); }
+        void add(int64_t value);
+        Histogram get() const;
+        void reset();
+
+    private:
+        std::atomic<int64_t> m_bins[HistogramBins];
+        std::atomic<int64_t> m_count;
+        std::atomic<int64_t> m_total;
+        std::atomic<int64_t> m_max;
+    };
+
+    static void addTo(Histogram &, int64_t value);
+
+    std::atomic<int64_t> m_callbacks;
+    std::atomic<int64_t> m_underruns;
+    std::atomic<int64_t> m_underrunFrames;
+    std::atomic<int64_t> m_overruns;
+    std::atomic<int64_t> m_overrunFrames;
+    std::atomic<int64_t> m_pendingSourceRead;
+
+    AtomicHistogram m_callbackReadSpace;
+    AtomicHistogram m_fillDuration;
+    AtomicHistogram m_stretchDuration;
+    AtomicHistogram m_resampleDuration;
+
+    std::map<ModelId, Histogram> m_modelMixDuration;
+    mutable QMutex m_modelMutex;
+
+    PlaybackHealth(const PlaybackHealth &) =delete;
+    PlaybackHealth &operator=(const PlaybackHealth &) =delete;
+};
+
+} // end namespace sv
+
+Q_DECLARE_METATYPE(sv::PlaybackHealth::Report)
+
+#endif
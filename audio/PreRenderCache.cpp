@@ -0,0 +1,356 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "PreRenderCache.h"
+
+#include "AudioGenerator.h"
+#include "PlaybackHealth.h"
+
+#include "base/Debug.h"
+
+#include <algorithm>
+
+//#define DEBUG_PRE_RENDER_CACHE 1
+
+namespace sv {
+
+// Frames rendered at the start of each head. This needs to cover the
+// time the fill thread takes to mix its first block after play()
+static const sv_frame_t PRE_RENDER_FRAMES = 16384;
+
+// Most range starts to render for, when playing selections
+static const size_t MAX_RANGE_HEADS = 16;
+
+// Time to wait after the last change before rendering, so that we
+// don't render again and again while, say, a selection is dragged
+static const int64_t SETTLE_USEC = 250 * 1000;
+
+PreRenderCache::PreRenderCache(AudioCallbackPlaySource *source) :
+    m_source(source),
+    m_generator(new AudioGenerator()),
+    m_generatorGeneration(0),
+    m_playPosition(-1),
+    m_lastChange(0),
+    m_changed(false),
+    m_exiting(false),
+    m_generation(0),
+    m_thread(nullptr)
+{
+    m_context.generator = m_generator;
+    m_context.arena = &m_arena;
+}
+
+PreRenderCache::~PreRenderCache()
+{
+    if (m_thread) {
+        m_mutex.lock();
+        m_exiting = true;
+        ++m_generation; // abandon any render in progress
+        m_condition.wakeAll();
+        m_mutex.unlock();
+        m_thread->wait();
+        delete m_thread;
+    }
+
+    delete m_generator;
+}
+
+void
+PreRenderCache::invalidate()
+{
+    auto request = std::make_shared<Request>();
+    request->generation = ++m_generation;
+    request->models = m_source->m_models;
+    request->soloing = m_source->m_soloing;
+    request->soloModelSet = m_source->m_soloModelSet;
+    request->channels = m_source->getTargetChannelCount();
+    request->blockSize = m_source->m_generatorBlockSize;
+    request->ranges = std::atomic_load(&m_source->m_rangeIndex);
+    request->lastModelEndFrame = m_source->m_lastModelEndFrame;
+    request->maxFrames = m_source->getLowWaterMark();
+
+#ifdef DEBUG_PRE_RENDER_CACHE
+    SVDEBUG << "PreRenderCache::invalidate: generation "
+            << request->generation << endl;
+#endif
+
+    QMutexLocker locker(&m_mutex);
+
+    m_request = request;
+    m_heads.clear();
+    m_lastChange = PlaybackHealth::now();
+    m_changed = true;
+
+    if (!m_thread && !request->models.empty()) {
+        m_thread = new RenderThread(*this);
+        m_thread->start();
+    }
+
+    m_condition.wakeAll();
+}
+
+void
+PreRenderCache::rangesChanged
+(std::shared_ptr<const AudioCallbackPlaySource::PlayRangeIndex> ranges)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_request) return; // nothing rendered yet
+        auto current = m_request->ranges;
+        if (current == ranges) return;
+        if (current && ranges && current->isSameAs(*ranges)) return;
+    }
+
+    invalidate();
+}
+
+void
+PreRenderCache::setPlayPosition(sv_frame_t frame)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (frame == m_playPosition) return;
+    m_playPosition = frame;
+
+    if (!m_request) return;
+
+    m_lastChange = PlaybackHealth::now();
+    m_changed = true;
+    m_condition.wakeAll();
+}
+
+std::shared_ptr<const PreRenderCache::Head>
+PreRenderCache::getHead(sv_frame_t frame) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    auto itr = m_heads.find(frame);
+    if (itr == m_heads.end()) return {};
+    return itr->second;
+}
+
+void
+PreRenderCache::RenderThread::run()
+{
+    PreRenderCache &c(m_cache);
+
+    c.m_mutex.lock();
+
+    while (!c.m_exiting) {
+
+        if (!c.m_changed) {
+            c.m_condition.wait(&c.m_mutex);
+            continue;
+        }
+
+        int64_t wait = SETTLE_USEC - (PlaybackHealth::now() - c.m_lastChange);
+        if (wait > 0) {
+            c.m_condition.wait(&c.m_mutex, (unsigned long)(wait / 1000 + 1));
+            continue;
+        }
+
+        c.m_changed = false;
+
+        c.m_mutex.unlock();
+        c.renderPending();
+        c.m_mutex.lock();
+    }
+
+    c.m_mutex.unlock();
+}
+
+void
+PreRenderCache::renderPending()
+{
+    std::shared_ptr<const Request> request;
+    sv_frame_t position = -1;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        request = m_request;
+        position = m_playPosition;
+    }
+
+    if (!request || request->models.empty()) return;
+
+    updateGenerator(*request);
+
+    std::vector<sv_frame_t> wanted = getWantedFrames(*request, position);
+
+    for (sv_frame_t frame: wanted) {
+
+        if (m_generation != request->generation) {
+            // Superseded: the next pass will pick up the new request
+            return;
+        }
+
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_heads.find(frame) != m_heads.end()) continue;
+        }
+
+        auto head = render(*request, frame);
+        if (!head) continue;
+
+#ifdef DEBUG_PRE_RENDER_CACHE
+        SVDEBUG << "PreRenderCache: rendered " << head->frames
+                << " frames from " << frame << endl;
+#endif
+
+        QMutexLocker locker(&m_mutex);
+        if (m_request != request) return;
+        m_heads[frame] = head;
+    }
+
+    // Drop heads no longer wanted, such as an old play position
+
+    QMutexLocker locker(&m_mutex);
+    if (m_request != request) return;
+
+    for (auto itr = m_heads.begin(); itr != m_heads.end(); ) {
+        if (std::find(wanted.begin(), wanted.end(), itr->first) ==
+            wanted.end()) {
+            itr = m_heads.erase(itr);
+        } else {
+            ++itr;
+        }
+    }
+}
+
+void
+PreRenderCache::updateGenerator(const Request &request)
+{
+    if (m_generatorGeneration == request.generation) return;
+
+    for (ModelId modelId: m_generatorModels) {
+        if (request.models.find(modelId) == request.models.end()) {
+            m_generator->removeModel(modelId);
+        }
+    }
+    for (ModelId modelId: request.models) {
+        if (m_generatorModels.find(modelId) == m_generatorModels.end()) {
+            m_generator->addModel(modelId);
+        }
+    }
+    m_generatorModels = request.models;
+
+    m_generator->setTargetChannelCount(request.channels);
+    m_generator->setBlockSize(request.blockSize);
+
+    if (request.soloing) {
+        m_generator->setSoloModelSet(request.soloModelSet);
+    } else {
+        m_generator->clearSoloModelSet();
+    }
+
+    m_context.models = request.models;
+    m_context.channels = request.channels;
+    m_context.ranges = request.ranges;
+
+    m_source->prepareMixContext(m_context, m_generator->getBlockSize() * 4);
+
+    m_generatorGeneration = request.generation;
+}
+
+std::vector<sv_frame_t>
+PreRenderCache::getWantedFrames(const Request &request,
+                                sv_frame_t playPosition) const
+{
+    // The play position first, as the likeliest place to start
+
+    std::vector<sv_frame_t> frames;
+
+    if (playPosition >= 0) {
+        frames.push_back(playPosition);
+    }
+
+    auto ranges = request.ranges;
+
+    if (ranges && ranges->constrained) {
+        for (const auto &range: ranges->ranges) {
+            if (frames.size() > MAX_RANGE_HEADS) break;
+            if (range.start != playPosition) {
+                frames.push_back(range.start);
+            }
+        }
+    } else if (playPosition != 0) {
+        frames.push_back(0);
+    }
+
+    return frames;
+}
+
+std::shared_ptr<PreRenderCache::Head>
+PreRenderCache::render(const Request &request, sv_frame_t frame)
+{
+    // Render from the given frame to the end of the play range it is
+    // in, or PRE_RENDER_FRAMES, whichever is shorter. Stopping at the
+    // end of the range means that what follows (looping, or a jump
+    // to the next range) is left to the fill thread
+
+    sv_frame_t blockSize = m_generator->getBlockSize();
+    sv_frame_t limit = 0;
+
+    auto ranges = request.ranges;
+
+    if (ranges && ranges->constrained) {
+        int ri = ranges->findContainingOrFollowing(frame);
+        if (ri < 0 || ranges->ranges[ri].start > frame) return {};
+        limit = ranges->ranges[ri].end - frame;
+    } else {
+        limit = request.lastModelEndFrame - frame;
+    }
+
+    sv_frame_t frames = std::min(PRE_RENDER_FRAMES,
+                                 std::min(limit, request.maxFrames));
+    frames = (frames / blockSize) * blockSize;
+
+    int channels = request.channels;
+    if (frames <= 0 || channels <= 0) return {};
+
+    auto head = std::make_shared<Head>();
+    head->frame = frame;
+    head->data.resize(channels, std::vector<float>(frames, 0.f));
+
+    std::vector<float *> ptrs(channels, nullptr);
+
+    // As play() does
+    m_generator->reset();
+
+    sv_frame_t renderBlockSize = blockSize * 4;
+    sv_frame_t f = frame;
+    sv_frame_t done = 0;
+
+    while (done < frames) {
+
+        if (m_generation != request.generation) return {};
+
+        sv_frame_t n = std::min(renderBlockSize, frames - done);
+        for (int c = 0; c < channels; ++c) {
+            ptrs[c] = head->data[c].data() + done;
+        }
+
+        sv_frame_t got = m_source->mixModels(m_context, false, f, n,
+                                             ptrs.data());
+        if (got < n) return {};
+        done += got;
+        f += got;
+    }
+
+    head->frames = done;
+    head->endFrame = f;
+    return head;
+}
+
+} // end namespace sv
@@ -0,0 +1,152 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_PRE_RENDER_CACHE_H
+#define SV_PRE_RENDER_CACHE_H
+
+#include "AudioCallbackPlaySource.h"
+#include "MixArena.h"
+
+#include "base/BaseTypes.h"
+#include "base/Thread.h"
+
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace sv {
+
+class AudioGenerator;
+
+/**
+ * A small cache of pre-rendered audio for the places playback is
+ * likely to start from: the start of each play range (the selections,
+ * when playing selections only) and the current play position. When
+ * play() starts from one of these, it can put the cached audio
+ * straight into the ring buffers, so that the device has something
+ * to play without waiting for the fill thread to mix it.
+ *
+ * Rendering happens in a background thread with its own
+ * AudioGenerator, through the same mixModels code as playback, and
+ * from a freshly reset generator just as play() does, so the cached
+ * audio is the same as the fill thread would have produced. After
+ * each change the thread waits for things to settle before
+ * re-rendering.
+ *
+ * All functions except getHead are for the UI thread only.
+ */
+class PreRenderCache
+{
+public:
+    struct Head {
+        sv_frame_t frame = 0;    // playback frame the audio starts at
+        sv_frame_t frames = 0;   // number of frames rendered
+        sv_frame_t endFrame = 0; // playback frame to continue from
+        std::vector<std::vector<float>> data; // one vector per channel
+    };
+
+    PreRenderCache(AudioCallbackPlaySource *source);
+    ~PreRenderCache();
+
+    /**
+     * Discard everything cached and render again from the play
+     * source's current models, solo set, channel count and play
+     * ranges. Call whenever any of these, or the content or play
+     * parameters of any model, may have changed.
+     */
+    void invalidate();
+
+    /**
+     * Invalidate if the given range index differs from the one the
+     * cache was rendered for.
+     */
+    void rangesChanged(std::shared_ptr<const AudioCallbackPlaySource::PlayRangeIndex>);
+
+    /**
+     * Set the playback frame of the current play position, which is
+     * cached in addition to the range starts.
+     */
+    void setPlayPosition(sv_frame_t frame);
+
+    /**
+     * Return the cached audio for playback starting at the given
+     * frame, or a null pointer if there is none. May be called from
+     * any thread.
+     */
+    std::shared_ptr<const Head> getHead(sv_frame_t frame) const;
+
+private:
+    // A snapshot of the play source's state to render from
+    struct Request {
+        int generation = 0;
+        std::set<ModelId> models;
+        bool soloing = false;
+        std::set<ModelId> soloModelSet;
+        int channels = 0;
+        sv_frame_t blockSize = 0;
+        std::shared_ptr<const AudioCallbackPlaySource::PlayRangeIndex> ranges;
+        sv_frame_t lastModelEndFrame = 0;
+        sv_frame_t maxFrames = 0;
+    };
+
+    class RenderThread : public Thread
+    {
+    public:
+        RenderThread(PreRenderCache &cache) :
+            Thread(Thread::NonRTThread),
+            m_cache(cache) { }
+
+        void run() override;
+
+    protected:
+        PreRenderCache &m_cache;
+    };
+
+    AudioCallbackPlaySource *m_source;
+    AudioGenerator *m_generator;
+    AudioCallbackPlaySource::MixContext m_context;
+    MixArena m_arena;
+    std::set<ModelId> m_generatorModels; // render thread only
+    int m_generatorGeneration;           // render thread only
+
+    mutable QMutex m_mutex; // for everything below
+    QWaitCondition m_condition;
+    std::shared_ptr<const Request> m_request;
+    sv_frame_t m_playPosition;
+    std::map<sv_frame_t, std::shared_ptr<const Head>> m_heads;
+    int64_t m_lastChange;
+    bool m_changed;
+    bool m_exiting;
+
+    std::atomic<int> m_generation;
+    RenderThread *m_thread;
+
+    void renderPending();
+    void updateGenerator(const Request &);
+    std::vector<sv_frame_t> getWantedFrames(const Request &,
+                                            sv_frame_t playPosition) const;
+    std::shared_ptr<Head> render(const Request &, sv_frame_t frame);
+
+    PreRenderCache(const PreRenderCache &) =delete;
+    PreRenderCache &operator=(const PreRenderCache &) =delete;
+};
+
+} // end namespace sv
+
+#endif
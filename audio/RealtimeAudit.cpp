@@ -0,0 +1,320 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "RealtimeAudit.h"
+
+//#define REALTIME_AUDIT 1
+
+#ifdef REALTIME_AUDIT
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace sv {
+
+static const int64_t REPORTS_IN_FULL = 20;
+static const int64_t REPORT_INTERVAL = 1000;
+
+static thread_local const char *t_scope = nullptr;
+static thread_local bool t_reporting = false;
+
+static std::atomic<int64_t> g_allocations(0);
+static std::atomic<int64_t> g_locks(0);
+static std::atomic<int64_t> g_locksTaken(0);
+
+// This is called from within operator new and delete, so it must
+// not itself allocate: hence stdio rather than SVCERR
+static void
+report(std::atomic<int64_t> &counter, const char *what, size_t size,
+       const char *name = nullptr)
+{
+    if (!t_scope || t_reporting) return;
+    t_reporting = true;
+
+    int64_t n = ++counter;
+    if (n <= REPORTS_IN_FULL || n % REPORT_INTERVAL == 0) {
+        if (size > 0) {
+            fprintf(stderr, "RealtimeAudit: %s of %zu bytes in %s "
+                    "(%lld so far)\n", what, size, t_scope, (long long)n);
+        } else if (name) {
+            fprintf(stderr, "RealtimeAudit: %s %s in %s (%lld so far)\n",
+                    what, name, t_scope, (long long)n);
+        } else {
+            fprintf(stderr, "RealtimeAudit: %s in %s (%lld so far)\n",
+                    what, t_scope, (long long)n);
+        }
+    }
+
+    t_reporting = false;
+}
+
+RealtimeAudit::Scope::Scope(const char *name) :
+    m_previous(t_scope)
+{
+    if (!t_scope) t_scope = name;
+}
+
+RealtimeAudit::Scope::~Scope()
+{
+    t_scope = m_previous;
+}
+
+void
+RealtimeAudit::noteLock(const char *what)
+{
+    report(g_locks, "wait for lock", 0, what);
+}
+
+void
+RealtimeAudit::noteLockTaken(const char *what)
+{
+    report(g_locksTaken, "lock", 0, what);
+}
+
+bool
+RealtimeAudit::isEnabled()
+{
+    return true;
+}
+
+int64_t
+RealtimeAudit::getAllocationCount()
+{
+    return g_allocations;
+}
+
+int64_t
+RealtimeAudit::getLockCount()
+{
+    return g_locks;
+}
+
+int64_t
+RealtimeAudit::getLockTakenCount()
+{
+    return g_locksTaken;
+}
+
+} // end namespace sv
+
+static void *
+auditedAllocate(size_t size)
+{
+    sv::report(sv::g_allocations, "allocation", size);
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+static void
+auditedFree(void *ptr)
+{
+    if (!ptr) return;
+    sv::report(sv::g_allocations, "deallocation", 0);
+    free(ptr);
+}
+
+static void *
+auditedAllocateAligned(size_t size, std::align_val_t alignment,
+                       bool nothrow)
+{
+    sv::report(sv::g_allocations, "aligned allocation", size);
+    size_t align = std::max(size_t(alignment), sizeof(void *));
+    void *ptr = nullptr;
+#ifdef _WIN32
+    ptr = _aligned_malloc(size ? size : 1, align);
+#else
+    if (posix_memalign(&ptr, align, size ? size : 1) != 0) {
+        ptr = nullptr;
+    }
+#endif
+    if (!ptr && !nothrow) throw std::bad_alloc();
+    return ptr;
+}
+
+static void
+auditedFreeAligned(void *ptr)
+{
+    if (!ptr) return;
+    sv::report(sv::g_allocations, "aligned deallocation", 0);
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+void *operator new(size_t size)
+{
+    return auditedAllocate(size);
+}
+
+void *operator new[](size_t size)
+{
+    return auditedAllocate(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    sv::report(sv::g_allocations, "allocation", size);
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    sv::report(sv::g_allocations, "allocation", size);
+    return malloc(size ? size : 1);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    auditedFree(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    auditedFree(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    auditedFree(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    auditedFree(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    auditedFree(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    auditedFree(ptr);
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+    return auditedAllocateAligned(size, alignment, false);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+    return auditedAllocateAligned(size, alignment, false);
+}
+
+void *operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept
+{
+    return auditedAllocateAligned(size, alignment, true);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept
+{
+    return auditedAllocateAligned(size, alignment, true);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    auditedFreeAligned(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    auditedFreeAligned(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+    auditedFreeAligned(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept
+{
+    auditedFreeAligned(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept
+{
+    auditedFreeAligned(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept
+{
+    auditedFreeAligned(ptr);
+}
+
+#else
+
+namespace sv {
+
+RealtimeAudit::Scope::Scope(const char *) :
+    m_previous(nullptr)
+{
+}
+
+RealtimeAudit::Scope::~Scope()
+{
+}
+
+void
+RealtimeAudit::noteLock(const char *)
+{
+}
+
+void
+RealtimeAudit::noteLockTaken(const char *)
+{
+}
+
+bool
+RealtimeAudit::isEnabled()
+{
+    return false;
+}
+
+int64_t
+RealtimeAudit::getAllocationCount()
+{
+    return 0;
+}
+
+int64_t
+RealtimeAudit::getLockCount()
+{
+    return 0;
+}
+
+int64_t
+RealtimeAudit::getLockTakenCount()
+{
+    return 0;
+}
+
+} // end namespace sv
+
+#endif
@@ -0,0 +1,137 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_REALTIME_AUDIT_H
+#define SV_REALTIME_AUDIT_H
+
+#include <QReadWriteLock>
+
+#include <cstdint>
+
+namespace sv {
+
+/**
+ * A debugging aid for finding things that can stall the audio
+ * callback or the playback fill thread: heap allocation and
+ * deallocation, and taking locks.
+ *
+ * Code on those paths marks its extent with a Scope. When the audit
+ * is compiled in, by defining REALTIME_AUDIT in RealtimeAudit.cpp,
+ * every form of the global operator new and delete (plain, array,
+ * nothrow, sized and aligned) is replaced with a version that
+ * reports any call made by a thread that is within a Scope.
+ * noteLockTaken() reports any lock taken, whether or not it had to
+ * be waited for, and noteLock() reports one that had to be waited
+ * for. The first few reports of each kind are printed in full and
+ * after that only a periodic count, so as not to swamp the output.
+ * Without REALTIME_AUDIT none of this does anything.
+ *
+ * What the audit can't see:
+ *
+ * - Locks other than those our own code takes through ReadLocker or
+ *   reports with noteLockTaken(). Those taken inside Qt, svcore or
+ *   the audio libraries are not seen, including the registry lock in
+ *   ModelById::get() and, on platforms where Qt does not implement
+ *   QSemaphore with futexes, the one behind QSemaphore::release().
+ *
+ * - Allocation that doesn't go through operator new, such as malloc
+ *   called directly from C code or from inside other libraries.
+ */
+class RealtimeAudit
+{
+public:
+    /**
+     * Mark the current thread as being on a realtime path for the
+     * lifetime of this object. Scopes may be nested; the outermost
+     * name is the one reported.
+     */
+    class Scope
+    {
+    public:
+        Scope(const char *name);
+        ~Scope();
+
+    private:
+        const char *m_previous;
+
+        Scope(const Scope &) =delete;
+        Scope &operator=(const Scope &) =delete;
+    };
+
+    /**
+     * Lock a QReadWriteLock for reading for the lifetime of this
+     * object, like QReadLocker, reporting through noteLockTaken, and
+     * also through noteLock if the lock was not immediately
+     * available.
+     */
+    class ReadLocker
+    {
+    public:
+        ReadLocker(QReadWriteLock *lock, const char *what) : m_lock(lock) {
+            noteLockTaken(what);
+            if (!m_lock->tryLockForRead()) {
+                noteLock(what);
+                m_lock->lockForRead();
+            }
+        }
+        ~ReadLocker() {
+            m_lock->unlock();
+        }
+
+    private:
+        QReadWriteLock *m_lock;
+
+        ReadLocker(const ReadLocker &) =delete;
+        ReadLocker &operator=(const ReadLocker &) =delete;
+    };
+
+    /**
+     * Report that the current thread is waiting for the named lock,
+     * if it is within a Scope.
+     */
+    static void noteLock(const char *what);
+
+    /**
+     * Report that the current thread is taking the named lock, if it
+     * is within a Scope, whether or not it has to wait for it.
+     */
+    static void noteLockTaken(const char *what);
+
+    /**
+     * Return true if the audit was compiled in.
+     */
+    static bool isEnabled();
+
+    /**
+     * Return the number of allocations and deallocations reported
+     * so far, across all threads.
+     */
+    static int64_t getAllocationCount();
+
+    /**
+     * Return the number of waits for locks reported so far, across
+     * all threads.
+     */
+    static int64_t getLockCount();
+
+    /**
+     * Return the number of locks taken, whether waited for or not,
+     * reported so far across all threads.
+     */
+    static int64_t getLockTakenCount();
+};
+
+} // end namespace sv
+
+#endif
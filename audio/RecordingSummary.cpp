@@ -0,0 +1,163 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "RecordingSummary.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace sv {
+
+// Frames per peak at the finest level, and peaks of one level per
+// peak of the next. With five levels the coarsest has one peak per
+// 2^20 frames, or about 24 seconds at 44.1kHz
+static const int BASE_BLOCK_SIZE = 256;
+static const int LEVEL_RATIO = 8;
+static const int LEVEL_COUNT = 5;
+
+void
+RecordingSummary::Accumulator::add(const Peak &p, int weight)
+{
+    if (count == 0) {
+        peak.min = p.min;
+        peak.max = p.max;
+    } else {
+        peak.min = std::min(peak.min, p.min);
+        peak.max = std::max(peak.max, p.max);
+    }
+    absTotal += double(p.absmean) * weight;
+    count += weight;
+}
+
+RecordingSummary::RecordingSummary(int channels) :
+    m_channels(channels),
+    m_frameCount(0),
+    m_peaks(LEVEL_COUNT, std::vector<std::deque<Peak>>(channels)),
+    m_accumulators(LEVEL_COUNT, std::vector<Accumulator>(channels))
+{
+}
+
+RecordingSummary::~RecordingSummary()
+{
+}
+
+int
+RecordingSummary::getBaseBlockSize()
+{
+    return BASE_BLOCK_SIZE;
+}
+
+int
+RecordingSummary::getLevelRatio()
+{
+    return LEVEL_RATIO;
+}
+
+int
+RecordingSummary::getLevelCount()
+{
+    return LEVEL_COUNT;
+}
+
+sv_frame_t
+RecordingSummary::getFrameCount() const
+{
+    QReadLocker locker(&m_lock);
+    return m_frameCount;
+}
+
+void
+RecordingSummary::append(const float *const *samples, int nframes)
+{
+    QWriteLocker locker(&m_lock);
+
+    for (int c = 0; c < m_channels; ++c) {
+
+        const float *s = samples[c];
+        Accumulator &base = m_accumulators[0][c];
+
+        for (int i = 0; i < nframes; ++i) {
+
+            float v = s[i];
+
+            if (base.count == 0) {
+                base.peak.min = v;
+                base.peak.max = v;
+            } else {
+                if (v < base.peak.min) base.peak.min = v;
+                if (v > base.peak.max) base.peak.max = v;
+            }
+            base.absTotal += fabsf(v);
+
+            if (++base.count < BASE_BLOCK_SIZE) continue;
+
+            // A block is complete at the finest level: publish it and
+            // carry it up through any coarser levels it completes
+
+            Peak peak = base.peak;
+            peak.absmean = float(base.absTotal / base.count);
+            base = Accumulator();
+
+            m_peaks[0][c].push_back(peak);
+
+            for (int level = 1; level < LEVEL_COUNT; ++level) {
+                Accumulator &acc = m_accumulators[level][c];
+                acc.add(peak, 1);
+                if (acc.count < LEVEL_RATIO) break;
+                peak = acc.peak;
+                peak.absmean = float(acc.absTotal / acc.count);
+                acc = Accumulator();
+                m_peaks[level][c].push_back(peak);
+            }
+        }
+    }
+
+    m_frameCount += nframes;
+}
+
+void
+RecordingSummary::getSummary(int channel, sv_frame_t start, sv_frame_t count,
+                             std::vector<Peak> &peaks, int &blockSize) const
+{
+    peaks.clear();
+
+    int level = 0;
+    int levelBlockSize = BASE_BLOCK_SIZE;
+    while (level + 1 < LEVEL_COUNT &&
+           levelBlockSize * LEVEL_RATIO <= blockSize) {
+        ++level;
+        levelBlockSize *= LEVEL_RATIO;
+    }
+    blockSize = levelBlockSize;
+
+    if (channel < 0 || channel >= m_channels || count <= 0) return;
+    if (start < 0) {
+        count += start;
+        start = 0;
+    }
+
+    QReadLocker locker(&m_lock);
+
+    const std::deque<Peak> &source = m_peaks[level][channel];
+
+    size_t first = size_t(start / levelBlockSize);
+    size_t last = size_t((start + count + levelBlockSize - 1) /
+                         levelBlockSize);
+    last = std::min(last, source.size());
+    if (first >= last) return;
+
+    peaks.assign(source.begin() + first, source.begin() + last);
+}
+
+} // end namespace sv
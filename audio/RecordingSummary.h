@@ -0,0 +1,108 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_RECORDING_SUMMARY_H
+#define SV_RECORDING_SUMMARY_H
+
+#include "base/BaseTypes.h"
+
+#include <QReadWriteLock>
+
+#include <deque>
+#include <vector>
+
+namespace sv {
+
+/**
+ * Multi-resolution peak summaries of audio as it is recorded, built
+ * incrementally by the record target's writer thread as each block
+ * is written, so that a view of a long recording can be drawn
+ * without reading back, or rescanning, the file.
+ *
+ * There are several levels of summary: the finest has one peak per
+ * getBaseBlockSize() frames, and each coarser one has one peak per
+ * getLevelRatio() peaks of the level below. Only complete blocks are
+ * summarised, so the summaries lag the audio by up to one block at
+ * each level.
+ *
+ * append() is for one thread (the writer) only. All other functions
+ * may be called from any thread.
+ */
+class RecordingSummary
+{
+public:
+    struct Peak {
+        float min = 0.f;
+        float max = 0.f;
+        float absmean = 0.f;
+    };
+
+    RecordingSummary(int channels);
+    ~RecordingSummary();
+
+    int getChannelCount() const { return m_channels; }
+
+    /**
+     * Add the given number of frames, in all channels, to the end of
+     * the summarised audio.
+     */
+    void append(const float *const *samples, int nframes);
+
+    /**
+     * Return the number of frames appended so far.
+     */
+    sv_frame_t getFrameCount() const;
+
+    static int getBaseBlockSize();
+    static int getLevelRatio();
+    static int getLevelCount();
+
+    /**
+     * Retrieve peaks for the given channel covering as much as has
+     * been summarised of the given range of frames, at the coarsest
+     * level whose block size is no greater than the blockSize
+     * requested. On return, blockSize holds the block size of the
+     * level used and peaks holds one peak for each block, starting
+     * from the block containing the start frame.
+     */
+    void getSummary(int channel, sv_frame_t start, sv_frame_t count,
+                    std::vector<Peak> &peaks, int &blockSize) const;
+
+private:
+    struct Accumulator {
+        Peak peak;
+        double absTotal = 0.0;
+        int count = 0;
+        void add(const Peak &, int weight);
+    };
+
+    int m_channels;
+    sv_frame_t m_frameCount;
+
+    // m_peaks[level][channel]
+    std::vector<std::vector<std::deque<Peak>>> m_peaks;
+
+    // m_accumulators[level][channel], for the block in progress;
+    // writer thread only
+    std::vector<std::vector<Accumulator>> m_accumulators;
+
+    mutable QReadWriteLock m_lock; // for m_frameCount and m_peaks
+
+    RecordingSummary(const RecordingSummary &) =delete;
+    RecordingSummary &operator=(const RecordingSummary &) =delete;
+};
+
+} // end namespace sv
+
+#endif
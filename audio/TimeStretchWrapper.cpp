@@ -13,46 +13,331 @@
 */
 
 #include "TimeStretchWrapper.h"
+#include "PlaybackHealth.h"
+#include "RealtimeAudit.h"
+#include "MixKernels.h"
+#include "MixWorkerPool.h"
 
 #include <rubberband/RubberBandStretcher.h>
 
 #include "base/Debug.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
 using namespace RubberBand;
 using namespace std;
 
 namespace sv {
 
+// Callbacks in a row for which the source must be out of step with
+// the stretched loop before we give up on it, and by how much. The
+// source's position is only approximate while it is being refilled
+static const int LOOP_DRIFT_CALLBACKS = 3;
+static const sv_frame_t LOOP_DRIFT_TOLERANCE = 2048;
+
+// Length of the crossfade from one stretcher to the next, in output
+// frames
+static const sv_frame_t CROSSFADE_FRAMES = 2048;
+
+// Input retained for priming a new stretcher: enough for its start
+// pad, the output lag of the old one, and the time taken to prepare
+static const sv_frame_t HISTORY_FRAMES = 65536;
+
+// Output frames discarded at a time from the start of a stretcher
+static const int DISCARD_BLOCK_SIZE = 1024;
+
+/**
+ * One or more RubberBandStretchers acting as one: either a single
+ * stretcher for all channels, or one per channel with the channels
+ * processed in parallel on a worker pool.
+ */
+class TimeStretchWrapper::Stretcher
+{
+public:
+    Stretcher(sv_samplerate_t sampleRate, int channels, double ratio,
+              Quality quality, MixWorkerPool *pool) :
+        m_channels(channels),
+        m_quality(quality),
+        m_pool(pool),
+        m_discard(0),
+        m_lead(0),
+        m_fed(0),
+        m_position(0.0),
+        m_processInput(nullptr),
+        m_processFrames(0),
+        m_discardBuffers(channels, vector<float>(DISCARD_BLOCK_SIZE)),
+        m_discardPtrs(channels, nullptr),
+        m_unitPtrs(channels, nullptr)
+    {
+        RubberBandStretcher::Options options =
+            RubberBandStretcher::OptionProcessRealTime;
+        if (quality == Quality::Finer) {
+            options |= RubberBandStretcher::OptionEngineFiner;
+        }
+
+        int units = (m_pool ? channels : 1);
+        for (int i = 0; i < units; ++i) {
+            m_units.push_back(new RubberBandStretcher
+                              (size_t(round(sampleRate)),
+                               m_pool ? 1 : channels,
+                               options,
+                               ratio));
+        }
+
+        if (quality == Quality::Finer &&
+            m_units[0]->getEngineVersion() != 3) {
+            SVDEBUG << "TimeStretchWrapper::Stretcher: WARNING: Unexpected engine version " << m_units[0]->getEngineVersion() << " (expected 3)" << endl;
+        }
+        
+        for (int c = 0; c < channels; ++c) {
+            m_discardPtrs[c] = m_discardBuffers[c].data();
+        }
+
+        m_processJob = [this](int c) {
+            const float *input = m_processInput[c];
+            m_units[c]->process(&input, size_t(m_processFrames), false);
+        };
+
+        resetPosition();
+    }
+
+    ~Stretcher() {
+        for (auto u: m_units) delete u;
+    }
+
+    Quality getQuality() const { return m_quality; }
+    bool isMultithreaded() const { return m_pool != nullptr; }
+
+    double getTimeRatio() const { return m_units[0]->getTimeRatio(); }
+
+    void setTimeRatio(double ratio) {
+        for (auto u: m_units) u->setTimeRatio(ratio);
+    }
+
+    int getLatency() const { return int(m_units[0]->getLatency()); }
+    int getPreferredStartPad() const {
+        return int(m_units[0]->getPreferredStartPad());
+    }
+    int getStartDelay() const { return int(m_units[0]->getStartDelay()); }
+
+    int getSamplesRequired() const {
+        size_t required = 0;
+        for (auto u: m_units) {
+            required = std::max(required, u->getSamplesRequired());
+        }
+        return int(required);
+    }
+
+    /**
+     * Return the number of input frames by which our output lags
+     * our input: the input frame that the next output frame
+     * retrieved corresponds to is this many frames before the end
+     * of the input processed so far.
+     */
+    sv_frame_t getOutputLag() const {
+        return std::max(sv_frame_t(0),
+                        sv_frame_t(round(double(m_fed) - m_position)));
+    }
+
+    /**
+     * Declare that the input processed so far began with
+     * getPreferredStartPad() frames that are not to be heard. The
+     * start delay is discarded from the output as it becomes
+     * available, so that the output heard begins with the input that
+     * followed the pad.
+     */
+    void setPadded() {
+        m_discard = getStartDelay();
+        m_lead = 0;
+        m_position = getPreferredStartPad();
+    }
+
+    /**
+     * Discard the output for the given number of input frames
+     * following the current output position.
+     */
+    void skip(sv_frame_t frames) {
+        m_discard += int(round(double(frames) * getTimeRatio()));
+        m_position += double(frames);
+    }
+
+    void reset() {
+        for (auto u: m_units) u->reset();
+        resetPosition();
+    }
+    
+    void process(const float *const *input, int frames) {
+        m_fed += frames;
+        if (!m_pool) {
+            m_units[0]->process(input, size_t(frames), false);
+            return;
+        }
+        m_processInput = input;
+        m_processFrames = frames;
+        m_pool->run(m_channels, m_processJob);
+    }
+
+    int available() {
+        discard();
+        return getRawAvailable();
+    }
+
+    int retrieve(float *const *output, int frames) {
+        discard();
+        int got = retrieveRaw(output, std::min(frames, getRawAvailable()));
+        advance(got);
+        return got;
+    }
+
+private:
+    int m_channels;
+    Quality m_quality;
+    MixWorkerPool *m_pool;
+    vector<RubberBandStretcher *> m_units;
+    int m_discard;      // output frames still to be dropped
+    double m_lead;      // output frames still to go before input frame 0
+    sv_frame_t m_fed;   // input frames processed
+    double m_position;  // input frame of the next output frame
+    const float *const *m_processInput;
+    int m_processFrames;
+    MixWorkerPool::Job m_processJob;
+    vector<vector<float>> m_discardBuffers;
+    vector<float *> m_discardPtrs;
+    vector<float *> m_unitPtrs;
+
+    int getRawAvailable() const {
+        int available = 0;
+        for (size_t i = 0; i < m_units.size(); ++i) {
+            int a = m_units[i]->available();
+            if (i == 0 || a < available) available = a;
+        }
+        return std::max(available, 0);
+    }
+
+    int retrieveRaw(float *const *output, int frames) {
+        if (frames <= 0) return 0;
+        if (!m_pool) {
+            return int(m_units[0]->retrieve(output, size_t(frames)));
+        }
+        // Separate stretchers may differ by a frame or two in what
+        // they have ready; we only asked for what they all have
+        for (int c = 0; c < m_channels; ++c) {
+            m_unitPtrs[c] = output[c];
+            m_units[c]->retrieve(&m_unitPtrs[c], size_t(frames));
+        }
+        return frames;
+    }
+    
+    void resetPosition() {
+        // Without a start pad, the output begins with whatever part
+        // of the start delay the pad would have accounted for
+        m_discard = 0;
+        m_fed = 0;
+        m_position = 0.0;
+        m_lead = std::max(0.0, getStartDelay() -
+                          getTimeRatio() * getPreferredStartPad());
+    }
+
+    void advance(int frames) {
+        double n = frames;
+        if (m_lead > 0.0) {
+            double skipped = std::min(m_lead, n);
+            m_lead -= skipped;
+            n -= skipped;
+        }
+        m_position += n / getTimeRatio();
+    }
+    
+    void discard() {
+        while (m_discard > 0) {
+            int n = std::min(std::min(m_discard, getRawAvailable()),
+                             DISCARD_BLOCK_SIZE);
+            if (n <= 0) break;
+            retrieveRaw(m_discardPtrs.data(), n);
+            m_discard -= n;
+        }
+    }
+
+    Stretcher(const Stretcher &) =delete;
+    Stretcher &operator=(const Stretcher &) =delete;
+};
+
+sv_frame_t
+TimeStretchWrapper::StretchedLoop::getSourceOffset(sv_frame_t frame) const
+{
+    // The end of a range is included, as the source reports a fill
+    // that has just reached it before moving on to the next one
+    
+    sv_frame_t offset = 0;
+    for (const auto &r: ranges) {
+        if (frame >= r.first && frame <= r.second) {
+            return offset + frame - r.first;
+        }
+        offset += r.second - r.first;
+    }
+    return -1;
+}
+
 TimeStretchWrapper::TimeStretchWrapper(ApplicationPlaybackSource *source) :
     m_source(source),
     m_stretcher(nullptr),
+    m_pending(nullptr),
+    m_havePending(false),
+    m_pendingInputCount(0),
+    m_fadingOut(nullptr),
+    m_fadePosition(0),
+    m_pool(nullptr),
     m_timeRatio(1.0),
     m_quality(Quality::Finer),
-    m_qualityChangePending(false),
+    m_multithreading(false),
+    m_historyWrite(0),
+    m_historyFill(0),
+    m_inputCount(0),
     m_stretcherInputSize(16384),
     m_channelCount(0),
     m_lastReportedSystemLatency(0),
-    m_sampleRate(0)
+    m_sampleRate(0),
+    m_health(nullptr),
+    m_playingLoop(false),
+    m_loopPosition(0),
+    m_loopLatency(0),
+    m_loopInputOwed(0.0),
+    m_loopDriftCount(0),
+    m_sourceBufferedTo(-1),
+    m_sourceBuffered(0),
+    m_lastSourceOffset(-1)
 {
 }
 
 TimeStretchWrapper::~TimeStretchWrapper()
 {
     delete m_stretcher;
+    delete m_pending;
+    delete m_fadingOut;
+
+    // Before the pool, which the stretchers may use
+    m_scavenger.scavenge(true);
+    
+    delete m_pool;
 }
 
 void
 TimeStretchWrapper::setTimeStretchRatio(double ratio)
 {
-    lock_guard<mutex> guard(m_mutex);
+    {
+        lock_guard<mutex> guard(m_mutex);
 
-    SVDEBUG << "TimeStretchWrapper::setTimeStretchRatio: setting ratio to "
-            << ratio << " (was " << m_timeRatio << ")" << endl;
+        SVDEBUG << "TimeStretchWrapper::setTimeStretchRatio: setting ratio to "
+                << ratio << " (was " << m_timeRatio << ")" << endl;
     
-    m_timeRatio = ratio;
+        m_timeRatio = ratio;
+    }
 
-    // Stretcher will be updated by checkStretcher() from next call to
-    // reset() or getSourceSamples()
+    // An existing stretcher is updated from the next call to
+    // getSourceSamples; a new one is prepared here if needed
+    prepareStretcher();
 }
 
 double
@@ -64,16 +349,16 @@ TimeStretchWrapper::getTimeStretchRatio() const
 void
 TimeStretchWrapper::setQuality(Quality quality)
 {
-    lock_guard<mutex> guard(m_mutex);
+    {
+        lock_guard<mutex> guard(m_mutex);
 
-    SVDEBUG << "TimeStretchWrapper::setTimeStretchRatio: setting quality to "
-            << int(quality) << " (was " << int(m_quality) << ")" << endl;
+        SVDEBUG << "TimeStretchWrapper::setQuality: setting quality to "
+                << int(quality) << " (was " << int(m_quality) << ")" << endl;
 
-    if (m_quality != quality) {
-        m_qualityChangePending = true;
+        m_quality = quality;
     }
-    
-    m_quality = quality;
+
+    prepareStretcher();
 }
 
 TimeStretchWrapper::Quality
@@ -82,34 +367,396 @@ TimeStretchWrapper::getQuality() const
     return m_quality;
 }
 
+void
+TimeStretchWrapper::setMultithreading(bool multithreading)
+{
+    {
+        lock_guard<mutex> guard(m_mutex);
+
+        SVDEBUG << "TimeStretchWrapper::setMultithreading: "
+                << multithreading << endl;
+
+        m_multithreading = multithreading;
+    }
+
+    prepareStretcher();
+}
+
+bool
+TimeStretchWrapper::getMultithreading() const
+{
+    return m_multithreading;
+}
+
 void
 TimeStretchWrapper::reset()
 {
-    m_mutex.lock();
+    Stretcher *obsolete = nullptr;
+    Stretcher *fadingOut = nullptr;
+
+    {
+        lock_guard<mutex> guard(m_mutex);
+
+        // A reset is a discontinuity anyway, so there is no need to
+        // crossfade to any pending stretcher
+        
+        if (m_havePending) {
+            obsolete = m_stretcher;
+            m_stretcher = m_pending;
+            m_pending = nullptr;
+            m_havePending = false;
+            setSystemPlaybackLatency(m_lastReportedSystemLatency);
+        }
+        
+        fadingOut = m_fadingOut;
+        m_fadingOut = nullptr;
     
-    if (m_qualityChangePending) {
+        if (m_stretcher) {
+            m_stretcher->reset();
+        }
 
-        delete m_stretcher;
-        m_stretcher = nullptr;
+        m_historyFill = 0;
+        m_inputCount = 0;
         
-        m_mutex.unlock();
-        checkStretcher();
-        m_mutex.lock();
+        m_playingLoop = false;
+        m_sourceBufferedTo = -1;
+        m_lastSourceOffset = -1;
+    }
+
+    delete obsolete;
+    delete fadingOut;
+}
+
+void
+TimeStretchWrapper::setStretchedLoop(std::shared_ptr<const StretchedLoop> loop)
+{
+    {
+        lock_guard<mutex> guard(m_mutex);
+
+        SVDEBUG << "TimeStretchWrapper::setStretchedLoop: "
+                << (loop ? "setting" : "clearing") << " stretched loop"
+                << endl;
         
-    } else if (m_stretcher) {
-        m_stretcher->reset();
+        m_loop.swap(loop);
+        if (!m_loop) {
+            m_playingLoop = false;
+        }
+        m_lastSourceOffset = -1;
     }
 
-    m_mutex.unlock();
+    // Any previous loop is released here, outside the lock
+}
+
+void
+TimeStretchWrapper::setSourcePosition(sv_frame_t bufferedTo,
+                                      sv_frame_t buffered)
+{
+    // Called from within m_source->getSourceSamples, so m_mutex is
+    // already held by us
+    
+    m_sourceBufferedTo = bufferedTo;
+    m_sourceBuffered = buffered;
+}
+
+void
+TimeStretchWrapper::setPlaybackHealth(PlaybackHealth *health)
+{
+    lock_guard<mutex> guard(m_mutex);
+    m_health = health;
+}
+
+void
+TimeStretchWrapper::prepareStretcher()
+{
+    lock_guard<mutex> prepareGuard(m_prepareMutex);
+
+    m_scavenger.scavenge();
+    
+    double ratio = 1.0;
+    Quality quality = Quality::Finer;
+    bool multithreading = false;
+    int channels = 0;
+    sv_samplerate_t rate = 0;
+    Stretcher *obsolete = nullptr;
+    bool wanted = false;
+    
+    {
+        lock_guard<mutex> guard(m_mutex);
+
+        ratio = m_timeRatio;
+        quality = m_quality;
+        multithreading = (m_multithreading && m_channelCount > 1 &&
+                          MixWorkerPool::getDefaultThreadCount() > 0);
+        channels = m_channelCount;
+        rate = m_sampleRate;
+
+        // The stretcher we will end up with if nothing changes here
+        Stretcher *target = (m_havePending ? m_pending : m_stretcher);
+        
+        if (ratio == 1.0 || !channels || !rate) {
+            // Bypass, fading out any current stretcher
+            obsolete = m_pending;
+            m_pending = nullptr;
+            m_havePending = (m_stretcher != nullptr);
+        } else if (target &&
+                   target->getQuality() == quality &&
+                   target->isMultithreaded() == multithreading) {
+            // Nothing to prepare: any ratio change is made in place
+            // from getSourceSamples
+        } else {
+            wanted = true;
+        }
+    }
+
+    delete obsolete;
+    obsolete = nullptr;
+    
+    if (!wanted) return;
+
+    SVDEBUG << "TimeStretchWrapper::prepareStretcher: creating stretcher with ratio " << ratio << ", quality " << int(quality) << ", multithreading " << multithreading << endl;
+
+    if (multithreading && !m_pool) {
+        m_pool = new MixWorkerPool
+            (std::min(channels - 1, MixWorkerPool::getDefaultThreadCount()),
+             Thread::RTThread);
+    }
+    
+    Stretcher *stretcher = new Stretcher(rate, channels, ratio, quality,
+                                         multithreading ? m_pool : nullptr);
+
+    // If anything has been played yet, prime the new stretcher with
+    // the most recent input, so that once it has been given its
+    // start pad and the old stretcher's output lag, and we have
+    // discarded its start delay, its output carries on from the
+    // point the old stretcher's has reached
+
+    vector<vector<float>> history;
+    sv_frame_t inputCount = 0;
+    bool primed = false;
+    
+    {
+        lock_guard<mutex> guard(m_mutex);
+
+        if (m_historyFill > 0 && channels == m_channelCount) {
+
+            sv_frame_t lag = (m_stretcher ? m_stretcher->getOutputLag() : 0);
+            sv_frame_t frames = stretcher->getPreferredStartPad() + lag;
+            frames = std::min(frames, HISTORY_FRAMES);
+            sv_frame_t have = std::min(frames, m_historyFill);
+
+            // Zeros first for anything we don't have
+            history.resize(channels, vector<float>(frames, 0.f));
+            for (int c = 0; c < channels; ++c) {
+                const vector<float> &h = m_history[c];
+                for (sv_frame_t i = 0; i < have; ++i) {
+                    sv_frame_t ix = (m_historyWrite - have + i + HISTORY_FRAMES)
+                        % HISTORY_FRAMES;
+                    history[c][frames - have + i] = h[ix];
+                }
+            }
+
+            inputCount = m_inputCount;
+            primed = true;
+        }
+    }
+
+    if (primed) {
+        vector<const float *> ptrs(channels, nullptr);
+        sv_frame_t total = sv_frame_t(history[0].size());
+        for (sv_frame_t done = 0; done < total; ) {
+            int n = int(std::min(total - done, sv_frame_t(m_stretcherInputSize)));
+            for (int c = 0; c < channels; ++c) {
+                ptrs[c] = history[c].data() + done;
+            }
+            stretcher->process(ptrs.data(), n);
+            done += n;
+        }
+        stretcher->setPadded();
+    }
+    
+    {
+        lock_guard<mutex> guard(m_mutex);
+
+        if (channels != m_channelCount || rate != m_sampleRate) {
+            // Changed while we were preparing; the change will have
+            // prepared another
+            obsolete = stretcher;
+        } else {
+            obsolete = m_pending;
+            m_pending = stretcher;
+            m_havePending = true;
+            m_pendingInputCount = (primed ? inputCount : -1);
+        }
+    }
+
+    delete obsolete;
+}
+
+void
+TimeStretchWrapper::adoptPending()
+{
+    if (!m_havePending) return;
+
+    Stretcher *next = m_pending;
+    m_pending = nullptr;
+    m_havePending = false;
+
+    if (next && m_playingLoop) {
+        // Will start afresh on leaving the loop, as checkLoopEntry
+        // leaves the current one
+        next->reset();
+    } else if (next && m_pendingInputCount >= 0) {
+        
+        // Catch up with the input that has arrived since it was
+        // primed, then skip the output that the old stretcher (or
+        // the unstretched source) has played in the meantime
+        
+        feedHistory(next, m_inputCount - m_pendingInputCount);
+
+        sv_frame_t lag = (m_stretcher ? m_stretcher->getOutputLag() : 0);
+        sv_frame_t excess = next->getOutputLag() - lag;
+        if (excess > 0) {
+            next->skip(excess);
+        }
+    }
+
+    if (m_fadingOut) {
+        // Still fading from an earlier one: drop it
+        retire(m_fadingOut);
+        m_fadingOut = nullptr;
+    }
+
+    if (m_stretcher) {
+        if (m_playingLoop) {
+            retire(m_stretcher);
+        } else {
+            m_fadingOut = m_stretcher;
+            m_fadePosition = 0;
+        }
+    }
+
+    m_stretcher = next;
+
+    if (!m_stretcher) {
+        m_playingLoop = false;
+    }
+    
+    // Notify upstream of changed latency due to stretcher
+    setSystemPlaybackLatency(m_lastReportedSystemLatency);
+}
+
+void
+TimeStretchWrapper::retire(Stretcher *stretcher)
+{
+    // Realtime safe: the scavenger deletes it later, from
+    // prepareStretcher or the destructor
+    m_scavenger.claim(stretcher);
+}
+
+void
+TimeStretchWrapper::recordInput(const float *const *input, int frames)
+{
+    if (m_history.empty()) return;
+
+    int channels = std::min(m_channelCount, int(m_history.size()));
+    sv_frame_t offset = 0;
+    
+    if (frames > HISTORY_FRAMES) {
+        offset = frames - HISTORY_FRAMES;
+        frames = int(HISTORY_FRAMES);
+    }
+    
+    for (int c = 0; c < channels; ++c) {
+        float *h = m_history[c].data();
+        sv_frame_t w = m_historyWrite;
+        sv_frame_t done = 0;
+        while (done < frames) {
+            sv_frame_t n = std::min(sv_frame_t(frames) - done,
+                                    HISTORY_FRAMES - w);
+            const float *from = input[c] + offset + done;
+            std::copy(from, from + n, h + w);
+            done += n;
+            w = (w + n) % HISTORY_FRAMES;
+        }
+    }
+
+    m_historyWrite = (m_historyWrite + frames) % HISTORY_FRAMES;
+    m_historyFill = std::min(m_historyFill + frames, HISTORY_FRAMES);
+    m_inputCount += frames + offset;
+}
+
+void
+TimeStretchWrapper::feedHistory(Stretcher *stretcher, sv_frame_t frames)
+{
+    frames = std::min(frames, m_historyFill);
+    if (frames <= 0) return;
+
+    int channels = m_channelCount;
+    sv_frame_t r = (m_historyWrite - frames + HISTORY_FRAMES) % HISTORY_FRAMES;
+
+    while (frames > 0) {
+        sv_frame_t n = std::min(std::min(frames, HISTORY_FRAMES - r),
+                                sv_frame_t(m_stretcherInputSize));
+        for (int c = 0; c < channels; ++c) {
+            m_historyPtrs[c] = m_history[c].data() + r;
+        }
+        stretcher->process(m_historyPtrs.data(), int(n));
+        frames -= n;
+        r = (r + n) % HISTORY_FRAMES;
+    }
+}
+
+void
+TimeStretchWrapper::crossfade(float *const *samples, int nchannels,
+                              int nframes)
+{
+    // Mix the fading-out stretcher's output into samples, which hold
+    // the output of the new stretcher (or the unstretched source)
+    
+    int done = 0;
+    int channels = std::min(nchannels, m_channelCount);
+    
+    while (done < nframes && m_fadingOut) {
+
+        int n = int(std::min(std::min(sv_frame_t(nframes - done),
+                                      CROSSFADE_FRAMES - m_fadePosition),
+                             sv_frame_t(m_stretcherInputSize)));
+        
+        int got = m_fadingOut->retrieve(m_fadePtrs.data(), n);
+        if (got < 0) got = 0;
+        
+        float gain = float(m_fadePosition) / float(CROSSFADE_FRAMES);
+        float step = 1.f / float(CROSSFADE_FRAMES);
+
+        for (int c = 0; c < channels; ++c) {
+            std::fill(m_fadePtrs[c] + got, m_fadePtrs[c] + n, 0.f);
+            MixKernels::multiplyByRamp(samples[c] + done, gain, step, n);
+            MixKernels::addWithRamp(samples[c] + done, m_fadePtrs[c],
+                                    1.f - gain, -step, n);
+        }
+
+        done += n;
+        m_fadePosition += n;
+
+        if (m_fadePosition >= CROSSFADE_FRAMES) {
+            retire(m_fadingOut);
+            m_fadingOut = nullptr;
+        }
+    }
 }
 
 int
 TimeStretchWrapper::getSourceSamples(float *const *samples,
                                      int nchannels, int nframes)
 {
-    checkStretcher();
+    RealtimeAudit::Scope scope("audio callback");
 
-    lock_guard<mutex> guard(m_mutex);
+    RealtimeAudit::noteLockTaken("TimeStretchWrapper::getSourceSamples");
+    unique_lock<mutex> guard(m_mutex, try_to_lock);
+    if (!guard.owns_lock()) {
+        RealtimeAudit::noteLock("TimeStretchWrapper::getSourceSamples");
+        guard.lock();
+    }
 
     static int warnings = 0;
     if (nchannels != m_channelCount) {
@@ -123,16 +770,40 @@ TimeStretchWrapper::getSourceSamples(float *const *samples,
         }
         return 0;
     }
+
+    adoptPending();
     
     if (!m_stretcher) {
-        return m_source->getSourceSamples(samples, nchannels, nframes);
+        int got = m_source->getSourceSamples(samples, nchannels, nframes);
+        if (got > 0) {
+            recordInput(samples, got);
+            if (m_fadingOut) {
+                // Returning to a ratio of 1.0: fade out the stretcher
+                // over the unstretched input
+                m_fadingOut->process(samples, got);
+                crossfade(samples, nchannels, got);
+            }
+        }
+        return got;
     }
 
-    vector<float *> inputPtrs(m_channelCount, nullptr);
-    for (int i = 0; i < m_channelCount; ++i) {
-        inputPtrs[i] = m_inputs[i].data();
+    if (m_stretcher->getTimeRatio() != m_timeRatio) {
+        SVDEBUG << "TimeStretchWrapper::getSourceSamples: setting stretcher ratio to " << m_timeRatio << endl;
+        m_stretcher->setTimeRatio(m_timeRatio);
+    }
+    
+    if (m_playingLoop) {
+        if (m_loop->ratio == m_timeRatio) {
+            return getLoopSamples(samples, nchannels, nframes);
+        }
+        m_playingLoop = false;
     }
     
+    int64_t startTime = PlaybackHealth::now();
+    int64_t sourceTime = 0;
+
+    vector<float *> &inputPtrs(m_inputPtrs);
+    
     // The input block for a given output is approx output / ratio,
     // but we can't predict it exactly, for an adaptive timestretcher.
 
@@ -141,12 +812,14 @@ TimeStretchWrapper::getSourceSamples(float *const *samples,
     while ((available = m_stretcher->available()) < nframes) {
         
         int reqd = int(ceil(double(nframes - available) / m_timeRatio));
-        reqd = std::max(reqd, int(m_stretcher->getSamplesRequired()));
+        reqd = std::max(reqd, m_stretcher->getSamplesRequired());
         reqd = std::min(reqd, m_stretcherInputSize);
         if (reqd == 0) reqd = 1;
         
+        int64_t sourceStart = PlaybackHealth::now();
         int got = m_source->getSourceSamples
             (inputPtrs.data(), nchannels, reqd);
+        sourceTime += PlaybackHealth::now() - sourceStart;
 
         if (got <= 0) {
             // Don't print this - it happens routinely when we aren't playing!
@@ -154,66 +827,229 @@ TimeStretchWrapper::getSourceSamples(float *const *samples,
 //                   << endl;
             return 0;
         }
+
+        recordInput(inputPtrs.data(), got);
             
-        m_stretcher->process
-            (inputPtrs.data(), size_t(got), false);
+        m_stretcher->process(inputPtrs.data(), got);
+
+        if (m_fadingOut) {
+            m_fadingOut->process(inputPtrs.data(), got);
+        }
     }
 
-    return int(m_stretcher->retrieve(samples, nframes));
+    int retrieved = m_stretcher->retrieve(samples, nframes);
+
+    if (m_fadingOut) {
+        crossfade(samples, nchannels, retrieved);
+    }
+    
+    if (m_health) {
+        m_health->recordStretch(PlaybackHealth::now() - startTime -
+                                sourceTime);
+    }
+
+    checkLoopEntry(nchannels);
+    
+    return retrieved;
 }
 
-void
-TimeStretchWrapper::checkStretcher()
+sv_frame_t
+TimeStretchWrapper::getSourceLoopOffset(const StretchedLoop &loop) const
 {
-    lock_guard<mutex> guard(m_mutex);
+    if (m_sourceBufferedTo < 0 || loop.sourceFrames <= 0) return -1;
 
-    if (m_timeRatio == 1.0 || !m_channelCount || !m_sampleRate) {
-        if (m_stretcher) {
-            SVDEBUG << "TimeStretchWrapper::checkStretcher: m_timeRatio = "
-                    << m_timeRatio << ", m_channelCount = " << m_channelCount
-                    << ", m_sampleRate = " << m_sampleRate
-                    << ", deleting existing stretcher" << endl;
-            delete m_stretcher;
-            m_stretcher = nullptr;
-        }
+    sv_frame_t offset = loop.getSourceOffset(m_sourceBufferedTo);
+    if (offset < 0) return -1;
+
+    offset = (offset - m_sourceBuffered) % loop.sourceFrames;
+    if (offset < 0) offset += loop.sourceFrames;
+    return offset;
+}
+
+void
+TimeStretchWrapper::checkLoopEntry(int nchannels)
+{
+    if (!m_loop ||
+        m_loop->ratio != m_timeRatio ||
+        m_loop->channels > nchannels ||
+        m_loop->data.empty() ||
+        m_loop->data[0].empty()) {
+        m_lastSourceOffset = -1;
         return;
     }
+
+    sv_frame_t offset = getSourceLoopOffset(*m_loop);
+    sv_frame_t lastOffset = m_lastSourceOffset;
+    m_lastSourceOffset = offset;
+
+    // Switch over only as the source wraps around the loop point,
+    // where the join is covered by the fades there anyway
     
-    if (m_stretcher) {
-        if (m_timeRatio != m_stretcher->getTimeRatio()) {
-            SVDEBUG << "TimeStretchWrapper::checkStretcher: setting stretcher ratio to " << m_timeRatio << endl;
-            m_stretcher->setTimeRatio(m_timeRatio);
-        }
+    if (offset < 0 || lastOffset < 0 || offset >= lastOffset) {
         return;
     }
 
-    SVDEBUG << "TimeStretchWrapper::checkStretcher: creating stretcher with ratio " << m_timeRatio << endl;
+    // Start from where the live stretcher has got to in its output,
+    // which is behind the source by its latency and by whatever it
+    // has processed but not yet returned
+    
+    m_loopLatency = m_stretcher->getOutputLag();
+
+    const StretchedLoop &loop = *m_loop;
+    sv_frame_t outFrames = sv_frame_t(loop.data[0].size());
+    double ratio = double(outFrames) / double(loop.sourceFrames);
 
-    RubberBandStretcher::Options options = 0;
-    if (m_quality == Quality::Finer) {
-        SVDEBUG << "TimeStretchWrapper::checkStretcher: using finer-quality stretcher" << endl;
-        options = RubberBandStretcher::OptionEngineFiner;
+    sv_frame_t from = (offset - m_loopLatency) % loop.sourceFrames;
+    if (from < 0) from += loop.sourceFrames;
+    
+    m_loopPosition = sv_frame_t(round(double(from) * ratio)) % outFrames;
+    m_loopInputOwed = 0.0;
+    m_loopDriftCount = 0;
+    m_playingLoop = true;
+
+    // Ready for when we return to it
+    m_stretcher->reset();
+    if (m_fadingOut) {
+        retire(m_fadingOut);
+        m_fadingOut = nullptr;
     }
+
+    SVDEBUG << "TimeStretchWrapper: switching to stretched loop at source offset " << from << " (output frame " << m_loopPosition << " of " << outFrames << ")" << endl;
+}
+
+int
+TimeStretchWrapper::getLoopSamples(float *const *samples,
+                                   int nchannels, int nframes)
+{
+    int64_t startTime = PlaybackHealth::now();
+    int64_t sourceTime = 0;
     
-    m_stretcher = new RubberBandStretcher
-        (size_t(round(m_sampleRate)),
-         m_channelCount,
-         RubberBandStretcher::OptionProcessRealTime | options,
-         m_timeRatio);
+    const StretchedLoop &loop = *m_loop;
+    sv_frame_t outFrames = sv_frame_t(loop.data[0].size());
+    double ratio = double(outFrames) / double(loop.sourceFrames);
 
-    if (m_quality == Quality::Finer) {
-        if (m_stretcher->getEngineVersion() != 3) {
-            SVDEBUG << "TimeStretchWrapper::checkStretcher: WARNING: Unexpected engine version " << m_stretcher->getEngineVersion() << " (expected 3)" << endl;
+    // Pull as much from the source as the live stretcher would have
+    // consumed for this much output, and discard it, so that the
+    // source and its play position carry on as usual
+
+    vector<float *> &inputPtrs(m_inputPtrs);
+    
+    m_loopInputOwed += double(nframes) / ratio;
+    int owed = int(m_loopInputOwed);
+    
+    while (owed > 0) {
+        int reqd = std::min(owed, m_stretcherInputSize);
+        int64_t sourceStart = PlaybackHealth::now();
+        int got = m_source->getSourceSamples
+            (inputPtrs.data(), nchannels, reqd);
+        sourceTime += PlaybackHealth::now() - sourceStart;
+        if (got <= 0) {
+            // The source has run dry: return nothing, as the live
+            // path would, and catch up next time
+            return 0;
         }
+        recordInput(inputPtrs.data(), got);
+        owed -= got;
+        m_loopInputOwed -= got;
     }
+
+    for (int c = 0; c < nchannels; ++c) {
+        sv_frame_t position = m_loopPosition;
+        sv_frame_t done = 0;
+        while (done < nframes) {
+            sv_frame_t n = std::min(sv_frame_t(nframes) - done,
+                                    outFrames - position);
+            if (c < loop.channels) {
+                const float *from = loop.data[c].data() + position;
+                std::copy(from, from + n, samples[c] + done);
+            } else {
+                std::fill(samples[c] + done, samples[c] + done + n, 0.f);
+            }
+            done += n;
+            position = (position + n) % outFrames;
+        }
+    }
+    
+    m_loopPosition = (m_loopPosition + nframes) % outFrames;
+
+    // Check that we are still in step with the source. If not (for
+    // example because it has been refilled from elsewhere) go back
+    // to the live stretcher, to rejoin at the next loop point
     
-    m_inputs.resize(m_channelCount);
-    for (auto &v: m_inputs) {
-        v.resize(m_stretcherInputSize);
+    sv_frame_t offset = getSourceLoopOffset(loop);
+    if (offset >= 0) {
+        sv_frame_t expected = (offset - m_loopLatency) % loop.sourceFrames;
+        if (expected < 0) expected += loop.sourceFrames;
+        sv_frame_t actual = sv_frame_t(round(double(m_loopPosition) / ratio));
+        sv_frame_t drift = std::abs(expected - actual);
+        drift = std::min(drift, loop.sourceFrames - drift);
+        if (drift > LOOP_DRIFT_TOLERANCE) {
+            ++m_loopDriftCount;
+        } else {
+            m_loopDriftCount = 0;
+        }
+    } else {
+        ++m_loopDriftCount;
     }
 
-    // Notify upstream of changed latency due to stretcher
-    setSystemPlaybackLatency(m_lastReportedSystemLatency);
+    if (m_loopDriftCount >= LOOP_DRIFT_CALLBACKS) {
+        SVDEBUG << "TimeStretchWrapper: source is out of step with stretched loop, returning to live stretcher" << endl;
+        m_playingLoop = false;
+        m_lastSourceOffset = -1;
+    }
+    
+    if (m_health) {
+        m_health->recordStretch(PlaybackHealth::now() - startTime -
+                                sourceTime);
+    }
+    
+    return nframes;
+}
+
+void
+TimeStretchWrapper::allocateBuffers()
+{
+    int channels = m_channelCount;
+
+    m_inputs.resize(channels);
+    m_inputPtrs.resize(channels);
+    m_fadeBuffers.resize(channels);
+    m_fadePtrs.resize(channels);
+    m_history.resize(channels);
+    m_historyPtrs.resize(channels);
+
+    for (int c = 0; c < channels; ++c) {
+        m_inputs[c].resize(m_stretcherInputSize, 0.f);
+        m_inputPtrs[c] = m_inputs[c].data();
+        m_fadeBuffers[c].resize(m_stretcherInputSize, 0.f);
+        m_fadePtrs[c] = m_fadeBuffers[c].data();
+        m_history[c].resize(HISTORY_FRAMES, 0.f);
+    }
+
+    m_historyWrite = 0;
+    m_historyFill = 0;
+}
+
+void
+TimeStretchWrapper::discardStretchers()
+{
+    // Called when the channel count or rate changes, which no
+    // crossfade can cover
+
+    if (m_stretcher || m_pending) {
+        SVDEBUG << "TimeStretchWrapper: m_channelCount = " << m_channelCount
+                << ", m_sampleRate = " << m_sampleRate
+                << ", deleting existing stretcher" << endl;
+    }
+    
+    delete m_stretcher;
+    m_stretcher = nullptr;
+    delete m_pending;
+    m_pending = nullptr;
+    m_havePending = false;
+    delete m_fadingOut;
+    m_fadingOut = nullptr;
+    m_playingLoop = false;
 }
 
 void
@@ -222,12 +1058,13 @@ TimeStretchWrapper::setSystemPlaybackChannelCount(int count)
     {
         lock_guard<mutex> guard(m_mutex);
         if (m_channelCount != count) {
-            delete m_stretcher;
-            m_stretcher = nullptr;
+            m_channelCount = count;
+            discardStretchers();
+            allocateBuffers();
         }
-        m_channelCount = count;
     }
     m_source->setSystemPlaybackChannelCount(count);
+    prepareStretcher();
 }
 
 void
@@ -236,12 +1073,13 @@ TimeStretchWrapper::setSystemPlaybackSampleRate(int rate)
     {
         lock_guard<mutex> guard(m_mutex);
         if (m_sampleRate != rate) {
-            delete m_stretcher;
-            m_stretcher = nullptr;
+            m_sampleRate = rate;
+            discardStretchers();
+            m_historyFill = 0;
         }
-        m_sampleRate = rate;
     }
     m_source->setSystemPlaybackSampleRate(rate);
+    prepareStretcher();
 }
 
 std::string
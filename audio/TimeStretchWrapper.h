@@ -18,26 +18,39 @@
 #include "bqaudioio/ApplicationPlaybackSource.h"
 
 #include "base/BaseTypes.h"
+#include "base/Scavenger.h"
 
 #include <vector>
 #include <mutex>
-
-namespace RubberBand {
-    class RubberBandStretcher;
-}
+#include <memory>
 
 namespace sv {
 
+class PlaybackHealth;
+class MixWorkerPool;
+
 /**
  * A breakfastquay::ApplicationPlaybackSource wrapper that implements
  * time-stretching using Rubber Band. Note that the stretcher is
  * bypassed entirely when a ratio of 1.0 is set; this means it's
  * (almost) free to use one of these wrappers normally, but it also
- * means you can't switch from 1.0 to another ratio (or back again)
- * without some audible artifacts.
+ * means that switching back from another ratio to 1.0 involves a
+ * crossfade between material that is slightly out of step.
+ *
+ * Stretchers are never created in the audio callback. A change of
+ * quality or threading, or from a ratio of 1.0 to another, prepares
+ * a new stretcher in the calling thread, primed with the most recent
+ * input so that it can take over straight away. The callback
+ * adopts it and crossfades to it from the previous stretcher (or, on
+ * returning to 1.0, from the stretcher to the unstretched
+ * input). Changes between ratios other than 1.0 are made in place.
+ * The audio callback is real-time safe throughout.
  *
- * This is real-time safe while the ratio is fixed, and may perform
- * reallocations when the ratio changes.
+ * When looping, the wrapper can also be given a stretched copy of
+ * one pass through the loop, rendered ahead of time (see
+ * setStretchedLoop). It then switches from the live stretcher to the
+ * copy the next time playback passes the loop point, and back again
+ * if the ratio changes or the copy is withdrawn.
  */
 class TimeStretchWrapper : public breakfastquay::ApplicationPlaybackSource
 {
@@ -72,8 +85,8 @@ public:
     };
 
     /**
-     * Set a quality preference. The default is Finer. Any change will
-     * take effect at the next call to reset().
+     * Set a quality preference. The default is Finer. A change takes
+     * effect straight away, with a crossfade.
      */
     void setQuality(Quality quality);
 
@@ -81,12 +94,76 @@ public:
      * Obtain the current quality preference.
      */
     Quality getQuality() const;
+
+    /**
+     * Choose whether to stretch each channel separately, spreading
+     * the channels across worker threads, for multichannel
+     * material. The channels are then no longer analysed together,
+     * so that stereo images may be slightly less stable; this is
+     * worth it only when there are more channels than one core can
+     * stretch in time. The default is false. A change takes effect
+     * straight away, with a crossfade.
+     */
+    void setMultithreading(bool multithreading);
+
+    /**
+     * Return true if multithreading has been requested.
+     */
+    bool getMultithreading() const;
     
     /**
      * Clear stretcher buffers.
      */
     void reset();
 
+    /**
+     * One pass through a looped play region, already stretched.
+     */
+    struct StretchedLoop {
+        double ratio = 1.0;
+        int channels = 0;
+
+        // The source ranges, in the order that they are played in
+        // one pass of the loop, as start and end frames
+        std::vector<std::pair<sv_frame_t, sv_frame_t>> ranges;
+        sv_frame_t sourceFrames = 0; // total duration of the ranges
+
+        // The stretched audio, one vector per channel, aligned with
+        // the source (i.e. with no stretcher latency at the start)
+        std::vector<std::vector<float>> data;
+
+        /**
+         * Return the offset of the given source frame within one
+         * pass of the loop, or -1 if it is not in any of the ranges.
+         */
+        sv_frame_t getSourceOffset(sv_frame_t frame) const;
+    };
+
+    /**
+     * Supply a stretched pass through the loop to be played in place
+     * of the live stretcher, or nullptr to withdraw it. The loop is
+     * only used while its ratio matches the current one and while
+     * setSourcePosition is called, as below.
+     */
+    void setStretchedLoop(std::shared_ptr<const StretchedLoop> loop);
+
+    /**
+     * Report from within the wrapped source's getSourceSamples the
+     * source frame it has buffered up to, and how many frames it
+     * still has buffered before that, so that the position of the
+     * next frame it will supply is bufferedTo - buffered within the
+     * loop ranges. Only meaningful if the source is not resampled on
+     * the way to the wrapper.
+     */
+    void setSourcePosition(sv_frame_t bufferedTo, sv_frame_t buffered);
+
+    /**
+     * Supply an object in which to record the time spent
+     * stretching. This is not owned by the wrapper and must outlive
+     * it. Pass nullptr to stop recording.
+     */
+    void setPlaybackHealth(PlaybackHealth *health);
+
     // These functions are passed through to the wrapped
     // ApplicationPlaybackSource
     
@@ -111,19 +188,58 @@ public:
         override;
 
 private:
+    class Stretcher;
+
     ApplicationPlaybackSource *m_source;
-    RubberBand::RubberBandStretcher *m_stretcher;
+    Stretcher *m_stretcher;  // in use, or null when bypassed
+    Stretcher *m_pending;    // prepared by prepareStretcher, or null
+    bool m_havePending;      // m_pending (even if null) is to be adopted
+    sv_frame_t m_pendingInputCount; // m_inputCount when m_pending primed
+    Stretcher *m_fadingOut;  // previous stretcher, during a crossfade
+    sv_frame_t m_fadePosition;
+    Scavenger<Stretcher> m_scavenger; // for stretchers retired in callback
+    MixWorkerPool *m_pool;
     double m_timeRatio;
     Quality m_quality;
-    bool m_qualityChangePending;
+    bool m_multithreading;
     std::vector<std::vector<float>> m_inputs;
+    std::vector<std::vector<float>> m_fadeBuffers;
+    std::vector<float *> m_fadePtrs;
+    std::vector<std::vector<float>> m_history; // most recent input
+    std::vector<const float *> m_historyPtrs;
+    sv_frame_t m_historyWrite;
+    sv_frame_t m_historyFill;
+    sv_frame_t m_inputCount;  // total input obtained since reset
     std::mutex m_mutex;
+    std::mutex m_prepareMutex; // serialises prepareStretcher
     int m_stretcherInputSize;
     int m_channelCount;
     int m_lastReportedSystemLatency;
     sv_samplerate_t m_sampleRate;
-
-    void checkStretcher(); // call without m_mutex held
+    PlaybackHealth *m_health;
+
+    std::shared_ptr<const StretchedLoop> m_loop;
+    std::vector<float *> m_inputPtrs;
+    bool m_playingLoop;      // using m_loop rather than m_stretcher
+    sv_frame_t m_loopPosition; // next output frame within m_loop
+    sv_frame_t m_loopLatency;  // source frames output lags input by
+    double m_loopInputOwed;  // source frames to pull for output so far
+    int m_loopDriftCount;    // callbacks in a row out of step
+    sv_frame_t m_sourceBufferedTo; // from setSourcePosition
+    sv_frame_t m_sourceBuffered;
+    sv_frame_t m_lastSourceOffset;
+
+    void prepareStretcher(); // call without m_mutex held, not in callback
+    void allocateBuffers(); // call with m_mutex held, not in callback
+    void discardStretchers(); // call with m_mutex held, not in callback
+    void adoptPending(); // call with m_mutex held
+    void recordInput(const float *const *input, int frames);
+    void feedHistory(Stretcher *, sv_frame_t frames);
+    void crossfade(float *const *samples, int nchannels, int nframes);
+    void retire(Stretcher *);
+    sv_frame_t getSourceLoopOffset(const StretchedLoop &) const;
+    void checkLoopEntry(int nchannels); // call with m_mutex held
+    int getLoopSamples(float *const *samples, int nchannels, int nframes);
     
     TimeStretchWrapper(const TimeStretchWrapper &)=delete;
     TimeStretchWrapper &operator=(const TimeStretchWrapper &)=delete;
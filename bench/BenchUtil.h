@@ -0,0 +1,184 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_BENCH_UTIL_H
+#define SV_BENCH_UTIL_H
+
+/*
+ * Helpers shared by the headless benchmarks in this directory. Each
+ * benchmark is a single source file with its own main(), built and
+ * linked against svapp, svgui, svcore and their dependencies in the
+ * same way as the application, except for DTWBench, which needs only
+ * align/DTW.h and the standard library.
+ *
+ * Every benchmark takes the sizes to run as positional arguments,
+ * with defaults if there are none, and prints one tab-separated line
+ * per measurement:
+ *
+ *     benchmark <tab> parameter=value... <tab> measure=value...
+ *
+ * so that results before and after a change can be compared with
+ * diff or a spreadsheet.
+ *
+ * This header uses only the standard library and POSIX, so that it
+ * can be included without Qt.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace sv {
+namespace bench {
+
+class Timer
+{
+public:
+    Timer() : m_start(std::chrono::steady_clock::now()) { }
+
+    void restart() {
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    /**
+     * Return the time in seconds since construction or the last
+     * restart().
+     */
+    double elapsed() const {
+        return std::chrono::duration<double>
+            (std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+/**
+ * Return the peak resident set size of this process so far, in
+ * megabytes. This never goes down, so to measure the peak of one
+ * piece of work, run it in a process of its own.
+ */
+inline double
+getPeakMemoryMB()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+#ifdef __APPLE__
+    return double(usage.ru_maxrss) / (1024.0 * 1024.0); // bytes
+#else
+    return double(usage.ru_maxrss) / 1024.0; // kilobytes
+#endif
+}
+
+/**
+ * Return the positive integers given as positional arguments, or the
+ * defaults if there are none. Arguments beginning with '-' are
+ * options, left for the caller.
+ */
+inline std::vector<int>
+getCounts(int argc, char **argv, std::vector<int> defaults)
+{
+    std::vector<int> counts;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-') continue;
+        int n = atoi(argv[i]);
+        if (n > 0) counts.push_back(n);
+    }
+    if (counts.empty()) return defaults;
+    return counts;
+}
+
+/**
+ * Return true if the given option appears among the arguments.
+ */
+inline bool
+hasOption(int argc, char **argv, const char *option)
+{
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], option)) return true;
+    }
+    return false;
+}
+
+/**
+ * Write a 16-bit WAV file of the given duration holding a sine tone
+ * at the given frequency, decaying exponentially if decay is
+ * positive. Return false if it could not be written.
+ */
+inline bool
+writeToneWav(std::string path, int sampleRate, int channels,
+             double seconds, double frequency, double decay = 0.0)
+{
+    std::ofstream out(path, std::ios::binary);
+    if (!out) return false;
+
+    uint32_t frames = uint32_t(seconds * sampleRate);
+    uint32_t dataBytes = frames * uint32_t(channels) * 2;
+
+    auto u32 = [&](uint32_t v) {
+        char b[4] = { char(v), char(v >> 8), char(v >> 16), char(v >> 24) };
+        out.write(b, 4);
+    };
+    auto u16 = [&](uint16_t v) {
+        char b[2] = { char(v), char(v >> 8) };
+        out.write(b, 2);
+    };
+
+    out.write("RIFF", 4);
+    u32(36 + dataBytes);
+    out.write("WAVEfmt ", 8);
+    u32(16);
+    u16(1); // PCM
+    u16(uint16_t(channels));
+    u32(uint32_t(sampleRate));
+    u32(uint32_t(sampleRate * channels * 2));
+    u16(uint16_t(channels * 2));
+    u16(16);
+    out.write("data", 4);
+    u32(dataBytes);
+
+    for (uint32_t i = 0; i < frames; ++i) {
+        double t = double(i) / sampleRate;
+        double gain = 0.5 * (decay > 0.0 ? exp(-t * decay) : 1.0);
+        int16_t s = int16_t(32767.0 * gain * sin(2.0 * M_PI * frequency * t));
+        for (int c = 0; c < channels; ++c) {
+            u16(uint16_t(s));
+        }
+    }
+
+    return bool(out);
+}
+
+/**
+ * Print one result line.
+ */
+inline void
+report(std::string benchmark, std::string parameters, std::string measures)
+{
+    std::cout << benchmark << "\t" << parameters << "\t" << measures
+              << std::endl;
+}
+
+} // end namespace bench
+} // end namespace sv
+
+#endif
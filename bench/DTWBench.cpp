@@ -0,0 +1,171 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+ * Time and peak memory of DTW alignment across sequence lengths,
+ * for each constraint type.
+ *
+ *     DTWBench [-p] [length...]
+ *
+ * The sequences are a smooth random signal and a time-warped, noisy
+ * copy of it 10% shorter, aligned with MagnitudeDTW. With -p the
+ * cost matrix is calculated in parallel on all cores. Each case runs
+ * in a child process of its own, so that its peak memory is its own.
+ * The full matrix is skipped where it would have more than 2^28
+ * cells.
+ *
+ * Needs only the standard library:
+ *
+ *     c++ -O2 -std=c++17 -I.. DTWBench.cpp -o DTWBench -lpthread
+ */
+
+#include "BenchUtil.h"
+
+#include "align/DTW.h"
+
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace sv;
+using namespace sv::bench;
+
+static const double MAX_FULL_CELLS = double(1 << 28);
+
+static std::vector<double>
+makeSignal(int n, std::mt19937 &rng)
+{
+    std::normal_distribution<double> noise(0.0, 1.0);
+    std::vector<double> s(n);
+    double v = 0.0;
+    for (int i = 0; i < n; ++i) {
+        v = 0.95 * v + noise(rng);
+        s[i] = v + 4.0 * sin(double(i) / 50.0);
+    }
+    return s;
+}
+
+static std::vector<double>
+warp(const std::vector<double> &s, int n, std::mt19937 &rng)
+{
+    std::normal_distribution<double> noise(0.0, 0.1);
+    std::vector<double> w(n);
+    double scale = double(s.size()) / double(n);
+    for (int i = 0; i < n; ++i) {
+        double t = double(i) * scale;
+        t += 0.02 * double(s.size()) * sin(2.0 * M_PI * double(i) / n);
+        size_t j = size_t(std::max(0.0, std::min(t, double(s.size() - 1))));
+        w[i] = s[j] + noise(rng);
+    }
+    return w;
+}
+
+static const char *
+getTypeName(DTWConstraint::Type type)
+{
+    switch (type) {
+    case DTWConstraint::Type::Full: return "full";
+    case DTWConstraint::Type::Band: return "band";
+    case DTWConstraint::Type::SlopeBand: return "slopeband";
+    case DTWConstraint::Type::Multiscale: return "multiscale";
+    }
+    return "unknown";
+}
+
+static void
+runCase(int n1, DTWConstraint::Type type, bool parallel)
+{
+    std::mt19937 rng(n1);
+    int n2 = n1 - n1 / 10;
+    auto s1 = makeSignal(n1, rng);
+    auto s2 = warp(s1, n2, rng);
+
+    DTWConstraint constraint;
+    constraint.type = type;
+
+    MagnitudeDTW dtw(constraint);
+
+    int threads = 1;
+    if (parallel) {
+        threads = std::max(1, int(std::thread::hardware_concurrency()));
+        dtw.setParallelRunner
+            ([](int count, const std::function<void(int)> &job) {
+                 std::vector<std::thread> tt;
+                 for (int i = 0; i < count; ++i) tt.emplace_back(job, i);
+                 for (auto &t: tt) t.join();
+             }, threads);
+    }
+
+    double baseline = getPeakMemoryMB();
+
+    Timer timer;
+    auto path = dtw.alignSequences(s1, s2);
+    double seconds = timer.elapsed();
+
+    std::ostringstream params, measures;
+    params << "n1=" << n1 << " n2=" << n2 << " type=" << getTypeName(type)
+           << " threads=" << threads;
+    measures << "seconds=" << seconds
+             << " peakMB=" << getPeakMemoryMB()
+             << " baselineMB=" << baseline
+             << " estimateMB="
+             << double(constraint.estimateMemory(n1, n2, false)) /
+                (1024.0 * 1024.0)
+             << " pathEnd=" << (path.empty() ? 0 : path.back());
+    report("dtw", params.str(), measures.str());
+}
+
+int main(int argc, char **argv)
+{
+    auto lengths = getCounts(argc, argv, { 1000, 4000, 16000, 64000 });
+    bool parallel = hasOption(argc, argv, "-p");
+
+    std::vector<DTWConstraint::Type> types {
+        DTWConstraint::Type::Full,
+        DTWConstraint::Type::Band,
+        DTWConstraint::Type::SlopeBand,
+        DTWConstraint::Type::Multiscale
+    };
+
+    for (int n: lengths) {
+        for (auto type: types) {
+
+            if (type == DTWConstraint::Type::Full &&
+                double(n) * double(n) > MAX_FULL_CELLS) {
+                continue;
+            }
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                std::cerr << "fork failed" << std::endl;
+                return 1;
+            }
+            if (pid == 0) {
+                runCase(n, type, parallel);
+                _exit(0);
+            }
+            int status = 0;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                std::cerr << "case n=" << n << " type=" << getTypeName(type)
+                          << " failed" << std::endl;
+            }
+        }
+    }
+
+    return 0;
+}
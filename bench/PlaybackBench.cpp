@@ -0,0 +1,147 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+ * Throughput of AudioCallbackPlaySource::mixModels, the work done
+ * by fillBuffers on the fill thread, with a given number of models.
+ *
+ *     PlaybackBench [models...]
+ *
+ * Each model is a generated stereo WAV file of a sine tone, opened
+ * as a ReadOnlyWaveFileModel and added to a play source. The mix is
+ * rendered through an OfflineRenderer, which calls mixModels just as
+ * fillBuffers does but without waiting on an audio device, so this
+ * measures the mixing itself rather than the pacing of playback.
+ * The copy from the mix into the ring buffers is not included.
+ *
+ * Reports microseconds per block and the ratio of audio rendered to
+ * time taken, where 1 is just fast enough for realtime playback.
+ */
+
+#include "BenchUtil.h"
+
+#include "audio/AudioCallbackPlaySource.h"
+#include "audio/OfflineRenderer.h"
+
+#include "data/fileio/FileSource.h"
+#include "data/model/ReadOnlyWaveFileModel.h"
+
+#include "view/ViewManager.h"
+
+#include <QApplication>
+#include <QDir>
+#include <QTemporaryDir>
+#include <QThread>
+
+#include <sstream>
+
+using namespace sv;
+using namespace sv::bench;
+
+static const int SAMPLE_RATE = 44100;
+static const int CHANNELS = 2;
+static const int BLOCK_SIZE = 1024;
+static const double SECONDS = 30.0;
+
+static void
+run(ViewManager *viewManager, QTemporaryDir &dir, int count)
+{
+    std::vector<ModelId> models;
+
+    for (int i = 0; i < count; ++i) {
+        QString path = dir.filePath(QString("model%1.wav").arg(i));
+        if (!QFile::exists(path) &&
+            !writeToneWav(QDir::toNativeSeparators(path).toStdString(),
+                          SAMPLE_RATE, CHANNELS, SECONDS,
+                          110.0 * (1 + i % 16))) {
+            std::cerr << "failed to write " << path.toStdString()
+                      << std::endl;
+            return;
+        }
+        auto model = std::make_shared<ReadOnlyWaveFileModel>
+            (FileSource(path));
+        if (!model->isOK()) {
+            std::cerr << "failed to open " << path.toStdString()
+                      << std::endl;
+            return;
+        }
+        while (!model->isReady()) {
+            QThread::msleep(10);
+        }
+        models.push_back(ModelById::add(model));
+    }
+
+    {
+        AudioCallbackPlaySource source(viewManager, "PlaybackBench");
+        for (auto id: models) {
+            source.addModel(id);
+        }
+
+        OfflineRenderer renderer(&source);
+
+        int channels = renderer.getChannelCount();
+        std::vector<float> data(channels * BLOCK_SIZE);
+        std::vector<float *> buffers(channels);
+        for (int c = 0; c < channels; ++c) {
+            buffers[c] = data.data() + c * BLOCK_SIZE;
+        }
+
+        sv_frame_t frames = 0;
+        int blocks = 0;
+        Timer timer;
+        while (true) {
+            sv_frame_t got = renderer.render(buffers.data(), BLOCK_SIZE);
+            if (got <= 0) break;
+            frames += got;
+            ++blocks;
+        }
+        double seconds = timer.elapsed();
+
+        std::ostringstream params, measures;
+        params << "models=" << count << " channels=" << channels
+               << " block=" << BLOCK_SIZE;
+        measures << "usPerBlock=" << (seconds * 1e6 / std::max(blocks, 1))
+                 << " realtimeRatio="
+                 << (double(frames) / renderer.getSampleRate() / seconds);
+        report("mixmodels", params.str(), measures.str());
+
+        source.clearModels();
+    }
+
+    for (auto id: models) {
+        ModelById::release(id);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+    QApplication app(argc, argv);
+
+    auto counts = getCounts(argc, argv, { 1, 4, 16, 64 });
+
+    QTemporaryDir dir;
+    if (!dir.isValid()) {
+        std::cerr << "failed to create temporary directory" << std::endl;
+        return 1;
+    }
+
+    ViewManager viewManager;
+
+    for (int count: counts) {
+        run(&viewManager, dir, count);
+    }
+
+    return 0;
+}
@@ -0,0 +1,175 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+ * Time taken by SVFileReader to load generated sessions of a given
+ * total number of points.
+ *
+ *     SessionLoadBench [points...]
+ *
+ * Each session has 16 models, alternately time-value and note
+ * models, sharing the given number of points between them, in the
+ * uncompressed session XML that SVFileReader parses. There are no
+ * views, so nothing is drawn. Writing the session is not timed.
+ *
+ * If SV_TRACE_FILE is set, the phases recorded by PhaseTrace during
+ * loading are written to it at the end.
+ */
+
+#include "BenchUtil.h"
+
+#include "framework/Document.h"
+#include "framework/PhaseTrace.h"
+#include "framework/SVFileReader.h"
+
+#include <QApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryDir>
+#include <QTextStream>
+
+#include <sstream>
+
+using namespace sv;
+using namespace sv::bench;
+
+static const int MODELS = 16;
+static const int SAMPLE_RATE = 44100;
+static const int POINT_SPACING = 512;
+
+class NoPaneCallback : public SVFileReaderPaneCallback
+{
+public:
+    Pane *addPane() override { return nullptr; }
+    void setWindowSize(int, int) override { }
+    void addSelection(sv_frame_t, sv_frame_t) override { }
+};
+
+static bool
+writeSession(QString path, int points)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+
+    QTextStream out(&file);
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        << "<!DOCTYPE sonic-visualiser>\n"
+        << "<sv>\n  <data>\n";
+
+    int perModel = std::max(1, points / MODELS);
+    sv_frame_t end = sv_frame_t(perModel) * POINT_SPACING;
+
+    for (int m = 0; m < MODELS; ++m) {
+
+        bool notes = (m % 2 == 1);
+        int dimensions = (notes ? 3 : 2);
+        int dataset = MODELS + m;
+
+        out << QString("    <model id=\"%1\" name=\"Model %1\" "
+                       "sampleRate=\"%2\" start=\"0\" end=\"%3\" "
+                       "type=\"sparse\" dimensions=\"%4\" "
+                       "resolution=\"%5\" notifyOnAdd=\"true\" "
+                       "dataset=\"%6\" minimum=\"0\" maximum=\"100\" "
+                       "units=\"\" />\n")
+            .arg(m).arg(SAMPLE_RATE).arg(end).arg(dimensions)
+            .arg(POINT_SPACING).arg(dataset);
+
+        out << QString("    <dataset id=\"%1\" dimensions=\"%2\">\n")
+            .arg(dataset).arg(dimensions);
+
+        for (int i = 0; i < perModel; ++i) {
+            sv_frame_t frame = sv_frame_t(i) * POINT_SPACING;
+            double value = 50.0 + 40.0 * sin(i * 0.01 + m);
+            if (notes) {
+                out << QString("      <point frame=\"%1\" value=\"%2\" "
+                               "duration=\"%3\" level=\"0.8\" "
+                               "label=\"n%4\" />\n")
+                    .arg(frame).arg(value).arg(POINT_SPACING).arg(i);
+            } else {
+                out << QString("      <point frame=\"%1\" value=\"%2\" "
+                               "label=\"\" />\n")
+                    .arg(frame).arg(value);
+            }
+        }
+
+        out << "    </dataset>\n";
+    }
+
+    out << "  </data>\n</sv>\n";
+    out.flush();
+
+    return file.error() == QFileDevice::NoError;
+}
+
+static void
+run(QTemporaryDir &dir, int points)
+{
+    QString path = dir.filePath(QString("session%1.xml").arg(points));
+    if (!writeSession(path, points)) {
+        std::cerr << "failed to write " << path.toStdString() << std::endl;
+        return;
+    }
+
+    Document *document = new Document();
+    NoPaneCallback callback;
+    SVFileReader reader(document, callback, path);
+
+    Timer timer;
+    reader.parseFile(path);
+    double seconds = timer.elapsed();
+
+    if (!reader.isOK()) {
+        std::cerr << "failed to load session: "
+                  << reader.getErrorString().toStdString() << std::endl;
+    }
+
+    timer.restart();
+    delete document;
+    double closeSeconds = timer.elapsed();
+
+    std::ostringstream params, measures;
+    params << "points=" << points << " models=" << MODELS
+           << " bytes=" << QFileInfo(path).size();
+    measures << "seconds=" << seconds
+             << " pointsPerSecond=" << (double(points) / seconds)
+             << " closeSeconds=" << closeSeconds
+             << " peakMB=" << getPeakMemoryMB();
+    report("sessionload", params.str(), measures.str());
+
+    QFile::remove(path);
+}
+
+int main(int argc, char **argv)
+{
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+    QApplication app(argc, argv);
+
+    auto counts = getCounts(argc, argv, { 10000, 100000, 1000000 });
+
+    QTemporaryDir dir;
+    if (!dir.isValid()) {
+        std::cerr << "failed to create temporary directory" << std::endl;
+        return 1;
+    }
+
+    for (int points: counts) {
+        run(dir, points);
+    }
+
+    PhaseTrace::dumpIfRequested();
+
+    return 0;
+}
@@ -0,0 +1,174 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+ * Render cost of ClipMixer and ContinuousSynth at a given number of
+ * voices.
+ *
+ *     SynthBench [voices...]
+ *
+ * ClipMixer plays a generated one-second decaying tone as its clip,
+ * restarting all voices at new pitches every quarter second, so that
+ * voices start and end throughout. The pitches cycle through four
+ * octaves of semitones, so after the first pass they are all among
+ * the mixer's cached renderings; a warm-up pass is run first and not
+ * counted, with a pause after it for the renderings to be made. ContinuousSynth sums the given number of tracks with
+ * mixTracks(), each gliding slowly in pitch.
+ *
+ * Both report microseconds per block and the ratio of audio rendered
+ * to time taken, where 1 is just fast enough for realtime playback.
+ */
+
+#include "BenchUtil.h"
+
+#include "audio/ClipMixer.h"
+#include "audio/ContinuousSynth.h"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QTemporaryDir>
+#include <QThread>
+
+#include <sstream>
+
+using namespace sv;
+using namespace sv::bench;
+
+static const int SAMPLE_RATE = 44100;
+static const int CHANNELS = 2;
+static const int BLOCK_SIZE = 1024;
+static const double SECONDS = 20.0;
+static const double CLIP_F0 = 440.0;
+
+static void
+reportRate(std::string name, int voices, int blocks, double seconds)
+{
+    double audio = double(blocks) * BLOCK_SIZE / SAMPLE_RATE;
+    std::ostringstream params, measures;
+    params << "voices=" << voices << " block=" << BLOCK_SIZE;
+    measures << "usPerBlock=" << (seconds * 1e6 / blocks)
+             << " realtimeRatio=" << (audio / seconds);
+    report(name, params.str(), measures.str());
+}
+
+static void
+runClipMixer(QString clipPath, int voices)
+{
+    ClipMixer mixer(CHANNELS, SAMPLE_RATE, BLOCK_SIZE);
+    mixer.setPolyphony(voices);
+    if (!mixer.loadClipData(clipPath, CLIP_F0, 1.0)) {
+        std::cerr << "failed to load clip" << std::endl;
+        return;
+    }
+
+    std::vector<float> data(CHANNELS * BLOCK_SIZE);
+    std::vector<float *> buffers(CHANNELS);
+    for (int c = 0; c < CHANNELS; ++c) {
+        buffers[c] = data.data() + c * BLOCK_SIZE;
+    }
+
+    int blocks = int(SECONDS * SAMPLE_RATE / BLOCK_SIZE);
+    int restartEvery = SAMPLE_RATE / (4 * BLOCK_SIZE);
+    int pitch = 0;
+
+    std::vector<ClipMixer::NoteStart> starts;
+    std::vector<ClipMixer::NoteEnd> ends;
+    std::vector<float> sounding;
+    starts.reserve(voices);
+    ends.reserve(voices);
+    sounding.reserve(voices);
+
+    auto pass = [&](bool timed) {
+        Timer timer;
+        for (int b = 0; b < blocks; ++b) {
+            starts.clear();
+            ends.clear();
+            if (b % restartEvery == 0) {
+                for (float f: sounding) {
+                    ends.push_back({ 0, f });
+                }
+                sounding.clear();
+                for (int v = 0; v < voices; ++v) {
+                    float f = float(110.0 * pow(2.0, (pitch % 48) / 12.0));
+                    float pan = float(v % 3) - 1.f;
+                    starts.push_back({ (v * 7) % BLOCK_SIZE, f, 0.5f, pan });
+                    sounding.push_back(f);
+                    ++pitch;
+                }
+            }
+            for (auto &f: data) f = 0.f;
+            mixer.mix(buffers.data(), 1.f, starts, ends);
+        }
+        if (timed) {
+            reportRate("clipmixer", voices, blocks, timer.elapsed());
+        }
+    };
+
+    // Renderings are made on the mixer's own thread, so give it time
+    // to finish those the warm-up asked for
+    pass(false);
+    QThread::msleep(1000);
+    mixer.reset();
+    sounding.clear();
+    pass(true);
+}
+
+static void
+runContinuousSynth(int voices)
+{
+    ContinuousSynth synth(CHANNELS, SAMPLE_RATE, BLOCK_SIZE, 0);
+
+    std::vector<float> data(CHANNELS * BLOCK_SIZE);
+    std::vector<float *> buffers(CHANNELS);
+    for (int c = 0; c < CHANNELS; ++c) {
+        buffers[c] = data.data() + c * BLOCK_SIZE;
+    }
+
+    std::vector<float> f0s(voices);
+    int blocks = int(SECONDS * SAMPLE_RATE / BLOCK_SIZE);
+
+    Timer timer;
+    for (int b = 0; b < blocks; ++b) {
+        for (int v = 0; v < voices; ++v) {
+            f0s[v] = float(110.0 * pow(2.0, (v % 48) / 12.0) *
+                           (1.0 + 0.01 * sin(b * 0.05 + v)));
+        }
+        for (auto &f: data) f = 0.f;
+        synth.mixTracks(buffers.data(), 1.f, 0.f, f0s.data(), voices);
+    }
+    reportRate("continuoussynth", voices, blocks, timer.elapsed());
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    auto counts = getCounts(argc, argv, { 1, 8, 32, 128 });
+
+    QTemporaryDir dir;
+    QString clipPath = dir.filePath("clip.wav");
+    if (!dir.isValid() ||
+        !writeToneWav(QDir::toNativeSeparators(clipPath).toStdString(),
+                      SAMPLE_RATE, 1, 1.0, CLIP_F0, 4.0)) {
+        std::cerr << "failed to write clip" << std::endl;
+        return 1;
+    }
+
+    for (int voices: counts) {
+        runClipMixer(clipPath, voices);
+        runContinuousSynth(voices);
+    }
+
+    return 0;
+}
@@ -0,0 +1,668 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+
+#include "DerivedModelCache.h"
+
+#include "data/model/SparseOneDimensionalModel.h"
+#include "data/model/SparseTimeValueModel.h"
+#include "data/model/NoteModel.h"
+#include "data/model/RegionModel.h"
+#include "data/model/EditableDenseThreeDimensionalModel.h"
+
+#include "align/AlignmentCache.h"
+
+#include "base/BaseTypes.h"
+#include "base/Debug.h"
+#include "base/ResourceFinder.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QSysInfo>
+
+//#define DEBUG_DERIVED_MODEL_CACHE 1
+
+namespace sv {
+
+static const quint32 CACHE_MAGIC = 0x5356444d; // "SVDM"
+// Version 3 stores dense columns as raw floats in the byte order
+// recorded in the header, and keys file inputs on file identity
+static const quint32 CACHE_VERSION = 3;
+
+// Largest number of events, or of dense values, stored for a single
+// model. Bigger outputs are recalculated each time rather than
+// filling the user's disc
+static const qint64 MAX_STORED_EVENTS = 1000000;
+static const qint64 MAX_STORED_VALUES = 64 * 1000000;
+
+// Total size of the cache files beyond which the least recently used
+// are removed
+static const qint64 MAX_CACHE_BYTES = 1024LL * 1024 * 1024;
+
+enum class CachedModelType : quint32 {
+    SparseOneDimensional = 1,
+    SparseTimeValue = 2,
+    Note = 3,
+    Region = 4,
+    DenseThreeDimensional = 5
+};
+
+static QString
+getCachePath(QString key)
+{
+    QString dir = ResourceFinder().getResourceSaveDir("derived");
+    if (dir == "") return "";
+    return QDir(dir).filePath(key + ".model");
+}
+
+DerivedModelCache::DerivedModelCache() :
+    m_thread(nullptr),
+    m_exiting(false),
+    m_abort(false)
+{
+    connect(this, SIGNAL(jobFinished()),
+            this, SLOT(releaseFinishedModels()), Qt::QueuedConnection);
+}
+
+DerivedModelCache::~DerivedModelCache()
+{
+    if (m_thread) {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_exiting = true;
+            m_abort = true;
+            m_condition.wakeAll();
+        }
+        m_thread->wait();
+        delete m_thread;
+    }
+
+    // The thread is gone, so whatever it left is released here on
+    // the GUI thread
+    m_queue.clear();
+    m_finished.clear();
+}
+
+QString
+DerivedModelCache::makeKey(const Transform &transform,
+                           ModelId input, int channel)
+{
+    QString inputHash = AlignmentCache::getFileIdentityHash(input);
+    if (inputHash == "") {
+        inputHash = AlignmentCache::getKnownContentHash(input);
+    }
+    if (inputHash == "") return "";
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QString("%1\n%2\n%3\n%4")
+                 .arg(CACHE_VERSION)
+                 .arg(inputHash)
+                 .arg(channel)
+                 .arg(transform.toXmlString())
+                 .toUtf8());
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+static bool
+writeEvents(QDataStream &out, const EventVector &events,
+            const std::atomic<bool> &abort)
+{
+    out << qint64(events.size());
+    for (const auto &e: events) {
+        if (abort) return false;
+        quint8 flags = quint8((e.hasValue() ? 1 : 0) |
+                              (e.hasDuration() ? 2 : 0) |
+                              (e.hasLevel() ? 4 : 0));
+        out << qint64(e.getFrame()) << flags;
+        if (e.hasValue()) out << e.getValue();
+        if (e.hasDuration()) out << qint64(e.getDuration());
+        if (e.hasLevel()) out << e.getLevel();
+        out << e.getLabel();
+    }
+    return true;
+}
+
+template <typename ModelType>
+static bool
+readEvents(QDataStream &in, std::shared_ptr<ModelType> model,
+           const std::atomic<bool> &abort)
+{
+    if (!model) return false;
+    qint64 count = 0;
+    in >> count;
+    if (in.status() != QDataStream::Ok ||
+        count < 0 || count > MAX_STORED_EVENTS) {
+        return false;
+    }
+    for (qint64 i = 0; i < count; ++i) {
+        if (abort) return false;
+        qint64 frame = 0;
+        quint8 flags = 0;
+        in >> frame >> flags;
+        Event e(frame);
+        if (flags & 1) {
+            float value = 0.f;
+            in >> value;
+            e = e.withValue(value);
+        }
+        if (flags & 2) {
+            qint64 duration = 0;
+            in >> duration;
+            e = e.withDuration(duration);
+        }
+        if (flags & 4) {
+            float level = 0.f;
+            in >> level;
+            e = e.withLevel(level);
+        }
+        QString label;
+        in >> label;
+        if (in.status() != QDataStream::Ok) return false;
+        model->add(e.withLabel(label));
+    }
+    return true;
+}
+
+ModelId
+DerivedModelCache::load(QString key)
+{
+    // Only the header is read here, to find out what sort of model
+    // to make. The content follows in readBody on the cache thread
+    
+    QString path = getCachePath(key);
+    if (path == "") return {};
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return {};
+    }
+
+    QDataStream in(&file);
+    in.setFloatingPointPrecision(QDataStream::SinglePrecision);
+
+    quint32 magic = 0, version = 0, byteOrder = 0, type = 0;
+    double sampleRate = 0.0;
+    qint32 resolution = 0;
+    QString name;
+    in >> magic >> version >> byteOrder >> type
+       >> sampleRate >> resolution >> name;
+
+    if (in.status() != QDataStream::Ok ||
+        magic != CACHE_MAGIC || version != CACHE_VERSION ||
+        byteOrder != quint32(QSysInfo::ByteOrder) ||
+        sampleRate <= 0.0 || resolution <= 0) {
+        SVDEBUG << "DerivedModelCache::load: Cache file " << path
+                << " is not valid, ignoring it" << endl;
+        return {};
+    }
+
+    std::shared_ptr<Model> result;
+    qint64 denseWidth = 0;
+
+    switch (CachedModelType(type)) {
+
+    case CachedModelType::SparseOneDimensional:
+    {
+        result = std::make_shared<SparseOneDimensionalModel>
+            (sampleRate, resolution, false);
+        break;
+    }
+
+    case CachedModelType::SparseTimeValue:
+    {
+        float minimum = 0.f, maximum = 0.f;
+        QString units;
+        in >> minimum >> maximum >> units;
+        auto model = std::make_shared<SparseTimeValueModel>
+            (sampleRate, resolution, minimum, maximum, false);
+        model->setScaleUnits(units);
+        result = model;
+        break;
+    }
+
+    case CachedModelType::Note:
+    {
+        float minimum = 0.f, maximum = 0.f, quantization = 0.f;
+        QString units;
+        in >> minimum >> maximum >> quantization >> units;
+        auto model = std::make_shared<NoteModel>
+            (sampleRate, resolution, minimum, maximum, false);
+        model->setValueQuantization(quantization);
+        model->setScaleUnits(units);
+        result = model;
+        break;
+    }
+
+    case CachedModelType::Region:
+    {
+        float minimum = 0.f, maximum = 0.f, quantization = 0.f;
+        QString units;
+        in >> minimum >> maximum >> quantization >> units;
+        auto model = std::make_shared<RegionModel>
+            (sampleRate, resolution, minimum, maximum, false);
+        model->setValueQuantization(quantization);
+        model->setScaleUnits(units);
+        result = model;
+        break;
+    }
+
+    case CachedModelType::DenseThreeDimensional:
+    {
+        qint32 height = 0;
+        qint64 width = 0, startFrame = 0;
+        float minimum = 0.f, maximum = 0.f;
+        in >> height >> width >> startFrame >> minimum >> maximum;
+        if (in.status() != QDataStream::Ok || height <= 0 || width < 0 ||
+            width * height > MAX_STORED_VALUES) {
+            break;
+        }
+        auto model = std::make_shared<EditableDenseThreeDimensionalModel>
+            (sampleRate, resolution, height, false);
+        model->setStartFrame(startFrame);
+        model->setMinimumLevel(minimum);
+        model->setMaximumLevel(maximum);
+        for (int n = 0; n < height; ++n) {
+            QString binName;
+            in >> binName;
+            if (binName != "") model->setBinName(n, binName);
+        }
+        // The columns are of known size, so a truncated file can be
+        // caught now rather than after the model has been handed out
+        if (file.size() - file.pos() <
+            width * height * qint64(sizeof(float))) {
+            break;
+        }
+        denseWidth = width;
+        result = model;
+        break;
+    }
+
+    default:
+        break;
+    }
+
+    if (in.status() != QDataStream::Ok || !result) {
+        SVDEBUG << "DerivedModelCache::load: Cache file " << path
+                << " is truncated or of unknown type, ignoring it" << endl;
+        return {};
+    }
+
+    result->setObjectName(name);
+    result->setCompletion(0);
+
+    Job job;
+    job.isStore = false;
+    job.key = key;
+    job.type = type;
+    job.bodyOffset = file.pos();
+    job.width = denseWidth;
+    job.model = result;
+
+    ModelId id = ModelById::add(result);
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_queue.push_back(job);
+        if (!m_thread) {
+            m_thread = new CacheThread(*this);
+            m_thread->start();
+        }
+        m_condition.wakeAll();
+    }
+
+#ifdef DEBUG_DERIVED_MODEL_CACHE
+    SVDEBUG << "DerivedModelCache::load: Loading model of type " << type
+            << " for key " << key << " as " << id << endl;
+#endif
+
+    return id;
+}
+
+bool
+DerivedModelCache::store(QString key, ModelId modelId)
+{
+    auto model = ModelById::get(modelId);
+    if (!model || !model->isOK() || !model->isReady()) return false;
+
+    CachedModelType type;
+
+    if (ModelById::isa<SparseOneDimensionalModel>(modelId)) {
+        type = CachedModelType::SparseOneDimensional;
+    } else if (ModelById::isa<SparseTimeValueModel>(modelId)) {
+        type = CachedModelType::SparseTimeValue;
+    } else if (ModelById::isa<NoteModel>(modelId)) {
+        type = CachedModelType::Note;
+    } else if (ModelById::isa<RegionModel>(modelId)) {
+        type = CachedModelType::Region;
+    } else if (auto dm = ModelById::getAs<EditableDenseThreeDimensionalModel>
+               (modelId)) {
+        type = CachedModelType::DenseThreeDimensional;
+        if (qint64(dm->getWidth()) * dm->getHeight() > MAX_STORED_VALUES) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    Job job;
+    job.isStore = true;
+    job.key = key;
+    job.type = quint32(type);
+    job.bodyOffset = 0;
+    job.width = 0;
+    job.model = model;
+
+    QMutexLocker locker(&m_mutex);
+    m_queue.push_back(job);
+    if (!m_thread) {
+        m_thread = new CacheThread(*this);
+        m_thread->start();
+    }
+    m_condition.wakeAll();
+
+    return true;
+}
+
+void
+DerivedModelCache::releaseFinishedModels()
+{
+    // Take the models out under the lock, and release them on
+    // leaving here, on the GUI thread
+    std::vector<std::shared_ptr<Model>> finished;
+    QMutexLocker locker(&m_mutex);
+    finished.swap(m_finished);
+    locker.unlock();
+}
+
+void
+DerivedModelCache::CacheThread::run()
+{
+    DerivedModelCache &c(m_cache);
+
+    QMutexLocker locker(&c.m_mutex);
+
+    while (true) {
+
+        if (c.m_exiting) break;
+        
+        if (c.m_queue.empty()) {
+            c.m_condition.wait(&c.m_mutex);
+            continue;
+        }
+
+        Job job = c.m_queue.front();
+        c.m_queue.pop_front();
+
+        locker.unlock();
+
+        if (job.isStore) {
+            c.writeModel(job);
+        } else {
+            c.readBody(job);
+        }
+
+        // Hand the model over without keeping any reference here,
+        // so that if this is the last one it is released on the GUI
+        // thread rather than this one
+        locker.relock();
+        c.m_finished.push_back(job.model);
+        job.model.reset();
+        locker.unlock();
+
+        emit c.jobFinished();
+
+        locker.relock();
+    }
+}
+
+void
+DerivedModelCache::readBody(const Job &job)
+{
+    QString path = getCachePath(job.key);
+
+    QFile file(path);
+    bool ok = (path != "" &&
+               file.open(QIODevice::ReadOnly) &&
+               file.seek(job.bodyOffset));
+
+    if (ok) {
+        
+        QDataStream in(&file);
+        in.setFloatingPointPrecision(QDataStream::SinglePrecision);
+
+        switch (CachedModelType(job.type)) {
+
+        case CachedModelType::SparseOneDimensional:
+            ok = readEvents
+                (in, std::dynamic_pointer_cast<SparseOneDimensionalModel>
+                 (job.model), m_abort);
+            break;
+
+        case CachedModelType::SparseTimeValue:
+            ok = readEvents
+                (in, std::dynamic_pointer_cast<SparseTimeValueModel>
+                 (job.model), m_abort);
+            break;
+
+        case CachedModelType::Note:
+            ok = readEvents
+                (in, std::dynamic_pointer_cast<NoteModel>
+                 (job.model), m_abort);
+            break;
+
+        case CachedModelType::Region:
+            ok = readEvents
+                (in, std::dynamic_pointer_cast<RegionModel>
+                 (job.model), m_abort);
+            break;
+
+        case CachedModelType::DenseThreeDimensional:
+        {
+            auto model = std::dynamic_pointer_cast
+                <EditableDenseThreeDimensionalModel>(job.model);
+            if (!model) {
+                ok = false;
+                break;
+            }
+            int height = model->getHeight();
+            qint64 bytes = qint64(height) * qint64(sizeof(float));
+            DenseThreeDimensionalModel::Column column(height);
+            for (qint64 i = 0; i < job.width; ++i) {
+                if (m_abort) {
+                    ok = false;
+                    break;
+                }
+                if (in.readRawData(reinterpret_cast<char *>(column.data()),
+                                   int(bytes)) != bytes) {
+                    ok = false;
+                    break;
+                }
+                model->setColumn(int(i), column);
+            }
+            break;
+        }
+
+        default:
+            ok = false;
+            break;
+        }
+    }
+
+    if (m_abort) {
+        // The document is going away and the model with it
+        return;
+    }
+
+    if (ok) {
+        // The modification time orders entries by use for prune()
+        file.setFileTime(QDateTime::currentDateTimeUtc(),
+                         QFileDevice::FileModificationTime);
+    } else {
+        SVDEBUG << "DerivedModelCache::readBody: Cache file " << path
+                << " is truncated, removing it" << endl;
+        file.close();
+        if (path != "") QFile::remove(path);
+    }
+
+#ifdef DEBUG_DERIVED_MODEL_CACHE
+    SVDEBUG << "DerivedModelCache::readBody: Read content for key "
+            << job.key << endl;
+#endif
+
+    job.model->setCompletion(100);
+}
+
+void
+DerivedModelCache::writeModel(const Job &job)
+{
+    auto model = job.model;
+    CachedModelType type = CachedModelType(job.type);
+    
+    auto stvm = std::dynamic_pointer_cast<SparseTimeValueModel>(model);
+    auto nm = std::dynamic_pointer_cast<NoteModel>(model);
+    auto rm = std::dynamic_pointer_cast<RegionModel>(model);
+    auto dm = std::dynamic_pointer_cast
+        <EditableDenseThreeDimensionalModel>(model);
+
+    int resolution = 0;
+    EventVector events;
+
+    if (auto sodm = std::dynamic_pointer_cast
+        <SparseOneDimensionalModel>(model)) {
+        resolution = sodm->getResolution();
+        events = sodm->getAllEvents();
+    } else if (stvm) {
+        resolution = stvm->getResolution();
+        events = stvm->getAllEvents();
+    } else if (nm) {
+        resolution = nm->getResolution();
+        events = nm->getAllEvents();
+    } else if (rm) {
+        resolution = rm->getResolution();
+        events = rm->getAllEvents();
+    } else if (dm) {
+        resolution = dm->getResolution();
+    } else {
+        return;
+    }
+
+    if (qint64(events.size()) > MAX_STORED_EVENTS || resolution <= 0) {
+        return;
+    }
+
+    QString path = getCachePath(job.key);
+    if (path == "") return;
+
+    // A QSaveFile that is not committed leaves nothing behind, so
+    // an abandoned store needs no tidying up
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        SVDEBUG << "DerivedModelCache::writeModel: Failed to open " << path
+                << " for writing" << endl;
+        return;
+    }
+
+    QDataStream out(&file);
+    out.setFloatingPointPrecision(QDataStream::SinglePrecision);
+
+    out << CACHE_MAGIC << CACHE_VERSION << quint32(QSysInfo::ByteOrder)
+        << quint32(type) << double(model->getSampleRate())
+        << qint32(resolution) << model->objectName();
+
+    if (stvm) {
+        out << stvm->getValueMinimum() << stvm->getValueMaximum()
+            << stvm->getScaleUnits();
+    } else if (nm) {
+        out << nm->getValueMinimum() << nm->getValueMaximum()
+            << nm->getValueQuantization() << nm->getScaleUnits();
+    } else if (rm) {
+        out << rm->getValueMinimum() << rm->getValueMaximum()
+            << rm->getValueQuantization() << rm->getScaleUnits();
+    }
+
+    bool complete = true;
+
+    if (dm) {
+        int height = dm->getHeight();
+        int width = dm->getWidth();
+        out << qint32(height) << qint64(width)
+            << qint64(dm->getStartFrame())
+            << dm->getMinimumLevel() << dm->getMaximumLevel();
+        for (int n = 0; n < height; ++n) {
+            out << dm->getBinName(n);
+        }
+        int bytes = int(height * sizeof(float));
+        for (int i = 0; i < width; ++i) {
+            if (m_abort) {
+                complete = false;
+                break;
+            }
+            auto column = dm->getColumn(i);
+            column.resize(height, 0.f);
+            out.writeRawData(reinterpret_cast<const char *>(column.data()),
+                             bytes);
+        }
+    } else {
+        complete = writeEvents(out, events, m_abort);
+    }
+
+    if (!complete) {
+        file.cancelWriting();
+        return;
+    }
+
+    if (out.status() != QDataStream::Ok || !file.commit()) {
+        SVDEBUG << "DerivedModelCache::writeModel: Failed to write "
+                << path << endl;
+        return;
+    }
+
+#ifdef DEBUG_DERIVED_MODEL_CACHE
+    SVDEBUG << "DerivedModelCache::writeModel: Stored model for key "
+            << job.key << endl;
+#endif
+
+    prune();
+}
+
+void
+DerivedModelCache::prune()
+{
+    QString dirPath = ResourceFinder().getResourceSaveDir("derived");
+    if (dirPath == "") return;
+
+    // Newest first, by modification time, which readBody() updates
+    QFileInfoList entries = QDir(dirPath).entryInfoList
+        ({ "*.model" }, QDir::Files, QDir::Time);
+
+    qint64 total = 0;
+    for (const auto &entry: entries) {
+        total += entry.size();
+        if (total > MAX_CACHE_BYTES) {
+#ifdef DEBUG_DERIVED_MODEL_CACHE
+            SVDEBUG << "DerivedModelCache::prune: Removing "
+                    << entry.fileName() << endl;
+#endif
+            QFile::remove(entry.absoluteFilePath());
+        }
+    }
+}
+
+} // end namespace sv
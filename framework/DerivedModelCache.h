@@ -0,0 +1,155 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+
+#ifndef SV_DERIVED_MODEL_CACHE_H
+#define SV_DERIVED_MODEL_CACHE_H
+
+#include "data/model/Model.h"
+#include "transform/Transform.h"
+
+#include "base/Thread.h"
+
+#include <QObject>
+#include <QString>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace sv {
+
+/**
+ * An on-disk cache of the outputs of transforms, in the user's
+ * "derived" resource directory, so that running a transform again on
+ * the same audio gives its result without running the plugin.
+ *
+ * Entries are keyed by the whole transform (plugin identifier and
+ * version, parameters, program, block and step size, sample rate and
+ * so on), an identity for the input model and the input channel. For
+ * an input read from a local file, the identity is that of the file,
+ * which is known as soon as the file is opened; for any other input
+ * it is the content hash of its audio, once that has been calculated
+ * (see AlignmentCache). Entries are never invalidated, since a change
+ * to anything they depend on changes the key, but the directory is
+ * kept to a fixed total size by removing the least recently used.
+ *
+ * Reading and writing entries, which may be hundreds of megabytes
+ * for a dense model, happens on a thread of the cache's own, so that
+ * the GUI thread only ever reads the short header of an entry.
+ *
+ * Only the model types written by feature extraction transforms are
+ * stored: sparse one-dimensional, sparse time-value, note and region
+ * models, and editable dense 3-d models.
+ */
+class DerivedModelCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    DerivedModelCache();
+
+    /**
+     * Destroy the cache, abandoning any loads and stores still in
+     * progress. An abandoned store leaves no entry behind.
+     */
+    ~DerivedModelCache();
+
+    /**
+     * Return the cache key for the given transform applied to the
+     * given channel of the given input model, or an empty string if
+     * the input has neither a file identity nor an already
+     * calculated content hash. The transform should have its plugin
+     * version set.
+     */
+    static QString makeKey(const Transform &transform,
+                           ModelId input, int channel);
+
+    /**
+     * Look up the given key and, if there is a valid entry for it,
+     * create a model of the right type, add it to the ModelById pool
+     * and return its id, queueing its content to be read in the
+     * background. The model reaches completion 100 when that is done,
+     * as it would if calculated by the transform. Return None if
+     * there is no valid entry for the key. If the entry turns out to
+     * be truncated, the model is left with what could be read and
+     * the entry is removed.
+     */
+    ModelId load(QString key);
+
+    /**
+     * Queue the content of the given model to be stored under the
+     * given key in the background, then remove the least recently
+     * used entries if the cache has grown too large. The model should
+     * be complete. Return false if it is of a type that is not
+     * cached, is too large, or is not ready.
+     */
+    bool store(QString key, ModelId model);
+
+    DerivedModelCache(const DerivedModelCache &) =delete;
+    DerivedModelCache &operator=(const DerivedModelCache &) =delete;
+
+signals:
+    /**
+     * Emitted, from the cache thread, when a load or store has
+     * finished and its model is waiting to be released.
+     */
+    void jobFinished();
+
+private slots:
+    void releaseFinishedModels();
+
+private:
+    struct Job
+    {
+        bool isStore;
+        QString key;
+        quint32 type;
+        qint64 bodyOffset;
+        qint64 width; // of a dense model being loaded
+        std::shared_ptr<Model> model;
+    };
+
+    class CacheThread : public Thread
+    {
+    public:
+        CacheThread(DerivedModelCache &cache) :
+            Thread(Thread::NonRTThread),
+            m_cache(cache) { }
+
+        void run() override;
+
+    protected:
+        DerivedModelCache &m_cache;
+    };
+
+    void readBody(const Job &);
+    void writeModel(const Job &);
+    static void prune();
+
+    CacheThread *m_thread;
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    std::deque<Job> m_queue;
+    std::vector<std::shared_ptr<Model>> m_finished;
+    bool m_exiting;
+    std::atomic<bool> m_abort;
+};
+
+} // end namespace sv
+
+#endif
@@ -38,6 +38,11 @@
 
 #include "data/model/AlignmentModel.h"
 #include "align/Align.h"
+#include "align/AlignmentScheduler.h"
+
+#include "LazyDatasetLoader.h"
+#include "PackedDataset.h"
+#include "DerivedModelCache.h"
 
 namespace sv {
 
@@ -45,11 +50,18 @@ using std::vector;
 
 //#define DEBUG_DOCUMENT 1
 
+// Largest model XML, in bytes of UTF-8, to keep for reuse in later saves
+static const int MAX_CACHED_MODEL_XML = 16 * 1024 * 1024;
+
 //!!! still need to handle command history, documentRestored/documentModified
 
 Document::Document() :
     m_autoAlignment(false),
     m_align(new Align()),
+    m_datasetLoader(new LazyDatasetLoader()),
+    m_derivedModelCache(new DerivedModelCache()),
+    m_deferredModels(nullptr),
+    m_deferToSidecar(false),
     m_isIncomplete(false)
 {
     connect(ModelTransformerFactory::getInstance(),
@@ -62,6 +74,10 @@ Document::Document() :
 
     connect(m_align, SIGNAL(alignmentFailed(ModelId, QString)),
             this, SIGNAL(alignmentFailed(ModelId, QString)));
+
+    connect(AlignmentScheduler::getInstance(),
+            SIGNAL(progressChanged(int, int)),
+            this, SIGNAL(alignmentProgress(int, int)));
 }
 
 Document::~Document()
@@ -76,6 +92,9 @@ Document::~Document()
     SVCERR << "\n\nDocument::~Document: about to clear command history" << endl;
 #endif
     CommandHistory::getInstance()->clear();
+
+    delete m_datasetLoader;
+    delete m_derivedModelCache;
     
 #ifdef DEBUG_DOCUMENT
     SVCERR << "Document::~Document: about to delete layers" << endl;
@@ -802,39 +821,81 @@ Document::addDerivedModels(const Transforms &transforms,
                            AdditionalModelConverter *amc)
 {
     Profiler profiler("Document::addDerivedModels");
-    
-    vector<ModelId> mm = 
-        ModelTransformerFactory::getInstance()->transformMultiple
-        (transforms, input, message, amc);
+
+    m_datasetLoader->require(input.getModel());
+
+    // The transforms we actually use are presumably identical to the
+    // ones asked for, except that the version of the plugin may
+    // differ.  It's possible that the returned message contains a
+    // warning about this; that doesn't concern us here, but we do
+    // need to ensure that the transform we remember (and look up in
+    // the cache) is correct for what is actually applied, with the
+    // current plugin version.
+
+    //!!! would be nice to short-circuit this -- the version is
+    //!!! static data, shouldn't have to construct a plugin for it
+    //!!! (which may be expensive in Piper-world)
+
+    Transforms applied = transforms;
+    for (auto &t: applied) {
+        t.setPluginVersion
+            (TransformFactory::getInstance()->
+             getDefaultTransformFor(t.getIdentifier(),
+                                    t.getSampleRate())
+             .getPluginVersion());
+    }
+
+    // Outputs that go through an additional-model converter can't be
+    // reproduced from the cache, since the converter may make more
+    // models than we would store
+
+    vector<QString> keys(transforms.size());
+    vector<ModelId> mm(transforms.size());
+    Transforms toRun;
+
+    for (int j = 0; in_range_for(applied, j); ++j) {
+        if (!amc) {
+            keys[j] = DerivedModelCache::makeKey
+                (applied[j], input.getModel(), input.getChannel());
+        }
+        if (keys[j] != "") {
+            mm[j] = m_derivedModelCache->load(keys[j]);
+        }
+        if (mm[j].isNone()) {
+            toRun.push_back(transforms[j]);
+        } else {
+            SVDEBUG << "Document::addDerivedModels: using cached output for "
+                    << "transform " << applied[j].getIdentifier() << endl;
+        }
+    }
+
+    if (!toRun.empty()) {
+        vector<ModelId> run = 
+            ModelTransformerFactory::getInstance()->transformMultiple
+            (toRun, input, message, amc);
+        int r = 0;
+        for (int j = 0; in_range_for(mm, j); ++j) {
+            if (!mm[j].isNone()) continue;
+            if (in_range_for(run, r)) {
+                mm[j] = run[r];
+                if (keys[j] != "") {
+                    cacheDerivedModelWhenReady(mm[j], keys[j]);
+                }
+            }
+            ++r;
+        }
+    }
 
     for (int j = 0; in_range_for(mm, j); ++j) {
 
         ModelId modelId = mm[j];
-        Transform applied = transforms[j];
 
         if (modelId.isNone()) {
-            SVCERR << "WARNING: Document::addDerivedModel: no output model for transform " << applied.getIdentifier() << endl;
+            SVCERR << "WARNING: Document::addDerivedModel: no output model for transform " << applied[j].getIdentifier() << endl;
             continue;
         }
 
-        // The transform we actually used was presumably identical to
-        // the one asked for, except that the version of the plugin
-        // may differ.  It's possible that the returned message
-        // contains a warning about this; that doesn't concern us
-        // here, but we do need to ensure that the transform we
-        // remember is correct for what was actually applied, with the
-        // current plugin version.
-
-        //!!! would be nice to short-circuit this -- the version is
-        //!!! static data, shouldn't have to construct a plugin for it
-        //!!! (which may be expensive in Piper-world)
-        applied.setPluginVersion
-            (TransformFactory::getInstance()->
-             getDefaultTransformFor(applied.getIdentifier(),
-                                    applied.getSampleRate())
-             .getPluginVersion());
-
-        addAlreadyDerivedModel(applied, input, modelId);
+        addAlreadyDerivedModel(applied[j], input, modelId);
     }
         
     return mm;
@@ -924,10 +985,48 @@ Document::releaseModel(ModelId modelId)
                << "their source fields" << endl;
     }
 
+    m_modelXml.erase(modelId);
+    m_modelXmlGeneration.erase(modelId);
+    m_pendingCacheKeys.erase(modelId);
     m_models.erase(modelId);
     ModelById::release(modelId);
 }
 
+void
+Document::cacheDerivedModelWhenReady(ModelId modelId, QString key)
+{
+    auto model = ModelById::get(modelId);
+    if (!model) return;
+
+    m_pendingCacheKeys[modelId] = key;
+
+    connect(model.get(), SIGNAL(ready(ModelId)),
+            this, SLOT(derivedModelReady(ModelId)));
+
+    // The transform runs in its own thread, so the model may have
+    // become ready before we connected
+    if (model->isReady()) {
+        derivedModelReady(modelId);
+    }
+}
+
+void
+Document::derivedModelReady(ModelId modelId)
+{
+    auto itr = m_pendingCacheKeys.find(modelId);
+    if (itr == m_pendingCacheKeys.end()) return;
+
+    QString key = itr->second;
+    m_pendingCacheKeys.erase(itr);
+
+    if (auto model = ModelById::get(modelId)) {
+        disconnect(model.get(), SIGNAL(ready(ModelId)),
+                   this, SLOT(derivedModelReady(ModelId)));
+    }
+
+    m_derivedModelCache->store(key, modelId);
+}
+
 void
 Document::deleteLayer(Layer *layer, bool force)
 {
@@ -1249,9 +1348,20 @@ Document::alignModels()
     alignModel(m_mainModel);
 }
 
+void
+Document::prioritiseAlignment(ModelId modelId)
+{
+    m_align->prioritise(modelId);
+}
+
 void
 Document::realignModels()
 {
+    // Drop everything in progress first, so that the new alignments
+    // are queued afresh in order of the current priorities rather
+    // than each replacing its predecessor wherever that was
+    m_align->cancelAlignments();
+    
     for (auto rec: m_models) {
         alignModel(rec.first, true);
     }
@@ -1400,6 +1510,12 @@ void
 Document::toXml(QTextStream &out, QString indent, QString extraAttributes,
                 bool asTemplate) const
 {
+    if (!asTemplate) {
+        // Models still waiting for their datasets would be written
+        // without them
+        m_datasetLoader->requireAll();
+    }
+    
     out << indent + QString("<data%1%2>\n")
         .arg(extraAttributes == "" ? "" : " ").arg(extraAttributes);
 
@@ -1485,6 +1601,10 @@ Document::toXml(QTextStream &out, QString indent, QString extraAttributes,
 
     std::set<ModelId> written;
 
+    bool packDatasets =
+        ((m_deferredModels && m_deferToSidecar) ||
+         PackedDataset::isWritingEnabled());
+
     // Now write the other models in two passes: first the models that
     // aren't derived from anything (in case they are source
     // components for an aggregate model, in which case we need to
@@ -1551,7 +1671,7 @@ Document::toXml(QTextStream &out, QString indent, QString extraAttributes,
             }
             
             if (writeModel) {
-                model->toXml(out, indent + "  ");
+                writeModelXml(out, indent + "  ", modelId, packDatasets);
                 written.insert(modelId);
             }
             
@@ -1596,6 +1716,164 @@ Document::toXml(QTextStream &out, QString indent, QString extraAttributes,
     out << indent + "</data>\n";
 }
 
+void
+Document::writeModelXml(QTextStream &out, QString indent, ModelId modelId,
+                        bool packed) const
+{
+    auto model = ModelById::get(modelId);
+    if (!model) return;
+    
+    // Datasets written to a sidecar must be written afresh every
+    // time, as it is rewritten from scratch
+    bool toSidecar = (m_deferredModels && m_deferToSidecar);
+    bool cacheable = (!toSidecar && model->isReady());
+
+    if (cacheable) {
+        auto itr = m_modelXml.find(modelId);
+        if (itr != m_modelXml.end() &&
+            itr->second.indent == indent &&
+            itr->second.packed == packed) {
+#ifdef DEBUG_DOCUMENT
+            SVDEBUG << "Document::writeModelXml: model " << modelId
+                    << " unchanged since last written" << endl;
+#endif
+            out << QString::fromUtf8(qUncompress(itr->second.compressed));
+            return;
+        }
+        watchModelXml(modelId);
+    }
+
+    if (m_deferredModels && out.device()) {
+#ifdef DEBUG_DOCUMENT
+        SVDEBUG << "Document::writeModelXml: deferring model " << modelId
+                << endl;
+#endif
+        out.flush();
+        DeferredModel deferred;
+        deferred.position = out.device()->pos();
+        deferred.model = model;
+        deferred.indent = indent;
+        deferred.packed = packed;
+        deferred.cacheable = cacheable;
+        deferred.generation = m_modelXmlGeneration[modelId];
+        m_deferredModels->push_back(deferred);
+        return;
+    }
+
+    QString xml;
+    {
+        QTextStream stream(&xml);
+        if (!packed ||
+            !PackedDataset::writeModel(stream, indent, model, nullptr)) {
+            model->toXml(stream, indent);
+        }
+    }
+
+    out << xml;
+
+    if (cacheable) {
+        cacheModelXml(modelId, indent, packed,
+                      compressModelXml(xml.toUtf8()));
+    }
+}
+
+QByteArray
+Document::compressModelXml(const QByteArray &utf8)
+{
+    if (utf8.size() > MAX_CACHED_MODEL_XML) {
+        return {};
+    }
+    return qCompress(utf8, 1);
+}
+
+void
+Document::cacheModelXml(ModelId modelId, QString indent, bool packed,
+                        QByteArray compressed) const
+{
+    if (compressed.isEmpty()) {
+        m_modelXml.erase(modelId);
+        return;
+    }
+    m_modelXml[modelId] = { indent, packed, compressed };
+}
+
+void
+Document::watchModelXml(ModelId modelId) const
+{
+    auto model = ModelById::get(modelId);
+    if (!model) return;
+    
+    Document *self = const_cast<Document *>(this);
+
+    connect(model.get(), SIGNAL(modelChanged(ModelId)),
+            self, SLOT(modelXmlInvalidated(ModelId)), Qt::UniqueConnection);
+    connect(model.get(), SIGNAL(modelChangedWithin(ModelId, sv_frame_t, sv_frame_t)),
+            self, SLOT(modelXmlInvalidated(ModelId)), Qt::UniqueConnection);
+    connect(model.get(), SIGNAL(completionChanged(ModelId)),
+            self, SLOT(modelXmlInvalidated(ModelId)), Qt::UniqueConnection);
+    connect(model.get(), SIGNAL(objectNameChanged(QString)),
+            self, SLOT(modelXmlInvalidated()), Qt::UniqueConnection);
+
+    // Some model properties, such as units, are changed through the
+    // layer without the model saying so
+    for (auto layer: m_layers) {
+        if (layer->getModel() != modelId) continue;
+        connect(layer, SIGNAL(layerParametersChanged()),
+                self, SLOT(modelXmlInvalidated()), Qt::UniqueConnection);
+        connect(layer, SIGNAL(modelReplaced()),
+                self, SLOT(modelXmlInvalidated()), Qt::UniqueConnection);
+    }
+}
+
+void
+Document::writeDeferredModel(QTextStream &out, const DeferredModel &deferred,
+                             PackedDatasetSidecar *sidecar)
+{
+    if (!deferred.packed ||
+        !PackedDataset::writeModel(out, deferred.indent, deferred.model,
+                                   sidecar)) {
+        deferred.model->toXml(out, deferred.indent);
+    }
+}
+
+void
+Document::setDeferredModelXml(const DeferredModel &deferred,
+                              QByteArray compressed)
+{
+    if (!deferred.cacheable) return;
+
+    ModelId modelId = deferred.model->getId();
+    if (m_models.find(modelId) == m_models.end()) return;
+
+    // Changed again since it was deferred, so this is already stale
+    if (m_modelXmlGeneration[modelId] != deferred.generation) return;
+
+    cacheModelXml(modelId, deferred.indent, deferred.packed, compressed);
+}
+
+void
+Document::invalidateModelXml(ModelId modelId)
+{
+    m_modelXml.erase(modelId);
+    ++m_modelXmlGeneration[modelId];
+}
+
+void
+Document::modelXmlInvalidated(ModelId modelId)
+{
+    invalidateModelXml(modelId);
+}
+
+void
+Document::modelXmlInvalidated()
+{
+    if (auto model = qobject_cast<Model *>(sender())) {
+        invalidateModelXml(model->getId());
+    } else if (auto layer = qobject_cast<Layer *>(sender())) {
+        invalidateModelXml(layer->getModel());
+    }
+}
+
 void
 Document::writePlaceholderMainModel(QTextStream &out, QString indent) const
 {
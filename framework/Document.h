@@ -24,6 +24,8 @@
 
 #include <map>
 #include <set>
+#include <memory>
+#include <vector>
 
 namespace sv {
 
@@ -36,6 +38,9 @@ class AggregateWaveModel;
 class AdditionalModelConverter;
 
 class Align;
+class DerivedModelCache;
+class LazyDatasetLoader;
+class PackedDatasetSidecar;
 
 /**
  * A Sonic Visualiser document consists of a set of data models, and
@@ -230,6 +235,12 @@ public:
      * Add derived models associated with the given set of related
      * transforms, running the transforms and returning the resulting
      * models.  The models are added to ModelById before returning.
+     *
+     * Where the DerivedModelCache has the output of a transform for
+     * the same input content and channel, that is loaded instead of
+     * running the transform; outputs that are calculated are stored
+     * in the cache once they are ready. The cache is not used when an
+     * AdditionalModelConverter is supplied.
      */
     friend class AdditionalModelConverter;
     std::vector<ModelId> addDerivedModels(const Transforms &transforms,
@@ -313,6 +324,13 @@ public:
      */
     void realignModels();
 
+    /**
+     * Align the given model ahead of others waiting to be aligned,
+     * for example because it has become visible. This persists for
+     * later alignments of the same model.
+     */
+    void prioritiseAlignment(ModelId);
+
     /**
      * Return true if any external files (most obviously audio) failed
      * to be found on load, so that the document is incomplete
@@ -322,6 +340,66 @@ public:
 
     void setIncomplete(bool i) { m_isIncomplete = i; }
 
+    /**
+     * Return the loader for model datasets that are read from session
+     * sidecar files after the session has loaded. Call its require()
+     * for any model whose data is needed at once.
+     */
+    LazyDatasetLoader *getDatasetLoader() { return m_datasetLoader; }
+
+    /**
+     * A model whose XML has been left out of the output of toXml(),
+     * to be written later with writeDeferredModel().
+     */
+    struct DeferredModel {
+        qint64 position; // in bytes, in the toXml() output device
+        std::shared_ptr<Model> model;
+        QString indent;
+        bool packed;
+        bool cacheable;
+        int generation;
+    };
+
+    /**
+     * Have toXml() leave out the XML of every model that has to be
+     * serialised afresh, rather than reused from an earlier save,
+     * appending a record of each to the given vector instead. The
+     * stream passed to toXml() must then be writing to a device, so
+     * that the positions of the missing models can be recorded. If
+     * toSidecar is true, the deferred models are to be written with
+     * their datasets packed into a sidecar file. Pass null to have
+     * toXml() write all models in place again.
+     */
+    void setDeferredModels(std::vector<DeferredModel> *models,
+                           bool toSidecar) {
+        m_deferredModels = models;
+        m_deferToSidecar = toSidecar;
+    }
+
+    /**
+     * Write the XML of a model that was left out of toXml(), packing
+     * its dataset into the given sidecar if it is non-null. This
+     * reads only the model, which guards its own data, so it may be
+     * called from any thread.
+     */
+    static void writeDeferredModel(QTextStream &, const DeferredModel &,
+                                   PackedDatasetSidecar *sidecar);
+
+    /**
+     * Return the given UTF-8 model XML compressed for keeping in the
+     * model XML cache, or an empty array if it is too large to be
+     * worth keeping. This may be called from any thread.
+     */
+    static QByteArray compressModelXml(const QByteArray &utf8);
+
+    /**
+     * Remember the XML that writeDeferredModel() wrote for a model,
+     * as returned by compressModelXml(), for toXml() to reuse if the
+     * model has not changed since it was deferred. Call from the GUI
+     * thread.
+     */
+    void setDeferredModelXml(const DeferredModel &, QByteArray compressed);
+
     void toXml(QTextStream &, QString indent, QString extraAttributes) const override;
     void toXmlAsTemplate(QTextStream &, QString indent, QString extraAttributes) const;
 
@@ -353,10 +431,17 @@ signals:
     void alignmentComplete(ModelId); // an AlignmentModel
     void alignmentFailed(ModelId, QString message); // an AlignmentModel
 
+    // Across all alignments waiting or running in the process, not
+    // only this document's; jobs is zero once all are finished
+    void alignmentProgress(int jobs, int percent);
+
     void activity(QString);
 
 protected slots:
     void performDeferredAlignment(ModelId);
+    void modelXmlInvalidated(ModelId);
+    void modelXmlInvalidated();
+    void derivedModelReady(ModelId);
     
 protected:
     void releaseModel(ModelId model);
@@ -419,6 +504,43 @@ protected:
 
     std::set<ModelId> m_aggregateModels;
     std::set<ModelId> m_alignmentModels;
+
+    /**
+     * The XML last written for each model, reused by toXml() for
+     * models that have not changed since, so that saving a session
+     * again costs only what has changed. Entries are dropped when
+     * their model or a layer showing it signals a change, and are
+     * only made for models that are ready, whose changes all come
+     * from the GUI thread. The generation of a model counts its
+     * changes, so that XML written for a deferred model can be
+     * discarded if the model changed after it was deferred. The XML
+     * is kept compressed, and not at all for the largest models,
+     * which are written afresh each time (on the session writer
+     * thread, for background saves).
+     */
+    struct ModelXmlRecord {
+        QString indent;
+        bool packed;
+        QByteArray compressed; // UTF-8
+    };
+    mutable std::map<ModelId, ModelXmlRecord> m_modelXml;
+    mutable std::map<ModelId, int> m_modelXmlGeneration;
+
+    void writeModelXml(QTextStream &, QString indent, ModelId,
+                       bool packed) const;
+    void cacheModelXml(ModelId, QString indent, bool packed,
+                       QByteArray compressed) const;
+    void watchModelXml(ModelId) const;
+    void invalidateModelXml(ModelId);
+
+    /**
+     * Derived models still being calculated, with the keys under
+     * which to store them in the DerivedModelCache once they are
+     * ready.
+     */
+    std::map<ModelId, QString> m_pendingCacheKeys;
+
+    void cacheDerivedModelWhenReady(ModelId, QString key);
     
     /**
      * Add an extra derived model (returned at the end of processing a
@@ -489,6 +611,11 @@ protected:
     bool m_autoAlignment;
     Align *m_align;
 
+    LazyDatasetLoader *m_datasetLoader;
+    DerivedModelCache *m_derivedModelCache;
+    std::vector<DeferredModel> *m_deferredModels;
+    bool m_deferToSidecar;
+
     bool m_isIncomplete;
 };
 
@@ -0,0 +1,268 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+#include "LazyDatasetLoader.h"
+#include "PackedDataset.h"
+
+#include "data/model/EditableDenseThreeDimensionalModel.h"
+#include "data/model/SparseTimeValueModel.h"
+
+#include "base/Debug.h"
+
+#include <QByteArray>
+#include <QFile>
+#include <QTimer>
+
+#include <algorithm>
+
+//#define DEBUG_LAZY_DATASET_LOADER 1
+
+namespace sv {
+
+// Sections loaded in each pass through the event loop. Each is at
+// most a few megabytes, so this keeps the GUI responsive
+static const int SECTIONS_PER_PASS = 4;
+
+LazyDatasetLoader::LazyDatasetLoader() :
+    m_timer(new QTimer(this))
+{
+    m_timer->setInterval(0);
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(loadNext()));
+}
+
+LazyDatasetLoader::~LazyDatasetLoader()
+{
+    while (!m_files.empty()) {
+        closeFile(m_files.begin()->first);
+    }
+}
+
+void
+LazyDatasetLoader::addSection(ModelId model, QString file, qint64 offset,
+                              qint64 length,
+                              const QXmlStreamAttributes &attributes)
+{
+    if (m_pending.find(model) == m_pending.end()) {
+        m_order.push_back(model);
+    }
+    m_pending[model].push_back({ file, offset, length, attributes });
+    ++m_remaining[file];
+}
+
+void
+LazyDatasetLoader::start()
+{
+    if (!m_pending.empty()) {
+        SVDEBUG << "LazyDatasetLoader: Loading datasets for "
+                << m_pending.size() << " model(s) in background" << endl;
+        m_timer->start();
+    }
+}
+
+bool
+LazyDatasetLoader::isPending(ModelId model) const
+{
+    return m_pending.find(model) != m_pending.end();
+}
+
+void
+LazyDatasetLoader::require(ModelId model)
+{
+    auto itr = m_pending.find(model);
+    if (itr == m_pending.end()) return;
+
+#ifdef DEBUG_LAZY_DATASET_LOADER
+    SVDEBUG << "LazyDatasetLoader::require: Loading " << itr->second.size()
+            << " section(s) for model " << model << endl;
+#endif
+
+    std::deque<Section> sections;
+    sections.swap(itr->second);
+    m_pending.erase(itr);
+    m_order.erase(std::remove(m_order.begin(), m_order.end(), model),
+                  m_order.end());
+
+    for (const auto &section: sections) {
+        loadSection(model, section);
+    }
+
+    if (m_order.empty()) {
+        m_timer->stop();
+    }
+}
+
+void
+LazyDatasetLoader::requireAll()
+{
+    while (!m_order.empty()) {
+        require(m_order.front());
+    }
+}
+
+void
+LazyDatasetLoader::prioritise(ModelId model)
+{
+    if (!isPending(model)) return;
+    m_order.erase(std::remove(m_order.begin(), m_order.end(), model),
+                  m_order.end());
+    m_order.push_front(model);
+}
+
+void
+LazyDatasetLoader::loadNext()
+{
+    for (int i = 0; i < SECTIONS_PER_PASS && !m_order.empty(); ++i) {
+
+        ModelId model = m_order.front();
+        auto &sections = m_pending[model];
+        Section section = sections.front();
+        sections.pop_front();
+
+        if (sections.empty()) {
+            m_pending.erase(model);
+            m_order.pop_front();
+        }
+
+        loadSection(model, section);
+    }
+
+    if (m_order.empty()) {
+        SVDEBUG << "LazyDatasetLoader: All datasets loaded" << endl;
+        m_timer->stop();
+    }
+}
+
+void
+LazyDatasetLoader::loadSection(ModelId modelId, const Section &section)
+{
+    if (m_files.find(section.file) == m_files.end()) {
+        m_files[section.file] = openFile(section.file);
+    }
+
+    MappedFile mf = m_files[section.file];
+    
+    if (mf.file) {
+        
+        bool ok = false;
+        
+        if (section.offset < PackedDatasetSidecar::getHeaderSize() ||
+            section.length < 0 ||
+            section.offset + section.length > mf.size) {
+            SVCERR << "WARNING: LazyDatasetLoader: Section at " << section.offset
+                   << " of length " << section.length << " is outside file "
+                   << section.file << endl;
+        } else {
+            
+            QByteArray buffer;
+            const char *data = nullptr;
+            
+            if (mf.data) {
+                data = mf.data + section.offset;
+            } else if (mf.file->seek(section.offset)) {
+                buffer = mf.file->read(section.length);
+                if (buffer.size() == section.length) {
+                    data = buffer.constData();
+                }
+            }
+
+            if (!data) {
+                SVCERR << "WARNING: LazyDatasetLoader: Failed to read section "
+                       << "at " << section.offset << " of file "
+                       << section.file << endl;
+            } else if (auto dtdm = ModelById::getAs
+                       <EditableDenseThreeDimensionalModel>(modelId)) {
+                ok = PackedDataset::readColumns
+                    (section.attributes, data, section.length, dtdm.get());
+            } else if (auto stvm =
+                       ModelById::getAs<SparseTimeValueModel>(modelId)) {
+                ok = PackedDataset::readPoints
+                    (section.attributes, data, section.length, stvm.get());
+            } else if (ModelById::get(modelId)) {
+                SVCERR << "WARNING: LazyDatasetLoader: Model " << modelId
+                       << " is of a type that has no packed datasets" << endl;
+            } else {
+                ok = true; // model has gone since, nothing to do
+            }
+        }
+
+        if (!ok) {
+            SVCERR << "WARNING: LazyDatasetLoader: Failed to load section of "
+                   << "dataset for model " << modelId << endl;
+        }
+    }
+
+    if (--m_remaining[section.file] <= 0) {
+        closeFile(section.file);
+    }
+}
+
+LazyDatasetLoader::MappedFile
+LazyDatasetLoader::openFile(QString path)
+{
+    MappedFile mf { nullptr, nullptr, 0 };
+    
+    QFile *file = new QFile(path);
+    if (!file->open(QIODevice::ReadOnly)) {
+        SVCERR << "WARNING: LazyDatasetLoader: Failed to open dataset file "
+               << path << ": " << file->errorString() << endl;
+        delete file;
+        return mf;
+    }
+
+    qint64 size = file->size();
+    
+    const char *data =
+        reinterpret_cast<const char *>(file->map(0, size));
+
+    QByteArray header;
+    if (data) {
+        header = QByteArray::fromRawData
+            (data, int(std::min(size, PackedDatasetSidecar::getHeaderSize())));
+    } else {
+        SVDEBUG << "LazyDatasetLoader: Failed to map dataset file " << path
+                << ", reading it instead" << endl;
+        header = file->read(PackedDatasetSidecar::getHeaderSize());
+    }
+
+    if (!PackedDatasetSidecar::checkHeader(header.constData(),
+                                           header.size())) {
+        SVCERR << "WARNING: LazyDatasetLoader: File " << path
+               << " is not a session dataset file" << endl;
+        delete file; // also unmaps
+        return mf;
+    }
+
+#ifdef DEBUG_LAZY_DATASET_LOADER
+    SVDEBUG << "LazyDatasetLoader: Opened dataset file " << path << " ("
+            << size << " bytes, " << (data ? "mapped" : "not mapped") << ")"
+            << endl;
+#endif
+
+    mf.file = file;
+    mf.data = data;
+    mf.size = size;
+    return mf;
+}
+
+void
+LazyDatasetLoader::closeFile(QString path)
+{
+    auto itr = m_files.find(path);
+    if (itr == m_files.end()) return;
+    delete itr->second.file; // also unmaps
+    m_files.erase(itr);
+    m_remaining.erase(path);
+}
+
+} // end namespace sv
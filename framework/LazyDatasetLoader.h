@@ -0,0 +1,126 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+#ifndef SV_LAZY_DATASET_LOADER_H
+#define SV_LAZY_DATASET_LOADER_H
+
+#include "data/model/Model.h"
+
+#include <QObject>
+#include <QString>
+#include <QXmlStreamAttributes>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+class QFile;
+class QTimer;
+
+namespace sv {
+
+/**
+ * Loads packed dataset sections from session sidecar files into
+ * their models after the session itself has been read, so that a
+ * session is usable before all of its data is in memory. The models
+ * exist from the start and fill in as their sections are loaded.
+ *
+ * Sections are loaded in the background, a few at a time from the
+ * event loop, with those of prioritised models first. Anything that
+ * needs a model's data straight away (displaying, playing, running
+ * a transform on it, or saving it) should call require() first.
+ *
+ * Sidecar files are memory-mapped where possible, and stay mapped
+ * only until all of their sections have been loaded.
+ *
+ * For use from the GUI thread only.
+ */
+class LazyDatasetLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    LazyDatasetLoader();
+    ~LazyDatasetLoader();
+
+    /**
+     * Add a section of length bytes at the given offset in the given
+     * sidecar file, to be loaded into the given model, whose
+     * <packed> element had the given attributes.
+     */
+    void addSection(ModelId model, QString file, qint64 offset,
+                    qint64 length, const QXmlStreamAttributes &attributes);
+
+    /**
+     * Start loading sections in the background. Call when the
+     * session has been read.
+     */
+    void start();
+
+    /**
+     * Return true if the given model has sections not yet loaded.
+     */
+    bool isPending(ModelId model) const;
+
+    /**
+     * Load any sections not yet loaded for the given model, before
+     * returning.
+     */
+    void require(ModelId model);
+
+    /**
+     * Load all sections not yet loaded, before returning.
+     */
+    void requireAll();
+
+    /**
+     * Load the given model's sections in the background ahead of
+     * those of models prioritised before it.
+     */
+    void prioritise(ModelId model);
+
+    LazyDatasetLoader(const LazyDatasetLoader &) =delete;
+    LazyDatasetLoader &operator=(const LazyDatasetLoader &) =delete;
+
+private slots:
+    void loadNext();
+
+private:
+    struct Section {
+        QString file;
+        qint64 offset;
+        qint64 length;
+        QXmlStreamAttributes attributes;
+    };
+
+    struct MappedFile {
+        QFile *file; // null if the file could not be opened or is invalid
+        const char *data; // null if the file could not be mapped
+        qint64 size;
+    };
+
+    std::map<ModelId, std::deque<Section>> m_pending;
+    std::deque<ModelId> m_order;
+    std::map<QString, MappedFile> m_files;
+    std::map<QString, int> m_remaining; // sections not yet loaded, per file
+    QTimer *m_timer;
+
+    void loadSection(ModelId model, const Section &section);
+    MappedFile openFile(QString path);
+    void closeFile(QString path);
+};
+
+} // end namespace sv
+
+#endif
@@ -15,6 +15,12 @@
 
 #include "MainWindowBase.h"
 #include "Document.h"
+#include "LazyDatasetLoader.h"
+#include "PackedDataset.h"
+#include "SessionWriter.h"
+#include "ParallelAudioLoader.h"
+#include "StreamingModelExporter.h"
+#include "PhaseTrace.h"
 
 #include "view/Pane.h"
 #include "view/PaneStack.h"
@@ -55,7 +61,6 @@
 #include "data/fileio/PlaylistFileReader.h"
 #include "data/fileio/WavFileWriter.h"
 #include "data/fileio/MIDIFileWriter.h"
-#include "data/fileio/CSVFileWriter.h"
 #include "data/fileio/BZipFileDevice.h"
 #include "data/fileio/FileSource.h"
 #include "data/fileio/AudioFileReaderFactory.h"
@@ -96,6 +101,7 @@
 #include <QTreeView>
 #include <QFile>
 #include <QFileInfo>
+#include <QUrl>
 #include <QDir>
 #include <QTextStream>
 #include <QStringConverter>
@@ -112,6 +118,10 @@
 #include <iostream>
 #include <cstdio>
 #include <errno.h>
+#include <memory>
+#include <algorithm>
+
+//#define DEBUG_MAIN_WINDOW_BASE 1
 
 namespace sv {
 
@@ -119,6 +129,19 @@ using std::vector;
 using std::map;
 using std::set;
 
+// Most OSC messages handled, and longest spent handling them, before
+// returning to the event loop
+static const int OSC_BATCH_MAX_MESSAGES = 256;
+static const int OSC_BATCH_MAX_MSEC = 20;
+
+// Longest wait between checks of the playback position while
+// timestamped OSC messages are pending
+static const int OSC_SCHEDULE_MAX_INTERVAL_MSEC = 10;
+
+// How often to look again at pending OSC messages while waiting for
+// playback to start, or for the application to be ready for them
+static const int OSC_IDLE_INTERVAL_MSEC = 50;
+
 #ifdef Q_WS_X11
 #define Window X11Window
 #include <X11/Xlib.h>
@@ -157,6 +180,9 @@ MainWindowBase::MainWindowBase(AudioMode audioMode,
     m_oscQueue(nullptr),
     m_oscQueueStarter(nullptr),
     m_oscScript(nullptr),
+    m_oscScheduleTimer(nullptr),
+    m_oscRetryTimer(nullptr),
+    m_sessionWriter(new SessionWriter()),
     m_midiInput(nullptr),
     m_recentFiles("RecentFiles", 20),
     m_recentTransforms("RecentTransforms", 20),
@@ -173,6 +199,7 @@ MainWindowBase::MainWindowBase(AudioMode audioMode,
     m_menuShortcutMapper(nullptr)
 {
     Profiler profiler("MainWindowBase::MainWindowBase");
+    PhaseTrace::Phase phase("MainWindowBase::MainWindowBase");
 
     SVDEBUG << "MainWindowBase::MainWindowBase" << endl;
 
@@ -185,6 +212,9 @@ MainWindowBase::MainWindowBase(AudioMode audioMode,
 #endif
 
     connect(this, SIGNAL(hideSplash()), this, SLOT(emitHideSplash()));
+
+    connect(m_sessionWriter, SIGNAL(sessionWritten(QString, bool, QString)),
+            this, SLOT(sessionWritten(QString, bool, QString)));
     
     connect(CommandHistory::getInstance(), SIGNAL(commandExecuted()),
             this, SLOT(documentModified()));
@@ -348,6 +378,11 @@ MainWindowBase::~MainWindowBase()
     delete m_viewManager;
     delete m_midiInput;
 
+    // Finishes any save still being written
+    delete m_sessionWriter;
+
+    PhaseTrace::dumpIfRequested();
+
     if (m_oscScript) {
         disconnect(m_oscScript, nullptr, nullptr, nullptr);
         m_oscScript->abandon();
@@ -548,6 +583,18 @@ MainWindowBase::oscReady()
         connect(oscTimer, SIGNAL(timeout()), this, SLOT(pollOSC()));
         oscTimer->start(2000);
 
+        m_oscScheduleTimer = new QTimer(this);
+        m_oscScheduleTimer->setSingleShot(true);
+        m_oscScheduleTimer->setTimerType(Qt::PreciseTimer);
+        connect(m_oscScheduleTimer, SIGNAL(timeout()),
+                this, SLOT(dispatchScheduledOSC()));
+
+        m_oscRetryTimer = new QTimer(this);
+        m_oscRetryTimer->setSingleShot(true);
+        m_oscRetryTimer->setInterval(OSC_IDLE_INTERVAL_MSEC);
+        connect(m_oscRetryTimer, SIGNAL(timeout()),
+                this, SLOT(pollOSC()));
+
         if (m_oscQueue->hasPort()) {
             SVDEBUG << "Finished setting up OSC interface" << endl;
         } else {
@@ -891,6 +938,13 @@ MainWindowBase::currentPaneChanged(Pane *p)
 
     if (!p) return;
 
+    if (m_document) {
+        for (ModelId modelId: p->getModels()) {
+            m_document->getDatasetLoader()->require(modelId);
+            m_document->prioritiseAlignment(modelId);
+        }
+    }
+
     if (!(m_viewManager &&
           m_playSource &&
           m_viewManager->getPlaySoloMode())) {
@@ -1569,6 +1623,8 @@ MainWindowBase::openAudio(FileSource source,
 {
     SVDEBUG << "MainWindowBase::openAudio(" << source.getLocation() << ") with mode " << mode << " and template " << templateName << endl;
 
+    PhaseTrace::Phase phase("MainWindowBase::openAudio");
+
     if (templateName == "") {
         templateName = getDefaultSessionTemplate();
         SVDEBUG << "(Default template is: \"" << templateName << "\")" << endl;
@@ -1880,14 +1936,41 @@ MainWindowBase::openPlaylist(FileSource source, AudioFileOpenMode mode)
 
     PlaylistFileReader::Playlist playlist = reader.load();
 
+    QStringList locations;
+    for (const auto &location: playlist) {
+        locations.push_back(location);
+    }
+
+    return openAudioFiles(locations, mode, tr("Opening playlist..."));
+}
+
+static bool
+isLocalLocation(QString location)
+{
+    // A single-letter scheme is a Windows drive letter
+    QString scheme = QUrl(location).scheme().toLower();
+    return (scheme == "" || scheme == "file" || scheme.length() == 1);
+}
+
+MainWindowBase::FileOpenStatus
+MainWindowBase::openAudioFiles(QStringList locations,
+                               AudioFileOpenMode mode,
+                               QString progressText)
+{
     bool someSuccess = false;
+    int i = 0;
+
+    // Open files one at a time until one succeeds: that one sets up
+    // the session, and its rate may be the one to resample the rest
+    // to
 
-    for (PlaylistFileReader::Playlist::const_iterator i = playlist.begin();
-         i != playlist.end(); ++i) {
+    while (!someSuccess && i < locations.size()) {
 
-        ProgressDialog dialog(tr("Opening playlist..."), true, 2000, this);
+        ProgressDialog dialog(progressText, true, 2000, this);
         connect(&dialog, SIGNAL(showing()), this, SIGNAL(hideSplash()));
-        FileOpenStatus status = openAudio(FileSource(*i, &dialog), mode);
+        FileOpenStatus status = openAudio(FileSource(locations[i], &dialog),
+                                          mode);
+        ++i;
 
         if (status == FileOpenCancelled) {
             return FileOpenCancelled;
@@ -1895,12 +1978,70 @@ MainWindowBase::openPlaylist(FileSource source, AudioFileOpenMode mode)
 
         if (status == FileOpenSucceeded) {
             someSuccess = true;
-            mode = CreateAdditionalModel;
         }
     }
 
-    if (someSuccess) return FileOpenSucceeded;
-    else return FileOpenFailed;
+    if (!someSuccess) return FileOpenFailed;
+    if (i >= locations.size()) return FileOpenSucceeded;
+
+    sv_samplerate_t rate = 0;
+    if (Preferences::getInstance()->getFixedSampleRate() != 0) {
+        rate = Preferences::getInstance()->getFixedSampleRate();
+    } else if (Preferences::getInstance()->getResampleOnLoad()) {
+        if (getMainModel()) {
+            rate = getMainModel()->getSampleRate();
+        }
+    }
+
+    // Remote files are left to openAudio, as fetching them needs the
+    // GUI thread; local ones are loaded in parallel, and their models
+    // taken from the loader in order
+
+    QStringList localPaths;
+    std::vector<int> loaderIndices;
+    for (int j = i; j < locations.size(); ++j) {
+        if (isLocalLocation(locations[j])) {
+            loaderIndices.push_back(localPaths.size());
+            localPaths.push_back(locations[j]);
+        } else {
+            loaderIndices.push_back(-1);
+        }
+    }
+
+    ParallelAudioLoader loader
+        (localPaths, rate, ParallelAudioLoader::getDefaultConcurrency());
+
+    for (int j = i; j < locations.size(); ++j) {
+
+        int index = loaderIndices[j - i];
+        FileOpenStatus status = FileOpenFailed;
+
+        if (index < 0) {
+
+            ProgressDialog dialog(progressText, true, 2000, this);
+            connect(&dialog, SIGNAL(showing()), this, SIGNAL(hideSplash()));
+            status = openAudio(FileSource(locations[j], &dialog),
+                               CreateAdditionalModel);
+
+        } else {
+
+            m_openingAudioFile = true;
+            ModelId modelId = loader.take(index);
+            if (!modelId.isNone()) {
+                status = addOpenedAudioModel(FileSource(locations[j]),
+                                             modelId,
+                                             CreateAdditionalModel,
+                                             "", true);
+            }
+            m_openingAudioFile = false;
+        }
+
+        if (status == FileOpenCancelled) {
+            break;
+        }
+    }
+
+    return FileOpenSucceeded;
 }
 
 MainWindowBase::FileOpenStatus
@@ -2101,42 +2242,18 @@ MainWindowBase::openDirOfAudio(QString dirPath)
     QStringList files = dir.entryList(QDir::Files | QDir::Readable);
     files.sort();
 
-    FileOpenStatus status = FileOpenFailed;
-    bool first = true;
-    bool cancelled = false;
+    QStringList locations;
 
     foreach (QString file, files) {
-
-        FileSource source(dir.filePath(file));
-        if (!source.isAvailable()) {
-            continue;
-        }
-
+        QString path = dir.filePath(file);
         if (AudioFileReaderFactory::getKnownExtensions().contains
-            (source.getExtension().toLower())) {
-            
-            AudioFileOpenMode mode = CreateAdditionalModel;
-            if (first) mode = ReplaceSession;
-            
-            switch (openAudio(source, mode)) {
-            case FileOpenSucceeded:
-                status = FileOpenSucceeded;
-                first = false;
-                break;
-            case FileOpenFailed:
-                break;
-            case FileOpenCancelled:
-                cancelled = true;
-                break;
-            case FileOpenWrongMode:
-                break;
-            }
+            (QFileInfo(path).suffix().toLower())) {
+            locations.push_back(path);
         }
-
-        if (cancelled) break;
     }
 
-    return status;
+    return openAudioFiles(locations, ReplaceSession,
+                          tr("Opening audio files..."));
 }
 
 MainWindowBase::FileOpenStatus
@@ -2152,6 +2269,8 @@ MainWindowBase::openSession(FileSource source)
 {
     SVDEBUG << "MainWindowBase::openSession(" << source.getLocation() << ")" << endl;
 
+    PhaseTrace::Phase phase("MainWindowBase::openSession");
+
     if (!source.isAvailable()) return FileOpenFailed;
     source.waitForData();
 
@@ -2229,10 +2348,13 @@ MainWindowBase::openSession(FileSource source)
          this, SLOT(modelRegenerationWarning(QString, QString, QString)),
          Qt::QueuedConnection);
 
-    if (bzFile) {
-        reader.parseFile(bzFile);
-    } else {
-        reader.parseFile(rawFile);
+    {
+        PhaseTrace::Phase parsePhase("SVFileReader::parseFile");
+        if (bzFile) {
+            reader.parseFile(bzFile);
+        } else {
+            reader.parseFile(rawFile);
+        }
     }
     
     if (!reader.isOK()) {
@@ -2270,6 +2392,16 @@ MainWindowBase::openSession(FileSource source)
         setupMenus();
         findTimeRulerLayer();
 
+        // Datasets still to be loaded from a sidecar file come in
+        // during idle time, those shown in panes first
+        if (m_paneStack) {
+            for (int i = m_paneStack->getPaneCount() - 1; i >= 0; --i) {
+                for (ModelId modelId: m_paneStack->getPane(i)->getModels()) {
+                    m_document->getDatasetLoader()->prioritise(modelId);
+                }
+            }
+        }
+
         CommandHistory::getInstance()->clear();
         CommandHistory::getInstance()->documentSaved();
         m_documentModified = false;
@@ -2565,6 +2697,8 @@ MainWindowBase::createAudioIO()
 {
     if (m_playTarget || m_audioIO) return;
 
+    PhaseTrace::Phase phase("MainWindowBase::createAudioIO");
+
     static AudioLogCallback audioLogCallback;
     breakfastquay::AudioFactory::setLogCallback(&audioLogCallback);
 
@@ -2755,50 +2889,87 @@ MainWindowBase::createDocument()
     emit replacedDocument();
 }
 
-bool
-MainWindowBase::saveSessionFile(QString path)
+void
+MainWindowBase::makeSessionSnapshot(QString path, SessionSnapshot &snapshot)
 {
-    try {
+    snapshot.path = path;
+    snapshot.sidecar =
+        (m_document && PackedDatasetSidecar::isWritingEnabled());
 
-        TempWriteFile temp(path);
-
-        BZipFileDevice bzFile(temp.getTemporaryFilename());
-        if (!bzFile.open(QIODevice::WriteOnly)) {
-            SVCERR << "Failed to open session file \""
-                      << temp.getTemporaryFilename()
-                      << "\" for writing: "
-                      << bzFile.errorString() << endl;
-            return false;
-        }
-
-        QApplication::setOverrideCursor(QCursor(Qt::WaitCursor));
+    if (m_document) {
+        m_document->setDeferredModels(&snapshot.models, snapshot.sidecar);
+    }
 
-        QTextStream out(&bzFile);
+    {
+        QTextStream out(&snapshot.xml, QIODevice::WriteOnly);
         out.setEncoding(QStringConverter::Utf8);
         toXml(out, false);
         out.flush();
+    }
 
-        QApplication::restoreOverrideCursor();
+    if (m_document) {
+        m_document->setDeferredModels(nullptr, false);
+    }
+}
 
-        if (!bzFile.isOK()) {
-            QMessageBox::critical(this, tr("Failed to write file"),
-                                  tr("<b>Save failed</b><p>Failed to write to file \"%1\": %2")
-                                  .arg(path).arg(bzFile.errorString()));
-            bzFile.close();
-            return false;
-        }
+void
+MainWindowBase::cacheWrittenModels(const SessionWriter::WrittenModels &written)
+{
+    if (!m_document) return;
+    for (const auto &w: written) {
+        m_document->setDeferredModelXml(w.first, w.second);
+    }
+}
 
-        bzFile.close();
-        temp.moveToTarget();
-        return true;
+bool
+MainWindowBase::saveSessionFile(QString path)
+{
+    QApplication::setOverrideCursor(QCursor(Qt::WaitCursor));
 
-    } catch (FileOperationFailed &f) {
-        
+    // Don't let an earlier background save overwrite this one
+    m_sessionWriter->waitForWrites();
+    cacheWrittenModels(m_sessionWriter->takeWrittenModels());
+    
+    SessionSnapshot snapshot;
+    makeSessionSnapshot(path, snapshot);
+
+    QString error;
+    SessionWriter::WrittenModels written;
+    bool success = SessionWriter::write(snapshot, error, written);
+    cacheWrittenModels(written);
+
+    QApplication::restoreOverrideCursor();
+
+    if (!success) {
         QMessageBox::critical(this, tr("Failed to write file"),
                               tr("<b>Save failed</b><p>Failed to write to file \"%1\": %2")
-                              .arg(path).arg(f.what()));
-        return false;
+                              .arg(path).arg(error));
+    }
+
+    return success;
+}
+
+bool
+MainWindowBase::saveSessionFileInBackground(QString path)
+{
+    SessionSnapshot snapshot;
+    makeSessionSnapshot(path, snapshot);
+    m_sessionWriter->writeInBackground(snapshot);
+    return true;
+}
+
+void
+MainWindowBase::sessionWritten(QString path, bool success, QString error)
+{
+    cacheWrittenModels(m_sessionWriter->takeWrittenModels());
+    
+    if (!success) {
+        QMessageBox::critical(this, tr("Failed to write file"),
+                              tr("<b>Save failed</b><p>Failed to write to file \"%1\": %2")
+                              .arg(path).arg(error));
     }
+
+    emit sessionSaved(path, success);
 }
 
 bool
@@ -2980,18 +3151,53 @@ MainWindowBase::exportLayerToCSV(Layer *layer, LayerGeometryProvider *provider,
         QObject::tr("Exporting layer..."), true, 500, this,
         Qt::ApplicationModal
     };
-            
-    CSVFileWriter writer(path, model.get(), &dialog, delimiter, options);
 
-    if (selectionsToWrite) {
-        writer.writeSelection(*selectionsToWrite);
-    } else {
-        writer.write();
+    StreamingModelExporter exporter
+        (model->getId(), path, StreamingModelExporter::Format::Delimited,
+         delimiter, options, selectionsToWrite);
+
+    if (!exporter.run(&dialog)) {
+        error = exporter.getError();
+        if (exporter.wasCancelled()) {
+            error = tr("Export cancelled");
+        } else if (error == "") {
+            error = tr("Failed to export layer for an unknown reason");
+        }
+    }
+
+    return (error == "");
+}
+
+bool
+MainWindowBase::exportLayerToBinary(Layer *layer,
+                                    QString path, QString &error)
+{
+    if (QFileInfo(path).suffix() == "") path += ".bin";
+
+    auto model = ModelById::get(layer->getExportModel(nullptr));
+    if (!model) {
+        error = tr("Internal error: unknown model");
+        return false;
     }
 
-    if (!writer.isOK()) {
-        error = writer.getError();
-        if (error == "") {
+    if (!StreamingModelExporter::canExportBinary(model->getId())) {
+        error = tr("Sorry, cannot export this layer type as raw binary data (supported types are: colour 3D plot, spectrogram, waveform)");
+        return false;
+    }
+
+    ProgressDialog dialog {
+        QObject::tr("Exporting layer..."), true, 500, this,
+        Qt::ApplicationModal
+    };
+
+    StreamingModelExporter exporter
+        (model->getId(), path, StreamingModelExporter::Format::BinaryFloat);
+
+    if (!exporter.run(&dialog)) {
+        error = exporter.getError();
+        if (exporter.wasCancelled()) {
+            error = tr("Export cancelled");
+        } else if (error == "") {
             error = tr("Failed to export layer for an unknown reason");
         }
     }
@@ -3013,6 +3219,8 @@ MainWindowBase::exportLayerTo(Layer *layer, LayerGeometryProvider *provider,
         return exportLayerToMIDI(layer, selectionsToWrite, path, error);
     } else if (suffix == "ttl" || suffix == "n3") {
         return exportLayerToRDF(layer, path, error);
+    } else if (suffix == "bin") {
+        return exportLayerToBinary(layer, path, error);
     } else {
         return exportLayerToCSV(layer, provider, selectionsToWrite,
                                 (suffix == "csv" ? "," : "\t"),
@@ -3341,6 +3549,14 @@ MainWindowBase::play()
         QAction *action = qobject_cast<QAction *>(sender());
         if (action) action->setChecked(false);
     } else {
+        if (m_document && m_paneStack) {
+            // Anything audible must have its data before it can play
+            for (int i = 0; i < m_paneStack->getPaneCount(); ++i) {
+                for (ModelId modelId: m_paneStack->getPane(i)->getModels()) {
+                    m_document->getDatasetLoader()->require(modelId);
+                }
+            }
+        }
         if (m_audioIO) m_audioIO->resume();
         else if (m_playTarget) m_playTarget->resume();
         playbackFrameChanged(m_viewManager->getPlaybackFrame());
@@ -4099,6 +4315,11 @@ MainWindowBase::nextLayer()
 void
 MainWindowBase::playbackFrameChanged(sv_frame_t frame)
 {
+    if (m_playSource && !m_playSource->isPlaying()) {
+        // Have the audio from here ready for when play is pressed
+        m_playSource->preparePlayback(frame);
+    }
+    
     if (!(m_playSource && m_playSource->isPlaying()) || !getMainModel()) return;
 
     updatePositionStatusDisplays();
@@ -4338,50 +4559,271 @@ MainWindowBase::pollOSC()
     
     m_handlingOSC = true;
 
-    while (!m_oscQueue->isEmpty()) {
+    if (!m_oscWaitingSince.isValid()) {
+        m_oscWaitingSince.start();
+    }
 
-        if (m_openingAudioFile) {
-            SVDEBUG << "MainWindowBase::pollOSC: "
-                    << "waiting for audio to finish loading"
-                    << endl;
-            m_handlingOSC = false;
-            return;
-        }
+    disconnect(m_oscQueue, SIGNAL(messagesAvailable()),
+               this, SLOT(pollOSC()));
 
-        if (ModelTransformerFactory::getInstance()->haveRunningTransformers()) {
-            SVDEBUG << "MainWindowBase::pollOSC: "
-                    << "waiting for running transforms to complete"
-                    << endl;
-            m_handlingOSC = false;
-            return;
+    bool waiting = false;
+    
+    while (!m_oscQueue->isEmpty() && !waiting) {
+
+        // Handle a batch of messages before returning to the event
+        // loop, so that a burst of them costs one round of repaints
+        // and other UI updates rather than one per message
+
+        int depth = m_oscQueue->getMessagesAvailable();
+        if (depth > m_oscCounters.maxQueueDepth) {
+            m_oscCounters.maxQueueDepth = depth;
         }
 
-        SVDEBUG << "MainWindowBase::pollOSC: have "
-                << m_oscQueue->getMessagesAvailable()
+#ifdef DEBUG_MAIN_WINDOW_BASE
+        SVDEBUG << "MainWindowBase::pollOSC: have " << depth
                 << " messages" << endl;
-    
-        OSCMessage message = m_oscQueue->readMessage();
+#endif
 
-        if (message.getTarget() != 0) {
-            SVCERR << "MainWindowBase::pollOSC: ignoring message with target "
-                   << message.getTarget() << " (we are target 0)" << endl;
-            m_handlingOSC = false;
-            continue;
+        QElapsedTimer batchTimer;
+        batchTimer.start();
+        int count = 0;
+        
+        while (!m_oscQueue->isEmpty() &&
+               count < OSC_BATCH_MAX_MESSAGES &&
+               batchTimer.elapsed() < OSC_BATCH_MAX_MSEC) {
+
+            if (m_openingAudioFile) {
+                SVDEBUG << "MainWindowBase::pollOSC: "
+                        << "waiting for audio to finish loading"
+                        << endl;
+                waiting = true;
+                break;
+            }
+
+            if (ModelTransformerFactory::getInstance()->
+                haveRunningTransformers()) {
+                SVDEBUG << "MainWindowBase::pollOSC: "
+                        << "waiting for running transforms to complete"
+                        << endl;
+                waiting = true;
+                break;
+            }
+
+            OSCMessage message = m_oscQueue->readMessage();
+            ++count;
+
+            if (message.getTarget() != 0) {
+                SVCERR << "MainWindowBase::pollOSC: ignoring message with target "
+                       << message.getTarget() << " (we are target 0)" << endl;
+                continue;
+            }
+
+            double latency = double(m_oscWaitingSince.nsecsElapsed()) / 1.0e6;
+            ++m_oscCounters.received;
+            m_oscCounters.totalLatencyMsec += latency;
+            if (latency > m_oscCounters.maxLatencyMsec) {
+                m_oscCounters.maxLatencyMsec = latency;
+            }
+
+            if (message.getMethod() == "at") {
+                scheduleOSCMessage(message);
+            } else {
+                handleOSCMessageTimed(message);
+            }
+        }
+
+        if (count > 0) {
+            ++m_oscCounters.batches;
         }
 
-        handleOSCMessage(message);
+        if (m_oscQueue->isEmpty()) {
+            m_oscWaitingSince.invalidate();
+        }
 
-        disconnect(m_oscQueue, SIGNAL(messagesAvailable()),
-                   this, SLOT(pollOSC()));
-        
-        QApplication::processEvents(QEventLoop::ExcludeUserInputEvents |
-                                    QEventLoop::ExcludeSocketNotifiers);
+        if (!waiting) {
+            QApplication::processEvents(QEventLoop::ExcludeUserInputEvents |
+                                        QEventLoop::ExcludeSocketNotifiers);
+        }
     }
 
     m_handlingOSC = false;
 
     connect(m_oscQueue, SIGNAL(messagesAvailable()),
             this, SLOT(pollOSC()));
+
+    if (waiting && m_oscRetryTimer && !m_oscRetryTimer->isActive()) {
+        // Try again soon, rather than only at the next message or
+        // the next tick of the slow poll timer. There is only ever
+        // one retry pending, however many calls found us waiting
+        m_oscRetryTimer->start();
+    }
+}
+
+void
+MainWindowBase::handleOSCMessageTimed(const OSCMessage &message)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    handleOSCMessage(message);
+
+    double elapsed = double(timer.nsecsElapsed()) / 1.0e6;
+    ++m_oscCounters.handled;
+    m_oscCounters.totalHandlingMsec += elapsed;
+    if (elapsed > m_oscCounters.maxHandlingMsec) {
+        m_oscCounters.maxHandlingMsec = elapsed;
+    }
+}
+
+bool
+MainWindowBase::scheduleOSCMessage(const OSCMessage &message)
+{
+    // "/at <seconds> <method> [args...]": handle method with args
+    // once playback reaches the given time
+
+    bool ok = false;
+    double seconds = 0.0;
+    if (message.getArgCount() >= 2) {
+        seconds = message.getArg(0).toDouble(&ok);
+    }
+    QString method = (ok ? message.getArg(1).toString() : QString());
+    if (method.startsWith("/")) method = method.mid(1);
+    
+    if (!ok || seconds < 0.0 || method == "" || method == "at") {
+        SVCERR << "MainWindowBase::scheduleOSCMessage: expected "
+               << "\"at <seconds> <method> [args...]\", ignoring "
+               << message.toString() << endl;
+        return false;
+    }
+
+    sv_samplerate_t rate = 0;
+    if (m_playSource) rate = m_playSource->getSourceSampleRate();
+    if (rate == 0 && getMainModel()) rate = getMainModel()->getSampleRate();
+    if (rate == 0) {
+        SVCERR << "MainWindowBase::scheduleOSCMessage: no sample rate "
+               << "to schedule against, ignoring " << message.toString()
+               << endl;
+        return false;
+    }
+
+    OSCMessage scheduled;
+    scheduled.setTarget(message.getTarget());
+    scheduled.setTargetData(message.getTargetData());
+    scheduled.setMethod(method);
+    for (int i = 2; i < message.getArgCount(); ++i) {
+        scheduled.addArg(message.getArg(i));
+    }
+
+    sv_frame_t frame = RealTime::realTime2Frame
+        (RealTime::fromSeconds(seconds), rate);
+
+#ifdef DEBUG_MAIN_WINDOW_BASE
+    SVDEBUG << "MainWindowBase::scheduleOSCMessage: scheduling "
+            << scheduled.toString() << " at frame " << frame << endl;
+#endif
+
+    m_scheduledOSC.insert({ frame, scheduled });
+    rescheduleOSCTimer();
+    return true;
+}
+
+void
+MainWindowBase::rescheduleOSCTimer()
+{
+    if (!m_oscScheduleTimer) return;
+
+    if (m_scheduledOSC.empty()) {
+        m_oscScheduleTimer->stop();
+        return;
+    }
+
+    int interval = OSC_IDLE_INTERVAL_MSEC;
+
+    if (m_playSource && m_playSource->isPlaying()) {
+        interval = OSC_SCHEDULE_MAX_INTERVAL_MSEC;
+        sv_samplerate_t rate = m_playSource->getSourceSampleRate();
+        sv_frame_t now = m_playSource->getCurrentPlayingFrame();
+        sv_frame_t next = m_scheduledOSC.begin()->first;
+        if (rate > 0) {
+            double msec = (double(next - now) * 1000.0) / rate;
+            // Wake a little early and then re-check the clock, rather
+            // than trust the timer for the whole of a long wait
+            interval = int(std::max(0.0, std::min(msec - 1.0,
+                                                  double(interval))));
+        }
+    }
+
+    m_oscScheduleTimer->start(interval);
+}
+
+void
+MainWindowBase::dispatchScheduledOSC()
+{
+    if (m_scheduledOSC.empty()) return;
+
+    // Held while the application is busy in the same ways as pollOSC
+    // holds the queue, and only dispatched during playback
+    
+    if (m_handlingOSC || m_openingAudioFile ||
+        ModelTransformerFactory::getInstance()->haveRunningTransformers() ||
+        !m_playSource || !m_playSource->isPlaying()) {
+        rescheduleOSCTimer();
+        return;
+    }
+
+    m_handlingOSC = true;
+
+    sv_samplerate_t rate = m_playSource->getSourceSampleRate();
+    
+    while (!m_scheduledOSC.empty() && m_playSource->isPlaying()) {
+
+        sv_frame_t now = m_playSource->getCurrentPlayingFrame();
+        auto itr = m_scheduledOSC.begin();
+        if (itr->first > now) break;
+
+        OSCMessage message = itr->second;
+        if (rate > 0) {
+            ++m_oscCounters.scheduledHandled;
+            m_oscCounters.totalScheduleErrorMsec +=
+                (double(now - itr->first) * 1000.0) / rate;
+        }
+        m_scheduledOSC.erase(itr);
+
+        handleOSCMessageTimed(message);
+    }
+
+    m_handlingOSC = false;
+
+    rescheduleOSCTimer();
+}
+
+MainWindowBase::OSCStatistics
+MainWindowBase::getOSCStatistics() const
+{
+    const OSCCounters &c = m_oscCounters;
+    OSCStatistics stats;
+    stats.queueDepth = (m_oscQueue ? m_oscQueue->getMessagesAvailable() : 0);
+    stats.maxQueueDepth = c.maxQueueDepth;
+    stats.scheduledCount = int(m_scheduledOSC.size());
+    stats.handledCount = c.handled;
+    stats.batchCount = c.batches;
+    stats.receivedCount = c.received;
+    stats.meanLatencyMsec = (c.received > 0 ?
+                             c.totalLatencyMsec / double(c.received) : 0.0);
+    stats.maxLatencyMsec = c.maxLatencyMsec;
+    stats.meanHandlingMsec = (c.handled > 0 ?
+                              c.totalHandlingMsec / double(c.handled) : 0.0);
+    stats.maxHandlingMsec = c.maxHandlingMsec;
+    stats.meanScheduleErrorMsec = (c.scheduledHandled > 0 ?
+                                   c.totalScheduleErrorMsec /
+                                   double(c.scheduledHandled) : 0.0);
+    return stats;
+}
+
+void
+MainWindowBase::resetOSCStatistics()
+{
+    m_oscCounters = OSCCounters();
 }
 
 void
@@ -22,6 +22,7 @@
 #include <QMainWindow>
 #include <QPointer>
 #include <QThread>
+#include <QElapsedTimer>
 
 #include "base/Command.h"
 #include "view/ViewManager.h"
@@ -32,9 +33,11 @@
 #include "layer/LayerFactory.h"
 #include "transform/Transform.h"
 #include "SVFileReader.h"
+#include "SessionWriter.h"
 #include "data/fileio/FileFinder.h"
 #include "data/fileio/FileSource.h"
 #include "data/osc/OSCQueue.h"
+#include "data/osc/OSCMessage.h"
 #include "data/osc/OSCMessageCallback.h"
 #include "data/model/Model.h"
 
@@ -47,6 +50,7 @@ class QTreeView;
 class QPushButton;
 class QSignalMapper;
 class QShortcut;
+class QTimer;
 
 namespace breakfastquay {
     class SystemPlaybackTarget;
@@ -164,6 +168,16 @@ public:
     virtual FileOpenStatus openSessionPath(QString fileOrUrl);
     virtual bool saveSessionFile(QString path);
 
+    /** Save the session to the given path without waiting for it to
+     *  be written. Only the document structure, layers, and views,
+     *  and the models unchanged since the last save, are captured
+     *  here; the other models are serialised, and the session and
+     *  any sidecar compressed and written, in the background. The
+     *  sessionSaved signal reports when it is done. Return false if
+     *  the session could not be captured for saving at all.
+     */
+    virtual bool saveSessionFileInBackground(QString path);
+
     /** Open a session template as an empty session, ready to
      *  introduce a new main audio file into. If fileOrTemplateName
      *  contains any path separator characters ('/' or '\'), it will
@@ -200,6 +214,11 @@ public:
                                   DataExportOptions options,
                                   QString toPath, QString &error);
 
+    // Raw float32 rows with a short header, for dense layers only;
+    // see StreamingModelExporter for the format
+    virtual bool exportLayerToBinary(Layer *layer,
+                                     QString toPath, QString &error);
+
     // Delegate to one of the above depending on extension of path,
     // using the default export options
     virtual bool exportLayerTo(Layer *layer, LayerGeometryProvider *provider,
@@ -207,6 +226,31 @@ public:
                                QString toPath, QString &error);
     
     void cueOSCScript(QString filename);
+
+    /**
+     * Counters describing the handling of OSC messages since the
+     * queue was started or resetOSCStatistics() was last called.
+     * Latency is measured for each message from the time the queue
+     * was found non-empty after last being emptied. Schedule error is
+     * how late a timestamped ("/at") message was handled relative to
+     * the playback position it was scheduled for.
+     */
+    struct OSCStatistics {
+        int queueDepth;       // messages waiting in the queue now
+        int maxQueueDepth;    // most found waiting at once
+        int scheduledCount;   // timestamped messages waiting now
+        long receivedCount;   // taken from the queue, including "/at"
+        long handledCount;    // passed to handleOSCMessage
+        long batchCount;
+        double meanLatencyMsec;
+        double maxLatencyMsec;
+        double meanHandlingMsec;
+        double maxHandlingMsec;
+        double meanScheduleErrorMsec;
+    };
+
+    OSCStatistics getOSCStatistics() const;
+    void resetOSCStatistics();
     
     /// Implementation of FrameTimer interface method
     sv_frame_t getFrame() const override;
@@ -266,6 +310,7 @@ signals:
     void hideSplash();
     void hideSplash(QWidget *);
     void sessionLoaded();
+    void sessionSaved(QString path, bool success);
     void audioFileLoaded();
     void replacedDocument();
     void activity(QString);
@@ -276,6 +321,8 @@ public slots:
     virtual void recreateAudioIO();
 
 protected slots:
+    virtual void sessionWritten(QString path, bool success, QString error);
+
     virtual void zoomIn();
     virtual void zoomOut();
     virtual void zoomToFit();
@@ -394,6 +441,7 @@ protected slots:
 
     virtual void oscReady();
     virtual void pollOSC();
+    virtual void dispatchScheduledOSC();
     virtual void oscScriptFinished();
 
     virtual void contextHelpChanged(const QString &);
@@ -455,11 +503,43 @@ protected:
     OSCQueue                *m_oscQueue;
     OSCQueueStarter         *m_oscQueueStarter;
     OSCScript               *m_oscScript;
+
+    SessionWriter           *m_sessionWriter;
     QString                  m_oscScriptFile;
 
     void startOSCQueue(bool withNetworkPort);
     void startOSCScript();
 
+    // Timestamped messages, posted as "/at <seconds> <method>
+    // [args...]", waiting for playback to reach the frame they are
+    // keyed by. Messages for the same frame keep the order they
+    // arrived in
+    std::multimap<sv_frame_t, OSCMessage> m_scheduledOSC;
+    QTimer                  *m_oscScheduleTimer;
+
+    // Single-shot retry for pollOSC when it had to stop and wait
+    // for the application to become free
+    QTimer                  *m_oscRetryTimer;
+
+    bool scheduleOSCMessage(const OSCMessage &);
+    void rescheduleOSCTimer();
+    void handleOSCMessageTimed(const OSCMessage &);
+
+    struct OSCCounters {
+        int maxQueueDepth = 0;
+        long received = 0;
+        long handled = 0;
+        long batches = 0;
+        double totalLatencyMsec = 0.0;
+        double maxLatencyMsec = 0.0;
+        double totalHandlingMsec = 0.0;
+        double maxHandlingMsec = 0.0;
+        long scheduledHandled = 0;
+        double totalScheduleErrorMsec = 0.0;
+    };
+    OSCCounters              m_oscCounters;
+    QElapsedTimer            m_oscWaitingSince; // invalid when queue empty
+
     MIDIInput               *m_midiInput;
 
     RecentFiles              m_recentFiles;
@@ -492,6 +572,17 @@ protected:
                                        AudioFileOpenMode mode,
                                        QString templateName,
                                        bool registerSource);
+
+    /**
+     * Open the given audio files or URLs in order, the first with
+     * the given mode and the rest as additional models. Once the
+     * first has been opened, the local files among the rest are
+     * opened several at once by a ParallelAudioLoader, but are still
+     * added to the document in the order given.
+     */
+    FileOpenStatus openAudioFiles(QStringList locations,
+                                  AudioFileOpenMode mode,
+                                  QString progressText);
     
     sv_frame_t getModelsStartFrame() const; // earliest across all views
     sv_frame_t getModelsEndFrame() const; // latest across all views
@@ -599,6 +690,17 @@ protected:
     virtual void connectLayerEditDialog(ModelDataTableDialog *dialog);
 
     virtual void toXml(QTextStream &stream, bool asTemplate);
+
+    /** Capture the session for saving to the given path, leaving
+     *  the models that need serialising afresh, and any sidecar
+     *  dataset file, for the SessionWriter to write.
+     */
+    virtual void makeSessionSnapshot(QString path, SessionSnapshot &snapshot);
+
+    /** Pass the XML written for deferred models back to the
+     *  document, for it to reuse in later saves.
+     */
+    void cacheWrittenModels(const SessionWriter::WrittenModels &written);
 };
 
 
@@ -0,0 +1,378 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+#include "PackedDataset.h"
+
+#include "data/model/EditableDenseThreeDimensionalModel.h"
+#include "data/model/SparseTimeValueModel.h"
+
+#include "base/XmlExportable.h"
+#include "base/Debug.h"
+
+#include <QByteArray>
+#include <QFileInfo>
+#include <QSettings>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+
+namespace sv {
+
+// Most columns or points in a single <packed> element, to bound the
+// size of the buffers needed in writing and reading them
+static const int MAX_PACKED_COLUMNS = 1024;
+static const int MAX_PACKED_POINTS = 65536;
+
+static const int POINT_RECORD_SIZE = 12;
+
+static const char SIDECAR_MAGIC[] = "SVDS";
+static const int SIDECAR_MAGIC_SIZE = 4;
+static const quint32 SIDECAR_VERSION = 1;
+
+static void
+appendFloat(QByteArray &bytes, float value)
+{
+    quint32 u;
+    memcpy(&u, &value, sizeof(u));
+    u = qToLittleEndian(u);
+    bytes.append(reinterpret_cast<const char *>(&u), sizeof(u));
+}
+
+static float
+readFloat(const uchar *data)
+{
+    quint32 u = qFromLittleEndian<quint32>(data);
+    float value;
+    memcpy(&value, &u, sizeof(value));
+    return value;
+}
+
+bool
+PackedDataset::isWritingEnabled()
+{
+    QSettings settings;
+    settings.beginGroup("Preferences");
+    bool enabled = settings.value("pack-session-datasets", false).toBool();
+    settings.endGroup();
+    return enabled;
+}
+
+static void
+writeSection(QTextStream &out, QString indent, QString attributes,
+             const QByteArray &bytes, PackedDatasetSidecar *sidecar)
+{
+    qint64 offset = 0;
+    if (sidecar && sidecar->append(bytes, offset)) {
+        out << indent << "<packed " << attributes
+            << QString(" file=\"%1\" offset=\"%2\" length=\"%3\"/>\n")
+            .arg(XmlExportable::encodeEntities(sidecar->getFileName()))
+            .arg(offset).arg(bytes.size());
+    } else {
+        out << indent << "<packed " << attributes << ">"
+            << QString::fromLatin1(bytes.toBase64())
+            << "</packed>\n";
+    }
+}
+
+bool
+PackedDataset::writeModel(QTextStream &out, QString indent,
+                          std::shared_ptr<Model> model,
+                          PackedDatasetSidecar *sidecar)
+{
+    auto dense =
+        std::dynamic_pointer_cast<EditableDenseThreeDimensionalModel>(model);
+    auto stvm = std::dynamic_pointer_cast<SparseTimeValueModel>(model);
+    if (!dense && !stvm) return false;
+
+    EventVector events;
+    if (stvm) {
+        events = stvm->getAllEvents();
+        for (const auto &e: events) {
+            if (e.getLabel() != "") return false;
+        }
+    }
+
+    // Write the model and dataset elements as the model's own
+    // toXml() would, without ever producing its text dataset. The
+    // dataset ID need only be unique among datasets, so the model's
+    // own export ID will do, as EditableDenseThreeDimensionalModel
+    // itself does
+
+    int datasetId = model->getExportId();
+
+    if (dense) {
+        model->Model::toXml
+            (out, indent,
+             QString("type=\"dense\" dimensions=\"3\" windowSize=\"%1\" "
+                     "yBinCount=\"%2\" minimum=\"%3\" maximum=\"%4\" "
+                     "dataset=\"%5\" startFrame=\"%6\" ")
+             .arg(dense->getResolution())
+             .arg(dense->getHeight())
+             .arg(dense->getMinimumLevel())
+             .arg(dense->getMaximumLevel())
+             .arg(datasetId)
+             .arg(dense->getStartFrame()));
+        out << indent
+            << QString("<dataset id=\"%1\" dimensions=\"3\" separator=\" \">\n")
+            .arg(datasetId);
+    } else {
+        model->Model::toXml
+            (out, indent,
+             QString("type=\"sparse\" dimensions=\"2\" resolution=\"%1\" "
+                     "notifyOnAdd=\"true\" dataset=\"%2\" "
+                     "minimum=\"%3\" maximum=\"%4\" units=\"%5\" ")
+             .arg(stvm->getResolution())
+             .arg(datasetId)
+             .arg(stvm->getValueMinimum())
+             .arg(stvm->getValueMaximum())
+             .arg(XmlExportable::encodeEntities(stvm->getScaleUnits())));
+        out << indent
+            << QString("<dataset id=\"%1\" dimensions=\"2\">\n")
+            .arg(datasetId);
+    }
+
+    QString innerIndent = indent + "  ";
+
+    if (dense) {
+
+        for (int n = 0; n < dense->getHeight(); ++n) {
+            QString name = dense->getBinName(n);
+            if (name == "") continue;
+            out << innerIndent
+                << QString("<bin number=\"%1\" name=\"%2\"/>\n")
+                .arg(n).arg(XmlExportable::encodeEntities(name));
+        }
+
+        int width = dense->getWidth();
+        int start = 0;
+        DenseThreeDimensionalModel::Column column;
+        if (width > 0) {
+            column = dense->getColumn(start);
+        }
+
+        while (start < width) {
+            int bins = int(column.size());
+            int rows = 0;
+            QByteArray bytes;
+            bytes.reserve(MAX_PACKED_COLUMNS * bins * int(sizeof(float)));
+            while (start + rows < width && rows < MAX_PACKED_COLUMNS) {
+                if (rows > 0) {
+                    column = dense->getColumn(start + rows);
+                    if (int(column.size()) != bins) break;
+                }
+                for (auto value: column) {
+                    appendFloat(bytes, value);
+                }
+                ++rows;
+            }
+            writeSection(out, innerIndent,
+                         QString("start=\"%1\" rows=\"%2\" bins=\"%3\"")
+                         .arg(start).arg(rows).arg(bins),
+                         bytes, sidecar);
+            start += rows;
+            if (rows == MAX_PACKED_COLUMNS && start < width) {
+                column = dense->getColumn(start);
+            }
+        }
+
+    } else {
+
+        int count = int(events.size());
+        for (int start = 0; start < count; start += MAX_PACKED_POINTS) {
+            int points = std::min(MAX_PACKED_POINTS, count - start);
+            QByteArray bytes;
+            bytes.reserve(points * POINT_RECORD_SIZE);
+            for (int i = start; i < start + points; ++i) {
+                qint64 frame = qToLittleEndian(qint64(events[i].getFrame()));
+                bytes.append(reinterpret_cast<const char *>(&frame),
+                             sizeof(frame));
+                appendFloat(bytes, events[i].getValue());
+            }
+            writeSection(out, innerIndent,
+                         QString("points=\"%1\"").arg(points),
+                         bytes, sidecar);
+        }
+    }
+
+    out << indent << "</dataset>\n";
+    return true;
+}
+
+bool
+PackedDataset::readColumns(const QXmlStreamAttributes &attributes,
+                           const QString &text,
+                           EditableDenseThreeDimensionalModel *model)
+{
+    QByteArray bytes = QByteArray::fromBase64(text.toLatin1());
+    return readColumns(attributes, bytes.constData(), bytes.size(), model);
+}
+
+bool
+PackedDataset::readColumns(const QXmlStreamAttributes &attributes,
+                           const char *bytes, qint64 size,
+                           EditableDenseThreeDimensionalModel *model)
+{
+    bool ok = false;
+    int start = attributes.value("start").trimmed().toInt(&ok);
+    if (!ok || start < 0) return false;
+    int rows = attributes.value("rows").trimmed().toInt(&ok);
+    if (!ok || rows < 0) return false;
+    int bins = attributes.value("bins").trimmed().toInt(&ok);
+    if (!ok || bins < 0) return false;
+
+    if (size != qint64(rows) * bins * qint64(sizeof(float))) {
+        SVCERR << "WARNING: SV-XML: Packed 3-D dataset data has wrong size "
+               << size << " for " << rows << " rows of " << bins
+               << " bins" << endl;
+        return false;
+    }
+
+    if (bins > model->getHeight()) {
+        SVCERR << "WARNING: SV-XML: Too many y-bins in packed 3-D dataset rows "
+               << start << " to " << start + rows - 1 << endl;
+    }
+
+    const uchar *data = reinterpret_cast<const uchar *>(bytes);
+
+    DenseThreeDimensionalModel::Column column(bins);
+    for (int r = 0; r < rows; ++r) {
+        for (int b = 0; b < bins; ++b) {
+            column[b] = readFloat(data);
+            data += sizeof(float);
+        }
+        model->setColumn(start + r, column);
+    }
+
+    return true;
+}
+
+bool
+PackedDataset::readPoints(const QXmlStreamAttributes &attributes,
+                          const QString &text,
+                          SparseTimeValueModel *model)
+{
+    QByteArray bytes = QByteArray::fromBase64(text.toLatin1());
+    return readPoints(attributes, bytes.constData(), bytes.size(), model);
+}
+
+bool
+PackedDataset::readPoints(const QXmlStreamAttributes &attributes,
+                          const char *bytes, qint64 size,
+                          SparseTimeValueModel *model)
+{
+    bool ok = false;
+    int points = attributes.value("points").trimmed().toInt(&ok);
+    if (!ok || points < 0) return false;
+
+    if (size != qint64(points) * POINT_RECORD_SIZE) {
+        SVCERR << "WARNING: SV-XML: Packed 2-D dataset data has wrong size "
+               << size << " for " << points << " points" << endl;
+        return false;
+    }
+
+    const uchar *data = reinterpret_cast<const uchar *>(bytes);
+
+    for (int i = 0; i < points; ++i) {
+        sv_frame_t frame = qFromLittleEndian<qint64>(data);
+        float value = readFloat(data + sizeof(qint64));
+        data += POINT_RECORD_SIZE;
+        model->add(Event(frame, value, QString()));
+    }
+
+    return true;
+}
+
+bool
+PackedDatasetSidecar::isWritingEnabled()
+{
+    QSettings settings;
+    settings.beginGroup("Preferences");
+    bool enabled = settings.value("session-dataset-sidecar", false).toBool();
+    settings.endGroup();
+    return enabled;
+}
+
+QString
+PackedDatasetSidecar::getPathFor(QString sessionPath)
+{
+    return sessionPath + ".data";
+}
+
+qint64
+PackedDatasetSidecar::getHeaderSize()
+{
+    return SIDECAR_MAGIC_SIZE + sizeof(quint32);
+}
+
+bool
+PackedDatasetSidecar::checkHeader(const char *data, qint64 size)
+{
+    if (size < getHeaderSize()) return false;
+    if (memcmp(data, SIDECAR_MAGIC, SIDECAR_MAGIC_SIZE)) return false;
+    quint32 version = qFromLittleEndian<quint32>
+        (reinterpret_cast<const uchar *>(data) + SIDECAR_MAGIC_SIZE);
+    return version == SIDECAR_VERSION;
+}
+
+PackedDatasetSidecar::PackedDatasetSidecar(QString sessionPath) :
+    m_file(getPathFor(sessionPath)),
+    m_fileName(QFileInfo(getPathFor(sessionPath)).fileName()),
+    m_position(0),
+    m_ok(false)
+{
+    if (!m_file.open(QIODevice::WriteOnly)) {
+        SVCERR << "WARNING: PackedDatasetSidecar: Failed to open sidecar for "
+               << sessionPath << " for writing: " << m_file.errorString()
+               << endl;
+        return;
+    }
+
+    quint32 version = qToLittleEndian(SIDECAR_VERSION);
+    if (m_file.write(SIDECAR_MAGIC, SIDECAR_MAGIC_SIZE) != SIDECAR_MAGIC_SIZE ||
+        m_file.write(reinterpret_cast<const char *>(&version),
+                     sizeof(version)) != sizeof(version)) {
+        m_file.cancelWriting();
+        return;
+    }
+    
+    m_position = getHeaderSize();
+    m_ok = true;
+}
+
+bool
+PackedDatasetSidecar::append(const QByteArray &data, qint64 &offset)
+{
+    if (!m_ok) return false;
+    if (m_file.write(data) != data.size()) {
+        SVCERR << "WARNING: PackedDatasetSidecar: Failed to write to "
+               << m_fileName << ": " << m_file.errorString() << endl;
+        m_file.cancelWriting();
+        m_ok = false;
+        return false;
+    }
+    offset = m_position;
+    m_position += data.size();
+    return true;
+}
+
+bool
+PackedDatasetSidecar::commit()
+{
+    if (!m_ok) return false;
+    m_ok = false;
+    return m_file.commit();
+}
+
+} // end namespace sv
@@ -0,0 +1,184 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+#ifndef SV_PACKED_DATASET_H
+#define SV_PACKED_DATASET_H
+
+#include "data/model/Model.h"
+
+#include <QString>
+#include <QTextStream>
+#include <QSaveFile>
+#include <QXmlStreamAttributes>
+
+#include <memory>
+
+namespace sv {
+
+class EditableDenseThreeDimensionalModel;
+class SparseTimeValueModel;
+class PackedDatasetSidecar;
+
+/**
+ * Reading and writing of the packed dataset encoding in SV-XML
+ * session files. A packed dataset holds its rows or points in
+ * base64-encoded binary within <packed> elements, in place of the
+ * usual one <row> or <point> element per item:
+ *
+ * - For a dense 3-D model, each <packed start="S" rows="R" bins="B">
+ *   element holds R columns of B little-endian 32-bit floats, for
+ *   columns S to S+R-1.
+ *
+ * - For a sparse time-value model without labels, each <packed
+ *   points="N"> element holds N records of a little-endian 64-bit
+ *   frame followed by a little-endian 32-bit float value.
+ *
+ * A <packed> element with file, offset, and length attributes has
+ * no text, its data being that many bytes of raw binary at that
+ * offset in a PackedDatasetSidecar file in the session's directory.
+ *
+ * Other dataset types are always written as text. Sessions with
+ * packed datasets are smaller and much faster to load, but can't be
+ * read by versions of SV that predate the encoding, so writing it is
+ * a preference, off by default. Reading it is always supported.
+ */
+class PackedDataset
+{
+public:
+    /**
+     * Return true if the user has chosen to have datasets written
+     * packed where possible.
+     */
+    static bool isWritingEnabled();
+
+    /**
+     * Write the given model's XML to the stream, as its toXml()
+     * would, but with its dataset packed. If a sidecar is given, the
+     * packed data goes into that rather than into the XML. Return
+     * false, having written nothing, if the model's dataset can't be
+     * packed.
+     */
+    static bool writeModel(QTextStream &out, QString indent,
+                           std::shared_ptr<Model> model,
+                           PackedDatasetSidecar *sidecar = nullptr);
+
+    /**
+     * Decode the text of a <packed> element with the given
+     * attributes into the given dense 3-D model.
+     */
+    static bool readColumns(const QXmlStreamAttributes &attributes,
+                            const QString &text,
+                            EditableDenseThreeDimensionalModel *model);
+
+    /**
+     * Decode the raw data of a <packed> element with the given
+     * attributes into the given dense 3-D model.
+     */
+    static bool readColumns(const QXmlStreamAttributes &attributes,
+                            const char *data, qint64 size,
+                            EditableDenseThreeDimensionalModel *model);
+
+    /**
+     * Decode the text of a <packed> element with the given
+     * attributes into the given sparse time-value model.
+     */
+    static bool readPoints(const QXmlStreamAttributes &attributes,
+                           const QString &text,
+                           SparseTimeValueModel *model);
+
+    /**
+     * Decode the raw data of a <packed> element with the given
+     * attributes into the given sparse time-value model.
+     */
+    static bool readPoints(const QXmlStreamAttributes &attributes,
+                           const char *data, qint64 size,
+                           SparseTimeValueModel *model);
+};
+
+/**
+ * A file of raw packed dataset sections, written alongside a session
+ * file so that the sections can be memory-mapped and read only when
+ * their models are needed (see LazyDatasetLoader). The file starts
+ * with a short header identifying it, followed by the sections in
+ * the order they were appended.
+ *
+ * The file is written to a temporary location and only appears at
+ * its proper path on commit(), so that a session being overwritten
+ * keeps a consistent sidecar until the new one is complete.
+ */
+class PackedDatasetSidecar
+{
+public:
+    /**
+     * Return true if the user has chosen to have session datasets
+     * written to a sidecar file.
+     */
+    static bool isWritingEnabled();
+
+    /**
+     * Return the path of the sidecar for the session file at the
+     * given path.
+     */
+    static QString getPathFor(QString sessionPath);
+
+    /**
+     * Return the size of the header at the start of a sidecar.
+     */
+    static qint64 getHeaderSize();
+
+    /**
+     * Return true if the given data starts with a valid sidecar
+     * header.
+     */
+    static bool checkHeader(const char *data, qint64 size);
+
+    /**
+     * Start writing the sidecar for the session file at the given
+     * path.
+     */
+    PackedDatasetSidecar(QString sessionPath);
+
+    bool isOK() const { return m_ok; }
+
+    /**
+     * Return the file name of the sidecar, without directory, as it
+     * should be referred to from the session.
+     */
+    QString getFileName() const { return m_fileName; }
+
+    /**
+     * Append a section, returning its offset in the file through
+     * offset. Return false if it could not be written.
+     */
+    bool append(const QByteArray &data, qint64 &offset);
+
+    /**
+     * Finish writing and move the sidecar into place. Return false
+     * on failure.
+     */
+    bool commit();
+
+    PackedDatasetSidecar(const PackedDatasetSidecar &) =delete;
+    PackedDatasetSidecar &operator=(const PackedDatasetSidecar &) =delete;
+
+private:
+    QSaveFile m_file;
+    QString m_fileName;
+    qint64 m_position;
+    bool m_ok;
+};
+
+} // end namespace sv
+
+#endif
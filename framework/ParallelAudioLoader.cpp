@@ -0,0 +1,182 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ParallelAudioLoader.h"
+
+#include "data/model/ReadOnlyWaveFileModel.h"
+#include "data/fileio/FileSource.h"
+
+#include "base/Debug.h"
+
+#include <QApplication>
+#include <QMutexLocker>
+#include <QSettings>
+#include <QThread>
+
+#include <algorithm>
+
+//#define DEBUG_PARALLEL_AUDIO_LOADER 1
+
+namespace sv {
+
+// Most files opened at once by default, however many cores there
+// are, as beyond this the disc is usually the limit
+static const int MAX_DEFAULT_CONCURRENCY = 8;
+
+// How often take() returns to the event loop while waiting
+static const int WAIT_INTERVAL_MS = 50;
+
+ParallelAudioLoader::ParallelAudioLoader(QStringList paths,
+                                         sv_samplerate_t rate,
+                                         int maxThreads) :
+    m_paths(paths),
+    m_rate(rate),
+    m_models(paths.size()),
+    m_done(paths.size(), false),
+    m_taken(paths.size(), false),
+    m_next(0),
+    m_exiting(false)
+{
+    int n = std::min(std::max(maxThreads, 1), int(paths.size()));
+
+    SVDEBUG << "ParallelAudioLoader: loading " << paths.size()
+            << " file(s) with " << n << " thread(s)" << endl;
+    
+    for (int i = 0; i < n; ++i) {
+        LoaderThread *thread = new LoaderThread(*this);
+        m_threads.push_back(thread);
+        thread->start();
+    }
+}
+
+ParallelAudioLoader::~ParallelAudioLoader()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_exiting = true;
+    }
+    
+    for (auto thread: m_threads) {
+        thread->wait();
+        delete thread;
+    }
+
+    // Anything loaded but not taken is simply dropped: it was never
+    // added to ModelById, so it goes with its last shared pointer
+    m_models.clear();
+}
+
+int
+ParallelAudioLoader::getDefaultConcurrency()
+{
+    int cores = std::min(std::max(QThread::idealThreadCount(), 1),
+                         MAX_DEFAULT_CONCURRENCY);
+    QSettings settings;
+    settings.beginGroup("Preferences");
+    int n = settings.value("audio-import-concurrency", cores).toInt();
+    settings.endGroup();
+    return std::max(n, 1);
+}
+
+void
+ParallelAudioLoader::LoaderThread::run()
+{
+    while (true) {
+        int index = -1;
+        {
+            QMutexLocker locker(&m_loader.m_mutex);
+            if (m_loader.m_exiting ||
+                m_loader.m_next >= int(m_loader.m_paths.size())) {
+                return;
+            }
+            index = m_loader.m_next++;
+        }
+        m_loader.load(index);
+    }
+}
+
+bool
+ParallelAudioLoader::load(int index)
+{
+    QString path = m_paths[index];
+
+#ifdef DEBUG_PARALLEL_AUDIO_LOADER
+    SVDEBUG << "ParallelAudioLoader::load: opening \"" << path
+            << "\" (" << index << ")" << endl;
+#endif
+
+    std::shared_ptr<ReadOnlyWaveFileModel> model;
+
+    {
+        FileSource source(path);
+        if (source.isAvailable()) {
+            source.waitForData();
+            model = std::make_shared<ReadOnlyWaveFileModel>(source, m_rate);
+            if (!model->isOK()) {
+                SVDEBUG << "ParallelAudioLoader::load: failed to open \""
+                        << path << "\"" << endl;
+                model = {};
+            }
+        }
+    }
+
+    if (model) {
+        // It will be used, and its signals received, in the GUI
+        // thread from now on
+        model->moveToThread(QApplication::instance()->thread());
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_models[index] = model;
+    m_done[index] = true;
+    m_condition.wakeAll();
+    return bool(model);
+}
+
+ModelId
+ParallelAudioLoader::take(int index)
+{
+    if (index < 0 || index >= int(m_paths.size())) {
+        return {};
+    }
+
+    std::shared_ptr<ReadOnlyWaveFileModel> model;
+
+    while (true) {
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_taken[index]) {
+                SVCERR << "WARNING: ParallelAudioLoader::take: index "
+                       << index << " already taken" << endl;
+                return {};
+            }
+            if (!m_done[index]) {
+                m_condition.wait(&m_mutex, WAIT_INTERVAL_MS);
+            }
+            if (m_done[index]) {
+                model = m_models[index];
+                m_models[index] = {};
+                m_taken[index] = true;
+                break;
+            }
+        }
+        QApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
+    }
+
+    if (!model) return {};
+    return ModelById::add(model);
+}
+
+} // end namespace sv
@@ -0,0 +1,113 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_PARALLEL_AUDIO_LOADER_H
+#define SV_PARALLEL_AUDIO_LOADER_H
+
+#include "base/Thread.h"
+#include "base/BaseTypes.h"
+#include "data/model/Model.h"
+
+#include <QString>
+#include <QStringList>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <memory>
+#include <vector>
+
+namespace sv {
+
+class ReadOnlyWaveFileModel;
+
+/**
+ * Opens a list of local audio files as wave file models, several at
+ * once on threads of its own, so that importing many files is not
+ * limited to one core. The models are handed back, in the GUI
+ * thread, by take(), in whatever order the caller asks for them, so
+ * that the caller can add them to the document in a deterministic
+ * order regardless of which finishes first.
+ *
+ * Loading starts on construction. Files that could not be opened
+ * come back from take() as None.
+ */
+class ParallelAudioLoader
+{
+public:
+    /**
+     * Start loading the given local files, at the given sample rate
+     * (0 to keep each file's own rate), with at most maxThreads files
+     * being opened at once.
+     */
+    ParallelAudioLoader(QStringList paths, sv_samplerate_t rate,
+                        int maxThreads);
+
+    /**
+     * Destroy the loader, stopping before any files not yet started
+     * and releasing any models that were loaded but not taken.
+     */
+    ~ParallelAudioLoader();
+
+    /**
+     * Wait for the file at the given index in the list to be loaded,
+     * add its model to ModelById and return its id, or None if it
+     * could not be opened. Events are processed while waiting, with
+     * the exception of user input. Must be called from the GUI
+     * thread, and at most once for each index.
+     */
+    ModelId take(int index);
+
+    /**
+     * Return the number of files to open at once unless told
+     * otherwise, from the "audio-import-concurrency" preference,
+     * defaulting to the number of cores up to a limit.
+     */
+    static int getDefaultConcurrency();
+
+    ParallelAudioLoader(const ParallelAudioLoader &) =delete;
+    ParallelAudioLoader &operator=(const ParallelAudioLoader &) =delete;
+
+private:
+    class LoaderThread : public Thread
+    {
+    public:
+        LoaderThread(ParallelAudioLoader &loader) :
+            Thread(Thread::NonRTThread),
+            m_loader(loader) { }
+
+        void run() override;
+
+    protected:
+        ParallelAudioLoader &m_loader;
+    };
+
+    QStringList m_paths;
+    sv_samplerate_t m_rate;
+    std::vector<LoaderThread *> m_threads;
+
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    std::vector<std::shared_ptr<ReadOnlyWaveFileModel>> m_models;
+    std::vector<bool> m_done;
+    std::vector<bool> m_taken;
+    int m_next;
+    bool m_exiting;
+
+    bool load(int index);
+};
+
+} // end namespace sv
+
+#endif
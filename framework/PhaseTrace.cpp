@@ -0,0 +1,173 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "PhaseTrace.h"
+
+#include "base/Debug.h"
+
+#include <QByteArray>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QThread>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+namespace sv {
+
+// Most phases kept, so that a long session with tracing left on
+// cannot grow without bound; later ones are dropped
+static const size_t MAX_PHASES = 100000;
+
+struct PhaseRecord {
+    const char *name;
+    long long start;    // usec since the trace clock started
+    long long duration; // usec
+    int thread;
+};
+
+static std::atomic<bool> enabled(getenv("SV_TRACE_FILE") != nullptr);
+static QMutex phaseMutex;
+static std::vector<PhaseRecord> phases;
+static std::map<Qt::HANDLE, int> threadNumbers;
+
+static long long
+now()
+{
+    static const auto origin = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now() - origin).count();
+}
+
+PhaseTrace::Phase::Phase(const char *name) :
+    m_name(name),
+    m_start(enabled ? now() : -1)
+{
+}
+
+PhaseTrace::Phase::~Phase()
+{
+    if (m_start < 0 || !enabled) return;
+
+    long long duration = now() - m_start;
+    Qt::HANDLE handle = QThread::currentThreadId();
+
+    QMutexLocker locker(&phaseMutex);
+    if (phases.size() >= MAX_PHASES) return;
+
+    auto itr = threadNumbers.find(handle);
+    if (itr == threadNumbers.end()) {
+        itr = threadNumbers.insert({ handle, int(threadNumbers.size()) + 1 })
+            .first;
+    }
+    
+    phases.push_back({ m_name, m_start, duration, itr->second });
+}
+
+bool
+PhaseTrace::isEnabled()
+{
+    return enabled;
+}
+
+void
+PhaseTrace::setEnabled(bool e)
+{
+    if (e) now(); // start the clock
+    enabled = e;
+}
+
+QString
+PhaseTrace::getTraceFilePath()
+{
+    return qEnvironmentVariable("SV_TRACE_FILE");
+}
+
+static QByteArray
+jsonEscape(const char *name)
+{
+    QByteArray escaped;
+    for (const char *c = name; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            escaped.append('\\');
+            escaped.append(*c);
+        } else if (uchar(*c) < 0x20) {
+            escaped.append(QString::asprintf("\\u%04x", int(*c)).toLatin1());
+        } else {
+            escaped.append(*c);
+        }
+    }
+    return escaped;
+}
+
+bool
+PhaseTrace::dump(QString path)
+{
+    std::vector<PhaseRecord> records;
+    {
+        QMutexLocker locker(&phaseMutex);
+        records = phases;
+    }
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        SVCERR << "PhaseTrace::dump: Failed to open trace file \""
+               << path << "\" for writing" << endl;
+        return false;
+    }
+
+    QByteArray out("{\"traceEvents\":[\n");
+    for (size_t i = 0; i < records.size(); ++i) {
+        const auto &r = records[i];
+        out.append("{\"name\":\"");
+        out.append(jsonEscape(r.name));
+        out.append(QString("\",\"ph\":\"X\",\"pid\":1,\"tid\":%1,"
+                           "\"ts\":%2,\"dur\":%3}")
+                   .arg(r.thread).arg(r.start).arg(r.duration).toLatin1());
+        out.append(i + 1 < records.size() ? ",\n" : "\n");
+    }
+    out.append("],\"displayTimeUnit\":\"ms\"}\n");
+
+    file.write(out);
+    if (!file.commit()) {
+        SVCERR << "PhaseTrace::dump: Failed to write trace file \""
+               << path << "\"" << endl;
+        return false;
+    }
+
+    SVDEBUG << "PhaseTrace::dump: Wrote " << records.size()
+            << " phase(s) to " << path << endl;
+    return true;
+}
+
+void
+PhaseTrace::dumpIfRequested()
+{
+    QString path = getTraceFilePath();
+    if (path != "") dump(path);
+}
+
+void
+PhaseTrace::clear()
+{
+    QMutexLocker locker(&phaseMutex);
+    phases.clear();
+}
+
+} // end namespace sv
@@ -0,0 +1,89 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_PHASE_TRACE_H
+#define SV_PHASE_TRACE_H
+
+#include <QString>
+
+namespace sv {
+
+/**
+ * A lightweight record of how long the phases of startup and loading
+ * take, such as MainWindowBase construction, audio device setup and
+ * session loading, for finding out where the time goes and catching
+ * regressions.
+ *
+ * Tracing is off unless the SV_TRACE_FILE environment variable is
+ * set, or setEnabled(true) is called. When off, a Phase costs one
+ * check of a flag. When the variable is set, the trace is written to
+ * the file it names when the MainWindowBase is destroyed, in the
+ * Trace Event JSON format read by chrome://tracing and Perfetto.
+ *
+ *     PhaseTrace::Phase phase("MainWindowBase::openSession");
+ *
+ * records a span from construction of the Phase to its destruction.
+ * Phases may nest, and may be recorded from any thread.
+ */
+class PhaseTrace
+{
+public:
+    class Phase
+    {
+    public:
+        /**
+         * Begin a phase with the given name, which must remain valid
+         * for the life of the program (normally a string literal).
+         */
+        Phase(const char *name);
+        ~Phase();
+
+        Phase(const Phase &) =delete;
+        Phase &operator=(const Phase &) =delete;
+
+    private:
+        const char *m_name;
+        long long m_start;
+    };
+
+    static bool isEnabled();
+    static void setEnabled(bool);
+
+    /**
+     * Return the file named by SV_TRACE_FILE, or an empty string.
+     */
+    static QString getTraceFilePath();
+
+    /**
+     * Write the phases recorded so far to the given file. Return
+     * false if it could not be written.
+     */
+    static bool dump(QString path);
+
+    /**
+     * Write the phases recorded so far to the file named by
+     * SV_TRACE_FILE, if it is set.
+     */
+    static void dumpIfRequested();
+
+    /**
+     * Forget all phases recorded so far.
+     */
+    static void clear();
+};
+
+} // end namespace sv
+
+#endif
@@ -20,6 +20,7 @@
 #include "base/PlayParameters.h"
 #include "base/PlayParameterRepository.h"
 #include "base/Preferences.h"
+#include "base/BaseTypes.h"
 
 #include "data/fileio/AudioFileReaderFactory.h"
 #include "data/fileio/FileSource.h"
@@ -45,10 +46,15 @@
 #include "widgets/ProgressDialog.h"
 
 #include "Document.h"
+#include "LazyDatasetLoader.h"
+#include "PackedDataset.h"
 
 #include <QString>
 #include <QMessageBox>
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QDir>
+#include <QUrl>
 
 #include <QXmlStreamReader>
 
@@ -70,6 +76,7 @@ SVFileReader::SVFileReader(Document *document,
     m_currentTransformIsNewStyle(true),
     m_datasetSeparator(" "),
     m_inRow(false),
+    m_inPacked(false),
     m_inLayer(false),
     m_inView(false),
     m_inData(false),
@@ -167,6 +174,10 @@ SVFileReader::parseWith(QXmlStreamReader &reader)
     }
     
     m_ok = ok;
+
+    if (m_ok) {
+        m_document->getDatasetLoader()->start();
+    }
 }    
 
 bool
@@ -230,6 +241,7 @@ SVFileReader::startElement(const QString &localName,
     // model
     // point
     // row
+    // packed
     // view
     // window
     // plugin
@@ -278,6 +290,10 @@ SVFileReader::startElement(const QString &localName,
 
         ok = addRowToDataset(attributes);
 
+    } else if (name == "packed") {
+
+        ok = readPackedStart(attributes);
+
     } else if (name == "layer") {
 
         addUnaddedModels(); // all models must be specified before first layer
@@ -345,6 +361,9 @@ SVFileReader::characters(const QString &text)
         if (!ok) {
             SVCERR << "WARNING: SV-XML: Failed to read row data content for row " << m_rowNumber << endl;
         }
+    } else if (m_inPacked) {
+        // decoded in one go when the element ends
+        m_packedText += text;
     }
 
     return true;
@@ -391,23 +410,20 @@ SVFileReader::endElement(const QString &localName)
                 SVCERR << "WARNING: SV-XML: Derivation has existing model "
                        << m_pendingDerivedModel
                        << " as target, not regenerating" << endl;
+            } else if (isPendingDerivation(m_pendingDerivedModel)) {
+                SVCERR << "WARNING: SV-XML: Duplicate derivation of model "
+                       << m_pendingDerivedModel << ", ignoring it" << endl;
             } else {
-                QString message;
-                m_currentDerivedModel = m_models[m_pendingDerivedModel] =
-                    m_document->addDerivedModel
-                    (m_currentTransform,
-                     ModelTransformer::Input(m_currentTransformSource,
-                                             m_currentTransformChannel),
-                     message);
-                if (m_currentDerivedModel.isNone()) {
-                    emit modelRegenerationFailed(tr("(derived model in SV-XML)"),
-                                                 m_currentTransform.getIdentifier(),
-                                                 message);
-                } else if (message != "") {
-                    emit modelRegenerationWarning(tr("(derived model in SV-XML)"),
-                                                  m_currentTransform.getIdentifier(),
-                                                  message);
-                }                    
+                // Regenerated in a batch with any other derivations
+                // from the same source that can share a plugin run,
+                // when flushPendingDerivations is called
+                PendingDerivationRec rec {
+                    m_pendingDerivedModel,
+                    m_currentTransform,
+                    m_currentTransformSource,
+                    m_currentTransformChannel
+                };
+                m_pendingDerivations.push_back(rec);
             }
         } else {
             m_document->addAlreadyDerivedModel
@@ -417,7 +433,9 @@ SVFileReader::endElement(const QString &localName)
                  m_currentDerivedModel);
         }
 
-        m_addedModels.insert(m_currentDerivedModel);
+        if (!m_currentDerivedModel.isNone()) {
+            m_addedModels.insert(m_currentDerivedModel);
+        }
         m_currentDerivedModel = {};
         m_pendingDerivedModel = XmlExportable::NO_ID;
         m_currentTransformSource = {};
@@ -426,6 +444,13 @@ SVFileReader::endElement(const QString &localName)
 
     } else if (name == "row") {
         m_inRow = false;
+    } else if (name == "packed") {
+        if (m_inPacked && !readPackedData()) {
+            SVCERR << "WARNING: SV-XML: Failed to read packed dataset content"
+                   << endl;
+        }
+        m_inPacked = false;
+        m_packedText = QString();
     } else if (name == "layer") {
         m_inLayer = false;
     } else if (name == "view") {
@@ -513,9 +538,116 @@ SVFileReader::makeAggregateModels()
     m_pendingAggregates = stillPending;
 }
 
+bool
+SVFileReader::isPendingDerivation(ExportId id) const
+{
+    for (const auto &rec: m_pendingDerivations) {
+        if (rec.output == id) return true;
+    }
+    return false;
+}
+
+static QString
+getBatchKey(Transform transform)
+{
+    // Transforms that differ only in their output can be run
+    // together, with one plugin and one pass through the input
+    transform.setOutput("");
+    return transform.toXmlString();
+}
+
+void
+SVFileReader::flushPendingDerivations()
+{
+    if (m_pendingDerivations.empty()) return;
+
+    std::vector<PendingDerivationRec> pending;
+    pending.swap(m_pendingDerivations);
+
+    std::vector<bool> done(pending.size(), false);
+
+    for (int i = 0; in_range_for(pending, i); ++i) {
+
+        if (done[i]) continue;
+
+        const PendingDerivationRec &first = pending[i];
+        QString batchKey = getBatchKey(first.transform);
+
+        // Gather this derivation and the later ones that share its
+        // input and plugin configuration, running each distinct
+        // output once
+
+        Transforms transforms;
+        std::vector<std::vector<ExportId>> outputs;
+
+        for (int j = i; in_range_for(pending, j); ++j) {
+            const PendingDerivationRec &rec = pending[j];
+            if (done[j] ||
+                rec.source != first.source ||
+                rec.channel != first.channel ||
+                getBatchKey(rec.transform) != batchKey) {
+                continue;
+            }
+            done[j] = true;
+            bool found = false;
+            for (int k = 0; in_range_for(transforms, k); ++k) {
+                if (transforms[k] == rec.transform) {
+                    outputs[k].push_back(rec.output);
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                transforms.push_back(rec.transform);
+                outputs.push_back({ rec.output });
+            }
+        }
+
+        SVDEBUG << "SVFileReader::flushPendingDerivations: regenerating "
+                << transforms.size() << " output(s) of "
+                << first.transform.getPluginIdentifier()
+                << " in one batch" << endl;
+
+        ModelTransformer::Input input(first.source, first.channel);
+        QString message;
+        std::vector<ModelId> models;
+
+        if (transforms.size() == 1) {
+            // This path also reuses an existing model from the same
+            // transform, if the document has one
+            models.push_back(m_document->addDerivedModel
+                             (transforms[0], input, message));
+        } else {
+            models = m_document->addDerivedModels
+                (transforms, input, message, nullptr);
+        }
+
+        for (int k = 0; in_range_for(transforms, k); ++k) {
+            ModelId modelId;
+            if (in_range_for(models, k)) modelId = models[k];
+            for (ExportId output: outputs[k]) {
+                m_models[output] = modelId;
+            }
+            if (modelId.isNone()) {
+                emit modelRegenerationFailed(tr("(derived model in SV-XML)"),
+                                             transforms[k].getIdentifier(),
+                                             message);
+            } else {
+                m_addedModels.insert(modelId);
+                if (message != "") {
+                    emit modelRegenerationWarning(tr("(derived model in SV-XML)"),
+                                                  transforms[k].getIdentifier(),
+                                                  message);
+                }
+            }
+        }
+    }
+}
+
 void
 SVFileReader::addUnaddedModels()
 {
+    flushPendingDerivations();
     makeAggregateModels();
 
     for (auto i: m_models) {
@@ -1339,6 +1471,90 @@ SVFileReader::readRowData(const QString &text)
     return false;
 }
 
+bool
+SVFileReader::readPackedStart(const QXmlStreamAttributes &attributes)
+{
+    m_inPacked = false;
+    
+    if (!haveModel(m_currentDataset)) {
+        SVCERR << "WARNING: SV-XML: Packed data found in non-model dataset"
+               << endl;
+        return false;
+    }
+
+    if (attributes.hasAttribute("file")) {
+        return readPackedSidecarSection(attributes);
+    }
+
+    m_packedAttributes = attributes;
+    m_packedText = QString();
+    m_inPacked = true;
+    return true;
+}
+
+bool
+SVFileReader::readPackedSidecarSection(const QXmlStreamAttributes &attributes)
+{
+    // The data is in a sidecar file next to the session, to be loaded
+    // after the session has been read, or when first needed
+
+    bool ok = false;
+
+    QString file = attributes.value("file").toString();
+    qint64 offset = attributes.value("offset").trimmed().toLongLong(&ok);
+    if (!ok) return false;
+    qint64 length = attributes.value("length").trimmed().toLongLong(&ok);
+    if (!ok) return false;
+
+    // Only ever a file alongside the session, not a path to elsewhere
+    if (file == "" || QFileInfo(file).fileName() != file) {
+        SVCERR << "WARNING: SV-XML: Invalid dataset file name \""
+               << file << "\"" << endl;
+        return false;
+    }
+
+    QString sessionPath = m_location;
+    QUrl url(m_location);
+    if (url.isLocalFile()) {
+        sessionPath = url.toLocalFile();
+    } else if (url.scheme().length() > 1) {
+        SVCERR << "WARNING: SV-XML: Can't load dataset file \"" << file
+               << "\" for remote session " << m_location << endl;
+        return false;
+    }
+
+    QString path = QFileInfo(sessionPath).dir().filePath(file);
+
+    m_document->getDatasetLoader()->addSection
+        (m_models[m_currentDataset], path, offset, length, attributes);
+    return true;
+}
+
+bool
+SVFileReader::readPackedData()
+{
+    if (!haveModel(m_currentDataset)) {
+        return false;
+    }
+        
+    ModelId modelId = m_models[m_currentDataset];        
+
+    if (auto dtdm = ModelById::getAs<EditableDenseThreeDimensionalModel>
+        (modelId)) {
+        return PackedDataset::readColumns
+            (m_packedAttributes, m_packedText, dtdm.get());
+    }
+
+    if (auto stvm = ModelById::getAs<SparseTimeValueModel>(modelId)) {
+        return PackedDataset::readPoints
+            (m_packedAttributes, m_packedText, stvm.get());
+    }
+
+    SVCERR << "WARNING: SV-XML: Packed data found in incompatible dataset"
+           << endl;
+    return false;
+}
+
 bool
 SVFileReader::readDerivation(const QXmlStreamAttributes &attributes)
 {
@@ -1364,6 +1580,11 @@ SVFileReader::readDerivation(const QXmlStreamAttributes &attributes)
     bool sourceOk = false;
     sourceId = attributes.value("source").trimmed().toInt(&sourceOk);
 
+    if (sourceOk && isPendingDerivation(sourceId)) {
+        // derived from a derived model we haven't regenerated yet
+        flushPendingDerivations();
+    }
+
     if (sourceOk && haveModel(sourceId)) {
         m_currentTransformSource = m_models[sourceId];
     } else {
@@ -19,10 +19,12 @@
 #include "layer/LayerFactory.h"
 #include "transform/Transform.h"
 
+#include <QXmlStreamAttributes>
+
 #include <map>
+#include <vector>
 
 class QXmlStreamReader;
-class QXmlStreamAttributes;
 
 namespace sv {
 
@@ -218,6 +220,9 @@ protected:
     bool addPointToDataset(const QXmlStreamAttributes &);
     bool addRowToDataset(const QXmlStreamAttributes &);
     bool readRowData(const QString &);
+    bool readPackedStart(const QXmlStreamAttributes &);
+    bool readPackedSidecarSection(const QXmlStreamAttributes &);
+    bool readPackedData();
     bool readDerivation(const QXmlStreamAttributes &);
     bool readPlayParameters(const QXmlStreamAttributes &);
     bool readPlugin(const QXmlStreamAttributes &);
@@ -230,6 +235,7 @@ protected:
 
     void makeAggregateModels();
     void addUnaddedModels();
+    void flushPendingDerivations();
 
     // We use the term "pending" of things that have been referred to
     // but not yet constructed because their definitions are
@@ -263,6 +269,20 @@ protected:
     std::set<ModelId> m_addedModels; // i.e. added to Document, not just ById
     std::map<ExportId, PendingAggregateRec> m_pendingAggregates;
 
+    // Derivations whose output models must be regenerated. These are
+    // held until the models are first needed (at the first layer or
+    // the end of the data element) so that those sharing a source
+    // and plugin configuration can be run together
+    struct PendingDerivationRec {
+        ExportId output;
+        Transform transform;
+        ModelId source;
+        int channel;
+    };
+    std::vector<PendingDerivationRec> m_pendingDerivations;
+
+    bool isPendingDerivation(ExportId id) const;
+
     // A model element often contains a dataset id, and the dataset
     // then follows it. When the model is read, an entry in this map
     // is added, mapping from the dataset's export id (the actual
@@ -286,6 +306,9 @@ protected:
     bool m_currentTransformIsNewStyle;
     QString m_datasetSeparator;
     bool m_inRow;
+    bool m_inPacked;
+    QXmlStreamAttributes m_packedAttributes;
+    QString m_packedText;
     bool m_inLayer;
     bool m_inView;
     bool m_inData;
@@ -0,0 +1,240 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+#include "SessionWriter.h"
+#include "PackedDataset.h"
+
+#include "data/fileio/BZipFileDevice.h"
+
+#include "base/TempWriteFile.h"
+#include "base/Exceptions.h"
+#include "base/Debug.h"
+
+#include <QMutexLocker>
+#include <QTextStream>
+
+#include <iterator>
+#include <memory>
+
+namespace sv {
+
+SessionWriter::SessionWriter() :
+    m_thread(nullptr),
+    m_busy(false),
+    m_exiting(false)
+{
+}
+
+SessionWriter::~SessionWriter()
+{
+    if (m_thread) {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_exiting = true;
+            m_condition.wakeAll();
+        }
+        m_thread->wait();
+        delete m_thread;
+    }
+}
+
+bool
+SessionWriter::write(const SessionSnapshot &snapshot, QString &error,
+                     WrittenModels &written)
+{
+    // Every deferred model goes back to the caller, written or not,
+    // so that none is released on this thread
+    size_t first = written.size();
+    for (const auto &m: snapshot.models) {
+        written.push_back({ m, QByteArray() });
+    }
+    
+    try {
+
+        TempWriteFile temp(snapshot.path);
+
+        BZipFileDevice bzFile(temp.getTemporaryFilename());
+        if (!bzFile.open(QIODevice::WriteOnly)) {
+            error = bzFile.errorString();
+            SVCERR << "Failed to open session file \""
+                   << temp.getTemporaryFilename()
+                   << "\" for writing: " << error << endl;
+            return false;
+        }
+
+        std::unique_ptr<PackedDatasetSidecar> sidecar;
+        if (snapshot.sidecar) {
+            sidecar.reset(new PackedDatasetSidecar(snapshot.path));
+            if (!sidecar->isOK()) {
+                sidecar.reset();
+            }
+        }
+
+        qint64 from = 0;
+        for (size_t i = 0; i < snapshot.models.size(); ++i) {
+
+            const auto &m = snapshot.models[i];
+            bzFile.write(snapshot.xml.constData() + from, m.position - from);
+            from = m.position;
+
+            QByteArray xml;
+            {
+                QString s;
+                QTextStream out(&s);
+                Document::writeDeferredModel(out, m, sidecar.get());
+                out.flush();
+                xml = s.toUtf8();
+            }
+            bzFile.write(xml);
+
+            if (m.cacheable) {
+                written[first + i].second = Document::compressModelXml(xml);
+            }
+        }
+        
+        bzFile.write(snapshot.xml.constData() + from,
+                     snapshot.xml.size() - from);
+
+        if (!bzFile.isOK()) {
+            error = bzFile.errorString();
+            bzFile.close();
+            return false;
+        }
+
+        // Sections already written refer to the sidecar, so if it
+        // failed part way through, the session is no good either
+        if (sidecar && !sidecar->isOK()) {
+            error = QString("Failed to write dataset file \"%1\"")
+                .arg(PackedDatasetSidecar::getPathFor(snapshot.path));
+            bzFile.close();
+            return false;
+        }
+
+        bzFile.close();
+        temp.moveToTarget();
+
+        // Only now that the session referring to it is in place
+        if (sidecar && !sidecar->commit()) {
+            error = QString("Failed to write dataset file \"%1\"")
+                .arg(PackedDatasetSidecar::getPathFor(snapshot.path));
+            return false;
+        }
+        
+        return true;
+
+    } catch (FileOperationFailed &f) {
+        error = f.what();
+        return false;
+    }
+}
+
+void
+SessionWriter::writeInBackground(SessionSnapshot snapshot)
+{
+    QMutexLocker locker(&m_mutex);
+
+    bool replaced = false;
+    for (auto &entry: m_queue) {
+        if (entry.path == snapshot.path) {
+            entry = snapshot;
+            replaced = true;
+            break;
+        }
+    }
+    if (!replaced) {
+        m_queue.push_back(snapshot);
+    }
+
+    if (!m_thread) {
+        m_thread = new WriterThread(*this);
+        m_thread->start();
+    }
+
+    m_condition.wakeAll();
+}
+
+SessionWriter::WrittenModels
+SessionWriter::takeWrittenModels()
+{
+    QMutexLocker locker(&m_mutex);
+    WrittenModels written;
+    written.swap(m_written);
+    return written;
+}
+
+bool
+SessionWriter::isWriting() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_busy || !m_queue.empty();
+}
+
+void
+SessionWriter::waitForWrites()
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_busy || !m_queue.empty()) {
+        m_condition.wait(&m_mutex);
+    }
+}
+
+void
+SessionWriter::WriterThread::run()
+{
+    SessionWriter &w(m_writer);
+
+    QMutexLocker locker(&w.m_mutex);
+
+    while (true) {
+
+        if (w.m_queue.empty()) {
+            if (w.m_exiting) break;
+            w.m_condition.wait(&w.m_mutex);
+            continue;
+        }
+
+        SessionSnapshot snapshot = w.m_queue.front();
+        w.m_queue.pop_front();
+        w.m_busy = true;
+
+        locker.unlock();
+
+        SVDEBUG << "SessionWriter: Writing " << snapshot.xml.size()
+                << " bytes of session XML and " << snapshot.models.size()
+                << " models to " << snapshot.path << endl;
+        
+        QString error;
+        WrittenModels written;
+        bool success = write(snapshot, error, written);
+
+        // Hand the models over without keeping any reference here,
+        // so that whichever is last to go is released on the GUI
+        // thread rather than this one
+        snapshot.models.clear();
+        locker.relock();
+        w.m_written.insert(w.m_written.end(),
+                           std::make_move_iterator(written.begin()),
+                           std::make_move_iterator(written.end()));
+        written.clear();
+        locker.unlock();
+
+        emit w.sessionWritten(snapshot.path, success, error);
+
+        locker.relock();
+        w.m_busy = false;
+        w.m_condition.wakeAll();
+    }
+}
+
+} // end namespace sv
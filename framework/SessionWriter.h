@@ -0,0 +1,151 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+#ifndef SV_SESSION_WRITER_H
+#define SV_SESSION_WRITER_H
+
+#include "Document.h"
+
+#include "base/Thread.h"
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <deque>
+#include <vector>
+#include <utility>
+
+namespace sv {
+
+/**
+ * A session captured for writing: the XML of the document, layers,
+ * and views, less the models that Document::toXml() deferred, which
+ * are to be serialised into it as it is written.
+ */
+struct SessionSnapshot
+{
+    QString path;
+    QByteArray xml;
+    std::vector<Document::DeferredModel> models;
+    bool sidecar = false;
+};
+
+/**
+ * Serialises the deferred models of a session snapshot into it,
+ * then compresses it and writes it to file, either at once or in
+ * the background on a thread of its own. Writing is atomic: the file
+ * at the destination path is either the old one or the complete new
+ * one. A sidecar dataset file is written alongside and only moved
+ * into place once the session that refers to it has been.
+ *
+ * Only the snapshot itself has to be made on the GUI thread, as it
+ * comes from the document, layers, and views, and it is quick to
+ * make: models whose XML is not already cached by the document are
+ * left to be serialised here, along with the sidecar.
+ */
+class SessionWriter : public QObject
+{
+    Q_OBJECT
+
+public:
+    SessionWriter();
+
+    /**
+     * Destroy the writer, first finishing any writes that have been
+     * queued.
+     */
+    ~SessionWriter();
+
+    /**
+     * A deferred model and the XML that was written for it, as
+     * returned by Document::compressModelXml(), or an empty array if
+     * it was not cacheable.
+     */
+    typedef std::vector<std::pair<Document::DeferredModel, QByteArray>>
+        WrittenModels;
+
+    /**
+     * Write the given session snapshot to its path, returning when
+     * done, and appending the XML written for each of its deferred
+     * models to written. Return false, with a message in error, on
+     * failure.
+     */
+    static bool write(const SessionSnapshot &snapshot, QString &error,
+                      WrittenModels &written);
+
+    /**
+     * Queue the given session snapshot to be written in the
+     * background, emitting sessionWritten when done. If an earlier
+     * write to the same path is still waiting to start, this one
+     * replaces it, so that frequent saves coalesce.
+     */
+    void writeInBackground(SessionSnapshot snapshot);
+
+    /**
+     * Return the deferred models written in the background since
+     * this was last called, with their XML, for the document to
+     * cache. Call from the GUI thread, so that the models are also
+     * released there.
+     */
+    WrittenModels takeWrittenModels();
+
+    /**
+     * Return true if any background write is queued or in progress.
+     */
+    bool isWriting() const;
+
+    /**
+     * Wait until all background writes queued so far are finished.
+     */
+    void waitForWrites();
+
+    SessionWriter(const SessionWriter &) =delete;
+    SessionWriter &operator=(const SessionWriter &) =delete;
+
+signals:
+    /**
+     * Emitted, from the writer thread, when a background write has
+     * finished. error is the reason for failure if success is false.
+     */
+    void sessionWritten(QString path, bool success, QString error);
+
+private:
+    class WriterThread : public Thread
+    {
+    public:
+        WriterThread(SessionWriter &writer) :
+            Thread(Thread::NonRTThread),
+            m_writer(writer) { }
+
+        void run() override;
+
+    protected:
+        SessionWriter &m_writer;
+    };
+
+    WriterThread *m_thread;
+    mutable QMutex m_mutex;
+    QWaitCondition m_condition;
+    std::deque<SessionSnapshot> m_queue;
+    WrittenModels m_written;
+    bool m_busy;
+    bool m_exiting;
+};
+
+} // end namespace sv
+
+#endif
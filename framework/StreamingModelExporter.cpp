@@ -0,0 +1,409 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "StreamingModelExporter.h"
+
+#include "data/model/DenseThreeDimensionalModel.h"
+#include "data/model/DenseTimeValueModel.h"
+
+#include "base/ProgressReporter.h"
+#include "base/StringBits.h"
+#include "base/Debug.h"
+
+#include <QApplication>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+
+//#define DEBUG_STREAMING_MODEL_EXPORTER 1
+
+namespace sv {
+
+// Frames of the model formatted at a time
+static const sv_frame_t EXPORT_CHUNK_FRAMES = 65536;
+
+// Size the write buffer may reach before it is written out
+static const int BUFFER_FLUSH_SIZE = 1024 * 1024;
+
+// How often run() returns to the event loop while waiting
+static const int WAIT_INTERVAL_MS = 50;
+
+static const char BINARY_MAGIC[] = "SVXF";
+static const int BINARY_MAGIC_SIZE = 4;
+static const quint32 BINARY_VERSION = 1;
+
+template <typename T>
+static void
+appendLE(QByteArray &bytes, T value)
+{
+    T le = qToLittleEndian(value);
+    bytes.append(reinterpret_cast<const char *>(&le), sizeof(le));
+}
+
+static void
+appendFloat(QByteArray &bytes, float value)
+{
+    quint32 u;
+    memcpy(&u, &value, sizeof(u));
+    appendLE(bytes, u);
+}
+
+static void
+appendDouble(QByteArray &bytes, double value)
+{
+    quint64 u;
+    memcpy(&u, &value, sizeof(u));
+    appendLE(bytes, u);
+}
+
+StreamingModelExporter::StreamingModelExporter(ModelId model,
+                                               QString path,
+                                               Format format,
+                                               QString delimiter,
+                                               DataExportOptions options,
+                                               const MultiSelection *selections) :
+    m_model(model),
+    m_path(path),
+    m_format(format),
+    m_delimiter(delimiter),
+    m_options(options),
+    m_haveSelections(selections != nullptr),
+    m_thread(nullptr),
+    m_cancelled(false),
+    m_completion(0),
+    m_finished(false),
+    m_ok(false),
+    m_file(nullptr)
+{
+    if (selections) {
+        for (const auto &s: selections->getSelections()) {
+            m_selections.push_back(s);
+        }
+    }
+}
+
+StreamingModelExporter::~StreamingModelExporter()
+{
+    if (m_thread) {
+        m_cancelled = true;
+        m_thread->wait();
+        delete m_thread;
+    }
+}
+
+bool
+StreamingModelExporter::canExportBinary(ModelId modelId)
+{
+    return (ModelById::isa<DenseThreeDimensionalModel>(modelId) ||
+            ModelById::isa<DenseTimeValueModel>(modelId));
+}
+
+void
+StreamingModelExporter::start()
+{
+    if (m_thread) return;
+    m_thread = new ExportThread(*this);
+    m_thread->start();
+}
+
+void
+StreamingModelExporter::cancel()
+{
+    m_cancelled = true;
+}
+
+bool
+StreamingModelExporter::isFinished() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_finished;
+}
+
+int
+StreamingModelExporter::getCompletion() const
+{
+    return m_completion;
+}
+
+bool
+StreamingModelExporter::isOK() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_finished && m_ok;
+}
+
+QString
+StreamingModelExporter::getError() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_error;
+}
+
+bool
+StreamingModelExporter::wasCancelled() const
+{
+    return m_cancelled;
+}
+
+bool
+StreamingModelExporter::run(ProgressReporter *reporter)
+{
+    start();
+
+    while (true) {
+        {
+            QMutexLocker locker(&m_mutex);
+            if (!m_finished) {
+                m_condition.wait(&m_mutex, WAIT_INTERVAL_MS);
+            }
+            if (m_finished) break;
+        }
+        if (reporter) {
+            reporter->setProgress(getCompletion());
+            if (reporter->wasCancelled()) {
+                cancel();
+            }
+        }
+        QApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
+    }
+
+    return isOK();
+}
+
+void
+StreamingModelExporter::ExportThread::run()
+{
+    m_exporter.exportModel();
+}
+
+void
+StreamingModelExporter::exportModel()
+{
+    auto model = ModelById::get(m_model);
+    if (!model) {
+        finish(false, QObject::tr("Internal error: unknown model"));
+        return;
+    }
+
+    QSaveFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        finish(false, QObject::tr("Failed to open file %1 for writing")
+               .arg(m_path));
+        return;
+    }
+    m_file = &file;
+
+    QString error;
+    bool ok = false;
+    if (m_format == Format::BinaryFloat) {
+        ok = writeBinary(model, error);
+    } else {
+        ok = writeDelimited(model);
+    }
+
+    if (ok) ok = flush();
+
+    if (!ok || m_cancelled) {
+        file.cancelWriting();
+        if (!m_cancelled && error == "") {
+            error = file.errorString();
+            if (error == "") {
+                error = QObject::tr("Failed to export layer for an unknown reason");
+            }
+        }
+        ok = false;
+    } else if (!file.commit()) {
+        error = QObject::tr("Failed to write file %1: %2")
+            .arg(m_path).arg(file.errorString());
+        ok = false;
+    }
+
+    m_file = nullptr;
+    m_buffer.clear();
+
+#ifdef DEBUG_STREAMING_MODEL_EXPORTER
+    SVDEBUG << "StreamingModelExporter: export of " << m_model << " to "
+            << m_path << " finished, ok = " << ok << endl;
+#endif
+    
+    finish(ok, error);
+}
+
+bool
+StreamingModelExporter::append(const QByteArray &bytes)
+{
+    m_buffer.append(bytes);
+    if (m_buffer.size() >= BUFFER_FLUSH_SIZE) {
+        return flush();
+    }
+    return true;
+}
+
+bool
+StreamingModelExporter::flush()
+{
+    if (m_buffer.isEmpty()) return true;
+    if (m_file->write(m_buffer) != m_buffer.size()) {
+        return false;
+    }
+    m_buffer.clear();
+    return true;
+}
+
+void
+StreamingModelExporter::finish(bool ok, QString error)
+{
+    m_completion = 100;
+    QMutexLocker locker(&m_mutex);
+    m_ok = ok;
+    m_error = error;
+    m_finished = true;
+    m_condition.wakeAll();
+}
+
+bool
+StreamingModelExporter::writeDelimited(std::shared_ptr<Model> model)
+{
+    if (m_options & DataExportIncludeHeader) {
+        auto header = model->getStringExportHeaders(m_options);
+        if (!header.empty()) {
+            if (!append((StringBits::joinDelimited(header, m_delimiter)
+                         + "\n").toUtf8())) {
+                return false;
+            }
+        }
+    }
+
+    std::vector<std::pair<sv_frame_t, sv_frame_t>> ranges;
+    if (m_haveSelections) {
+        for (const auto &s: m_selections) {
+            ranges.push_back({ s.getStartFrame(), s.getEndFrame() });
+        }
+    } else {
+        ranges.push_back({ model->getStartFrame(), model->getEndFrame() });
+    }
+
+    sv_frame_t total = 0, done = 0;
+    for (const auto &r: ranges) {
+        total += std::max(r.second - r.first, sv_frame_t(0));
+    }
+
+    for (const auto &r: ranges) {
+        for (sv_frame_t f = r.first; f < r.second; f += EXPORT_CHUNK_FRAMES) {
+
+            if (m_cancelled) return false;
+
+            sv_frame_t n = std::min(EXPORT_CHUNK_FRAMES, r.second - f);
+            auto rows = model->toStringExportRows(m_options, f, n);
+
+            QString text;
+            for (const auto &row: rows) {
+                text += StringBits::joinDelimited(row, m_delimiter);
+                text += "\n";
+            }
+            if (!append(text.toUtf8())) return false;
+
+            done += n;
+            if (total > 0) {
+                m_completion = int((done * 99) / total);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool
+StreamingModelExporter::writeBinary(std::shared_ptr<Model> model,
+                                    QString &error)
+{
+    auto dense = std::dynamic_pointer_cast<DenseThreeDimensionalModel>(model);
+    auto wave = std::dynamic_pointer_cast<DenseTimeValueModel>(model);
+
+    if (!dense && !wave) {
+        error = QObject::tr("Only dense layers (such as spectrograms, colour 3-d plots and waveforms) can be exported as raw binary data");
+        return false;
+    }
+
+    quint32 resolution = 1, height = 0;
+    qint64 start = 0, rows = 0;
+
+    if (dense) {
+        resolution = quint32(dense->getResolution());
+        height = quint32(dense->getHeight());
+        start = dense->getStartFrame();
+        rows = dense->getWidth();
+    } else {
+        height = quint32(wave->getChannelCount());
+        start = wave->getStartFrame();
+        rows = wave->getEndFrame() - start;
+    }
+
+    QByteArray header(BINARY_MAGIC, BINARY_MAGIC_SIZE);
+    appendLE(header, BINARY_VERSION);
+    appendDouble(header, model->getSampleRate());
+    appendLE(header, resolution);
+    appendLE(header, height);
+    appendLE(header, qint64(start));
+    appendLE(header, qint64(rows));
+    if (!append(header)) return false;
+
+    // Rows per chunk, so that a chunk spans about the same number of
+    // frames whatever the resolution
+    qint64 chunkRows = std::max(qint64(EXPORT_CHUNK_FRAMES) /
+                                std::max(qint64(resolution), qint64(1)),
+                                qint64(1));
+
+    for (qint64 r = 0; r < rows; r += chunkRows) {
+
+        if (m_cancelled) return false;
+
+        qint64 n = std::min(chunkRows, rows - r);
+        QByteArray bytes;
+        bytes.reserve(int(n * height * sizeof(float)));
+
+        if (dense) {
+            for (qint64 i = 0; i < n; ++i) {
+                auto column = dense->getColumn(int(r + i));
+                for (int y = 0; y < int(height); ++y) {
+                    appendFloat(bytes, in_range_for(column, y) ?
+                                column[y] : 0.f);
+                }
+            }
+        } else {
+            std::vector<floatvec_t> channels;
+            for (int c = 0; c < int(height); ++c) {
+                channels.push_back(wave->getData(c, start + r, n));
+            }
+            for (qint64 i = 0; i < n; ++i) {
+                for (int c = 0; c < int(height); ++c) {
+                    appendFloat(bytes, in_range_for(channels[c], i) ?
+                                channels[c][i] : 0.f);
+                }
+            }
+        }
+
+        if (!append(bytes)) return false;
+
+        m_completion = int(((r + n) * 99) / rows);
+    }
+
+    return true;
+}
+
+} // end namespace sv
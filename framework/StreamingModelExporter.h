@@ -0,0 +1,181 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    This file copyright 2006 Chris Cannam and QMUL.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_STREAMING_MODEL_EXPORTER_H
+#define SV_STREAMING_MODEL_EXPORTER_H
+
+#include "base/Thread.h"
+#include "base/BaseTypes.h"
+#include "base/DataExportOptions.h"
+#include "base/Selection.h"
+#include "data/model/Model.h"
+
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <vector>
+
+class QSaveFile;
+
+namespace sv {
+
+class ProgressReporter;
+
+/**
+ * Writes the contents of a model to a file on a thread of its own,
+ * a bounded chunk of frames at a time through a buffer, so that
+ * exporting a very large model neither holds the whole of it in
+ * memory as text nor blocks the GUI thread while it is formatted.
+ *
+ * Two formats are offered. Delimited is the same text as
+ * CSVFileWriter writes, using the model's own string export rows.
+ * BinaryFloat is for downstream numeric tools and is available only
+ * for dense models (see canExportBinary): a 40-byte header, of
+ *
+ *   "SVXF", then quint32 version (1), float64 sample rate, quint32
+ *   frames per row (the model's resolution), quint32 values per
+ *   row, int64 start frame, int64 row count,
+ *
+ * all little-endian, followed by that many rows of float32 LE
+ * values. Rows are the columns of a dense 3-d model or the sample
+ * frames, channels interleaved, of a dense time-value model. The
+ * binary format always contains the whole model.
+ *
+ * The file is replaced only if the export completes: a failed or
+ * cancelled export leaves any existing file at the path untouched.
+ */
+class StreamingModelExporter
+{
+public:
+    enum class Format {
+        Delimited,
+        BinaryFloat
+    };
+
+    /**
+     * Prepare to export the given model. The selections, if
+     * supplied, limit a delimited export to the frames within them,
+     * and are copied.
+     */
+    StreamingModelExporter(ModelId model,
+                           QString path,
+                           Format format,
+                           QString delimiter = ",",
+                           DataExportOptions options = DataExportDefaults,
+                           const MultiSelection *selections = nullptr);
+
+    /**
+     * Destroy the exporter, cancelling any export in progress and
+     * waiting for its thread to finish.
+     */
+    ~StreamingModelExporter();
+
+    /**
+     * Return true if the given model can be exported in the
+     * BinaryFloat format.
+     */
+    static bool canExportBinary(ModelId model);
+
+    /**
+     * Start the export in the background.
+     */
+    void start();
+
+    /**
+     * Ask a running export to stop at the end of its current chunk.
+     */
+    void cancel();
+
+    bool isFinished() const;
+
+    /**
+     * Return the completion of the export as a percentage.
+     */
+    int getCompletion() const;
+
+    /**
+     * Return true if the export finished successfully. Meaningful
+     * only once isFinished() returns true.
+     */
+    bool isOK() const;
+
+    /**
+     * Return the reason for failure, if the export has finished and
+     * isOK() returns false (empty if it was cancelled).
+     */
+    QString getError() const;
+
+    bool wasCancelled() const;
+
+    /**
+     * Start the export and wait for it to finish, processing events
+     * other than user input meanwhile, updating the given reporter
+     * (if any) with progress and cancelling if it is cancelled.
+     * Must be called from the GUI thread. Return isOK().
+     */
+    bool run(ProgressReporter *reporter);
+
+    StreamingModelExporter(const StreamingModelExporter &) =delete;
+    StreamingModelExporter &operator=(const StreamingModelExporter &) =delete;
+
+private:
+    class ExportThread : public Thread
+    {
+    public:
+        ExportThread(StreamingModelExporter &exporter) :
+            Thread(Thread::NonRTThread),
+            m_exporter(exporter) { }
+
+        void run() override;
+
+    protected:
+        StreamingModelExporter &m_exporter;
+    };
+
+    ModelId m_model;
+    QString m_path;
+    Format m_format;
+    QString m_delimiter;
+    DataExportOptions m_options;
+    std::vector<Selection> m_selections;
+    bool m_haveSelections;
+
+    ExportThread *m_thread;
+    std::atomic<bool> m_cancelled;
+    std::atomic<int> m_completion;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_condition;
+    bool m_finished;
+    bool m_ok;
+    QString m_error;
+
+    QByteArray m_buffer;
+    QSaveFile *m_file;
+
+    void exportModel();
+    bool writeDelimited(std::shared_ptr<Model>);
+    bool writeBinary(std::shared_ptr<Model>, QString &error);
+    bool append(const QByteArray &);
+    bool flush();
+    void finish(bool ok, QString error);
+};
+
+} // end namespace sv
+
+#endif